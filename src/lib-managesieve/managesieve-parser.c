@@ -13,6 +13,15 @@
 
 #define LIST_INIT_COUNT 7
 
+/* Test all bytes of a 64-bit word at once (SWAR): the result is non-zero if
+   any byte of v is zero, or respectively equal to c. */
+#define WORD_ONES  0x0101010101010101ULL
+#define WORD_HIGHS 0x8080808080808080ULL
+#define WORD_HAS_ZERO(v) \
+	(((v) - WORD_ONES) & ~(v) & WORD_HIGHS)
+#define WORD_HAS_BYTE(v, c) \
+	WORD_HAS_ZERO((v) ^ (WORD_ONES * (unsigned char)(c)))
+
 enum arg_parse_type {
 	ARG_PARSE_NONE = 0,
 	ARG_PARSE_ATOM,
@@ -234,6 +243,30 @@ managesieve_parser_read_atom(struct managesieve_parser *parser,
 	return (parser->cur_type == ARG_PARSE_NONE);
 }
 
+/* Returns the number of leading bytes that need no special treatment inside a
+   quoted string, i.e. up to the first NUL, CR, LF or QUOTED-SPECIAL. Long
+   strings are mostly scanned a word at a time. */
+static size_t
+managesieve_quoted_plain_length(const unsigned char *data, size_t size)
+{
+	size_t i = 0;
+	uint64_t v;
+
+	for (; i + sizeof(v) <= size; i += sizeof(v)) {
+		memcpy(&v, data + i, sizeof(v));
+		if ((WORD_HAS_ZERO(v) | WORD_HAS_BYTE(v, '"') |
+		     WORD_HAS_BYTE(v, '\\') | WORD_HAS_BYTE(v, '\r') |
+		     WORD_HAS_BYTE(v, '\n')) != 0)
+			break;
+	}
+	for (; i < size; i++) {
+		if (data[i] == '\0' || IS_QUOTED_SPECIAL(data[i]) ||
+		    is_linebreak(data[i]))
+			break;
+	}
+	return i;
+}
+
 static bool
 managesieve_parser_read_string(struct managesieve_parser *parser,
 			       const unsigned char *data, size_t data_size)
@@ -247,6 +280,11 @@ managesieve_parser_read_string(struct managesieve_parser *parser,
 
 	/* Read until we've found non-escaped ", CR or LF */
 	for (i = parser->cur_pos; i < data_size; i++) {
+		/* Skip plain characters in one go */
+		i += managesieve_quoted_plain_length(data + i, data_size - i);
+		if (i == data_size)
+			break;
+
 		if (data[i] == '"') {
 			if (!uni_utf8_data_is_valid(data+1, i-1)) {
 				parser->error =
@@ -683,6 +721,18 @@ static ssize_t quoted_string_istream_read(struct istream_private *stream)
 
 	data = i_stream_get_data(stream->parent, &size);
 	for (i = 0; i < size && dest < stream->buffer_size; ) {
+		size_t plain;
+
+		/* Copy plain characters in one go */
+		plain = managesieve_quoted_plain_length(
+			data + i, I_MIN(size - i, stream->buffer_size - dest));
+		if (plain > 0) {
+			memcpy(stream->w_buffer + dest, data + i, plain);
+			dest += plain;
+			i += plain;
+			continue;
+		}
+
 		if (data[i] == '"') {
 			i++;
 			qsstream->str_end = TRUE;
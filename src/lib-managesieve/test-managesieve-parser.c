@@ -0,0 +1,192 @@
+/* Copyright (c) 2021 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "str.h"
+#include "istream.h"
+#include "managesieve-parser.h"
+#include "test-common.h"
+
+struct quoted_string_test {
+	const char *input;
+	const char *output;
+};
+
+static const struct quoted_string_test quoted_string_tests[] = {
+	{
+		.input = "\"\"",
+		.output = "",
+	},
+	{
+		.input = "\"frop\"",
+		.output = "frop",
+	},
+	{
+		.input = "\"a\\\"b\\\\c\"",
+		.output = "a\"b\\c",
+	},
+	{
+		.input = "\"require \\\"fileinto\\\"; "
+			 "if header :contains \\\"subject\\\" "
+			 "\\\"[spam]\\\" { fileinto \\\"Junk\\\"; }\"",
+		.output = "require \"fileinto\"; "
+			  "if header :contains \"subject\" "
+			  "\"[spam]\" { fileinto \"Junk\"; }",
+	},
+	{
+		.input = "\"0123456789abcdef0123456789abcdef"
+			 "0123456789abcdef0123456789abcdef\\\\\"",
+		.output = "0123456789abcdef0123456789abcdef"
+			  "0123456789abcdef0123456789abcdef\\",
+	},
+	{
+		.input = "\"\xc3\xa4\xc3\xb6\xc3\xbc and some more "
+			 "characters after the UTF-8\"",
+		.output = "\xc3\xa4\xc3\xb6\xc3\xbc and some more "
+			  "characters after the UTF-8",
+	},
+};
+
+static const char *invalid_quoted_string_tests[] = {
+	"\"frop\rfriep\"",
+	"\"0123456789abcdef0123456789abcdef\nfrop\"",
+	"\"frop\\nfriep\"",
+	"\"0123456789abcdef0123456789abcdef\xff\"",
+};
+
+static int
+test_parse_args(const char *line, size_t max_step,
+		enum managesieve_parser_flags flags,
+		struct istream **input_r, struct managesieve_parser **parser_r,
+		const struct managesieve_arg **args_r)
+{
+	size_t size, line_len = strlen(line);
+	int ret;
+
+	*input_r = test_istream_create(line);
+	*parser_r = managesieve_parser_create(*input_r, 4096);
+
+	/* Feed the input in small steps to test the resume logic */
+	for (size = 0; size < line_len; size += max_step) {
+		test_istream_set_size(*input_r, size);
+		(void)i_stream_read(*input_r);
+		ret = managesieve_parser_read_args(*parser_r, 0, flags,
+						   args_r);
+		if (ret != -2)
+			return ret;
+	}
+	test_istream_set_size(*input_r, line_len);
+	(void)i_stream_read(*input_r);
+	return managesieve_parser_read_args(*parser_r, 0, flags, args_r);
+}
+
+static void
+test_parse_deinit(struct istream **input, struct managesieve_parser **parser)
+{
+	managesieve_parser_destroy(parser);
+	i_stream_unref(input);
+}
+
+static void test_managesieve_parser_quoted_string(void)
+{
+	unsigned int i, step;
+
+	for (i = 0; i < N_ELEMENTS(quoted_string_tests); i++) T_BEGIN {
+		const struct quoted_string_test *test =
+			&quoted_string_tests[i];
+
+		test_begin(t_strdup_printf(
+			"managesieve parser quoted string [%u]", i));
+		for (step = 1; step <= 64; step *= 4) {
+			struct istream *input;
+			struct managesieve_parser *parser;
+			const struct managesieve_arg *args;
+			const char *line, *str;
+			int ret;
+
+			line = t_strconcat(test->input, "\r\n", NULL);
+			ret = test_parse_args(line, step, 0,
+					      &input, &parser, &args);
+			test_assert_idx(ret == 1, step);
+			if (ret == 1) {
+				test_assert_idx(managesieve_arg_get_string(
+					&args[0], &str), step);
+				test_assert_idx(strcmp(str, test->output) == 0,
+						step);
+			}
+			test_parse_deinit(&input, &parser);
+		}
+		test_end();
+	} T_END;
+}
+
+static void test_managesieve_parser_quoted_string_invalid(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(invalid_quoted_string_tests); i++) T_BEGIN {
+		struct istream *input;
+		struct managesieve_parser *parser;
+		const struct managesieve_arg *args;
+		const char *line;
+
+		test_begin(t_strdup_printf(
+			"managesieve parser invalid quoted string [%u]", i));
+		line = t_strconcat(invalid_quoted_string_tests[i], "\r\n",
+				   NULL);
+		test_assert(test_parse_args(line, 1024, 0,
+					    &input, &parser, &args) == -1);
+		test_parse_deinit(&input, &parser);
+		test_end();
+	} T_END;
+}
+
+static void test_managesieve_parser_quoted_string_stream(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(quoted_string_tests); i++) T_BEGIN {
+		const struct quoted_string_test *test =
+			&quoted_string_tests[i];
+		struct istream *input, *str_input;
+		struct managesieve_parser *parser;
+		const struct managesieve_arg *args;
+		const unsigned char *data;
+		size_t size;
+		string_t *str;
+		int ret;
+
+		test_begin(t_strdup_printf(
+			"managesieve parser quoted string stream [%u]", i));
+		ret = test_parse_args(t_strconcat(test->input, "\r\n", NULL),
+				      1024, MANAGESIEVE_PARSE_FLAG_STRING_STREAM,
+				      &input, &parser, &args);
+		test_assert(ret >= 0);
+		if (ret >= 0 &&
+		    managesieve_arg_get_string_stream(&args[0], &str_input)) {
+			str = t_str_new(128);
+			while (i_stream_read_more(str_input,
+						  &data, &size) > 0) {
+				str_append_data(str, data, size);
+				i_stream_skip(str_input, size);
+			}
+			test_assert(str_input->stream_errno == 0);
+			test_assert(strcmp(str_c(str), test->output) == 0);
+		} else {
+			test_assert(FALSE);
+		}
+		test_parse_deinit(&input, &parser);
+		test_end();
+	} T_END;
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_managesieve_parser_quoted_string,
+		test_managesieve_parser_quoted_string_invalid,
+		test_managesieve_parser_quoted_string_stream,
+		NULL
+	};
+	return test_run(test_functions);
+}
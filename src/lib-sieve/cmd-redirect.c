@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "str.h"
 #include "str-sanitize.h"
 #include "strfuncs.h"
 #include "istream.h"
@@ -256,11 +257,21 @@ cmd_redirect_operation_execute(const struct sieve_runtime_env *renv,
  * Action implementation
  */
 
+struct act_redirect_batch {
+	/* Status of the combined submission */
+	int status;
+};
+
 struct act_redirect_transaction {
 	const char *msg_id, *new_msg_id;
 	const char *dupeid;
+	struct mail *mail;
+
+	/* Submission this redirect was sent with, once sent */
+	struct act_redirect_batch *batch;
 
 	bool skip_redirect:1;
+	bool executed:1;
 };
 
 static bool
@@ -301,8 +312,9 @@ act_redirect_print(const struct sieve_action *action,
 
 static int
 act_redirect_send(const struct sieve_action_exec_env *aenv, struct mail *mail,
-		  struct act_redirect_context *ctx, const char *new_msg_id)
-		  ATTR_NULL(4)
+		  const struct smtp_address *const *rcpts,
+		  unsigned int rcpt_count, const char *new_msg_id)
+		  ATTR_NULL(5)
 {
 	static const char *hide_headers[] = { "Return-Path" };
 	const struct sieve_execute_env *eenv = aenv->exec_env;
@@ -313,10 +325,14 @@ act_redirect_send(const struct sieve_action_exec_env *aenv, struct mail *mail,
 	struct istream *input;
 	struct ostream *output;
 	const struct smtp_address *sender;
-	const char *error;
+	const char *error, *rcpts_str;
 	struct sieve_smtp_context *sctx;
+	string_t *str;
+	unsigned int i;
 	int ret;
 
+	i_assert(rcpt_count > 0);
+
 	/* Just to be sure */
 	if (!sieve_smtp_available(senv)) {
 		sieve_result_global_warning(aenv, "no means to send mail");
@@ -361,7 +377,10 @@ act_redirect_send(const struct sieve_action_exec_env *aenv, struct mail *mail,
 	}
 
 	/* Open SMTP transport */
-	sctx = sieve_smtp_start_single(senv, ctx->to_address, sender, &output);
+	sctx = sieve_smtp_start(senv, sender);
+	for (i = 0; i < rcpt_count; i++)
+		sieve_smtp_add_rcpt(sctx, rcpts[i]);
+	output = sieve_smtp_send(sctx);
 
 	/* Remove unwanted headers */
 	input = i_stream_create_header_filter(
@@ -389,9 +408,11 @@ act_redirect_send(const struct sieve_action_exec_env *aenv, struct mail *mail,
 					      smtp_address_encode(user_email),
 					      FALSE, NULL);
 		}
-		rfc2822_header_append(hdr, "X-Forwarded-To",
-				      smtp_address_encode(ctx->to_address),
-				      FALSE, NULL);
+		for (i = 0; i < rcpt_count; i++) {
+			rfc2822_header_append(hdr, "X-Forwarded-To",
+					      smtp_address_encode(rcpts[i]),
+					      FALSE, NULL);
+		}
 
 		/* Add new Message-ID if message doesn't have one */
 		if (new_msg_id != NULL)
@@ -415,20 +436,27 @@ act_redirect_send(const struct sieve_action_exec_env *aenv, struct mail *mail,
 
 	/* Close SMTP transport */
 	if ((ret = sieve_smtp_finish(sctx, &error)) <= 0) {
+		str = t_str_new(128);
+		for (i = 0; i < rcpt_count; i++) {
+			if (i > 0)
+				str_append(str, ", ");
+			str_printfa(str, "<%s>",
+				    smtp_address_encode(rcpts[i]));
+		}
+		rcpts_str = str_c(str);
+
 		if (ret < 0) {
 			sieve_result_global_error(
-				aenv, "failed to redirect message to <%s>: %s "
+				aenv, "failed to redirect message to %s: %s "
 				"(temporary failure)",
-				smtp_address_encode(ctx->to_address),
-				str_sanitize(error, 512));
+				rcpts_str, str_sanitize(error, 512));
 			return SIEVE_EXEC_TEMP_FAILURE;
 		}
 
 		sieve_result_global_log_error(
-			aenv, "failed to redirect message to <%s>: %s "
+			aenv, "failed to redirect message to %s: %s "
 			"(permanent failure)",
-			smtp_address_encode(ctx->to_address),
-			str_sanitize(error, 512));
+			rcpts_str, str_sanitize(error, 512));
 		return SIEVE_EXEC_FAILURE;
 	}
 
@@ -541,11 +569,15 @@ act_redirect_check_loop_header(const struct sieve_action_exec_env *aenv,
 static int
 act_redirect_start(const struct sieve_action_exec_env *aenv, void **tr_context)
 {
+	const struct sieve_action *action = aenv->action;
+	struct act_redirect_context *ctx =
+		(struct act_redirect_context *)action->context;
 	struct act_redirect_transaction *trans;
 	pool_t pool = sieve_result_pool(aenv->result);
 
 	/* Create transaction context */
 	trans = p_new(pool, struct act_redirect_transaction, 1);
+	ctx->trans = trans;
 	*tr_context = trans;
 
 	return SIEVE_EXEC_OK;
@@ -630,9 +662,63 @@ act_redirect_execute(const struct sieve_action_exec_env *aenv,
 	/* Cancel implicit keep */
 	*keep = FALSE;
 
+	trans->mail = mail;
+	trans->executed = TRUE;
 	return SIEVE_EXEC_OK;
 }
 
+static int
+act_redirect_send_batch(const struct sieve_action_exec_env *aenv,
+			struct mail *mail,
+			struct act_redirect_context *ctx)
+{
+	struct act_redirect_transaction *trans = ctx->trans;
+	struct sieve_result_iterate_context *rictx;
+	const struct sieve_action *action;
+	ARRAY(struct act_redirect_transaction *) batch_trans;
+	ARRAY(const struct smtp_address *) rcpts;
+	struct act_redirect_transaction *const *btrans;
+	struct act_redirect_batch *batch;
+	pool_t pool = sieve_result_pool(aenv->result);
+	unsigned int i, count;
+
+	t_array_init(&batch_trans, 4);
+	t_array_init(&rcpts, 4);
+	array_append(&batch_trans, &trans, 1);
+	array_append(&rcpts, &ctx->to_address, 1);
+
+	/* Collect the other redirects of this message that are still to be
+	   sent */
+	rictx = sieve_result_iterate_init(aenv->result);
+	while ((action = sieve_result_iterate_next(rictx, NULL)) != NULL) {
+		struct act_redirect_context *octx;
+		struct act_redirect_transaction *otrans;
+
+		if (!sieve_action_is(action, act_redirect) ||
+		    action == aenv->action)
+			continue;
+		octx = (struct act_redirect_context *)action->context;
+		otrans = octx->trans;
+		if (otrans == NULL || !otrans->executed ||
+		    otrans->skip_redirect || otrans->batch != NULL ||
+		    otrans->mail != mail)
+			continue;
+
+		array_append(&batch_trans, &otrans, 1);
+		array_append(&rcpts, &octx->to_address, 1);
+	}
+
+	batch = p_new(pool, struct act_redirect_batch, 1);
+	batch->status = act_redirect_send(aenv, mail, array_idx(&rcpts, 0),
+					  array_count(&rcpts),
+					  trans->new_msg_id);
+
+	btrans = array_get(&batch_trans, &count);
+	for (i = 0; i < count; i++)
+		btrans[i]->batch = batch;
+	return batch->status;
+}
+
 static int
 act_redirect_commit(const struct sieve_action_exec_env *aenv, void *tr_context)
 {
@@ -654,7 +740,17 @@ act_redirect_commit(const struct sieve_action_exec_env *aenv, void *tr_context)
 	 * Try to forward the message
 	 */
 
-	ret = act_redirect_send(aenv, mail, ctx, trans->new_msg_id);
+	if (trans->batch != NULL) {
+		/* Already sent together with an earlier redirect */
+		ret = trans->batch->status;
+	} else if (svinst->redirect_batch) {
+		T_BEGIN {
+			ret = act_redirect_send_batch(aenv, mail, ctx);
+		} T_END;
+	} else {
+		ret = act_redirect_send(aenv, mail, &ctx->to_address, 1,
+					trans->new_msg_id);
+	}
 	if (ret == SIEVE_EXEC_OK) {
 		/* Mark this message id as forwarded to the specified
 		   destination */
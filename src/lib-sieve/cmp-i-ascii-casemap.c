@@ -10,6 +10,8 @@
 #include "sieve-common.h"
 #include "sieve-comparators.h"
 
+#include "ascii-casemap.h"
+
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -24,6 +26,9 @@ static int cmp_i_ascii_casemap_compare
 static bool cmp_i_ascii_casemap_char_match
 	(const struct sieve_comparator *cmp, const char **val1, const char *val1_end,
 		const char **val2, const char *val2_end);
+static size_t cmp_i_ascii_casemap_find
+	(const struct sieve_comparator *cmp, const char *val, size_t val_size,
+		const char *key, size_t key_size);
 
 /*
  * Comparator object
@@ -39,7 +44,8 @@ const struct sieve_comparator_def i_ascii_casemap_comparator = {
 		SIEVE_COMPARATOR_FLAG_PREFIX_MATCH,
 	.compare = cmp_i_ascii_casemap_compare,
 	.char_match = cmp_i_ascii_casemap_char_match,
-	.char_skip = sieve_comparator_octet_skip
+	.char_skip = sieve_comparator_octet_skip,
+	.find = cmp_i_ascii_casemap_find
 };
 
 /*
@@ -51,7 +57,7 @@ static int cmp_i_ascii_casemap_compare(
 	const char *val1, size_t val1_size, const char *val2, size_t val2_size)
 {
 	size_t size = I_MIN(val1_size, val2_size);
-	int ret = strncasecmp(val1, val2, size);
+	int ret = ascii_casemap_memcmp(val1, val2, size);
 	return ret != 0 ? ret : (int)val1_size - (int)val2_size;
 }
 
@@ -60,24 +66,22 @@ static bool cmp_i_ascii_casemap_char_match
 		const char **val, const char *val_end,
 		const char **key, const char *key_end)
 {
-	const char *val_begin = *val;
-	const char *key_begin = *key;
-
-	while ( i_tolower(**val) == i_tolower(**key) &&
-		*val < val_end && *key < key_end ) {
-		(*val)++;
-		(*key)++;
-	}
-
-	if ( *key < key_end ) {
-		/* Reset */
-		*val = val_begin;
-		*key = key_begin;
+	size_t key_size = key_end - *key;
 
+	/* The key must match entirely; on failure both pointers are left as
+	   they were */
+	if ( (size_t)(val_end - *val) < key_size ||
+		ascii_casemap_prefix_len(*val, *key, key_size) < key_size )
 		return FALSE;
-	}
 
+	*val += key_size;
+	*key += key_size;
 	return TRUE;
 }
 
-
+static size_t cmp_i_ascii_casemap_find
+	(const struct sieve_comparator *cmp ATTR_UNUSED,
+		const char *val, size_t val_size, const char *key, size_t key_size)
+{
+	return ascii_casemap_find(val, val_size, key, key_size);
+}
@@ -23,6 +23,9 @@ static int cmp_i_octet_compare
 static bool cmp_i_octet_char_match
 	(const struct sieve_comparator *cmp, const char **val1, const char *val1_end,
 		const char **val2, const char *val2_end);
+static size_t cmp_i_octet_find
+	(const struct sieve_comparator *cmp, const char *val, size_t val_size,
+		const char *key, size_t key_size);
 
 /*
  * Comparator object
@@ -38,7 +41,8 @@ const struct sieve_comparator_def i_octet_comparator = {
 		SIEVE_COMPARATOR_FLAG_PREFIX_MATCH,
 	.compare = cmp_i_octet_compare,
 	.char_match = cmp_i_octet_char_match,
-	.char_skip = sieve_comparator_octet_skip
+	.char_skip = sieve_comparator_octet_skip,
+	.find = cmp_i_octet_find
 };
 
 /*
@@ -94,4 +98,36 @@ static bool cmp_i_octet_char_match
 	return TRUE;
 }
 
+/* Candidate positions are found with memchr() on the first octet of the key,
+ * which the C library implements with vector instructions where available.
+ * Candidates are then filtered on the last octet of the key before the rest
+ * is compared.
+ */
+static size_t cmp_i_octet_find
+	(const struct sieve_comparator *cmp ATTR_UNUSED,
+		const char *val, size_t val_size, const char *key, size_t key_size)
+{
+	const char *p, *pend;
+	char last;
+
+	if ( key_size == 0 )
+		return 0;
+	if ( key_size > val_size )
+		return (size_t)-1;
+
+	pend = val + (val_size - key_size) + 1;
+	if ( key_size == 1 ) {
+		p = memchr(val, key[0], pend - val);
+		return ( p == NULL ? (size_t)-1 : (size_t)(p - val) );
+	}
 
+	last = key[key_size - 1];
+	for ( p = val; p < pend; p++ ) {
+		if ( (p = memchr(p, key[0], pend - p)) == NULL )
+			break;
+		if ( p[key_size - 1] == last &&
+			memcmp(p + 1, key + 1, key_size - 2) == 0 )
+			return p - val;
+	}
+	return (size_t)-1;
+}
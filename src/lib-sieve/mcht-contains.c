@@ -5,7 +5,12 @@
  */
 
 #include "lib.h"
+#include "str.h"
+#include "str-sanitize.h"
+#include "istream.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
@@ -13,13 +18,28 @@
 #include <string.h>
 #include <stdio.h>
 
+/*
+ * Configuration
+ */
+
+/* Upper bound for the size of the automaton's transition table (in entries);
+   larger key lists are matched one key at a time */
+#define MCHT_CONTAINS_MAX_TABLE_SIZE (1 << 22)
+
 /*
  * Forward declarations
  */
 
+static void mcht_contains_match_init(struct sieve_match_context *mctx);
+static int mcht_contains_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
 static int mcht_contains_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
+static int mcht_contains_match_keys_stream
+	(struct sieve_match_context *mctx, struct istream *input,
+		struct sieve_stringlist *key_list);
 
 /*
  * Match-type object
@@ -29,15 +49,18 @@ const struct sieve_match_type_def contains_match_type = {
 	SIEVE_OBJECT("contains",
 		&match_type_operand, SIEVE_MATCH_TYPE_CONTAINS),
 	.validate_context = sieve_match_substring_validate_context,
-	.match_key = mcht_contains_match_key
+	.match_init = mcht_contains_match_init,
+	.match_keys = mcht_contains_match_keys,
+	.match_key = mcht_contains_match_key,
+	.match_keys_stream = mcht_contains_match_keys_stream
 };
 
 /*
  * Match-type implementation
  */
 
-/* FIXME: Naive substring match implementation. Should switch to more
- * efficient algorithm if large values need to be searched (e.g. message body).
+/* Comparators that provide a native substring search use it; others are
+ * matched naively using their char_match() method.
  */
 static int mcht_contains_match_key
 (struct sieve_match_context *mctx, const char *val, size_t val_size,
@@ -55,6 +78,11 @@ static int mcht_contains_match_key
 	if ( cmp->def == NULL || cmp->def->char_match == NULL )
 		return 0;
 
+	if ( cmp->def->find != NULL ) {
+		return ( cmp->def->find(cmp, val, val_size, key, key_size) !=
+			(size_t)-1 ? 1 : 0 );
+	}
+
 	while ( (vp < vend) && (kp < kend) ) {
 		if ( !cmp->def->char_match(cmp, &vp, vend, &kp, kend) )
 			vp++;
@@ -63,4 +91,340 @@ static int mcht_contains_match_key
 	return ( kp == kend ? 1 : 0 );
 }
 
+/*
+ * Multi-key implementation
+ */
+
+/* Literal key lists used with the i;octet or i;ascii-casemap comparator are
+ * compiled into an Aho-Corasick automaton once for each loaded binary. The
+ * automaton is stored as a complete DFA over byte classes (one class for each
+ * distinct byte occurring in the keys, plus one for all other bytes), so that
+ * each value is matched against all keys in a single scan. Case folding for
+ * i;ascii-casemap is done in the class map.
+ */
+
+struct mcht_contains_automaton {
+	unsigned char class_map[256];
+	unsigned int class_count;
+	unsigned int state_count;
+
+	/* Transitions: state_count * class_count entries */
+	unsigned int *delta;
+	/* For each state: index + 1 of a key ending there (or at one of its
+	   suffixes); 0 if none */
+	unsigned int *accept;
+
+	/* Keys; only used for tracing */
+	const char **keys;
+	unsigned int key_count;
+
+	bool empty_key:1;
+	/* Automaton could not be built; match keys one at a time */
+	bool unusable:1;
+};
+
+struct mcht_contains_context {
+	const struct mcht_contains_automaton *automaton;
+	bool checked:1;
+};
+
+static void mcht_contains_automaton_free(void *data)
+{
+	struct mcht_contains_automaton *autom =
+		(struct mcht_contains_automaton *) data;
+
+	i_free(autom->delta);
+	i_free(autom->accept);
+}
+
+static void mcht_contains_automaton_build
+(struct mcht_contains_automaton *autom, bool casemap)
+{
+	unsigned int class_count, max_states, state_count, i, k;
+	unsigned int *delta, *fail, *queue, qhead, qtail;
+	size_t total_len = 0;
+	unsigned int c;
+
+	/* Assign byte classes */
+	memset(autom->class_map, 0, sizeof(autom->class_map));
+	class_count = 1;
+	for ( k = 0; k < autom->key_count; k++ ) {
+		const unsigned char *key = (const unsigned char *) autom->keys[k];
+
+		for ( ; *key != '\0'; key++ ) {
+			c = ( casemap ? (unsigned char) i_tolower(*key) : *key );
+			if ( autom->class_map[c] == 0 )
+				autom->class_map[c] = class_count++;
+			total_len++;
+		}
+	}
+	if ( casemap ) {
+		for ( c = 0; c < 256; c++ )
+			autom->class_map[c] = autom->class_map[(unsigned char) i_tolower(c)];
+	}
+
+	max_states = total_len + 1;
+	if ( class_count > 256 ||
+		(size_t) max_states * class_count > MCHT_CONTAINS_MAX_TABLE_SIZE ) {
+		autom->unusable = TRUE;
+		return;
+	}
+
+	/* Build trie; transition 0 means 'undefined', since no trie edge leads
+	   back to the root state */
+	delta = i_new(unsigned int, (size_t) max_states * class_count);
+	autom->accept = i_new(unsigned int, max_states);
+	state_count = 1;
+	for ( k = 0; k < autom->key_count; k++ ) {
+		const unsigned char *key = (const unsigned char *) autom->keys[k];
+		unsigned int state = 0;
+
+		if ( *key == '\0' ) {
+			autom->empty_key = TRUE;
+			continue;
+		}
+
+		for ( ; *key != '\0'; key++ ) {
+			unsigned int *next =
+				&delta[state * class_count + autom->class_map[*key]];
+
+			if ( *next == 0 )
+				*next = state_count++;
+			state = *next;
+		}
+		if ( autom->accept[state] == 0 )
+			autom->accept[state] = k + 1;
+	}
+
+	/* Compute failure links breadth-first and complete the transition
+	   table at the same time */
+	fail = i_new(unsigned int, state_count);
+	queue = i_new(unsigned int, state_count);
+	qhead = qtail = 0;
+	for ( i = 0; i < class_count; i++ ) {
+		unsigned int next = delta[i];
+
+		if ( next != 0 ) {
+			fail[next] = 0;
+			queue[qtail++] = next;
+		}
+	}
+	while ( qhead < qtail ) {
+		unsigned int state = queue[qhead++];
+
+		if ( autom->accept[state] == 0 )
+			autom->accept[state] = autom->accept[fail[state]];
+
+		for ( i = 0; i < class_count; i++ ) {
+			unsigned int *next = &delta[state * class_count + i];
+
+			if ( *next != 0 ) {
+				fail[*next] = delta[fail[state] * class_count + i];
+				queue[qtail++] = *next;
+			} else {
+				*next = delta[fail[state] * class_count + i];
+			}
+		}
+	}
+	i_free(fail);
+	i_free(queue);
+
+	autom->class_count = class_count;
+	autom->state_count = state_count;
+	autom->delta = i_realloc(delta, (size_t) max_states * class_count *
+		sizeof(unsigned int), (size_t) state_count * class_count *
+		sizeof(unsigned int));
+}
+
+static const struct mcht_contains_automaton *mcht_contains_automaton_get
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct sieve_match_key_data *key_data;
+	struct mcht_contains_automaton *autom;
+	ARRAY_TYPE(const_string) keys;
+	string_t *key_item = NULL;
+	bool casemap, nul_key = FALSE;
+	int ret;
+
+	if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
+		casemap = TRUE;
+	else if ( sieve_comparator_is(cmp, i_octet_comparator) )
+		casemap = FALSE;
+	else
+		return NULL;
+
+	if ( (key_data=sieve_match_key_data_get(mctx, key_list)) == NULL )
+		return NULL;
 
+	if ( key_data->data != NULL ) {
+		autom = (struct mcht_contains_automaton *) key_data->data;
+		return ( autom->unusable ? NULL : autom );
+	}
+
+	/* First use of this key list: build the automaton */
+	p_array_init(&keys, key_data->pool, 16);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		const char *key;
+
+		/* Keys with NUL characters are not handled by the automaton */
+		if ( memchr(str_data(key_item), '\0', str_len(key_item)) != NULL ) {
+			nul_key = TRUE;
+			break;
+		}
+
+		key = p_strndup(key_data->pool,
+			str_data(key_item), str_len(key_item));
+		array_push_back(&keys, &key);
+	}
+	sieve_stringlist_reset(key_list);
+	if ( ret < 0 )
+		return NULL;
+
+	autom = p_new(key_data->pool, struct mcht_contains_automaton, 1);
+	if ( nul_key ) {
+		autom->unusable = TRUE;
+	} else {
+		autom->keys = array_get_modifiable(&keys, &autom->key_count);
+		mcht_contains_automaton_build(autom, casemap);
+	}
+
+	key_data->data = (void *) autom;
+	key_data->free = mcht_contains_automaton_free;
+	return ( autom->unusable ? NULL : autom );
+}
+
+/* Runs the automaton over the next chunk of the value, starting and ending
+   in *state; the chunks of a value need not be aligned to anything */
+static int mcht_contains_automaton_feed
+(const struct mcht_contains_automaton *autom, unsigned int *state,
+	const unsigned char *data, size_t size, unsigned int *key_idx_r)
+{
+	const unsigned char *vp = data;
+	const unsigned char *vend = vp + size;
+	unsigned int st = *state;
+
+	for ( ; vp < vend; vp++ ) {
+		st = autom->delta
+			[st * autom->class_count + autom->class_map[*vp]];
+		if ( autom->accept[st] != 0 ) {
+			*state = st;
+			*key_idx_r = autom->accept[st] - 1;
+			return 1;
+		}
+	}
+	*state = st;
+	return 0;
+}
+
+static int mcht_contains_automaton_match
+(const struct mcht_contains_automaton *autom, const char *val,
+	size_t val_size, unsigned int *key_idx_r)
+{
+	unsigned int state = 0;
+
+	if ( val_size == 0 || autom->empty_key ) {
+		*key_idx_r = 0;
+		return ( autom->empty_key ? 1 : 0 );
+	}
+
+	return mcht_contains_automaton_feed(autom, &state,
+		(const unsigned char *) val, val_size, key_idx_r);
+}
+
+static void mcht_contains_match_init(struct sieve_match_context *mctx)
+{
+	mctx->data = p_new(mctx->pool, struct mcht_contains_context, 1);
+}
+
+static const struct mcht_contains_automaton *mcht_contains_get_automaton
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	struct mcht_contains_context *ctx =
+		(struct mcht_contains_context *) mctx->data;
+
+	if ( !ctx->checked ) {
+		ctx->automaton = mcht_contains_automaton_get(mctx, key_list);
+		ctx->checked = TRUE;
+	}
+	return ctx->automaton;
+}
+
+static void mcht_contains_trace_match
+(struct sieve_match_context *mctx,
+	const struct mcht_contains_automaton *autom, unsigned int key_idx,
+	int match)
+{
+	if ( match > 0 && !autom->empty_key ) {
+		sieve_runtime_trace(mctx->runenv, 0,
+			"with key `%s' => %d",
+			str_sanitize(autom->keys[key_idx], 80), match);
+	} else {
+		sieve_runtime_trace(mctx->runenv, 0,
+			"with %u literal keys => %d",
+			autom->key_count, match);
+	}
+}
+
+static int mcht_contains_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	const struct mcht_contains_automaton *autom;
+	unsigned int key_idx;
+	int match;
+
+	if ( (autom=mcht_contains_get_automaton(mctx, key_list)) == NULL )
+		return sieve_match_keys_default(mctx, val, val_size, key_list);
+
+	if ( autom->key_count == 1 && !autom->empty_key &&
+		mctx->comparator->def->find != NULL ) {
+		/* A single key is found faster by the comparator's substring
+		   search than by running the automaton over every octet */
+		key_idx = 0;
+		match = ( mctx->comparator->def->find(mctx->comparator,
+			val, val_size, autom->keys[0], strlen(autom->keys[0])) !=
+			(size_t)-1 ? 1 : 0 );
+	} else {
+		match = mcht_contains_automaton_match(autom, val, val_size, &key_idx);
+	}
+
+	if ( mctx->trace )
+		mcht_contains_trace_match(mctx, autom, key_idx, match);
+	return match;
+}
+
+/* The automaton keeps its state between the chunks of a streamed value, so
+ * a value read from a stream is matched using only as much memory as the
+ * automaton itself.
+ */
+static int mcht_contains_match_keys_stream
+(struct sieve_match_context *mctx, struct istream *input,
+	struct sieve_stringlist *key_list)
+{
+	const struct mcht_contains_automaton *autom;
+	const unsigned char *data;
+	unsigned int state = 0, key_idx = 0;
+	size_t size;
+	int match = 0, ret = 0;
+
+	if ( (autom=mcht_contains_get_automaton(mctx, key_list)) == NULL )
+		return sieve_match_keys_stream_default(mctx, input, key_list);
+
+	if ( autom->empty_key ) {
+		match = 1;
+	} else {
+		while ( match == 0 &&
+			(ret=i_stream_read_more(input, &data, &size)) > 0 ) {
+			match = mcht_contains_automaton_feed
+				(autom, &state, data, size, &key_idx);
+			i_stream_skip(input, size);
+		}
+		if ( ret < 0 && input->stream_errno != 0 )
+			return sieve_match_stream_error(mctx, input);
+	}
+
+	if ( mctx->trace )
+		mcht_contains_trace_match(mctx, autom, key_idx, match);
+	return match;
+}
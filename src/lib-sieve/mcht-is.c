@@ -5,7 +5,11 @@
  */
 
 #include "lib.h"
+#include "str.h"
+#include "str-sanitize.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
@@ -17,6 +21,10 @@
  * Forward declarations
  */
 
+static void mcht_is_match_init(struct sieve_match_context *mctx);
+static int mcht_is_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
 static int mcht_is_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
@@ -28,6 +36,8 @@ static int mcht_is_match_key
 const struct sieve_match_type_def is_match_type = {
 	SIEVE_OBJECT("is",
 		&match_type_operand, SIEVE_MATCH_TYPE_IS),
+	.match_init = mcht_is_match_init,
+	.match_keys = mcht_is_match_keys,
 	.match_key = mcht_is_match_key
 };
 
@@ -50,3 +60,210 @@ static int mcht_is_match_key
 	return 0;
 }
 
+/*
+ * Multi-key implementation
+ */
+
+/* Literal key lists used with the i;octet or i;ascii-casemap comparator are
+ * put in an open-addressing hash set once for each loaded binary, so that
+ * each value is looked up in constant time rather than compared to each key.
+ * For i;ascii-casemap the hash is computed over the case-folded key.
+ */
+
+struct mcht_is_key {
+	const char *key;
+	size_t key_size;
+	unsigned int hash;
+};
+
+struct mcht_is_key_set {
+	/* Number of slots; always a power of two */
+	unsigned int size;
+	struct mcht_is_key *slots;
+	unsigned int key_count;
+
+	bool casemap:1;
+	bool empty_key:1;
+	/* Set could not be built; match keys one at a time */
+	bool unusable:1;
+};
+
+struct mcht_is_context {
+	const struct mcht_is_key_set *key_set;
+	bool checked:1;
+};
+
+static unsigned int
+mcht_is_hash(const char *data, size_t size, bool casemap)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	const unsigned char *pend = p + size;
+	unsigned int hash = 2166136261U;
+
+	/* FNV-1a */
+	if ( casemap ) {
+		for ( ; p < pend; p++ )
+			hash = (hash ^ (unsigned char) i_tolower(*p)) * 16777619U;
+	} else {
+		for ( ; p < pend; p++ )
+			hash = (hash ^ *p) * 16777619U;
+	}
+	return hash;
+}
+
+static void mcht_is_key_set_insert
+(struct mcht_is_key_set *kset, const char *key, size_t key_size)
+{
+	unsigned int hash = mcht_is_hash(key, key_size, kset->casemap);
+	unsigned int mask = kset->size - 1, i;
+
+	for ( i = hash & mask; kset->slots[i].key != NULL; i = (i + 1) & mask ) {
+		/* Skip duplicates */
+		if ( kset->slots[i].hash == hash &&
+			kset->slots[i].key_size == key_size &&
+			(kset->casemap ?
+				strncasecmp(kset->slots[i].key, key, key_size) :
+				memcmp(kset->slots[i].key, key, key_size)) == 0 )
+			return;
+	}
+
+	kset->slots[i].key = key;
+	kset->slots[i].key_size = key_size;
+	kset->slots[i].hash = hash;
+}
+
+static const struct mcht_is_key *mcht_is_key_set_lookup
+(const struct mcht_is_key_set *kset, const struct sieve_comparator *cmp,
+	const char *val, size_t val_size)
+{
+	unsigned int hash = mcht_is_hash(val, val_size, kset->casemap);
+	unsigned int mask = kset->size - 1, i;
+
+	for ( i = hash & mask; kset->slots[i].key != NULL; i = (i + 1) & mask ) {
+		const struct mcht_is_key *key = &kset->slots[i];
+
+		if ( key->hash == hash && key->key_size == val_size &&
+			cmp->def->compare(cmp, val, val_size,
+				key->key, key->key_size) == 0 )
+			return key;
+	}
+	return NULL;
+}
+
+static const struct mcht_is_key_set *mcht_is_key_set_get
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct sieve_match_key_data *key_data;
+	struct mcht_is_key_set *kset;
+	ARRAY_TYPE(const_string) keys;
+	ARRAY(size_t) key_sizes;
+	string_t *key_item = NULL;
+	const char *const *key_strs;
+	const size_t *sizes;
+	bool casemap, nul_key = FALSE;
+	unsigned int count, i;
+	int ret;
+
+	if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
+		casemap = TRUE;
+	else if ( sieve_comparator_is(cmp, i_octet_comparator) )
+		casemap = FALSE;
+	else
+		return NULL;
+
+	if ( (key_data=sieve_match_key_data_get(mctx, key_list)) == NULL )
+		return NULL;
+
+	if ( key_data->data != NULL ) {
+		kset = (struct mcht_is_key_set *) key_data->data;
+		return ( kset->unusable ? NULL : kset );
+	}
+
+	/* First use of this key list: build the set */
+	p_array_init(&keys, key_data->pool, 16);
+	p_array_init(&key_sizes, key_data->pool, 16);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		const char *key;
+		size_t key_size = str_len(key_item);
+
+		/* Comparators stop at NUL characters; leave those to them */
+		if ( memchr(str_data(key_item), '\0', key_size) != NULL ) {
+			nul_key = TRUE;
+			break;
+		}
+
+		key = p_strndup(key_data->pool, str_data(key_item), key_size);
+		array_push_back(&keys, &key);
+		array_push_back(&key_sizes, &key_size);
+	}
+	sieve_stringlist_reset(key_list);
+	if ( ret < 0 )
+		return NULL;
+
+	kset = p_new(key_data->pool, struct mcht_is_key_set, 1);
+	kset->casemap = casemap;
+	if ( nul_key ) {
+		kset->unusable = TRUE;
+	} else {
+		key_strs = array_get(&keys, &count);
+		sizes = array_idx(&key_sizes, 0);
+
+		/* Keep the load factor at or below 1/2 */
+		kset->key_count = count;
+		kset->size = nearest_power(count * 2 + 1);
+		kset->slots = p_new(key_data->pool, struct mcht_is_key, kset->size);
+		for ( i = 0; i < count; i++ ) {
+			if ( sizes[i] == 0 )
+				kset->empty_key = TRUE;
+			else
+				mcht_is_key_set_insert(kset, key_strs[i], sizes[i]);
+		}
+	}
+
+	key_data->data = (void *) kset;
+	return ( kset->unusable ? NULL : kset );
+}
+
+static void mcht_is_match_init(struct sieve_match_context *mctx)
+{
+	mctx->data = p_new(mctx->pool, struct mcht_is_context, 1);
+}
+
+static int mcht_is_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	struct mcht_is_context *ctx = (struct mcht_is_context *) mctx->data;
+	const struct mcht_is_key *key;
+	int match;
+
+	if ( !ctx->checked ) {
+		ctx->key_set = mcht_is_key_set_get(mctx, key_list);
+		ctx->checked = TRUE;
+	}
+
+	if ( ctx->key_set == NULL )
+		return sieve_match_keys_default(mctx, val, val_size, key_list);
+
+	if ( val_size == 0 ) {
+		key = NULL;
+		match = ( ctx->key_set->empty_key ? 1 : 0 );
+	} else {
+		key = mcht_is_key_set_lookup
+			(ctx->key_set, mctx->comparator, val, val_size);
+		match = ( key != NULL ? 1 : 0 );
+	}
+
+	if ( mctx->trace ) {
+		if ( key != NULL ) {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with key `%s' => %d", str_sanitize(key->key, 80), match);
+		} else {
+			sieve_runtime_trace(mctx->runenv, 0,
+				"with %u literal keys => %d",
+				ctx->key_set->key_count, match);
+		}
+	}
+	return match;
+}
@@ -6,7 +6,10 @@
 
 #include "lib.h"
 #include "str.h"
+#include "str-sanitize.h"
 
+#include "sieve-common.h"
+#include "sieve-stringlist.h"
 #include "sieve-match-types.h"
 #include "sieve-comparators.h"
 #include "sieve-match.h"
@@ -18,6 +21,10 @@
  * Forward declarations
  */
 
+static void mcht_matches_match_init(struct sieve_match_context *mctx);
+static int mcht_matches_match_keys
+	(struct sieve_match_context *mctx, const char *val, size_t val_size,
+		struct sieve_stringlist *key_list);
 static int mcht_matches_match_key
 	(struct sieve_match_context *mctx, const char *val, size_t val_size,
 		const char *key, size_t key_size);
@@ -30,6 +37,8 @@ const struct sieve_match_type_def matches_match_type = {
 	SIEVE_OBJECT("matches",
 		&match_type_operand, SIEVE_MATCH_TYPE_MATCHES),
 	.validate_context = sieve_match_substring_validate_context,
+	.match_init = mcht_matches_match_init,
+	.match_keys = mcht_matches_match_keys,
 	.match_key = mcht_matches_match_key
 };
 
@@ -438,3 +447,325 @@ static int mcht_matches_match_key
 	return 0;
 }
 
+/*
+ * Compiled implementation
+ */
+
+/* Literal key lists used with the i;octet or i;ascii-casemap comparator are
+ * compiled once for each loaded binary. A compiled key is the list of
+ * fixed-length segments between its '*' wildcards, with escapes resolved and
+ * '?' positions marked:
+ *
+ *   <key> = <segment>*<segment>*...*<segment>
+ *
+ * The first segment is anchored at the beginning of the value and the last
+ * one at the end. The segments in between are placed at their leftmost
+ * possible position, which yields the same (shortest) '*' match values as the
+ * backtracking implementation above, without any backtracking.
+ */
+
+struct mcht_matches_segment {
+	const char *chars;
+	/* Marks '?' positions; NULL if the segment has no '?' wildcards */
+	const bool *any;
+	size_t len;
+};
+
+struct mcht_matches_key {
+	const char *key;
+	size_t key_size;
+
+	struct mcht_matches_segment *segments;
+	unsigned int segment_count;
+
+	/* Key could not be compiled; use the backtracking implementation */
+	bool fallback:1;
+};
+
+struct mcht_matches_key_list {
+	struct mcht_matches_key *keys;
+	unsigned int key_count;
+
+	bool casemap:1;
+	/* Keys could not be read; use the default key loop */
+	bool unusable:1;
+};
+
+struct mcht_matches_context {
+	const struct mcht_matches_key_list *key_list;
+	bool checked:1;
+};
+
+/* Folds only ASCII letters, like i;ascii-casemap does; all other octets,
+   including those of UTF-8 sequences, are compared as they are. */
+static inline unsigned char mcht_matches_ascii_fold(char c)
+{
+	unsigned char uc = (unsigned char)c;
+
+	return ( uc >= 'A' && uc <= 'Z' ? uc + ('a' - 'A') : uc );
+}
+
+static bool mcht_matches_key_compile
+(pool_t pool, struct mcht_matches_key *ckey, const char *key,
+	size_t key_size, bool casemap)
+{
+	ARRAY(struct mcht_matches_segment) segments;
+	struct mcht_matches_segment *seg;
+	const char *kp = key, *kend = key + key_size;
+	char *chars;
+	bool *any;
+	size_t len, max_len;
+
+	ckey->key = p_strndup(pool, key, key_size);
+	ckey->key_size = key_size;
+
+	p_array_init(&segments, pool, 4);
+	for (;;) {
+		/* Each segment is at most as long as the rest of the key */
+		max_len = kend - kp;
+		chars = p_malloc(pool, max_len + 1);
+		any = NULL;
+		len = 0;
+
+		while ( kp < kend && *kp != '*' ) {
+			if ( *kp == '?' ) {
+				if ( any == NULL )
+					any = p_new(pool, bool, max_len + 1);
+				any[len] = TRUE;
+				chars[len++] = '?';
+				kp++;
+				continue;
+			}
+			if ( *kp == '\\' && ++kp == kend ) {
+				/* Dangling escape */
+				return FALSE;
+			}
+			chars[len++] = ( casemap ?
+				(char)mcht_matches_ascii_fold(*kp) : *kp );
+			kp++;
+		}
+
+		seg = array_append_space(&segments);
+		seg->chars = chars;
+		seg->any = any;
+		seg->len = len;
+
+		if ( kp == kend )
+			break;
+		kp++; /* Skip '*' */
+	}
+
+	ckey->segments = array_get_modifiable(&segments, &ckey->segment_count);
+	return TRUE;
+}
+
+static inline bool mcht_matches_segment_match
+(const struct mcht_matches_segment *seg, const char *vp, bool casemap)
+{
+	size_t i;
+
+	for ( i = 0; i < seg->len; i++ ) {
+		if ( seg->any != NULL && seg->any[i] )
+			continue;
+		if ( casemap ) {
+			if ( mcht_matches_ascii_fold(vp[i]) !=
+				(unsigned char)seg->chars[i] )
+				return FALSE;
+		} else if ( vp[i] != seg->chars[i] ) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void mcht_matches_segment_add_values
+(struct sieve_match_values *mvalues, const struct mcht_matches_segment *seg,
+	const char *vp)
+{
+	size_t i;
+
+	if ( seg->any == NULL )
+		return;
+
+	for ( i = 0; i < seg->len; i++ ) {
+		if ( seg->any[i] )
+			sieve_match_values_add_char(mvalues, vp[i]);
+	}
+}
+
+static int mcht_matches_compiled_match
+(struct sieve_match_context *mctx, const struct mcht_matches_key *ckey,
+	const char *val, size_t val_size, bool casemap)
+{
+	const struct mcht_matches_segment *segs = ckey->segments;
+	unsigned int count = ckey->segment_count, i;
+	const struct mcht_matches_segment *last = &segs[count - 1];
+	struct sieve_match_values *mvalues;
+	size_t *starts, pos, end, p;
+
+	/* Anchored first segment */
+	if ( segs[0].len > val_size ||
+		!mcht_matches_segment_match(&segs[0], val, casemap) )
+		return 0;
+
+	/* Segment start positions */
+	starts = t_new(size_t, count);
+	starts[0] = 0;
+	pos = segs[0].len;
+
+	if ( count == 1 ) {
+		if ( pos != val_size )
+			return 0;
+	} else {
+		/* Anchored last segment */
+		if ( pos + last->len > val_size )
+			return 0;
+		end = val_size - last->len;
+
+		/* Leftmost placement of the segments in between */
+		for ( i = 1; i < count - 1; i++ ) {
+			const struct mcht_matches_segment *seg = &segs[i];
+
+			if ( pos + seg->len > end )
+				return 0;
+			for ( p = pos; p + seg->len <= end; p++ ) {
+				if ( mcht_matches_segment_match(seg, val + p, casemap) )
+					break;
+			}
+			if ( p + seg->len > end )
+				return 0;
+
+			starts[i] = p;
+			pos = p + seg->len;
+		}
+
+		if ( !mcht_matches_segment_match(last, val + end, casemap) )
+			return 0;
+		starts[count - 1] = end;
+	}
+
+	/* Matched; record match values if requested */
+	if ( (mvalues = sieve_match_values_start(mctx->runenv)) != NULL ) {
+		string_t *matched = str_new_const(pool_datastack_create(),
+			val, val_size);
+		string_t *mvalue = t_str_new(32);
+
+		sieve_match_values_add(mvalues, matched);
+
+		mcht_matches_segment_add_values(mvalues, &segs[0], val);
+		for ( i = 1; i < count; i++ ) {
+			size_t star_start = starts[i - 1] + segs[i - 1].len;
+
+			str_truncate(mvalue, 0);
+			str_append_data(mvalue, val + star_start,
+				starts[i] - star_start);
+			sieve_match_values_add(mvalues, mvalue);
+
+			mcht_matches_segment_add_values
+				(mvalues, &segs[i], val + starts[i]);
+		}
+
+		sieve_match_values_commit(mctx->runenv, &mvalues);
+	}
+	return 1;
+}
+
+static const struct mcht_matches_key_list *mcht_matches_key_list_get
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	const struct sieve_comparator *cmp = mctx->comparator;
+	struct sieve_match_key_data *key_data;
+	struct mcht_matches_key_list *ckeys;
+	ARRAY(struct mcht_matches_key) keys;
+	string_t *key_item = NULL;
+	bool casemap;
+	int ret;
+
+	if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
+		casemap = TRUE;
+	else if ( sieve_comparator_is(cmp, i_octet_comparator) )
+		casemap = FALSE;
+	else
+		return NULL;
+
+	if ( (key_data=sieve_match_key_data_get(mctx, key_list)) == NULL )
+		return NULL;
+
+	if ( key_data->data != NULL ) {
+		ckeys = (struct mcht_matches_key_list *) key_data->data;
+		return ( ckeys->unusable ? NULL : ckeys );
+	}
+
+	/* First use of this key list: compile the keys */
+	ckeys = p_new(key_data->pool, struct mcht_matches_key_list, 1);
+	ckeys->casemap = casemap;
+
+	p_array_init(&keys, key_data->pool, 8);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		struct mcht_matches_key *ckey = array_append_space(&keys);
+		const char *key = str_c(key_item);
+		size_t key_size = str_len(key_item);
+
+		/* Comparators stop at NUL characters; leave those to them */
+		if ( memchr(key, '\0', key_size) != NULL ||
+			!mcht_matches_key_compile
+				(key_data->pool, ckey, key, key_size, casemap) ) {
+			ckey->key = p_strndup(key_data->pool, key, key_size);
+			ckey->key_size = key_size;
+			ckey->fallback = TRUE;
+		}
+	}
+	sieve_stringlist_reset(key_list);
+	if ( ret < 0 )
+		return NULL;
+
+	ckeys->keys = array_get_modifiable(&keys, &ckeys->key_count);
+	key_data->data = (void *) ckeys;
+	return ckeys;
+}
+
+static void mcht_matches_match_init(struct sieve_match_context *mctx)
+{
+	mctx->data = p_new(mctx->pool, struct mcht_matches_context, 1);
+}
+
+static int mcht_matches_match_keys
+(struct sieve_match_context *mctx, const char *val, size_t val_size,
+	struct sieve_stringlist *key_list)
+{
+	struct mcht_matches_context *ctx =
+		(struct mcht_matches_context *) mctx->data;
+	const struct mcht_matches_key_list *ckeys;
+	unsigned int i;
+	int match;
+
+	if ( !ctx->checked ) {
+		ctx->key_list = mcht_matches_key_list_get(mctx, key_list);
+		ctx->checked = TRUE;
+	}
+
+	if ( (ckeys=ctx->key_list) == NULL )
+		return sieve_match_keys_default(mctx, val, val_size, key_list);
+
+	match = 0;
+	for ( i = 0; match == 0 && i < ckeys->key_count; i++ ) {
+		const struct mcht_matches_key *ckey = &ckeys->keys[i];
+
+		T_BEGIN {
+			if ( ckey->fallback ) {
+				match = mcht_matches_match_key
+					(mctx, val, val_size, ckey->key, ckey->key_size);
+			} else {
+				match = mcht_matches_compiled_match
+					(mctx, ckey, val, val_size, ckeys->casemap);
+			}
+
+			if ( mctx->trace ) {
+				sieve_runtime_trace(mctx->runenv, 0,
+					"with key `%s' => %d", str_sanitize(ckey->key, 80),
+					match);
+			}
+		} T_END;
+	}
+	return match;
+}
@@ -14,6 +14,8 @@
 #include "sieve-code.h"
 #include "sieve-message.h"
 #include "sieve-interpreter.h"
+#include "sieve-match-types.h"
+#include "sieve-match.h"
 
 #include "ext-body-common.h"
 
@@ -100,3 +102,42 @@ static void ext_body_stringlist_reset
 
 	strlist->body_parts_iter = strlist->body_parts;
 }
+
+/*
+ * Streamed raw body match
+ */
+
+int ext_body_match_raw_stream
+(const struct sieve_runtime_env *renv,
+	const struct sieve_match_type *mcht,
+	const struct sieve_comparator *cmp,
+	struct sieve_stringlist *key_list, int *exec_status)
+{
+	struct sieve_match_context *mctx;
+	struct istream *input;
+	int ret;
+
+	i_assert( mcht->def != NULL && mcht->def->match_keys_stream != NULL );
+
+	*exec_status = SIEVE_EXEC_OK;
+
+	if ( (ret=sieve_message_body_get_raw_stream(renv, &input)) <= 0 ) {
+		*exec_status = ret;
+		return -1;
+	}
+
+	if ( (mctx=sieve_match_begin(renv, mcht, cmp)) == NULL ) {
+		if ( input != NULL )
+			i_stream_unref(&input);
+		return 0;
+	}
+
+	/* An empty body is no value at all, like for sieve_message_body_get_raw()
+	 */
+	if ( input != NULL ) {
+		(void)sieve_match_value_stream(mctx, input, key_list);
+		i_stream_unref(&input);
+	}
+
+	return sieve_match_end(&mctx, exec_status);
+}
@@ -362,16 +362,25 @@ static int ext_body_operation_execute
 
 	sieve_runtime_trace(renv, SIEVE_TRLVL_TESTS, "body test");
 
-	/* Extract requested parts */
-	if ( (ret=ext_body_get_part_list(renv,
-		(enum tst_body_transform) transform, content_types,&value_list)) <= 0 )
-		return ret;
+	if ( transform == TST_BODY_TRANSFORM_RAW && mcht.def != NULL &&
+		mcht.def->match_keys_stream != NULL ) {
+		/* Disable match values processing as required by RFC */
+		mvalues_active = sieve_match_values_set_enabled(renv, FALSE);
+
+		/* Match the raw body without reading it into memory */
+		match = ext_body_match_raw_stream(renv, &mcht, &cmp, key_list, &ret);
+	} else {
+		/* Extract requested parts */
+		if ( (ret=ext_body_get_part_list(renv,
+			(enum tst_body_transform) transform, content_types,&value_list)) <= 0 )
+			return ret;
 
-	/* Disable match values processing as required by RFC */
-	mvalues_active = sieve_match_values_set_enabled(renv, FALSE);
+		/* Disable match values processing as required by RFC */
+		mvalues_active = sieve_match_values_set_enabled(renv, FALSE);
 
-	/* Perform match */
-	match = sieve_match(renv, &mcht, &cmp, value_list, key_list, &ret);
+		/* Perform match */
+		match = sieve_match(renv, &mcht, &cmp, value_list, key_list, &ret);
+	}
 
 	/* Restore match values processing */
 	(void)sieve_match_values_set_enabled(renv, mvalues_active);
@@ -95,7 +95,7 @@ static int cmp_i_ascii_numeric_compare
 	const char *kend = key + key_size;
 	const char *vp = val;
 	const char *kp = key;
-	int digits, i;
+	int digits, ret;
 
 	/* RFC 4790: All input is valid; strings that do not start with a digit
 	 * represent positive infinity.
@@ -114,10 +114,10 @@ static int cmp_i_ascii_numeric_compare
 
 	/* Ignore leading zeros */
 
-	while ( *vp == '0' && vp < vend )
+	while ( vp < vend && *vp == '0' )
 		vp++;
 
-	while ( *kp == '0' && kp < kend )
+	while ( kp < kend && *kp == '0' )
 		kp++;
 
 	/* Check whether both numbers are equally long in terms of digits */
@@ -139,22 +139,13 @@ static int cmp_i_ascii_numeric_compare
 		return 1;
 	}
 
-	/* Equally long: compare digits */
-
-	vp -= digits;
-	kp -= digits;
-	i = 0;
-	while ( i < digits ) {
-		if ( *vp > *kp )
-			return 1;
-		else if ( *vp < *kp )
-			return -1;
-
-		kp++;
-		vp++;
-		i++;
-	}
+	/* Equally long: compare digits; ASCII digits sort like their values */
 
+	ret = memcmp(vp - digits, kp - digits, digits);
+	if ( ret > 0 )
+		return 1;
+	if ( ret < 0 )
+		return -1;
 	return 0;
 }
 
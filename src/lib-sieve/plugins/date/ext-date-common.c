@@ -5,7 +5,6 @@
 #include "utc-offset.h"
 #include "str.h"
 #include "iso8601-date.h"
-#include "message-date.h"
 
 #include "sieve-common.h"
 #include "sieve-stringlist.h"
@@ -532,9 +531,10 @@ static int ext_date_stringlist_next_item
 			date_string++;
 		}
 
-		/* Parse the date value */
-		if ( message_date_parse((const unsigned char *) date_string,
-			strlen(date_string), &date_value, &original_zone) ) {
+		/* Parse the date value; the message context caches the parsed
+		   result, since the same header is usually tested repeatedly */
+		if ( sieve_message_parse_date(_strlist->runenv->msgctx,
+			date_string, &date_value, &original_zone) ) {
 			got_date = TRUE;
 		}
 	} else {
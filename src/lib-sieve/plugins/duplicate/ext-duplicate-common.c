@@ -222,14 +222,17 @@ int ext_duplicate_check(const struct sieve_runtime_env *renv, string_t *handle,
 	}
 	if (hash_record != NULL) {
 		const struct ext_duplicate_handle *rhandle;
+		const char *handle_str =
+			(handle == NULL ? NULL : str_c(handle));
+
+		/* Checked earlier for this message; reuse the outcome rather
+		   than querying the duplicate database again. */
 		array_foreach(&hash_record->handles, rhandle) {
-			const char *handle_str =
-				(handle == NULL ? NULL : str_c(handle));
 			if (null_strcmp(rhandle->handle, handle_str) == 0 &&
-			    rhandle->last == last)
-				return (rhandle->duplicate ?
-				        SIEVE_DUPLICATE_CHECK_RESULT_EXISTS :
-					SIEVE_DUPLICATE_CHECK_RESULT_NOT_FOUND);
+			    rhandle->last == last) {
+				*duplicate_r = rhandle->duplicate;
+				return SIEVE_EXEC_OK;
+			}
 		}
 	}
 
@@ -279,10 +282,10 @@ int ext_duplicate_check(const struct sieve_runtime_env *renv, string_t *handle,
 		msg_pool = sieve_message_context_pool(renv->msgctx);
 	if (hash_record == NULL) {
 		if (!array_is_created(&rctx->hashes))
-			p_array_init(&rctx->hashes, msg_pool, 64);
+			p_array_init(&rctx->hashes, msg_pool, 8);
 		hash_record = array_append_space(&rctx->hashes);
 		memcpy(hash_record->hash, hash, MD5_RESULTLEN);
-		p_array_init(&hash_record->handles, msg_pool, 64);
+		p_array_init(&hash_record->handles, msg_pool, 2);
 	}
 
 	handle_record = array_append_space(&hash_record->handles);
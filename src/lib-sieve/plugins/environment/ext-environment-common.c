@@ -27,12 +27,70 @@ static const struct sieve_environment_item *core_env_items[] = {
 
 static unsigned int core_env_items_count = N_ELEMENTS(core_env_items);
 
-static void
-sieve_environment_item_insert(struct ext_environment_interpreter_context *ctx,
-			      const struct sieve_environment_item *item);
+/*
+ * Extension context
+ */
+
+/* The core items are indexed once for the Sieve instance. The values of items
+   with instance scope are remembered once they are first retrieved, so that
+   only the items that can change between executions are evaluated each time.
+ */
+
+struct ext_environment_context {
+	pool_t pool;
+
+	HASH_TABLE(const char *,
+		   const struct sieve_environment_item *) core_items;
+	HASH_TABLE(const char *, const char *) instance_values;
+};
+
+/* Names of prefixed items can come from the script, so the number of
+   remembered values is limited */
+#define EXT_ENVIRONMENT_MAX_INSTANCE_VALUES 256
+
+/* Marks a remembered value that does not exist */
+static const char ext_environment_no_value[] = "";
+
+bool ext_environment_init(const struct sieve_extension *ext ATTR_UNUSED,
+			  void **context)
+{
+	struct ext_environment_context *ectx;
+	pool_t pool;
+	unsigned int i;
+
+	if (*context != NULL)
+		return TRUE;
+
+	pool = pool_alloconly_create("sieve environment", 1024);
+	ectx = p_new(pool, struct ext_environment_context, 1);
+	ectx->pool = pool;
+	hash_table_create(&ectx->core_items, pool, 0, str_hash, strcmp);
+	hash_table_create(&ectx->instance_values, pool, 0, str_hash, strcmp);
+
+	for (i = 0; i < core_env_items_count; i++) {
+		i_assert(!core_env_items[i]->prefix);
+		hash_table_insert(ectx->core_items, core_env_items[i]->name,
+				  core_env_items[i]);
+	}
+
+	*context = ectx;
+	return TRUE;
+}
+
+void ext_environment_deinit(const struct sieve_extension *ext)
+{
+	struct ext_environment_context *ectx =
+		(struct ext_environment_context *)ext->context;
+
+	if (ectx == NULL)
+		return;
+	hash_table_destroy(&ectx->core_items);
+	hash_table_destroy(&ectx->instance_values);
+	pool_unref(&ectx->pool);
+}
 
 /*
- * Validator context
+ * Interpreter context
  */
 
 struct ext_environment_interpreter_context {
@@ -103,14 +161,9 @@ void ext_environment_interpreter_init(const struct sieve_extension *this_ext,
 				      struct sieve_interpreter *interp)
 {
 	struct ext_environment_interpreter_context *ctx;
-	unsigned int i;
 
 	/* Create our context */
 	ctx = ext_environment_interpreter_context_get(this_ext, interp);
-
-	for (i = 0; i < core_env_items_count; i++)
-		sieve_environment_item_insert(ctx, core_env_items[i]);
-
 	ctx->active = TRUE;
 }
 
@@ -127,16 +180,6 @@ bool sieve_ext_environment_is_active(const struct sieve_extension *env_ext,
  * Registration
  */
 
-static void
-sieve_environment_item_insert(struct ext_environment_interpreter_context *ctx,
-			      const struct sieve_environment_item *item)
-{
-	if (!item->prefix)
-		hash_table_insert(ctx->name_items, item->name, item);
-	else
-		array_append(&ctx->prefix_items, &item, 1);
-}
-
 void sieve_environment_item_register(const struct sieve_extension *env_ext,
 				     struct sieve_interpreter *interp,
 				     const struct sieve_environment_item *item)
@@ -146,7 +189,10 @@ void sieve_environment_item_register(const struct sieve_extension *env_ext,
 	i_assert(sieve_extension_is(env_ext, environment_extension));
 	ctx = ext_environment_interpreter_context_get(env_ext, interp);
 
-	sieve_environment_item_insert(ctx, item);
+	if (!item->prefix)
+		hash_table_insert(ctx->name_items, item->name, item);
+	else
+		array_append(&ctx->prefix_items, &item, 1);
 }
 
 /*
@@ -154,12 +200,16 @@ void sieve_environment_item_register(const struct sieve_extension *env_ext,
  */
 
 static const struct sieve_environment_item *
-ext_environment_item_lookup(struct ext_environment_interpreter_context *ctx,
+ext_environment_item_lookup(struct ext_environment_context *ectx,
+			    struct ext_environment_interpreter_context *ctx,
 			    const char **_name)
 {
 	const struct sieve_environment_item *item;
 	const char *suffix, *name = *_name;
 
+	item = hash_table_lookup(ectx->core_items, name);
+	if (item != NULL)
+		return item;
 	item = hash_table_lookup(ctx->name_items, name);
 	if (item != NULL)
 		return item;
@@ -183,21 +233,40 @@ ext_environment_item_get_value(const struct sieve_extension *env_ext,
 			       const struct sieve_runtime_env *renv,
 			       const char *name)
 {
+	struct ext_environment_context *ectx =
+		(struct ext_environment_context *)env_ext->context;
 	struct ext_environment_interpreter_context *ctx;
 	const struct sieve_environment_item *item;
+	const char *full_name = name, *value;
 
 	i_assert(sieve_extension_is(env_ext, environment_extension));
 	ctx = ext_environment_interpreter_context_get(env_ext, renv->interp);
 
-	item = ext_environment_item_lookup(ctx, &name);
+	item = ext_environment_item_lookup(ectx, ctx, &name);
 	if (item == NULL)
 		return NULL;
 
 	if (item->value != NULL)
 		return item->value;
-	if (item->get_value != NULL)
+	if (item->get_value == NULL)
+		return NULL;
+	if (item->scope != SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE)
 		return item->get_value(renv, name);
-	return NULL;
+
+	/* Retrieve instance-scoped values only once */
+	value = hash_table_lookup(ectx->instance_values, full_name);
+	if (value != NULL)
+		return (value == ext_environment_no_value ? NULL : value);
+
+	value = item->get_value(renv, name);
+	if (hash_table_count(ectx->instance_values) <
+	    EXT_ENVIRONMENT_MAX_INSTANCE_VALUES) {
+		hash_table_insert(ectx->instance_values,
+				  p_strdup(ectx->pool, full_name),
+				  (value == NULL ? ext_environment_no_value :
+				   p_strdup(ectx->pool, value)));
+	}
+	return value;
 }
 
 /*
@@ -221,6 +290,7 @@ envit_domain_get_value(const struct sieve_runtime_env *renv,
 
 const struct sieve_environment_item domain_env_item = {
 	.name = "domain",
+	.scope = SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE,
 	.get_value = envit_domain_get_value,
 };
 
@@ -241,6 +311,7 @@ envit_host_get_value(const struct sieve_runtime_env *renv,
 
 const struct sieve_environment_item host_env_item = {
 	.name = "host",
+	.scope = SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE,
 	.get_value = envit_host_get_value,
 };
 
@@ -276,6 +347,7 @@ envit_location_get_value(const struct sieve_runtime_env *renv,
 
 const struct sieve_environment_item location_env_item = {
 	.name = "location",
+	.scope = SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE,
 	.get_value = envit_location_get_value
 };
 
@@ -308,6 +380,7 @@ envit_phase_get_value(const struct sieve_runtime_env *renv,
 
 const struct sieve_environment_item phase_env_item = {
 	.name = "phase",
+	.scope = SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE,
 	.get_value = envit_phase_get_value
 };
 
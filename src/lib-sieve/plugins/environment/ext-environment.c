@@ -36,6 +36,8 @@ static bool ext_environment_interpreter_load
 
 const struct sieve_extension_def environment_extension = {
 	.name = "environment",
+	.load = ext_environment_init,
+	.unload = ext_environment_deinit,
 	.validator_load = ext_environment_validator_load,
 	.interpreter_load = ext_environment_interpreter_load,
 	SIEVE_EXT_DEFINE_OPERATION(tst_environment_operation)
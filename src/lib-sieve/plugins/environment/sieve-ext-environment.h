@@ -35,9 +35,18 @@ bool sieve_ext_environment_is_active
  * Environment item
  */
 
+enum sieve_environment_item_scope {
+	/* The value can differ for each execution (default) */
+	SIEVE_ENVIRONMENT_ITEM_SCOPE_EXECUTION = 0,
+	/* The value is fixed for the Sieve instance, i.e. for the process or
+	   the user; it is retrieved only once */
+	SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE,
+};
+
 struct sieve_environment_item {
 	const char *name;
 	bool prefix;
+	enum sieve_environment_item_scope scope;
 
 	const char *value;
 	const char *(*get_value)
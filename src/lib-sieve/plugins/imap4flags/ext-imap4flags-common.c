@@ -319,8 +319,11 @@ void ext_imap4flags_iter_init
 	iter->flags_list = flags_list;
 }
 
-static string_t *ext_imap4flags_iter_get_flag_str
-(struct ext_imap4flags_iter *iter)
+/* Finds the next flag in the list without copying it; the returned data
+   points into the flags list. */
+static bool ext_imap4flags_iter_next
+(struct ext_imap4flags_iter *iter, const unsigned char **flag_r,
+	size_t *flag_len_r)
 {
 	unsigned int len;
 	const unsigned char *fp;
@@ -329,11 +332,11 @@ static string_t *ext_imap4flags_iter_get_flag_str
 	const unsigned char *fend;
 
 	/* Return if not initialized */
-	if ( iter->flags_list == NULL ) return NULL;
+	if ( iter->flags_list == NULL ) return FALSE;
 
 	/* Return if no more flags are available */
 	len = str_len(iter->flags_list);
-	if ( iter->offset >= len ) return NULL;
+	if ( iter->offset >= len ) return FALSE;
 
 	/* Mark string boundries */
 	fbegin = str_data(iter->flags_list);
@@ -350,13 +353,13 @@ static string_t *ext_imap4flags_iter_get_flag_str
 			/* Did we scan more than nothing ? */
 			if ( fp > fstart ) {
 				/* Return flag */
-				string_t *flag = t_str_new(fp-fstart+1);
-				str_append_data(flag, fstart, fp-fstart);
+				*flag_r = fstart;
+				*flag_len_r = fp - fstart;
 
 				iter->last = fstart - fbegin;
 				iter->offset = fp - fbegin;
 
-				return flag;
+				return TRUE;
 			}
 
 			fstart = fp + 1;
@@ -369,7 +372,36 @@ static string_t *ext_imap4flags_iter_get_flag_str
 
 	iter->last = fstart - fbegin;
 	iter->offset = fp - fbegin;
-	return NULL;
+	return FALSE;
+}
+
+static string_t *ext_imap4flags_iter_get_flag_str
+(struct ext_imap4flags_iter *iter)
+{
+	const unsigned char *fdata;
+	size_t flen;
+	string_t *flag;
+
+	if ( !ext_imap4flags_iter_next(iter, &fdata, &flen) )
+		return NULL;
+
+	flag = t_str_new(flen+1);
+	str_append_data(flag, fdata, flen);
+	return flag;
+}
+
+static bool ext_imap4flags_iter_next_is
+(struct ext_imap4flags_iter *iter, const char *flag, size_t flag_len)
+{
+	const unsigned char *fdata;
+	size_t flen;
+
+	while ( ext_imap4flags_iter_next(iter, &fdata, &flen) ) {
+		if ( flen == flag_len &&
+			strncasecmp((const char *)fdata, flag, flen) == 0 )
+			return TRUE;
+	}
+	return FALSE;
 }
 
 const char *ext_imap4flags_iter_get_flag
@@ -408,32 +440,23 @@ static string_t *ext_imap4flags_get_flag_variable
 static bool flags_list_flag_exists
 (string_t *flags_list, const char *flag)
 {
-	const char *flg;
 	struct ext_imap4flags_iter flit;
 
 	ext_imap4flags_iter_init(&flit, flags_list);
 
-	while ( (flg=ext_imap4flags_iter_get_flag(&flit)) != NULL ) {
-		if ( strcasecmp(flg, flag) == 0 )
-			return TRUE;
-	}
-
-	return FALSE;
+	return ext_imap4flags_iter_next_is(&flit, flag, strlen(flag));
 }
 
 static void flags_list_flag_delete
 (string_t *flags_list, const char *flag)
 {
-	const char *flg;
 	struct ext_imap4flags_iter flit;
+	size_t flag_len = strlen(flag);
 
 	ext_imap4flags_iter_init(&flit, flags_list);
 
-	while ( (flg=ext_imap4flags_iter_get_flag(&flit)) != NULL ) {
-		if ( strcasecmp(flg, flag) == 0 ) {
-			ext_imap4flags_iter_delete_last(&flit);
-		}
-	}
+	while ( ext_imap4flags_iter_next_is(&flit, flag, flag_len) )
+		ext_imap4flags_iter_delete_last(&flit);
 }
 
 static void flags_list_add_flags
@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "hash.h"
 #include "str-sanitize.h"
 #include "mail-storage.h"
 #include "mail-namespace.h"
@@ -150,13 +151,86 @@ tst_mailboxexists_operation_dump(const struct sieve_dumptime_env *denv,
  * Code execution
  */
 
+/* The status of each mailbox tested is remembered for the duration of the
+   script execution, so that testing the same mailbox again does not open it
+   again. Scripts commonly test the same few mailboxes before each fileinto.
+ */
+
+enum tst_mailboxexists_status {
+	TST_MAILBOXEXISTS_STATUS_EXISTS = 1,
+	TST_MAILBOXEXISTS_STATUS_UNAVAILABLE,
+	TST_MAILBOXEXISTS_STATUS_READONLY,
+};
+
+struct tst_mailboxexists_cache {
+	HASH_TABLE(const char *, void *) mailboxes;
+};
+
+static struct tst_mailboxexists_cache *
+tst_mailboxexists_cache_get(const struct sieve_runtime_env *renv)
+{
+	const struct sieve_extension *this_ext = renv->oprtn->ext;
+	struct tst_mailboxexists_cache *cache;
+	pool_t pool;
+
+	cache = sieve_interpreter_extension_get_context(renv->interp,
+							this_ext);
+	if (cache == NULL) {
+		pool = sieve_interpreter_pool(renv->interp);
+		cache = p_new(pool, struct tst_mailboxexists_cache, 1);
+		hash_table_create(&cache->mailboxes, pool, 0, str_hash, strcmp);
+		sieve_interpreter_extension_set_context(renv->interp, this_ext,
+							cache);
+	}
+	return cache;
+}
+
+static enum tst_mailboxexists_status
+tst_mailboxexists_lookup(const struct sieve_runtime_env *renv,
+			 const char *mailbox)
+{
+	const struct sieve_execute_env *eenv = renv->exec_env;
+	struct tst_mailboxexists_cache *cache;
+	enum tst_mailboxexists_status status;
+	struct mailbox *box;
+	void *value;
+
+	cache = tst_mailboxexists_cache_get(renv);
+	value = hash_table_lookup(cache->mailboxes, mailbox);
+	if (value != NULL)
+		return POINTER_CAST_TO(value, enum tst_mailboxexists_status);
+
+	/* Open the box */
+	box = mailbox_alloc_for_user(eenv->scriptenv->user,
+				     mailbox,
+				     MAILBOX_FLAG_POST_SESSION);
+
+	if (mailbox_open(box) < 0)
+		status = TST_MAILBOXEXISTS_STATUS_UNAVAILABLE;
+	else if (mailbox_is_readonly(box)) {
+		/* Also fail when it is readonly */
+		status = TST_MAILBOXEXISTS_STATUS_READONLY;
+	} else {
+		/* FIXME: check acl for 'p' or 'i' ACL permissions as
+		   required by RFC */
+		status = TST_MAILBOXEXISTS_STATUS_EXISTS;
+	}
+
+	/* Close mailbox */
+	mailbox_free(&box);
+
+	hash_table_insert(cache->mailboxes,
+			  p_strdup(sieve_interpreter_pool(renv->interp),
+				   mailbox),
+			  POINTER_CAST(status));
+	return status;
+}
+
 static int
 tst_mailboxexists_test_mailbox(const struct sieve_runtime_env *renv,
 			       const char *mailbox, bool trace,
 			       bool *all_exist_r)
 {
-	const struct sieve_execute_env *eenv = renv->exec_env;
-	struct mailbox *box;
 	const char *error;
 
 	/* Check validity of mailbox name */
@@ -169,47 +243,33 @@ tst_mailboxexists_test_mailbox(const struct sieve_runtime_env *renv,
 		return SIEVE_EXEC_OK;
 	}
 
-	/* Open the box */
-	box = mailbox_alloc_for_user(eenv->scriptenv->user,
-				     mailbox,
-				     MAILBOX_FLAG_POST_SESSION);
-
-	if (mailbox_open(box) < 0) {
+	switch (tst_mailboxexists_lookup(renv, mailbox)) {
+	case TST_MAILBOXEXISTS_STATUS_UNAVAILABLE:
 		if (trace) {
 			sieve_runtime_trace(
 				renv, 0,
 				"mailbox `%s' cannot be opened",
 				str_sanitize(mailbox, 80));
 		}
-		mailbox_free(&box);
 		*all_exist_r = FALSE;
-		return SIEVE_EXEC_OK;
-	}
-
-	/* Also fail when it is readonly */
-	if (mailbox_is_readonly(box)) {
+		break;
+	case TST_MAILBOXEXISTS_STATUS_READONLY:
 		if (trace) {
 			sieve_runtime_trace(
 				renv, 0,
 				"mailbox `%s' is read-only",
 				str_sanitize(mailbox, 80));
 		}
-		mailbox_free(&box);
 		*all_exist_r = FALSE;
-		return SIEVE_EXEC_OK;
-	}
-
-	/* FIXME: check acl for 'p' or 'i' ACL permissions as
-	   required by RFC */
-
-	if (trace) {
-		sieve_runtime_trace(
-			renv, 0, "mailbox `%s' exists",
-			str_sanitize(mailbox, 80));
+		break;
+	case TST_MAILBOXEXISTS_STATUS_EXISTS:
+		if (trace) {
+			sieve_runtime_trace(
+				renv, 0, "mailbox `%s' exists",
+				str_sanitize(mailbox, 80));
+		}
+		break;
 	}
-
-	/* Close mailbox */
-	mailbox_free(&box);
 	return SIEVE_EXEC_OK;
 }
 
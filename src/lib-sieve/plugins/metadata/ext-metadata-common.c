@@ -0,0 +1,191 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "hash.h"
+#include "mail-namespace.h"
+
+#include "sieve-common.h"
+#include "sieve-extensions.h"
+#include "sieve-code.h"
+#include "sieve-interpreter.h"
+
+#include "ext-metadata-common.h"
+
+/*
+ * Interpreter context
+ */
+
+/* All metadata tests of one script execution share one mailbox and one
+   attribute transaction per mailbox, which are kept open until the
+   interpreter is freed. Annotations that were retrieved once are remembered
+   for the rest of the execution. */
+
+struct ext_metadata_mailbox {
+	struct mailbox *box;
+	struct imap_metadata_transaction *imtrans;
+
+	HASH_TABLE(const char *,
+		   struct ext_metadata_annotation *) annotations;
+};
+
+struct ext_metadata_interpreter_context {
+	pool_t pool;
+
+	/* mboxmetadata */
+	HASH_TABLE(const char *, struct ext_metadata_mailbox *) mailboxes;
+	/* servermetadata */
+	struct ext_metadata_mailbox *server;
+};
+
+static void
+ext_metadata_interpreter_free(const struct sieve_extension *ext,
+			      struct sieve_interpreter *interp,
+			      void *context);
+
+const struct sieve_interpreter_extension
+mboxmetadata_interpreter_extension = {
+	.ext_def = &mboxmetadata_extension,
+	.free = ext_metadata_interpreter_free,
+};
+const struct sieve_interpreter_extension
+servermetadata_interpreter_extension = {
+	.ext_def = &servermetadata_extension,
+	.free = ext_metadata_interpreter_free,
+};
+
+static void ext_metadata_mailbox_close(struct ext_metadata_mailbox *mbox)
+{
+	(void)imap_metadata_transaction_commit(&mbox->imtrans, NULL, NULL);
+	if (mbox->box != NULL)
+		mailbox_free(&mbox->box);
+	hash_table_destroy(&mbox->annotations);
+}
+
+static void
+ext_metadata_interpreter_free(const struct sieve_extension *ext ATTR_UNUSED,
+			      struct sieve_interpreter *interp ATTR_UNUSED,
+			      void *context)
+{
+	struct ext_metadata_interpreter_context *ctx =
+		(struct ext_metadata_interpreter_context *)context;
+	struct hash_iterate_context *iter;
+	struct ext_metadata_mailbox *mbox;
+	const char *name;
+
+	if (ctx->server != NULL)
+		ext_metadata_mailbox_close(ctx->server);
+
+	if (!hash_table_is_created(ctx->mailboxes))
+		return;
+	iter = hash_table_iterate_init(ctx->mailboxes);
+	while (hash_table_iterate(iter, ctx->mailboxes, &name, &mbox))
+		ext_metadata_mailbox_close(mbox);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&ctx->mailboxes);
+}
+
+static struct ext_metadata_interpreter_context *
+ext_metadata_interpreter_context_get(const struct sieve_extension *this_ext,
+				     struct sieve_interpreter *interp)
+{
+	struct ext_metadata_interpreter_context *ctx =
+		(struct ext_metadata_interpreter_context *)
+		sieve_interpreter_extension_get_context(interp, this_ext);
+	pool_t pool;
+
+	if (ctx != NULL)
+		return ctx;
+
+	pool = sieve_interpreter_pool(interp);
+	ctx = p_new(pool, struct ext_metadata_interpreter_context, 1);
+	ctx->pool = pool;
+
+	sieve_interpreter_extension_register(
+		interp, this_ext,
+		(sieve_extension_is(this_ext, servermetadata_extension) ?
+		 &servermetadata_interpreter_extension :
+		 &mboxmetadata_interpreter_extension), (void *)ctx);
+	return ctx;
+}
+
+static struct ext_metadata_mailbox *
+ext_metadata_mailbox_get(struct ext_metadata_interpreter_context *ctx,
+			 struct mail_user *user, const char *mailbox)
+{
+	struct ext_metadata_mailbox *mbox;
+
+	if (mailbox == NULL) {
+		if (ctx->server != NULL)
+			return ctx->server;
+	} else {
+		if (!hash_table_is_created(ctx->mailboxes)) {
+			hash_table_create(&ctx->mailboxes, ctx->pool, 0,
+					  str_hash, strcmp);
+		}
+		mbox = hash_table_lookup(ctx->mailboxes, mailbox);
+		if (mbox != NULL)
+			return mbox;
+	}
+
+	mbox = p_new(ctx->pool, struct ext_metadata_mailbox, 1);
+	hash_table_create(&mbox->annotations, ctx->pool, 0, str_hash, strcmp);
+
+	if (mailbox != NULL) {
+		struct mail_namespace *ns;
+
+		ns = mail_namespace_find(user->namespaces, mailbox);
+		mbox->box = mailbox_alloc(ns->list, mailbox, 0);
+		mbox->imtrans = imap_metadata_transaction_begin(mbox->box);
+		hash_table_insert(ctx->mailboxes,
+				  p_strdup(ctx->pool, mailbox), mbox);
+	} else {
+		mbox->imtrans = imap_metadata_transaction_begin_server(user);
+		ctx->server = mbox;
+	}
+	return mbox;
+}
+
+/*
+ * Annotation lookup
+ */
+
+int ext_metadata_get_annotation(const struct sieve_runtime_env *renv,
+				const char *mailbox, const char *aname,
+				const struct ext_metadata_annotation **annot_r,
+				enum mail_error *error_code_r,
+				const char **error_r)
+{
+	const struct sieve_execute_env *eenv = renv->exec_env;
+	struct mail_user *user = eenv->scriptenv->user;
+	struct ext_metadata_interpreter_context *ctx;
+	struct ext_metadata_mailbox *mbox;
+	struct ext_metadata_annotation *annot;
+	struct mail_attribute_value avalue;
+
+	i_assert(user != NULL);
+
+	ctx = ext_metadata_interpreter_context_get(renv->oprtn->ext,
+						   renv->interp);
+	mbox = ext_metadata_mailbox_get(ctx, user, mailbox);
+
+	annot = hash_table_lookup(mbox->annotations, aname);
+	if (annot != NULL) {
+		*annot_r = annot;
+		return 0;
+	}
+
+	if (imap_metadata_get(mbox->imtrans, aname, &avalue) < 0) {
+		*error_r = imap_metadata_transaction_get_last_error(
+			mbox->imtrans, error_code_r);
+		return -1;
+	}
+
+	annot = p_new(ctx->pool, struct ext_metadata_annotation, 1);
+	annot->value = p_strdup(ctx->pool, avalue.value);
+	annot->exists = (avalue.value != NULL || avalue.value_stream != NULL);
+	hash_table_insert(mbox->annotations, p_strdup(ctx->pool, aname), annot);
+
+	*annot_r = annot;
+	return 0;
+}
@@ -37,4 +37,24 @@ extern const struct sieve_operation_def servermetadata_operation;
 extern const struct sieve_operation_def metadataexists_operation;
 extern const struct sieve_operation_def servermetadataexists_operation;
 
+/*
+ * Annotation lookup
+ */
+
+struct ext_metadata_annotation {
+	/* Value, or NULL when it does not exist or is only available as a
+	   stream */
+	const char *value;
+	bool exists;
+};
+
+/* Retrieves the annotation for the mailbox, or the server annotation when
+   mailbox is NULL. The result is remembered for the rest of the script
+   execution. Returns 0 on success and -1 on error. */
+int ext_metadata_get_annotation(const struct sieve_runtime_env *renv,
+				const char *mailbox, const char *aname,
+				const struct ext_metadata_annotation **annot_r,
+				enum mail_error *error_code_r,
+				const char **error_r);
+
 #endif
@@ -268,36 +268,17 @@ tst_metadata_get_annotation(const struct sieve_runtime_env *renv,
 			    const char **annotation_r)
 {
 	const struct sieve_execute_env *eenv = renv->exec_env;
-	struct mail_user *user = eenv->scriptenv->user;
-	struct mailbox *box;
-	struct imap_metadata_transaction *imtrans;
-	struct mail_attribute_value avalue;
-	int status, ret;
+	const struct ext_metadata_annotation *annot;
+	enum mail_error error_code;
+	const char *error;
 
 	*annotation_r = NULL;
 
-	if (user == NULL)
+	if (eenv->scriptenv->user == NULL)
 		return SIEVE_EXEC_OK;
 
-	if (mailbox != NULL) {
-		struct mail_namespace *ns;
-		ns = mail_namespace_find(user->namespaces, mailbox);
-		box = mailbox_alloc(ns->list, mailbox, 0);
-		imtrans = imap_metadata_transaction_begin(box);
-	} else {
-		box = NULL;
-		imtrans = imap_metadata_transaction_begin_server(user);
-	}
-
-	status = SIEVE_EXEC_OK;
-	ret = imap_metadata_get(imtrans, aname, &avalue);
-	if (ret < 0) {
-		enum mail_error error_code;
-		const char *error;
-
-		error = imap_metadata_transaction_get_last_error(
-			imtrans, &error_code);
-
+	if (ext_metadata_get_annotation(renv, mailbox, aname, &annot,
+					&error_code, &error) < 0) {
 		sieve_runtime_error(
 			renv, NULL, "%s test: "
 			"failed to retrieve annotation `%s': %s%s",
@@ -307,16 +288,12 @@ tst_metadata_get_annotation(const struct sieve_runtime_env *renv,
 			(error_code == MAIL_ERROR_TEMP ?
 			 " (temporary failure)" : ""));
 
-		status = (error_code == MAIL_ERROR_TEMP ?
-			  SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE);
-
-	} else if (avalue.value != NULL) {
-		*annotation_r = avalue.value;
+		return (error_code == MAIL_ERROR_TEMP ?
+			SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE);
 	}
-	(void)imap_metadata_transaction_commit(&imtrans, NULL, NULL);
-	if (box != NULL)
-		mailbox_free(&box);
-	return status;
+
+	*annotation_r = annot->value;
+	return SIEVE_EXEC_OK;
 }
 
 static int
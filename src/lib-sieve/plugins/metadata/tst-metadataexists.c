@@ -238,13 +238,12 @@ tst_metadataexists_operation_dump(const struct sieve_dumptime_env *denv,
 
 static int
 tst_metadataexists_check_annotation(const struct sieve_runtime_env *renv,
-				    struct imap_metadata_transaction *imtrans,
 				    const char *mailbox, const char *aname,
 				    bool *all_exist_r)
 {
-	struct mail_attribute_value avalue;
+	const struct ext_metadata_annotation *annot;
+	enum mail_error error_code;
 	const char *error;
-	int ret;
 
 	if (!imap_metadata_verify_entry_name(aname, &error)) {
 		sieve_runtime_warning(
@@ -258,13 +257,8 @@ tst_metadataexists_check_annotation(const struct sieve_runtime_env *renv,
 		return SIEVE_EXEC_OK;
 	}
 
-	ret = imap_metadata_get(imtrans, aname, &avalue);
-	if (ret < 0) {
-		enum mail_error error_code;
-		const char *error;
-
-		error = imap_metadata_transaction_get_last_error(
-			imtrans, &error_code);
+	if (ext_metadata_get_annotation(renv, mailbox, aname, &annot,
+					&error_code, &error) < 0) {
 		sieve_runtime_error(
 			renv, NULL, "%s test: "
 			"failed to retrieve annotation `%s': %s%s",
@@ -279,7 +273,7 @@ tst_metadataexists_check_annotation(const struct sieve_runtime_env *renv,
 		return (error_code == MAIL_ERROR_TEMP ?
 			SIEVE_EXEC_TEMP_FAILURE : SIEVE_EXEC_FAILURE);
 	}
-	if (avalue.value == NULL && avalue.value_stream == NULL) {
+	if (!annot->exists) {
 		sieve_runtime_trace(renv, 0,
 				    "annotation `%s': not found", aname);
 		*all_exist_r = FALSE;
@@ -297,8 +291,6 @@ tst_metadataexists_check_annotations(const struct sieve_runtime_env *renv,
 {
 	const struct sieve_execute_env *eenv = renv->exec_env;
 	struct mail_user *user = eenv->scriptenv->user;
-	struct mailbox *box = NULL;
-	struct imap_metadata_transaction *imtrans;
 	string_t *aname;
 	bool all_exist = TRUE;
 	int ret, sret, status;
@@ -308,15 +300,6 @@ tst_metadataexists_check_annotations(const struct sieve_runtime_env *renv,
 	if (user == NULL)
 		return SIEVE_EXEC_OK;
 
-	if (mailbox != NULL) {
-		struct mail_namespace *ns;
-		ns = mail_namespace_find(user->namespaces, mailbox);
-		box = mailbox_alloc(ns->list, mailbox, 0);
-		imtrans = imap_metadata_transaction_begin(box);
-	} else {
-		imtrans = imap_metadata_transaction_begin_server(user);
-	}
-
 	if (mailbox != NULL) {
 		sieve_runtime_trace(
 			renv, SIEVE_TRLVL_TESTS,
@@ -333,7 +316,7 @@ tst_metadataexists_check_annotations(const struct sieve_runtime_env *renv,
 	while (all_exist &&
 	       (sret = sieve_stringlist_next_item(anames, &aname)) > 0) {
 		ret = tst_metadataexists_check_annotation(
-			renv, imtrans, mailbox, str_c(aname), &all_exist);
+			renv, mailbox, str_c(aname), &all_exist);
 		if (ret <= 0) {
 			status = ret;
 			break;
@@ -346,10 +329,6 @@ tst_metadataexists_check_annotations(const struct sieve_runtime_env *renv,
 		status = SIEVE_EXEC_BIN_CORRUPT;
 	}
 
-	(void)imap_metadata_transaction_commit(&imtrans, NULL, NULL);
-	if (box != NULL)
-		mailbox_free(&box);
-
 	*all_exist_r = all_exist;
 	return status;
 }
@@ -262,7 +262,6 @@ static int cmd_extracttext_operation_execute
 	struct sieve_variable_storage *storage;
 	ARRAY_TYPE(sieve_variables_modifier) modifiers;
 	struct ext_foreverypart_runtime_loop *sfploop;
-	struct sieve_message_part *mpart;
 	struct sieve_message_part_data mpart_data;
 	int opt_code = 0;
 	sieve_number_t first = 0;
@@ -324,12 +323,10 @@ static int cmd_extracttext_operation_execute
 		return SIEVE_EXEC_BIN_CORRUPT;
 	}
 
-	/* Get current message part */
-	mpart = sieve_message_part_iter_current(&sfploop->part_iter);
-	i_assert( mpart != NULL );
-
-	/* Get message part content */
-	sieve_message_part_get_data(mpart, &mpart_data, TRUE);
+	/* Get current message part content */
+	if ( (ret=sieve_message_part_iter_get_data
+		(&sfploop->part_iter, &mpart_data, TRUE)) <= 0 )
+		return ret;
 
 	/* Apply ":first" limit, if any */
 	if ( !have_first || (size_t)first > mpart_data.size ) {
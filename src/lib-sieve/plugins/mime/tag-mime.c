@@ -2,8 +2,6 @@
  */
 
 #include "lib.h"
-#include "rfc822-parser.h"
-#include "rfc2231-parser.h"
 #include "mail-storage.h"
 
 #include "sieve-common.h"
@@ -418,7 +416,7 @@ content_header_parse(struct content_header_stringlist *strlist,
 {
 	const struct sieve_runtime_env *renv = strlist->strlist.runenv;
 	bool trace = strlist->strlist.trace;
-	struct rfc822_parser_context parser;
+	const struct sieve_message_content_header *chdr;
 	const char *type, *p;
 	bool is_ctype = FALSE;
 	string_t *content;
@@ -436,47 +434,26 @@ content_header_parse(struct content_header_stringlist *strlist,
 		return t_str_new(0);
 	}
 
-	/* Initialize parsing */
-	rfc822_parser_init(&parser, str_data(str), str_len(str), NULL);
-	(void)rfc822_skip_lwsp(&parser);
+	/* Parse content type/disposition; the parsed value is cached in the
+	   message context, so successive tests on the same header are cheap */
+	if ( !sieve_message_parse_content_header(renv->msgctx, is_ctype,
+		(const char *)str_data(str), str_len(str), &chdr) )
+		return t_str_new(0);
 
-	/* Parse content type/disposition */
 	content = t_str_new(64);
-	if ( is_ctype ){
-		if (rfc822_parse_content_type(&parser, content) < 0) {
-			str_truncate(content, 0);
-			return content;
-		}
-	} else {
-		if (rfc822_parse_mime_token(&parser, content) < 0) {
-			str_truncate(content, 0);
-			return content;
-		}
-	}
-
-	/* Content-type value must end here, otherwise it is invalid after all */
-	(void)rfc822_skip_lwsp(&parser);
-	if ( parser.data != parser.end && *parser.data != ';' ) {
-		str_truncate(content, 0);
-		return content;
-	}
-
 	if ( strlist->option == EXT_MIME_OPTION_PARAM ) {
 		string_t *param_val;
 
 		/* MIME parameter */
 		i_assert( strlist->params != NULL );
 
-		// FIXME: not very nice when multiple parameters in the same header
-		// are queried in successive tests.
-		str_truncate(content, 0);
-		rfc2231_parse(&parser, &strlist->param_values);
-
+		strlist->param_values = chdr->params;
 		param_val = content_type_param_next(strlist);
 		if ( param_val != NULL )
 			content = param_val;
 	} else {
 		/* Get :type/:subtype:/:contenttype value */
+		str_append(content, chdr->content);
 		type = str_c(content);
 		p = strchr(type, '/');
 		switch ( strlist->option ) {
@@ -12,10 +12,11 @@
  */
 
 /* FIXME: Regular expressions are compiled during compilation and
- * again during interpretation. This is suboptimal and should be
- * changed. This requires dumping the compiled regex to the binary.
- * Most likely, this will only be possible when we implement regular
- * expressions ourselves.
+ * again when the binary is first executed. Literal expressions are compiled
+ * only once for each loaded binary and variable expressions are kept in a
+ * small per-binary cache, but dumping the compiled regex to the binary
+ * itself will only be possible when we implement regular expressions
+ * ourselves.
  *
  */
 
@@ -16,6 +16,7 @@
 #include "sieve-ast.h"
 #include "sieve-stringlist.h"
 #include "sieve-commands.h"
+#include "sieve-binary.h"
 #include "sieve-validator.h"
 #include "sieve-interpreter.h"
 #include "sieve-comparators.h"
@@ -166,18 +167,263 @@ static bool mcht_regex_validate_context
 }
 
 /*
- * Match type implementation
+ * Regex cache
  */
 
+/* Compiled regular expression */
+
 struct mcht_regex_key {
 	regex_t regexp;
 	int status;
 };
+ARRAY_DEFINE_TYPE(mcht_regex_key, struct mcht_regex_key);
+
+static int
+mcht_regex_get_cflags(const struct sieve_comparator *cmp, bool match_values)
+{
+	int cflags;
+
+	/* Configure case-sensitivity according to comparator */
+	if ( sieve_comparator_is(cmp, i_octet_comparator) )
+		cflags = REG_EXTENDED;
+	else if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
+		cflags = REG_EXTENDED | REG_ICASE;
+	else
+		return -1; /* Not supported */
+
+	/* Indicate whether match values need to be produced */
+	if ( !match_values ) cflags |= REG_NOSUB;
+
+	return cflags;
+}
+
+static void mcht_regex_key_compile
+(struct sieve_match_context *mctx, struct mcht_regex_key *rkey,
+	const char *regex_str, int cflags)
+{
+	int rxret;
+
+	if ( cflags < 0 ) {
+		rkey->status = -1;
+		return;
+	}
+
+	/* Compile regular expression */
+	if ( (rxret=regcomp(&rkey->regexp, regex_str, cflags)) != 0 ) {
+		sieve_runtime_error(mctx->runenv, NULL,
+			"invalid regular expression '%s' for regex match: %s",
+			str_sanitize(regex_str, 128),
+			_regexp_error(&rkey->regexp, rxret));
+		rkey->status = -1;
+	} else {
+		rkey->status = 1;
+	}
+}
+
+/* Literal keys: compiled once for each loaded binary */
+
+struct mcht_regex_key_data {
+	/* Indexed by whether match values are produced */
+	ARRAY_TYPE(mcht_regex_key) keys[2];
+};
+
+static void mcht_regex_key_data_free(void *data)
+{
+	struct mcht_regex_key_data *kdata = (struct mcht_regex_key_data *) data;
+	struct mcht_regex_key *rkey;
+	unsigned int i;
+
+	for ( i = 0; i < N_ELEMENTS(kdata->keys); i++ ) {
+		if ( !array_is_created(&kdata->keys[i]) )
+			continue;
+		array_foreach_modifiable(&kdata->keys[i], rkey) {
+			if ( rkey->status > 0 )
+				regfree(&rkey->regexp);
+		}
+	}
+}
+
+static int mcht_regex_key_data_compile
+(struct sieve_match_context *mctx, struct sieve_match_key_data *key_data,
+	struct sieve_stringlist *key_list, bool match_values,
+	ARRAY_TYPE(mcht_regex_key) **keys_r)
+{
+	struct mcht_regex_key_data *kdata =
+		(struct mcht_regex_key_data *) key_data->data;
+	ARRAY_TYPE(mcht_regex_key) *keys, new_keys;
+	int cflags = mcht_regex_get_cflags(mctx->comparator, match_values);
+	string_t *key_item = NULL;
+	int ret;
+
+	if ( kdata == NULL ) {
+		kdata = p_new(key_data->pool, struct mcht_regex_key_data, 1);
+		key_data->data = (void *) kdata;
+		key_data->free = mcht_regex_key_data_free;
+	}
+
+	keys = &kdata->keys[match_values ? 1 : 0];
+	if ( array_is_created(keys) ) {
+		*keys_r = keys;
+		return 1;
+	}
+
+	p_array_init(&new_keys, key_data->pool, 4);
+	while ( (ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		struct mcht_regex_key *rkey = array_append_space(&new_keys);
+
+		T_BEGIN {
+			mcht_regex_key_compile(mctx, rkey, str_c(key_item), cflags);
+		} T_END;
+	}
+
+	if ( ret < 0 ) {
+		/* Binary is corrupt; don't leave a partial list behind */
+		struct mcht_regex_key *rkey;
+
+		array_foreach_modifiable(&new_keys, rkey) {
+			if ( rkey->status > 0 )
+				regfree(&rkey->regexp);
+		}
+		mctx->exec_status = key_list->exec_status;
+		return -1;
+	}
+
+	*keys = new_keys;
+	*keys_r = keys;
+	return 1;
+}
+
+/* Variable keys: small per-binary LRU */
+
+#define MCHT_REGEX_CACHE_SIZE 16
+
+struct mcht_regex_cache_entry {
+	struct mcht_regex_key key;
+	char *regex_str;
+	int cflags;
+
+	/* One reference is held by the cache itself */
+	unsigned int refcount;
+};
+
+struct mcht_regex_binary_context {
+	/* Most recently used entry first */
+	struct mcht_regex_cache_entry *entries[MCHT_REGEX_CACHE_SIZE];
+	unsigned int count;
+};
+
+static void
+mcht_regex_cache_entry_unref(struct mcht_regex_cache_entry **_entry)
+{
+	struct mcht_regex_cache_entry *entry = *_entry;
+
+	*_entry = NULL;
+
+	i_assert(entry->refcount > 0);
+	if ( --entry->refcount > 0 )
+		return;
+
+	if ( entry->key.status > 0 )
+		regfree(&entry->key.regexp);
+	i_free(entry->regex_str);
+	i_free(entry);
+}
+
+static void mcht_regex_binary_free
+(const struct sieve_extension *ext ATTR_UNUSED,
+	struct sieve_binary *sbin ATTR_UNUSED, void *context)
+{
+	struct mcht_regex_binary_context *bctx =
+		(struct mcht_regex_binary_context *) context;
+	unsigned int i;
+
+	for ( i = 0; i < bctx->count; i++ )
+		mcht_regex_cache_entry_unref(&bctx->entries[i]);
+	bctx->count = 0;
+}
+
+static const struct sieve_binary_extension mcht_regex_binary_ext = {
+	.extension = &regex_extension,
+	.binary_free = mcht_regex_binary_free
+};
+
+static struct mcht_regex_binary_context *
+mcht_regex_get_binary_context(struct sieve_match_context *mctx)
+{
+	const struct sieve_extension *this_ext = mctx->match_type->object.ext;
+	struct sieve_binary *sbin = mctx->runenv->sbin;
+	struct mcht_regex_binary_context *bctx;
+
+	bctx = (struct mcht_regex_binary_context *)
+		sieve_binary_extension_get_context(sbin, this_ext);
+	if ( bctx == NULL ) {
+		bctx = p_new(sieve_binary_pool(sbin),
+			struct mcht_regex_binary_context, 1);
+		sieve_binary_extension_set
+			(sbin, this_ext, &mcht_regex_binary_ext, (void *) bctx);
+	}
+	return bctx;
+}
+
+static struct mcht_regex_cache_entry *mcht_regex_cache_get
+(struct sieve_match_context *mctx, const char *regex_str, int cflags)
+{
+	struct mcht_regex_binary_context *bctx =
+		mcht_regex_get_binary_context(mctx);
+	struct mcht_regex_cache_entry *entry;
+	unsigned int i;
+
+	for ( i = 0; i < bctx->count; i++ ) {
+		entry = bctx->entries[i];
+		if ( entry->cflags == cflags &&
+			strcmp(entry->regex_str, regex_str) == 0 )
+			break;
+	}
+
+	if ( i < bctx->count ) {
+		/* Hit: move to front */
+		memmove(&bctx->entries[1], &bctx->entries[0],
+			i * sizeof(bctx->entries[0]));
+	} else {
+		/* Miss: compile and insert at front, dropping the least recently
+		   used entry when the cache is full */
+		entry = i_new(struct mcht_regex_cache_entry, 1);
+		entry->regex_str = i_strdup(regex_str);
+		entry->cflags = cflags;
+		entry->refcount = 1;
+		mcht_regex_key_compile(mctx, &entry->key, regex_str, cflags);
+
+		/* Failures are not cached, so that the error is reported each
+		   time the regular expression is used */
+		if ( entry->key.status <= 0 )
+			return entry;
+
+		if ( bctx->count == MCHT_REGEX_CACHE_SIZE )
+			mcht_regex_cache_entry_unref(&bctx->entries[--bctx->count]);
+		memmove(&bctx->entries[1], &bctx->entries[0],
+			bctx->count * sizeof(bctx->entries[0]));
+		bctx->count++;
+	}
+	bctx->entries[0] = entry;
+
+	entry->refcount++;
+	return entry;
+}
+
+/*
+ * Match type implementation
+ */
 
 struct mcht_regex_context {
-	ARRAY(struct mcht_regex_key) reg_expressions;
+	/* Compiled literal keys (owned by the binary) */
+	ARRAY_TYPE(mcht_regex_key) *literal_keys;
+
+	/* Compiled variable keys (referenced from the binary's cache) */
+	ARRAY(struct mcht_regex_cache_entry *) var_keys;
+
 	regmatch_t *pmatch;
 	size_t nmatch;
+	bool literal_checked:1;
 	bool all_compiled:1;
 };
 
@@ -262,18 +508,53 @@ static int mcht_regex_match_keys
 	const struct sieve_runtime_env *renv = mctx->runenv;
 	bool trace = sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING);
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
-	const struct sieve_comparator *cmp = mctx->comparator;
+	int cflags = mcht_regex_get_cflags(mctx->comparator, ctx->nmatch > 0);
 	int match;
 
-	if ( !ctx->all_compiled ) {
+	if ( !ctx->literal_checked ) {
+		struct sieve_match_key_data *key_data;
+
+		/* Literal keys are compiled only once for each loaded binary */
+		ctx->literal_checked = TRUE;
+		key_data = sieve_match_key_data_get(mctx, key_list);
+		if ( key_data != NULL ) {
+			if ( mcht_regex_key_data_compile(mctx, key_data, key_list,
+				ctx->nmatch > 0, &ctx->literal_keys) < 0 )
+				return -1;
+		}
+	}
+
+	if ( ctx->literal_keys != NULL ) {
+		const struct mcht_regex_key *rkeys;
+		unsigned int i, count;
+
+		rkeys = array_get(ctx->literal_keys, &count);
+
+		i = 0;
+		match = 0;
+		while ( match == 0 && i < count ) {
+			if ( rkeys[i].status > 0 ) {
+				match = mcht_regex_match_key(mctx, val, &rkeys[i].regexp);
+
+				if ( trace ) {
+					sieve_runtime_trace(renv, 0,
+						"with compiled regex [id=%d] => %d", i, match);
+				}
+			}
+
+			i++;
+		}
+
+	} else if ( !ctx->all_compiled ) {
 		string_t *key_item = NULL;
 		unsigned int i;
 		int ret;
 
-		/* Regular expressions still need to be compiled */
+		/* Regular expressions still need to be compiled (or found in the
+		   binary's cache) */
 
-		if ( !array_is_created(&ctx->reg_expressions) )
-			p_array_init(&ctx->reg_expressions, mctx->pool, 16);
+		if ( !array_is_created(&ctx->var_keys) )
+			p_array_init(&ctx->var_keys, mctx->pool, 16);
 
 		i = 0;
 		match = 0;
@@ -281,51 +562,24 @@ static int mcht_regex_match_keys
 			(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
 
 			T_BEGIN {
-				struct mcht_regex_key *rkey;
-
-				if ( i >= array_count(&ctx->reg_expressions) ) {
-					int cflags;
-
-					rkey = array_append_space(&ctx->reg_expressions);
-
-					/* Configure case-sensitivity according to comparator */
-					if ( sieve_comparator_is(cmp, i_octet_comparator) )
-						cflags =  REG_EXTENDED;
-					else if ( sieve_comparator_is(cmp, i_ascii_casemap_comparator) )
-						cflags =  REG_EXTENDED | REG_ICASE;
-					else
-						rkey->status = -1; /* Not supported */
-
-					if ( rkey->status >= 0 ) {
-						const char *regex_str = str_c(key_item);
-						int rxret;
-
-						/* Indicate whether match values need to be produced */
-						if ( ctx->nmatch == 0 ) cflags |= REG_NOSUB;
-
-						/* Compile regular expression */
-						if ( (rxret=regcomp(&rkey->regexp, regex_str, cflags)) != 0 ) {
-							sieve_runtime_error(renv, NULL,
-								"invalid regular expression '%s' for regex match: %s",
-								str_sanitize(regex_str, 128),
-								_regexp_error(&rkey->regexp, rxret));
-							rkey->status = -1;
-						} else {
-							rkey->status = 1;
-						}
-					}
+				struct mcht_regex_cache_entry *entry;
+
+				if ( i >= array_count(&ctx->var_keys) ) {
+					entry = mcht_regex_cache_get
+						(mctx, str_c(key_item), cflags);
+					array_append(&ctx->var_keys, &entry, 1);
 				} else {
-					rkey = array_idx_modifiable(&ctx->reg_expressions, 1);
+					entry = array_idx_elem(&ctx->var_keys, i);
 				}
 
-				if ( rkey->status > 0 ) {
-					match = mcht_regex_match_key(mctx, val, &rkey->regexp);
+				if ( entry->key.status > 0 ) {
+					match = mcht_regex_match_key
+						(mctx, val, &entry->key.regexp);
 
 					if ( trace ) {
 						sieve_runtime_trace(renv, 0,
 							"with regex `%s' [id=%d] => %d",
-							str_sanitize(str_c(key_item), 80),
-							array_count(&ctx->reg_expressions)-1, match);
+							str_sanitize(str_c(key_item), 80), i, match);
 					}
 				}
 			} T_END;
@@ -341,18 +595,19 @@ static int mcht_regex_match_keys
 		}
 
 	} else {
-		const struct mcht_regex_key *rkeys;
+		struct mcht_regex_cache_entry *const *entries;
 		unsigned int i, count;
 
 		/* Regular expressions are compiled */
 
-		rkeys = array_get(&ctx->reg_expressions, &count);
+		entries = array_get(&ctx->var_keys, &count);
 
 		i = 0;
 		match = 0;
 		while ( match == 0 && i < count ) {
-			if ( rkeys[i].status > 0 ) {
-				match = mcht_regex_match_key(mctx, val, &rkeys[i].regexp);
+			if ( entries[i]->key.status > 0 ) {
+				match = mcht_regex_match_key
+					(mctx, val, &entries[i]->key.regexp);
 
 				if ( trace ) {
 					sieve_runtime_trace(renv, 0,
@@ -371,15 +626,11 @@ void mcht_regex_match_deinit
 (struct sieve_match_context *mctx)
 {
 	struct mcht_regex_context *ctx = (struct mcht_regex_context *) mctx->data;
-	struct mcht_regex_key *rkeys;
-	unsigned int count, i;
-
-	/* Clean up compiled regular expressions */
-	if ( array_is_created(&ctx->reg_expressions) ) {
-		rkeys = array_get_modifiable(&ctx->reg_expressions, &count);
-		for ( i = 0; i < count; i++ ) {
-			regfree(&rkeys[i].regexp);
-		}
+	struct mcht_regex_cache_entry **entryp;
+
+	/* Release references to cached regular expressions */
+	if ( array_is_created(&ctx->var_keys) ) {
+		array_foreach_modifiable(&ctx->var_keys, entryp)
+			mcht_regex_cache_entry_unref(entryp);
 	}
 }
-
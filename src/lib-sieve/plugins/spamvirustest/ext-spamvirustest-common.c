@@ -469,7 +469,7 @@ int ext_spamvirustest_get_value
 	const char *status = NULL, *max = NULL;
 	float status_value, max_value;
 	unsigned int i, max_text;
-	pool_t pool = sieve_interpreter_pool(renv->interp);
+	pool_t pool;
 
 	*value_r = "0";
 
@@ -490,7 +490,9 @@ int ext_spamvirustest_get_value
 		sieve_message_context_extension_get(msgctx, ext);
 
 	if ( mctx == NULL ) {
-		/* Create new context */
+		/* Create new context; it must live as long as the message context,
+		   so that later scripts executed for this message reuse the score */
+		pool = sieve_message_context_pool(msgctx);
 		mctx = p_new(pool, struct ext_spamvirustest_message_context, 1);
 		sieve_message_context_extension_set(msgctx, ext, (void *)mctx);
 	} else if ( mctx->reload == ext_data->reload ) {
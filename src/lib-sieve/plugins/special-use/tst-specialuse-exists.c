@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "hash.h"
 #include "str-sanitize.h"
 #include "mail-storage.h"
 #include "mail-namespace.h"
@@ -297,20 +298,44 @@ tst_specialuse_find_mailbox(const struct sieve_runtime_env *renv,
 	return 1;
 }
 
+/* Whether a usable mailbox exists for a special-use flag is remembered for
+   the duration of the script execution, so that testing the same flag again
+   does not resolve and open the mailbox again. Temporary failures are not
+   remembered. */
+
+struct tst_specialuse_cache {
+	HASH_TABLE(const char *, void *) flags;
+};
+
+static struct tst_specialuse_cache *
+tst_specialuse_cache_get(const struct sieve_runtime_env *renv)
+{
+	const struct sieve_extension *this_ext = renv->oprtn->ext;
+	struct tst_specialuse_cache *cache;
+	pool_t pool;
+
+	cache = sieve_interpreter_extension_get_context(renv->interp,
+							this_ext);
+	if (cache == NULL) {
+		pool = sieve_interpreter_pool(renv->interp);
+		cache = p_new(pool, struct tst_specialuse_cache, 1);
+		hash_table_create(&cache->flags, pool, 0,
+				  strcase_hash, strcasecmp);
+		sieve_interpreter_extension_set_context(renv->interp, this_ext,
+							cache);
+	}
+	return cache;
+}
+
 static int
-tst_specialuse_find_specialuse(const struct sieve_runtime_env *renv,
-			       const char *special_use)
+tst_specialuse_open_specialuse(const struct sieve_runtime_env *renv,
+			       struct mail_user *user, const char *special_use)
 {
-	const struct sieve_execute_env *eenv = renv->exec_env;
-	struct mail_user *user = eenv->scriptenv->user;
 	struct mailbox *box;
 	bool trace = sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING);
 	enum mail_error error_code;
 	const char *error;
 
-	if (user == NULL)
-		return 0;
-
 	/* Open the box */
 	box = mailbox_alloc_for_user(user, special_use,
 				     (MAILBOX_FLAG_POST_SESSION |
@@ -354,6 +379,43 @@ tst_specialuse_find_specialuse(const struct sieve_runtime_env *renv,
 	return 1;
 }
 
+static int
+tst_specialuse_find_specialuse(const struct sieve_runtime_env *renv,
+			       const char *special_use)
+{
+	const struct sieve_execute_env *eenv = renv->exec_env;
+	struct mail_user *user = eenv->scriptenv->user;
+	struct tst_specialuse_cache *cache;
+	void *value;
+	int ret;
+
+	if (user == NULL)
+		return 0;
+
+	cache = tst_specialuse_cache_get(renv);
+	value = hash_table_lookup(cache->flags, special_use);
+	if (value != NULL) {
+		ret = POINTER_CAST_TO(value, int) - 1;
+		if (sieve_runtime_trace_active(renv, SIEVE_TRLVL_MATCHING)) {
+			sieve_runtime_trace(
+				renv, 0, "mailbox with special-use flag `%s' "
+				"%s (checked before)",
+				str_sanitize(special_use, 64),
+				(ret > 0 ? "is available" : "is unavailable"));
+		}
+		return ret;
+	}
+
+	ret = tst_specialuse_open_specialuse(renv, user, special_use);
+	if (ret >= 0) {
+		hash_table_insert(cache->flags,
+				  p_strdup(sieve_interpreter_pool(renv->interp),
+					   special_use),
+				  POINTER_CAST(ret + 1));
+	}
+	return ret;
+}
+
 static int
 tst_specialuse_exists_check_flag(const struct sieve_runtime_env *renv,
 				 struct mailbox *box, const char *use_flag,
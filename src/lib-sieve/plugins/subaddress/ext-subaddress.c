@@ -32,7 +32,8 @@
 #define SUBADDRESS_DEFAULT_DELIM "+"
 
 struct ext_subaddress_config {
-	char *delimiter;
+	/* Lookup table of the recipient_delimiter characters */
+	bool delim_chars[256];
 };
 
 /*
@@ -79,7 +80,8 @@ static bool ext_subaddress_load
 		delim = SUBADDRESS_DEFAULT_DELIM;
 
 	config = i_new(struct ext_subaddress_config, 1);
-	config->delimiter = i_strdup(delim);
+	for ( ; *delim != '\0'; delim++ )
+		config->delim_chars[(unsigned char)*delim] = TRUE;
 
 	*context = (void *) config;
 
@@ -92,7 +94,6 @@ static void ext_subaddress_unload
 	struct ext_subaddress_config *config =
 		(struct ext_subaddress_config *) ext->context;
 
-	i_free(config->delimiter);
 	i_free(config);
 }
 
@@ -137,16 +138,26 @@ const struct sieve_address_part_def detail_address_part = {
 
 /* Address part implementation */
 
+static inline const char *subaddress_find_delim
+(const struct ext_subaddress_config *config, const char *localpart)
+{
+	const unsigned char *p = (const unsigned char *)localpart;
+
+	for ( ; *p != '\0'; p++ ) {
+		if ( config->delim_chars[*p] )
+			return (const char *)p;
+	}
+	return NULL;
+}
+
 static const char *subaddress_user_extract_from
 (const struct sieve_address_part *addrp, const struct smtp_address *address)
 {
 	struct ext_subaddress_config *config =
 		(struct ext_subaddress_config *) addrp->object.ext->context;
 	const char *delim;
-	size_t idx;
 
-	idx = strcspn(address->localpart, config->delimiter);
-	delim = address->localpart[idx] != '\0' ? address->localpart + idx : NULL;
+	delim = subaddress_find_delim(config, address->localpart);
 
 	if ( delim == NULL ) return address->localpart;
 
@@ -159,16 +170,11 @@ static const char *subaddress_detail_extract_from
 	struct ext_subaddress_config *config =
 		(struct ext_subaddress_config *) addrp->object.ext->context;
 	const char *delim;
-	size_t idx;
 
-	idx = strcspn(address->localpart, config->delimiter);
-	delim = address->localpart[idx] != '\0' ? address->localpart + idx + 1: NULL;
+	delim = subaddress_find_delim(config, address->localpart);
 
-	/* Just to be sure */
-	if ( delim == NULL ||
-		delim > (address->localpart + strlen(address->localpart)) )
-		return NULL;
-	return delim;
+	if ( delim == NULL ) return NULL;
+	return delim + 1;
 }
 
 /*
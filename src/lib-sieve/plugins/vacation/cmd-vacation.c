@@ -191,6 +191,8 @@ act_vacation_print(const struct sieve_action *action,
 static int
 act_vacation_commit(const struct sieve_action_exec_env *aenv, void *tr_context);
 
+static void act_vacation_add_filter_headers(struct sieve_ast *ast);
+
 /* Action object */
 
 const struct sieve_action_def act_vacation = {
@@ -464,6 +466,9 @@ cmd_vacation_validate(struct sieve_validator *valdtr,
 	if (!sieve_validator_argument_activate(valdtr, cmd, arg, FALSE))
 		return FALSE;
 
+	/* Have the header fields checked before responding prefetched */
+	act_vacation_add_filter_headers(cmd->ast_node->ast);
+
 	/* Construct handle if not set explicitly */
 	if (ctx_data->handle_arg == NULL) {
 		T_BEGIN {
@@ -868,6 +873,26 @@ static const char * const _sender_headers[] = {
 	NULL
 };
 
+/* Headers that mark a message as automatically generated
+ */
+
+static const char * const _automatic_headers[] = {
+	"auto-submitted",
+	"precedence",
+	"x-auto-response-suppress",
+	NULL
+};
+
+static void act_vacation_add_filter_headers(struct sieve_ast *ast)
+{
+	const char *const *hdsp;
+
+	for (hdsp = _automatic_headers; *hdsp != NULL; hdsp++)
+		sieve_ast_header_field_add(ast, *hdsp);
+	for (hdsp = _list_headers; *hdsp != NULL; hdsp++)
+		sieve_ast_header_field_add(ast, *hdsp);
+}
+
 static inline bool _is_system_address(const struct smtp_address *address)
 {
 	if (strcasecmp(address->localpart, "MAILER-DAEMON") == 0)
@@ -1226,6 +1251,124 @@ act_vacation_hash(struct act_vacation_context *vctx, const char *sender,
 	md5_final(&ctx, hash_r);
 }
 
+/* Checks whether the message is obviously not to be answered, because it
+   is sent by a system address, is automatically generated or originates
+   from a mailing list. This only looks at the sender and some header fields,
+   so it is performed before anything more expensive. Returns 1 when the
+   response is to be discarded (it is logged), 0 when it is not and an
+   execution status < 0 on error. */
+static int
+act_vacation_filter_automatic(const struct sieve_action_exec_env *aenv,
+			      struct mail *mail,
+			      const struct smtp_address *sender)
+{
+	const char *const *hdsp, *const *headers;
+	int ret;
+
+	/* Do not reply to system addresses */
+	if (_is_system_address(sender)) {
+		sieve_result_global_log(
+			aenv, "not sending vacation response to system address <%s>",
+			smtp_address_encode(sender));
+		return 1;
+	}
+
+	/* Is the message that we are replying to an automatic reply ? */
+	if ((ret = mail_get_headers(mail, "auto-submitted", &headers)) < 0) {
+		return sieve_result_mail_error(
+			aenv, mail,
+			"failed to read header field `auto-submitted'");
+	}
+	/* Theoretically multiple headers could exist, so lets make sure */
+	if (ret > 0) {
+		hdsp = headers;
+		while (*hdsp != NULL) {
+			if (strcasecmp(*hdsp, "no") != 0) {
+				sieve_result_global_log(
+					aenv, "discarding vacation response "
+					"to auto-submitted message from <%s>",
+					smtp_address_encode(sender));
+				return 1;
+			}
+			hdsp++;
+		}
+	}
+
+	/* Check for the (non-standard) precedence header */
+	if ((ret = mail_get_headers(mail, "precedence", &headers)) < 0) {
+		return sieve_result_mail_error(
+			aenv, mail, "failed to read header field `precedence'");
+	}
+	/* Theoretically multiple headers could exist, so lets make sure */
+	if (ret > 0) {
+		hdsp = headers;
+		while (*hdsp != NULL) {
+			if (strcasecmp(*hdsp, "junk") == 0 ||
+			    strcasecmp(*hdsp, "bulk") == 0 ||
+			    strcasecmp(*hdsp, "list") == 0) {
+				sieve_result_global_log(
+					aenv, "discarding vacation response "
+					"to precedence=%s message from <%s>",
+					*hdsp, smtp_address_encode(sender));
+				return 1;
+			}
+			hdsp++;
+		}
+	}
+
+	/* Are we trying to respond to a mailing list ? */
+	hdsp = _list_headers;
+	while (*hdsp != NULL) {
+		if ((ret = mail_get_headers(mail, *hdsp, &headers)) < 0) {
+			return sieve_result_mail_error(
+				aenv, mail,
+				"failed to read header field `%s'", *hdsp);
+		}
+
+		if (ret > 0 && headers[0] != NULL) {
+			/* Yes, bail out */
+			sieve_result_global_log(
+				aenv, "discarding vacation response "
+				"to mailinglist recipient <%s>",
+				smtp_address_encode(sender));
+			return 1;
+		}
+		hdsp++;
+	}
+
+	/* Check for the (non-standard) Microsoft X-Auto-Response-Suppress header */
+	if ((ret = mail_get_headers(mail, "x-auto-response-suppress",
+				    &headers)) < 0) {
+		return sieve_result_mail_error(
+			aenv, mail,
+			"failed to read header field `x-auto-response-suppress'");
+	}
+	/* Theoretically multiple headers could exist, so lets make sure */
+	if (ret > 0) {
+		hdsp = headers;
+		while (*hdsp != NULL) {
+			const char *const *flags = t_strsplit(*hdsp, ",");
+
+			while (*flags != NULL) {
+				const char *flag = t_str_trim(*flags, " \t");
+
+				if (strcasecmp(flag, "All") == 0 ||
+				    strcasecmp(flag, "OOF") == 0) {
+					sieve_result_global_log(
+						aenv, "discarding vacation response to message from <%s> "
+						"(`%s' flag found in x-auto-response-suppress header)",
+						smtp_address_encode(sender), flag);
+					return 1;
+				}
+				flags++;
+			}
+			hdsp++;
+		}
+	}
+
+	return 0;
+}
+
 static int
 act_vacation_commit(const struct sieve_action_exec_env *aenv,
 		    void *tr_context ATTR_UNUSED)
@@ -1303,6 +1446,11 @@ act_vacation_commit(const struct sieve_action_exec_env *aenv,
 		}
 	}
 
+	/* Is this an automatic message or one from a mailing list? */
+	ret = act_vacation_filter_automatic(aenv, mail, sender);
+	if (ret != 0)
+		return (ret > 0 ? SIEVE_EXEC_OK : ret);
+
 	/* Did whe respond to this user before? */
 	if (sieve_action_duplicate_check_available(aenv)) {
 		bool duplicate;
@@ -1329,107 +1477,6 @@ act_vacation_commit(const struct sieve_action_exec_env *aenv,
 		}
 	}
 
-	/* Are we trying to respond to a mailing list ? */
-	hdsp = _list_headers;
-	while (*hdsp != NULL) {
-		if ((ret = mail_get_headers(mail, *hdsp, &headers)) < 0) {
-			return sieve_result_mail_error(
-				aenv, mail,
-				"failed to read header field `%s'", *hdsp);
-		}
-
-		if (ret > 0 && headers[0] != NULL) {
-			/* Yes, bail out */
-			sieve_result_global_log(
-				aenv, "discarding vacation response "
-				"to mailinglist recipient <%s>",
-				smtp_address_encode(sender));
-			return SIEVE_EXEC_OK;
-		}
-		hdsp++;
-	}
-
-	/* Is the message that we are replying to an automatic reply ? */
-	if ((ret = mail_get_headers(mail, "auto-submitted", &headers)) < 0) {
-		return sieve_result_mail_error(
-			aenv, mail,
-			"failed to read header field `auto-submitted'");
-	}
-	/* Theoretically multiple headers could exist, so lets make sure */
-	if (ret > 0) {
-		hdsp = headers;
-		while (*hdsp != NULL) {
-			if (strcasecmp(*hdsp, "no") != 0) {
-				sieve_result_global_log(
-					aenv, "discarding vacation response "
-					"to auto-submitted message from <%s>",
-					smtp_address_encode(sender));
-					return SIEVE_EXEC_OK;
-			}
-			hdsp++;
-		}
-	}
-
-	/* Check for the (non-standard) precedence header */
-	if ((ret = mail_get_headers(mail, "precedence", &headers)) < 0) {
-		return sieve_result_mail_error(
-			aenv, mail, "failed to read header field `precedence'");
-	}
-	/* Theoretically multiple headers could exist, so lets make sure */
-	if (ret > 0) {
-		hdsp = headers;
-		while (*hdsp != NULL) {
-			if (strcasecmp(*hdsp, "junk") == 0 ||
-			    strcasecmp(*hdsp, "bulk") == 0 ||
-			    strcasecmp(*hdsp, "list") == 0) {
-				sieve_result_global_log(
-					aenv, "discarding vacation response "
-					"to precedence=%s message from <%s>",
-					*hdsp, smtp_address_encode(sender));
-					return SIEVE_EXEC_OK;
-			}
-			hdsp++;
-		}
-	}
-
-	/* Check for the (non-standard) Microsoft X-Auto-Response-Suppress header */
-	if ((ret = mail_get_headers(mail, "x-auto-response-suppress",
-				    &headers)) < 0) {
-		return sieve_result_mail_error(
-			aenv, mail,
-			"failed to read header field `x-auto-response-suppress'");
-	}
-	/* Theoretically multiple headers could exist, so lets make sure */
-	if (ret > 0) {
-		hdsp = headers;
-		while (*hdsp != NULL) {
-			const char *const *flags = t_strsplit(*hdsp, ",");
-
-			while (*flags != NULL) {
-				const char *flag = t_str_trim(*flags, " \t");
-
-				if (strcasecmp(flag, "All") == 0 ||
-				    strcasecmp(flag, "OOF") == 0) {
-					sieve_result_global_log(
-						aenv, "discarding vacation response to message from <%s> "
-						"(`%s' flag found in x-auto-response-suppress header)",
-						smtp_address_encode(sender), flag);
-					return SIEVE_EXEC_OK;
-				}
-				flags++;
-			}
-			hdsp++;
-		}
-	}
-
-	/* Do not reply to system addresses */
-	if (_is_system_address(sender)) {
-		sieve_result_global_log(
-			aenv, "not sending vacation response to system address <%s>",
-			smtp_address_encode(sender));
-		return SIEVE_EXEC_OK;
-	}
-
 	/* Fetch original recipient if necessary */
 	if (config->use_original_recipient)
 		orig_recipient = sieve_message_get_orig_recipient(aenv->msgctx);
@@ -123,6 +123,8 @@ static bool ext_variables_match_value_argument_activate
 	arg->argument = sieve_argument_create
 		(ast, &match_value_argument, this_ext, 0);
 	arg->argument->data = (void *) POINTER_CAST(index);
+
+	sieve_ast_match_values_set_used(ast);
 	return TRUE;
 }
 
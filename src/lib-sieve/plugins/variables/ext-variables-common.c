@@ -523,7 +523,11 @@ sieve_variable_storage_create(const struct sieve_extension *var_ext,
 
 	storage->max_size = sieve_variable_scope_binary_get_size(scpbin);
 
-	p_array_init(&storage->var_values, pool, 4);
+	/* The number of variables in the scope is known up front, so allocate
+	   the value index only once. */
+	p_array_init(&storage->var_values, pool,
+		     (storage->scope_bin == NULL || storage->max_size == 0 ?
+		      4 : storage->max_size));
 
 	return storage;
 }
@@ -600,8 +604,10 @@ bool sieve_variable_get(struct sieve_variable_storage *storage,
 	return TRUE;
 }
 
-bool sieve_variable_get_modifiable(struct sieve_variable_storage *storage,
-				   unsigned int index, string_t **value)
+static bool
+sieve_variable_get_modifiable_sized(struct sieve_variable_storage *storage,
+				    unsigned int index, size_t size_hint,
+				    string_t **value)
 {
 	string_t *dummy;
 
@@ -612,12 +618,24 @@ bool sieve_variable_get_modifiable(struct sieve_variable_storage *storage,
 		return FALSE;
 
 	if (*value == NULL) {
-		*value = str_new(storage->pool, 256);
+		/* Variable buffers are reused for later assignments, so this
+		   is only allocated once per variable. Size it for the first
+		   value, since most variables hold short strings. */
+		size_hint = I_MAX(size_hint + 1,
+				  EXT_VARIABLES_MIN_VALUE_ALLOC_SIZE);
+		*value = str_new(storage->pool, size_hint);
 		array_idx_set(&storage->var_values, index, value);
 	}
 	return TRUE;
 }
 
+bool sieve_variable_get_modifiable(struct sieve_variable_storage *storage,
+				   unsigned int index, string_t **value)
+{
+	return sieve_variable_get_modifiable_sized(
+		storage, index, EXT_VARIABLES_DEFAULT_VALUE_ALLOC_SIZE, value);
+}
+
 bool sieve_variable_assign(struct sieve_variable_storage *storage,
 			   unsigned int index, const string_t *value)
 {
@@ -625,7 +643,8 @@ bool sieve_variable_assign(struct sieve_variable_storage *storage,
 		ext_variables_get_config(storage->var_ext);
 	string_t *varval;
 
-	if (!sieve_variable_get_modifiable(storage, index, &varval))
+	if (!sieve_variable_get_modifiable_sized(storage, index,
+						 str_len(value), &varval))
 		return FALSE;
 
 	str_truncate(varval, 0);
@@ -645,7 +664,8 @@ bool sieve_variable_assign_cstr(struct sieve_variable_storage *storage,
 		ext_variables_get_config(storage->var_ext);
 	string_t *varval;
 
-	if (!sieve_variable_get_modifiable(storage, index, &varval))
+	if (!sieve_variable_get_modifiable_sized(storage, index,
+						 strlen(value), &varval))
 		return FALSE;
 
 	str_truncate(varval, 0);
@@ -893,8 +913,10 @@ bool ext_variables_interpreter_load(const struct sieve_extension *ext,
 	(void)ext_variables_interpreter_context_create(ext, renv->interp,
 						       scpbin);
 
-	/* Enable support for match values */
-	(void)sieve_match_values_set_enabled(renv, TRUE);
+	/* Enable support for match values, unless the script never reads
+	   them */
+	if (sieve_binary_get_match_values_used(renv->sbin))
+		(void)sieve_match_values_set_enabled(renv, TRUE);
 
 	return TRUE;
 }
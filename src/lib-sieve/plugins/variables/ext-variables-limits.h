@@ -32,4 +32,8 @@
 
 #define EXT_VARIABLES_MAX_MATCH_INDEX            SIEVE_MAX_MATCH_VALUES
 
+/* Initial allocation of variable value buffers */
+#define EXT_VARIABLES_MIN_VALUE_ALLOC_SIZE       32
+#define EXT_VARIABLES_DEFAULT_VALUE_ALLOC_SIZE   255
+
 #endif
@@ -130,19 +130,19 @@ void ext_variables_register_core_modifiers
 
 static bool
 mod_lower_modify(const struct sieve_variables_modifier *modf,
-		 string_t *in, string_t **result);
+		 string_t *value);
 static bool
 mod_upper_modify(const struct sieve_variables_modifier *modf,
-		 string_t *in, string_t **result);
+		 string_t *value);
 static bool
 mod_lowerfirst_modify(const struct sieve_variables_modifier *modf,
-		      string_t *in, string_t **result);
+		      string_t *value);
 static bool
 mod_upperfirst_modify(const struct sieve_variables_modifier *modf,
-		      string_t *in, string_t **result);
+		      string_t *value);
 static bool
 mod_length_modify(const struct sieve_variables_modifier *modf,
-		  string_t *in, string_t **result);
+		  string_t *value);
 static bool
 mod_quotewildcard_modify(const struct sieve_variables_modifier *modf,
 			 string_t *in, string_t **result);
@@ -152,12 +152,14 @@ mod_quotewildcard_modify(const struct sieve_variables_modifier *modf,
 const struct sieve_variables_modifier_def lower_modifier = {
 	SIEVE_OBJECT("lower", &modifier_operand, EXT_VARIABLES_MODIFIER_LOWER),
 	40,
+	NULL,
 	mod_lower_modify
 };
 
 const struct sieve_variables_modifier_def upper_modifier = {
 	SIEVE_OBJECT("upper", &modifier_operand, EXT_VARIABLES_MODIFIER_UPPER),
 	40,
+	NULL,
 	mod_upper_modify
 };
 
@@ -165,6 +167,7 @@ const struct sieve_variables_modifier_def lowerfirst_modifier = {
 	SIEVE_OBJECT
 		("lowerfirst", &modifier_operand, EXT_VARIABLES_MODIFIER_LOWERFIRST),
 	30,
+	NULL,
 	mod_lowerfirst_modify
 };
 
@@ -172,6 +175,7 @@ const struct sieve_variables_modifier_def upperfirst_modifier = {
 	SIEVE_OBJECT
 		("upperfirst", &modifier_operand,	EXT_VARIABLES_MODIFIER_UPPERFIRST),
 	30,
+	NULL,
 	mod_upperfirst_modify
 };
 
@@ -179,12 +183,14 @@ const struct sieve_variables_modifier_def quotewildcard_modifier = {
 	SIEVE_OBJECT
 		("quotewildcard", &modifier_operand, EXT_VARIABLES_MODIFIER_QUOTEWILDCARD),
 	20,
-	mod_quotewildcard_modify
+	mod_quotewildcard_modify,
+	NULL
 };
 
 const struct sieve_variables_modifier_def length_modifier = {
 	SIEVE_OBJECT("length", &modifier_operand, EXT_VARIABLES_MODIFIER_LENGTH),
 	10,
+	NULL,
 	mod_length_modify
 };
 
@@ -192,19 +198,14 @@ const struct sieve_variables_modifier_def length_modifier = {
 
 static bool
 mod_upperfirst_modify(const struct sieve_variables_modifier *modf ATTR_UNUSED,
-		      string_t *in, string_t **result)
+		      string_t *value)
 {
 	char *content;
 
-	if ( str_len(in) == 0 ) {
-		*result = in;
+	if ( str_len(value) == 0 )
 		return TRUE;
-	}
 
-	*result = t_str_new(str_len(in));
-	str_append_str(*result, in);
-
-	content = str_c_modifiable(*result);
+	content = str_c_modifiable(value);
 	content[0] = i_toupper(content[0]);
 
 	return TRUE;
@@ -212,19 +213,14 @@ mod_upperfirst_modify(const struct sieve_variables_modifier *modf ATTR_UNUSED,
 
 static bool
 mod_lowerfirst_modify(const struct sieve_variables_modifier *modf ATTR_UNUSED,
-		      string_t *in, string_t **result)
+		      string_t *value)
 {
 	char *content;
 
-	if ( str_len(in) == 0 ) {
-		*result = in;
+	if ( str_len(value) == 0 )
 		return TRUE;
-	}
-
-	*result = t_str_new(str_len(in));
-	str_append_str(*result, in);
 
-	content = str_c_modifiable(*result);
+	content = str_c_modifiable(value);
 	content[0] = i_tolower(content[0]);
 
 	return TRUE;
@@ -232,51 +228,36 @@ mod_lowerfirst_modify(const struct sieve_variables_modifier *modf ATTR_UNUSED,
 
 static bool
 mod_upper_modify(const struct sieve_variables_modifier *modf ATTR_UNUSED,
-		 string_t *in, string_t **result)
+		 string_t *value)
 {
-	char *content;
-
-	if ( str_len(in) == 0 ) {
-		*result = in;
+	if ( str_len(value) == 0 )
 		return TRUE;
-	}
-
-	*result = t_str_new(str_len(in));
-	str_append_str(*result, in);
-
-	content = str_c_modifiable(*result);
-	(void)str_ucase(content);
 
+	(void)str_ucase(str_c_modifiable(value));
 	return TRUE;
 }
 
 static bool
 mod_lower_modify(const struct sieve_variables_modifier *modf ATTR_UNUSED,
-		 string_t *in, string_t **result)
+		 string_t *value)
 {
-	char *content;
-
-	if ( str_len(in) == 0 ) {
-		*result = in;
+	if ( str_len(value) == 0 )
 		return TRUE;
-	}
-
-	*result = t_str_new(str_len(in));
-	str_append_str(*result, in);
-
-	content = str_c_modifiable(*result);
-	(void)str_lcase(content);
 
+	(void)str_lcase(str_c_modifiable(value));
 	return TRUE;
 }
 
 static bool
 mod_length_modify(const struct sieve_variables_modifier *modf ATTR_UNUSED,
-		  string_t *in, string_t **result)
+		  string_t *value)
 {
-	*result = t_str_new(64);
-	str_printfa(*result, "%llu", (unsigned long long)
-		uni_utf8_strlen_n(str_data(in), str_len(in)));
+	unsigned long long length =
+		uni_utf8_strlen_n(str_data(value), str_len(value));
+
+	/* The length replaces the value; no separate result string needed */
+	str_truncate(value, 0);
+	str_printfa(value, "%llu", length);
 	return TRUE;
 }
 
@@ -295,8 +276,18 @@ mod_quotewildcard_modify(const struct sieve_variables_modifier *modf,
 		return TRUE;
 	}
 
-	/* allocate new string */
-	new_size = str_len(in) + 16;
+	/* allocate new string; size it for the escapes right away */
+	new_size = str_len(in);
+	pend = str_data(in) + str_len(in);
+	for (p = str_data(in); p < pend; p++) {
+		if (*p == '*' || *p == '?' || *p == '\\')
+			new_size++;
+	}
+	if (new_size == str_len(in)) {
+		/* nothing to escape */
+		*result = in;
+		return TRUE;
+	}
 	if (new_size > max_var_size)
 		new_size = max_var_size;
 	*result = t_str_new(new_size + 1);
@@ -537,6 +528,7 @@ int sieve_variables_modifiers_apply
 		ext_variables_get_config(var_ext);
 	const struct sieve_variables_modifier *modfs;
 	unsigned int i, modf_count;
+	bool copied = FALSE;
 
 	/* Hold value within limits */
 	if ( str_len(*value) > config->max_variable_size ) {
@@ -545,6 +537,7 @@ int sieve_variables_modifiers_apply
 		str_append_str(new_value, *value);
 		*value = new_value;
 		str_truncate_utf8(*value, config->max_variable_size);
+		copied = TRUE;
 	}
 	
 	if ( !array_is_created(modifiers) )
@@ -558,13 +551,37 @@ int sieve_variables_modifiers_apply
 		string_t *new_value;
 		const struct sieve_variables_modifier *modf = &modfs[i];
 
-		if ( modf->def != NULL && modf->def->modify != NULL ) {
+		if ( modf->def != NULL && modf->def->modify_inplace != NULL ) {
+			/* The value is copied at most once for the whole chain of
+			   in-place modifiers */
+			if ( !copied ) {
+				new_value = t_str_new(str_len(*value) + 1);
+				str_append_str(new_value, *value);
+				*value = new_value;
+				copied = TRUE;
+			}
+
+			if ( !modf->def->modify_inplace(modf, *value) )
+				return SIEVE_EXEC_FAILURE;
+
+			sieve_runtime_trace_here
+				(renv, SIEVE_TRLVL_COMMANDS,
+					"modify :%s => \"%s\"",
+					sieve_variables_modifier_name(modf),
+					str_sanitize(str_c(*value), 256));
+
+			/* Hold value within limits */
+			if ( str_len(*value) > config->max_variable_size )
+				str_truncate_utf8(*value, config->max_variable_size);
+		} else if ( modf->def != NULL && modf->def->modify != NULL ) {
 			if ( !modf->def->modify(modf, *value, &new_value) )
 				return SIEVE_EXEC_FAILURE;
 
-			*value = new_value;
-			if ( *value == NULL )
+			if ( new_value == NULL )
 				return SIEVE_EXEC_FAILURE;
+			if ( new_value != *value )
+				copied = TRUE;
+			*value = new_value;
 
 			sieve_runtime_trace_here
 				(renv, SIEVE_TRLVL_COMMANDS,
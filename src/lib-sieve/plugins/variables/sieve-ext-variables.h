@@ -294,6 +294,10 @@ struct sieve_variables_modifier_def {
 
 	bool (*modify)(const struct sieve_variables_modifier *modf,
 		       string_t *in, string_t **result);
+	/* Alternative to modify() for modifiers that can change the value in
+	   place; the value passed is always a private copy. */
+	bool (*modify_inplace)(const struct sieve_variables_modifier *modf,
+			       string_t *value);
 };
 
 struct sieve_variables_modifier {
@@ -53,6 +53,7 @@ envit_username_get_value(const struct sieve_runtime_env *renv,
 
 const struct sieve_environment_item username_env_item = {
 	.name = "vnd.dovecot.username",
+	.scope = SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE,
 	.get_value = envit_username_get_value
 };
 
@@ -73,6 +74,7 @@ envit_config_get_value(const struct sieve_runtime_env *renv, const char *name)
 const struct sieve_environment_item config_env_item = {
 	.name = "vnd.dovecot.config",
 	.prefix = TRUE,
+	.scope = SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE,
 	.get_value = envit_config_get_value
 };
 
@@ -13,6 +13,8 @@
 #include "ostream.h"
 #include "smtp-params.h"
 #include "mail-storage.h"
+#include "mail-namespace.h"
+#include "mail-user.h"
 #include "message-date.h"
 #include "message-size.h"
 
@@ -27,6 +29,7 @@
 #include "sieve-result.h"
 #include "sieve-actions.h"
 #include "sieve-message.h"
+#include "sieve-mailbox-cache.h"
 #include "sieve-smtp.h"
 
 /*
@@ -299,6 +302,38 @@ void sieve_act_store_add_flags(const struct sieve_action_exec_env *aenv,
 
 /* Equality */
 
+/* Store actions into the same mailbox are merged into one when they are
+   added to the result, so that each mailbox is only opened, saved to and
+   committed once. Apart from exact matches, this recognizes the INBOX and its
+   children, whose INBOX prefix is case-insensitive.
+ */
+static bool
+act_store_mailbox_equals(const struct sieve_script_env *senv,
+			 const char *mailbox1, const char *mailbox2)
+{
+	struct mail_namespace *ns;
+
+	if (strcmp(mailbox1, mailbox2) == 0)
+		return TRUE;
+
+	if (strncasecmp(mailbox1, "INBOX", 5) != 0 ||
+	    strncasecmp(mailbox2, "INBOX", 5) != 0)
+		return FALSE;
+	mailbox1 += 5;
+	mailbox2 += 5;
+	if (*mailbox1 == '\0' || *mailbox2 == '\0')
+		return (*mailbox1 == *mailbox2);
+	if (strcmp(mailbox1, mailbox2) != 0)
+		return FALSE;
+
+	/* Only a child of INBOX if the remainder starts with the hierarchy
+	   separator */
+	if (senv->user == NULL)
+		return FALSE;
+	ns = mail_namespace_find_inbox(senv->user->namespaces);
+	return (ns != NULL && *mailbox1 == mail_namespace_get_sep(ns));
+}
+
 static bool
 act_store_equals(const struct sieve_script_env *senv,
 		 const struct sieve_action *act1,
@@ -322,11 +357,7 @@ act_store_equals(const struct sieve_script_env *senv,
 	mailbox2 = (st_ctx2 == NULL ?
 		    SIEVE_SCRIPT_DEFAULT_MAILBOX(senv) : st_ctx2->mailbox);
 
-	if (strcmp(mailbox1, mailbox2) == 0)
-		return TRUE;
-
-	return (strcasecmp(mailbox1, "INBOX") == 0 &&
-		strcasecmp(mailbox2, "INBOX") == 0);
+	return act_store_mailbox_equals(senv, mailbox1, mailbox2);
 }
 
 /* Result verification */
@@ -373,6 +404,18 @@ void sieve_act_store_get_storage_error(const struct sieve_action_exec_env *aenv,
 						&trans->error_code));
 }
 
+static enum mailbox_flags
+act_store_mailbox_flags(const struct sieve_execute_env *eenv)
+{
+	enum mailbox_flags flags = MAILBOX_FLAG_POST_SESSION;
+
+	if (eenv->scriptenv->mailbox_autocreate)
+		flags |= MAILBOX_FLAG_AUTO_CREATE;
+	if (eenv->scriptenv->mailbox_autosubscribe)
+		flags |= MAILBOX_FLAG_AUTO_SUBSCRIBE;
+	return flags;
+}
+
 static bool
 act_store_mailbox_alloc(const struct sieve_action_exec_env *aenv,
 		        const char *mailbox, struct mailbox **box_r,
@@ -381,7 +424,7 @@ act_store_mailbox_alloc(const struct sieve_action_exec_env *aenv,
 	const struct sieve_execute_env *eenv = aenv->exec_env;
 	struct mailbox *box;
 	struct mail_storage **storage = &(eenv->exec_status->last_storage);
-	enum mailbox_flags flags = MAILBOX_FLAG_POST_SESSION;
+	enum mailbox_flags flags = act_store_mailbox_flags(eenv);
 
 	*box_r = NULL;
 	*error_code_r = MAIL_ERROR_NONE;
@@ -397,12 +440,13 @@ act_store_mailbox_alloc(const struct sieve_action_exec_env *aenv,
 		return FALSE;
 	}
 
-	if (eenv->scriptenv->mailbox_autocreate)
-		flags |= MAILBOX_FLAG_AUTO_CREATE;
-	if (eenv->scriptenv->mailbox_autosubscribe)
-		flags |= MAILBOX_FLAG_AUTO_SUBSCRIBE;
-	*box_r = box = mailbox_alloc_for_user(eenv->scriptenv->user, mailbox,
-					      flags);
+	box = sieve_mailbox_cache_lookup(eenv->svinst, eenv->scriptenv->user,
+					 mailbox, flags);
+	if (box == NULL) {
+		box = mailbox_alloc_for_user(eenv->scriptenv->user, mailbox,
+					     flags);
+	}
+	*box_r = box;
 	*storage = mailbox_get_storage(box);
 
 	return TRUE;
@@ -789,12 +833,28 @@ act_store_log_status(struct act_store_transaction *trans,
 	}
 }
 
-static void act_store_cleanup(struct act_store_transaction *trans)
+static void
+act_store_cleanup(const struct sieve_action_exec_env *aenv,
+		  struct act_store_transaction *trans)
 {
+	const struct sieve_execute_env *eenv = aenv->exec_env;
+
 	if (trans->mail_trans != NULL)
 		mailbox_transaction_rollback(&trans->mail_trans);
-	if (trans->box != NULL)
+	if (trans->box == NULL)
+		return;
+
+	/* Only keep mailboxes around that are in a known good state and that
+	   still refer to the mailbox that was originally requested (side
+	   effects like :specialuse may have substituted it). */
+	if (trans->error_code != MAIL_ERROR_NONE ||
+	    strcmp(mailbox_get_vname(trans->box), trans->mailbox_name) != 0) {
 		mailbox_free(&trans->box);
+		return;
+	}
+	sieve_mailbox_cache_release(eenv->svinst, eenv->scriptenv->user,
+				    trans->mailbox_name,
+				    act_store_mailbox_flags(eenv), &trans->box);
 }
 
 static int
@@ -834,7 +894,7 @@ act_store_commit(const struct sieve_action_exec_env *aenv, void *tr_context)
 	}
 	if (bail_out) {
 		act_store_log_status(trans, aenv, FALSE, status);
-		act_store_cleanup(trans);
+		act_store_cleanup(aenv, trans);
 		return ret;
 	}
 
@@ -859,7 +919,7 @@ act_store_commit(const struct sieve_action_exec_env *aenv, void *tr_context)
 	act_store_log_status(trans, aenv, FALSE, status);
 
 	/* Clean up */
-	act_store_cleanup(trans);
+	act_store_cleanup(aenv, trans);
 
 	if (status)
 		return SIEVE_EXEC_OK;
@@ -894,7 +954,7 @@ act_store_rollback(const struct sieve_action_exec_env *aenv, void *tr_context,
 	act_store_log_status(trans, aenv, TRUE, success);
 
 	/* Rollback mailbox transaction and clean up */
-	act_store_cleanup(trans);
+	act_store_cleanup(aenv, trans);
 }
 
 /*
@@ -250,8 +250,14 @@ void sieve_act_store_get_storage_error(const struct sieve_action_exec_env *aenv,
  * Redirect action
  */
 
+struct act_redirect_transaction;
+
 struct act_redirect_context {
 	const struct smtp_address *to_address;
+
+	/* Transaction of the current execution; used for combining redirects
+	   into a single submission */
+	struct act_redirect_transaction *trans;
 };
 
 int sieve_act_redirect_add_to_result(const struct sieve_runtime_env *renv,
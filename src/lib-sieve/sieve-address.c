@@ -9,6 +9,7 @@
 
 #include "sieve-common.h"
 #include "sieve-runtime-trace.h"
+#include "sieve-message.h"
 
 #include "sieve-address.h"
 
@@ -29,6 +30,8 @@ sieve_header_address_list_next_item(struct sieve_address_list *_addrlist,
 				    string_t **unparsed_r);
 static void
 sieve_header_address_list_reset(struct sieve_stringlist *_strlist);
+static int
+sieve_header_address_list_get_length(struct sieve_stringlist *_strlist);
 static void
 sieve_header_address_list_set_trace(struct sieve_stringlist *_strlist,
 				    bool trace);
@@ -54,6 +57,8 @@ sieve_header_address_list_create(const struct sieve_runtime_env *renv,
 	addrlist->addrlist.strlist.next_item =
 		sieve_header_address_list_next_string_item;
 	addrlist->addrlist.strlist.reset = sieve_header_address_list_reset;
+	addrlist->addrlist.strlist.get_length =
+		sieve_header_address_list_get_length;
 	addrlist->addrlist.strlist.set_trace =
 		sieve_header_address_list_set_trace;
 	addrlist->addrlist.next_item = sieve_header_address_list_next_item;
@@ -152,10 +157,17 @@ sieve_header_address_list_next_item(struct sieve_address_list *_addrlist,
 				str_sanitize(str_c(value_item), 80));
 		}
 
-		addrlist->cur_address = message_address_parse(
-			pool_datastack_create(),
-			(const unsigned char *)str_data(value_item),
-			str_len(value_item), 256, 0);
+		if (runenv->msgctx != NULL) {
+			/* the same header is typically tested several times */
+			addrlist->cur_address = sieve_message_parse_addresses(
+				runenv->msgctx, str_c(value_item),
+				str_len(value_item));
+		} else {
+			addrlist->cur_address = message_address_parse(
+				pool_datastack_create(),
+				(const unsigned char *)str_data(value_item),
+				str_len(value_item), 256, 0);
+		}
 	}
 	i_unreached();
 }
@@ -191,6 +203,25 @@ static void sieve_header_address_list_reset(struct sieve_stringlist *_strlist)
 	addrlist->cur_address = NULL;
 }
 
+static int
+sieve_header_address_list_get_length(struct sieve_stringlist *_strlist)
+{
+	struct sieve_address_list *addrlist =
+		(struct sieve_address_list *)_strlist;
+	struct smtp_address addr;
+	string_t *unparsed;
+	int count = 0, ret;
+
+	/* Count the items without encoding the addresses as strings */
+	sieve_header_address_list_reset(_strlist);
+	while ((ret = sieve_header_address_list_next_item(
+		addrlist, &addr, &unparsed)) > 0)
+		count++;
+	sieve_header_address_list_reset(_strlist);
+
+	return (ret < 0 ? -1 : count);
+}
+
 static void
 sieve_header_address_list_set_trace(struct sieve_stringlist *_strlist,
 				    bool trace)
@@ -470,11 +501,59 @@ parse_mailbox_address(struct sieve_message_address_parser *ctx,
 	return TRUE;
 }
 
+/*
+ * Simple addresses
+ */
+
+/* Most addresses are a plain dot-atom local part and domain without any
+   comments, quoting or display name. These are recognized in a single scan
+   and don't need the full parser. Anything else returns FALSE and takes the
+   regular path. */
+
+static inline bool is_simple_atext(unsigned char c)
+{
+	return (i_isalnum(c) ||
+		(c != '\0' && strchr("!#$%&'*+-/=?^_`{|}~", c) != NULL));
+}
+
+static bool
+sieve_address_scan_simple(const unsigned char *address, size_t size,
+			  size_t *at_pos_r)
+{
+	const unsigned char *p, *pend = address + size, *at = NULL;
+	bool delim = TRUE;
+
+	for (p = address; p < pend; p++) {
+		if (*p == '.' || *p == '@') {
+			/* No empty atoms and only a single '@' */
+			if (delim || (*p == '@' && at != NULL))
+				return FALSE;
+			if (*p == '@')
+				at = p;
+			delim = TRUE;
+		} else if (is_simple_atext(*p)) {
+			delim = FALSE;
+		} else {
+			return FALSE;
+		}
+	}
+	if (at == NULL || delim)
+		return FALSE;
+
+	*at_pos_r = at - address;
+	return TRUE;
+}
+
+/*
+ * Address parsing
+ */
+
 static bool
 sieve_address_do_validate(const unsigned char *address, size_t size,
 			  const char **error_r)
 {
 	struct sieve_message_address_parser ctx;
+	size_t at_pos;
 
 	*error_r = NULL;
 
@@ -482,6 +561,8 @@ sieve_address_do_validate(const unsigned char *address, size_t size,
 		*error_r = "null address";
 		return FALSE;
 	}
+	if (sieve_address_scan_simple(address, size, &at_pos))
+		return TRUE;
 
 	i_zero(&ctx);
 
@@ -503,11 +584,20 @@ sieve_address_do_parse(const unsigned char *address, size_t size,
 		       const char **error_r)
 {
 	struct sieve_message_address_parser ctx;
+	size_t at_pos;
 
 	*error_r = NULL;
 
 	if (address == NULL)
 		return NULL;
+	if (sieve_address_scan_simple(address, size, &at_pos)) {
+		char *domain = t_strndup(address + at_pos + 1,
+					 size - at_pos - 1);
+
+		(void)str_lcase(domain);
+		return smtp_address_create_temp(
+			t_strndup(address, at_pos), domain);
+	}
 
 	i_zero(&ctx);
 
@@ -5,8 +5,10 @@
 #include "str.h"
 #include "mempool.h"
 #include "array.h"
+#include "hash.h"
 
 #include "sieve-common.h"
+#include "sieve-limits.h"
 #include "sieve-script.h"
 #include "sieve-extensions.h"
 
@@ -26,6 +28,12 @@ sieve_ast_node_create(struct sieve_ast *ast, struct sieve_ast_node *parent,
  * Types
  */
 
+/* The initial size of the AST pool is derived from the script size, so that
+   large scripts do not make the pool grow many times while parsing. */
+#define SIEVE_AST_POOL_MIN_SIZE         32768
+#define SIEVE_AST_POOL_MAX_SIZE         (4 * 1024 * 1024)
+#define SIEVE_AST_POOL_SIZE_FACTOR      8
+
 /* Extensions to the AST */
 
 struct sieve_ast_extension_reg {
@@ -50,8 +58,18 @@ struct sieve_ast {
 
 	struct sieve_ast_node *root;
 
+	/* Interned command, test and tag identifiers */
+	HASH_TABLE(const char *, const char *) identifiers;
+
 	ARRAY(const struct sieve_extension *) linked_extensions;
 	ARRAY(struct sieve_ast_extension_reg) extensions;
+
+	/* Header fields with a constant name that the script looks at */
+	ARRAY_TYPE(const_string) header_fields;
+	/* Static estimate of the execution cost */
+	unsigned int cost;
+
+	bool match_values_used:1;
 };
 
 struct sieve_ast *sieve_ast_create(struct sieve_script *script)
@@ -59,8 +77,18 @@ struct sieve_ast *sieve_ast_create(struct sieve_script *script)
 	pool_t pool;
 	struct sieve_ast *ast;
 	unsigned int ext_count;
+	size_t pool_size = SIEVE_AST_POOL_MIN_SIZE;
+	uoff_t script_size;
+
+	if (sieve_script_get_size(script, &script_size) >= 0 &&
+	    script_size > SIEVE_AST_POOL_MIN_SIZE / SIEVE_AST_POOL_SIZE_FACTOR) {
+		pool_size = (script_size >=
+			     SIEVE_AST_POOL_MAX_SIZE / SIEVE_AST_POOL_SIZE_FACTOR ?
+			     SIEVE_AST_POOL_MAX_SIZE :
+			     script_size * SIEVE_AST_POOL_SIZE_FACTOR);
+	}
 
-	pool = pool_alloconly_create("sieve_ast", 32768);
+	pool = pool_alloconly_create("sieve_ast", pool_size);
 	ast = p_new(pool, struct sieve_ast, 1);
 	ast->pool = pool;
 	ast->refcount = 1;
@@ -106,11 +134,31 @@ void sieve_ast_unref(struct sieve_ast **ast)
 	}
 
 	/* Destroy AST */
+	if (hash_table_is_created((*ast)->identifiers))
+		hash_table_destroy(&(*ast)->identifiers);
 	pool_unref(&(*ast)->pool);
 
 	*ast = NULL;
 }
 
+static const char *
+sieve_ast_identifier_intern(struct sieve_ast *ast, const char *identifier)
+{
+	const char *interned;
+
+	if (!hash_table_is_created(ast->identifiers)) {
+		hash_table_create(&ast->identifiers, default_pool, 0,
+				  str_hash, strcmp);
+	}
+
+	interned = hash_table_lookup(ast->identifiers, identifier);
+	if (interned == NULL) {
+		interned = p_strdup(ast->pool, identifier);
+		hash_table_insert(ast->identifiers, interned, interned);
+	}
+	return interned;
+}
+
 struct sieve_ast_node *sieve_ast_root(struct sieve_ast *ast)
 {
 	return ast->root;
@@ -219,6 +267,68 @@ bool sieve_ast_extension_is_required
 	return reg->required;
 }
 
+/*
+ * Header fields
+ */
+
+void sieve_ast_header_field_add(struct sieve_ast *ast, const char *field_name)
+{
+	const char *const *fields;
+	unsigned int count, i;
+
+	if (!array_is_created(&ast->header_fields))
+		p_array_init(&ast->header_fields, ast->pool, 8);
+
+	fields = array_get(&ast->header_fields, &count);
+	if (count >= SIEVE_MAX_WANTED_HEADERS)
+		return;
+	for (i = 0; i < count; i++) {
+		if (strcasecmp(fields[i], field_name) == 0)
+			return;
+	}
+
+	field_name = p_strdup(ast->pool, field_name);
+	array_append(&ast->header_fields, &field_name, 1);
+}
+
+const char *const *
+sieve_ast_header_fields_get(struct sieve_ast *ast, unsigned int *count_r)
+{
+	if (!array_is_created(&ast->header_fields)) {
+		*count_r = 0;
+		return NULL;
+	}
+	return array_get(&ast->header_fields, count_r);
+}
+
+/*
+ * Match values
+ */
+
+void sieve_ast_match_values_set_used(struct sieve_ast *ast)
+{
+	ast->match_values_used = TRUE;
+}
+
+bool sieve_ast_match_values_are_used(struct sieve_ast *ast)
+{
+	return ast->match_values_used;
+}
+
+/*
+ * Cost estimate
+ */
+
+void sieve_ast_cost_set(struct sieve_ast *ast, unsigned int cost)
+{
+	ast->cost = cost;
+}
+
+unsigned int sieve_ast_cost_get(struct sieve_ast *ast)
+{
+	return ast->cost;
+}
+
 /*
  * AST list implementations
  */
@@ -690,7 +800,7 @@ sieve_ast_argument_tag_create(struct sieve_ast_node *node, const char *tag,
 		sieve_ast_argument_create(node->ast, source_line);
 
 	argument->type = SAAT_TAG;
-	argument->_value.tag = p_strdup(node->ast->pool, tag);
+	argument->_value.tag = sieve_ast_identifier_intern(node->ast, tag);
 
 	if (!sieve_ast_node_add_argument(node, argument))
 		return NULL;
@@ -705,7 +815,7 @@ sieve_ast_argument_tag_insert(struct sieve_ast_argument *before,
 		sieve_ast_argument_create(before->ast, source_line);
 
 	argument->type = SAAT_TAG;
-	argument->_value.tag = p_strdup(before->ast->pool, tag);
+	argument->_value.tag = sieve_ast_identifier_intern(before->ast, tag);
 
 	if (!sieve_ast_arg_list_insert(before->list, before, argument))
 		return NULL;
@@ -775,7 +885,8 @@ sieve_ast_test_create(struct sieve_ast_node *parent, const char *identifier,
 	struct sieve_ast_node *test = sieve_ast_node_create(
 		parent->ast, parent, SAT_TEST, source_line);
 
-	test->identifier = p_strdup(parent->ast->pool, identifier);
+	test->identifier = sieve_ast_identifier_intern(parent->ast,
+						      identifier);
 
 	if (!sieve_ast_node_add_test(parent, test))
 		return NULL;
@@ -791,7 +902,8 @@ sieve_ast_command_create(struct sieve_ast_node *parent, const char *identifier,
 	struct sieve_ast_node *command = sieve_ast_node_create(
 		parent->ast, parent, SAT_COMMAND, source_line);
 
-	command->identifier = p_strdup(parent->ast->pool, identifier);
+	command->identifier = sieve_ast_identifier_intern(parent->ast,
+							 identifier);
 
 	if (!sieve_ast_node_add_command(parent, command))
 		return NULL;
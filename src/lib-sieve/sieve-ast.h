@@ -202,6 +202,28 @@ void *sieve_ast_extension_get_context(struct sieve_ast *ast,
 bool sieve_ast_extension_is_required(struct sieve_ast *ast,
 				     const struct sieve_extension *ext);
 
+/* Header fields */
+
+/* Records a (constant) header field name the script accesses; these are
+   prefetched from the message when the script is executed. */
+void sieve_ast_header_field_add(struct sieve_ast *ast, const char *field_name);
+const char *const *
+sieve_ast_header_fields_get(struct sieve_ast *ast, unsigned int *count_r);
+
+/* Match values */
+
+/* Records that the script reads match values (${1} etc.); if it never does,
+   match types don't need to collect them when the script is executed. */
+void sieve_ast_match_values_set_used(struct sieve_ast *ast);
+bool sieve_ast_match_values_are_used(struct sieve_ast *ast);
+
+/* Cost estimate */
+
+/* Records the estimated execution cost made by the validator; see
+   sieve_validator_estimate_cost(). */
+void sieve_ast_cost_set(struct sieve_ast *ast, unsigned int cost);
+unsigned int sieve_ast_cost_get(struct sieve_ast *ast);
+
 /*
  * AST node manipulation
  */
@@ -0,0 +1,160 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+
+#include "sieve-common.h"
+#include "sieve-limits.h"
+#include "sieve-script-private.h"
+#include "sieve-binary.h"
+
+#include "sieve-binary-cache.h"
+
+struct sieve_binary_cache_entry {
+	char *location, *name;
+	enum sieve_compile_flags flags;
+
+	struct sieve_binary *sbin;
+	time_t validated;
+};
+
+struct sieve_binary_cache {
+	/* Most recently used first */
+	ARRAY(struct sieve_binary_cache_entry) entries;
+};
+
+static void
+sieve_binary_cache_entry_free(struct sieve_binary_cache_entry *entry)
+{
+	sieve_binary_close(&entry->sbin);
+	i_free(entry->location);
+	i_free(entry->name);
+}
+
+void sieve_binary_cache_init(struct sieve_instance *svinst)
+{
+	if (svinst->binary_cache_period_secs == 0)
+		return;
+
+	svinst->binary_cache = i_new(struct sieve_binary_cache, 1);
+	i_array_init(&svinst->binary_cache->entries,
+		     SIEVE_BINARY_CACHE_MAX_ENTRIES);
+}
+
+void sieve_binary_cache_deinit(struct sieve_instance *svinst)
+{
+	struct sieve_binary_cache *cache = svinst->binary_cache;
+	struct sieve_binary_cache_entry *entry;
+
+	if (cache == NULL)
+		return;
+	svinst->binary_cache = NULL;
+
+	array_foreach_modifiable(&cache->entries, entry)
+		sieve_binary_cache_entry_free(entry);
+	array_free(&cache->entries);
+	i_free(cache);
+}
+
+static int
+sieve_binary_cache_find(struct sieve_binary_cache *cache,
+			const char *location, const char *name,
+			enum sieve_compile_flags flags)
+{
+	const struct sieve_binary_cache_entry *entries;
+	unsigned int count, i;
+
+	entries = array_get(&cache->entries, &count);
+	for (i = 0; i < count; i++) {
+		if (entries[i].flags == flags &&
+		    null_strcmp(entries[i].name, name) == 0 &&
+		    strcmp(entries[i].location, location) == 0)
+			return (int)i;
+	}
+	return -1;
+}
+
+static bool sieve_binary_cache_applies(struct sieve_script *script)
+{
+	/* Data scripts are only identified by their contents; they all share
+	   the same location */
+	return (script->script_class != &sieve_data_script &&
+		sieve_script_location(script) != NULL);
+}
+
+struct sieve_binary *
+sieve_binary_cache_lookup(struct sieve_script *script,
+			  enum sieve_compile_flags flags)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	struct sieve_binary_cache *cache = svinst->binary_cache;
+	const char *location = sieve_script_location(script);
+	const char *name = sieve_script_name(script);
+	struct sieve_binary_cache_entry entry;
+	int idx;
+
+	if (cache == NULL || !sieve_binary_cache_applies(script))
+		return NULL;
+	if ((idx = sieve_binary_cache_find(cache, location, name, flags)) < 0)
+		return NULL;
+
+	entry = *array_idx(&cache->entries, idx);
+	array_delete(&cache->entries, idx, 1);
+
+	if (ioloop_time < entry.validated ||
+	    (ioloop_time - entry.validated) >=
+		(time_t)svinst->binary_cache_period_secs) {
+		/* Expired; have the caller check the storage again */
+		sieve_binary_cache_entry_free(&entry);
+		return NULL;
+	}
+
+	array_insert(&cache->entries, 0, &entry, 1);
+	sieve_binary_ref(entry.sbin);
+	return entry.sbin;
+}
+
+void sieve_binary_cache_add(struct sieve_script *script,
+			    enum sieve_compile_flags flags,
+			    struct sieve_binary *sbin)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	struct sieve_binary_cache *cache = svinst->binary_cache;
+	const char *location = sieve_script_location(script);
+	const char *name = sieve_script_name(script);
+	struct sieve_binary_cache_entry entry;
+	unsigned int count;
+	int idx;
+
+	if (cache == NULL || !sieve_binary_cache_applies(script))
+		return;
+
+	if ((idx = sieve_binary_cache_find(cache, location, name, flags)) >= 0) {
+		struct sieve_binary_cache_entry *old =
+			array_idx_modifiable(&cache->entries, idx);
+
+		sieve_binary_cache_entry_free(old);
+		array_delete(&cache->entries, idx, 1);
+	}
+
+	count = array_count(&cache->entries);
+	if (count >= SIEVE_BINARY_CACHE_MAX_ENTRIES) {
+		struct sieve_binary_cache_entry *last =
+			array_idx_modifiable(&cache->entries, count - 1);
+
+		sieve_binary_cache_entry_free(last);
+		array_delete(&cache->entries, count - 1, 1);
+	}
+
+	i_zero(&entry);
+	entry.location = i_strdup(location);
+	entry.name = i_strdup(name);
+	entry.flags = flags;
+	entry.sbin = sbin;
+	entry.validated = ioloop_time;
+	sieve_binary_ref(sbin);
+
+	array_insert(&cache->entries, 0, &entry, 1);
+}
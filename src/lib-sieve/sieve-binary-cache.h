@@ -0,0 +1,27 @@
+#ifndef SIEVE_BINARY_CACHE_H
+#define SIEVE_BINARY_CACHE_H
+
+#include "sieve-common.h"
+
+/*
+ * Binary cache
+ */
+
+/* Binaries opened through sieve_open() and sieve_open_script() are kept
+   around by the instance for the configured sieve_binary_cache_period. Within
+   that period they are returned again without consulting the script storage.
+   Once the period has passed, the next open checks the storage as usual and
+   refreshes the entry. Binaries are identified by the script location, so
+   data scripts, which all share one location, are never cached. */
+
+void sieve_binary_cache_init(struct sieve_instance *svinst);
+void sieve_binary_cache_deinit(struct sieve_instance *svinst);
+
+struct sieve_binary *
+sieve_binary_cache_lookup(struct sieve_script *script,
+			  enum sieve_compile_flags flags);
+void sieve_binary_cache_add(struct sieve_script *script,
+			    enum sieve_compile_flags flags,
+			    struct sieve_binary *sbin);
+
+#endif
@@ -269,23 +269,23 @@ bool sieve_binary_read_code(struct sieve_binary_block *sblock,
 bool sieve_binary_read_offset(struct sieve_binary_block *sblock,
 			      sieve_size_t *address, sieve_offset_t *offset_r)
 {
-	sieve_offset_t offs = 0;
+	const uint8_t *data;
 	ADDR_CODE_READ(sblock);
 
-	if (ADDR_BYTES_LEFT(address) >= 4) {
-		int i;
-
-		for (i = 0; i < 4; i++) {
-			offs = (offs << 8) + ADDR_DATA_AT(address);
-			ADDR_JUMP(address, 1);
-		}
+	if (ADDR_BYTES_LEFT(address) < 4)
+		return FALSE;
 
-		if (offset_r != NULL)
-			*offset_r = offs;
+	/* Big-endian, fixed width */
+	data = (const uint8_t *)ADDR_POINTER(address);
+	ADDR_JUMP(address, 4);
 
-		return TRUE;
+	if (offset_r != NULL) {
+		*offset_r = ((sieve_offset_t)data[0] << 24) |
+			((sieve_offset_t)data[1] << 16) |
+			((sieve_offset_t)data[2] << 8) |
+			(sieve_offset_t)data[3];
 	}
-	return FALSE;
+	return TRUE;
 }
 
 /* FIXME: might need negative numbers in the future */
@@ -294,38 +294,59 @@ bool sieve_binary_read_integer(struct sieve_binary_block *sblock,
 {
 	int bits = sizeof(sieve_number_t) * 8;
 	sieve_number_t integer = 0;
+	const uint8_t *data, *end;
 
 	ADDR_CODE_READ(sblock);
 
 	if (ADDR_BYTES_LEFT(address) == 0)
 		return FALSE;
 
+	data = (const uint8_t *)ADDR_POINTER(address);
+
+	/* Most integers (string lengths, counts, small numbers) fit in a
+	   single byte [0xxxxxxx] */
+	if ((*data & 0x80) == 0) {
+		ADDR_JUMP(address, 1);
+		if (int_r != NULL)
+			*int_r = *data;
+		return TRUE;
+	}
+
+	end = data + ADDR_BYTES_LEFT(address);
+
 	/* Read first integer bytes [1xxxxxxx] */
-	while ((ADDR_DATA_AT(address) & 0x80) > 0) {
-		if (ADDR_BYTES_LEFT(address) > 0 && bits > 0) {
-			integer |= ADDR_DATA_AT(address) & 0x7F;
-			ADDR_JUMP(address, 1);
-
-			/* Each byte encodes 7 bits of the integer */
-			integer <<= 7;
-			bits -= 7;
-		} else {
+	while ((*data & 0x80) > 0) {
+		if (bits <= 0) {
 			/* This is an error */
 			return FALSE;
 		}
+		integer |= *data & 0x7F;
+		data++;
+
+		/* Each byte encodes 7 bits of the integer */
+		integer <<= 7;
+		bits -= 7;
+
+		if (data == end) {
+			/* Truncated */
+			return FALSE;
+		}
 	}
 
 	/* Read last byte [0xxxxxxx] */
-	integer |= ADDR_DATA_AT(address) & 0x7F;
-	ADDR_JUMP(address, 1);
+	integer |= *data & 0x7F;
+	data++;
+
+	ADDR_JUMP(address, (data - (const uint8_t *)ADDR_POINTER(address)));
 
 	if (int_r != NULL)
 		*int_r = integer;
 	return TRUE;
 }
 
-bool sieve_binary_read_string(struct sieve_binary_block *sblock,
-			      sieve_size_t *address, string_t **str_r)
+bool sieve_binary_read_string_data(struct sieve_binary_block *sblock,
+				   sieve_size_t *address,
+				   const char **data_r, size_t *size_r)
 {
 	unsigned int strlen = 0;
 	const char *strdata;
@@ -344,14 +365,30 @@ bool sieve_binary_read_string(struct sieve_binary_block *sblock,
 	if (ADDR_CODE_AT(address) != 0)
 		return FALSE;
 
- 	if (str_r != NULL)
-		*str_r = t_str_new_const(strdata, strlen);
+	if (data_r != NULL)
+		*data_r = strdata;
+	if (size_r != NULL)
+		*size_r = strlen;
 
 	ADDR_JUMP(address, 1);
 
 	return TRUE;
 }
 
+bool sieve_binary_read_string(struct sieve_binary_block *sblock,
+			      sieve_size_t *address, string_t **str_r)
+{
+	const char *strdata;
+	size_t strlen;
+
+	if (!sieve_binary_read_string_data(sblock, address, &strdata, &strlen))
+		return FALSE;
+
+	if (str_r != NULL)
+		*str_r = t_str_new_const(strdata, strlen);
+	return TRUE;
+}
+
 bool sieve_binary_read_extension(struct sieve_binary_block *sblock,
 				 sieve_size_t *address, unsigned int *offset_r,
 				 const struct sieve_extension **ext_r)
@@ -403,3 +440,67 @@ sieve_binary_read_extension_object(struct sieve_binary_block *sblock,
 		return NULL;
 	return ((const void *const *)objs->objects)[code];
 }
+
+/* Decoded operations */
+
+bool sieve_binary_operation_lookup(struct sieve_binary_block *sblock,
+				   sieve_size_t *address,
+				   const struct sieve_operation_def **def_r,
+				   const struct sieve_extension **ext_r)
+{
+	const struct sieve_binary_operation *op;
+	const uint32_t *entry;
+
+	if (!array_is_created(&sblock->operation_map) ||
+	    *address >= array_count(&sblock->operation_map))
+		return FALSE;
+
+	entry = array_idx(&sblock->operation_map, *address);
+	if (*entry == 0)
+		return FALSE;
+
+	op = array_idx(&sblock->operations, (*entry >> 8) - 1);
+	*def_r = op->def;
+	*ext_r = op->ext;
+	*address += (*entry & 0xff);
+	return TRUE;
+}
+
+void sieve_binary_operation_cache(struct sieve_binary_block *sblock,
+				  sieve_size_t address, sieve_size_t code_size,
+				  const struct sieve_operation_def *def,
+				  const struct sieve_extension *ext)
+{
+	const struct sieve_binary_operation *ops;
+	struct sieve_binary_operation *op;
+	unsigned int count, i;
+	uint32_t entry;
+
+	if (code_size == 0 || code_size > 0xff)
+		return;
+
+	if (!array_is_created(&sblock->operations)) {
+		pool_t pool = sblock->sbin->pool;
+
+		p_array_init(&sblock->operations, pool, 32);
+		p_array_init(&sblock->operation_map, pool,
+			     _sieve_binary_block_get_size(sblock));
+	}
+
+	/* Scripts use only a few distinct operations */
+	ops = array_get(&sblock->operations, &count);
+	for (i = 0; i < count; i++) {
+		if (ops[i].def == def && ops[i].ext == ext)
+			break;
+	}
+	if (i == count) {
+		if (count >= 0xffffff)
+			return;
+		op = array_append_space(&sblock->operations);
+		op->def = def;
+		op->ext = ext;
+	}
+
+	entry = ((i + 1) << 8) | code_size;
+	array_idx_set(&sblock->operation_map, address, &entry);
+}
@@ -167,6 +167,45 @@ bool sieve_binary_dumper_run(struct sieve_binary_dumper *dumper,
 	if (!success)
 		return FALSE;
 
+	T_BEGIN {
+		const char *const *fields =
+			sieve_binary_get_header_fields(sbin);
+
+		if (fields != NULL) {
+			sieve_binary_dumpf(denv, "header fields = %s\n",
+					   t_strarray_join(fields, ", "));
+		}
+	} T_END;
+
+	if (sieve_binary_get_match_values_used(sbin))
+		sieve_binary_dumpf(denv, "match values = used\n");
+	if (sieve_binary_get_script_cost(sbin) > 0) {
+		sieve_binary_dumpf(denv, "estimated cost = %u\n",
+				   sieve_binary_get_script_cost(sbin));
+	}
+
+	T_BEGIN {
+		enum sieve_binary_requirements reqs =
+			sieve_binary_get_requirements(sbin);
+		ARRAY_TYPE(const_string) names;
+		static const char *const req_names[] = {
+			"body", "mime", "envelope", "date", "edit"
+		};
+		unsigned int r;
+
+		t_array_init(&names, N_ELEMENTS(req_names));
+		for (r = 0; r < N_ELEMENTS(req_names); r++) {
+			if ((reqs & (1 << r)) != 0)
+				array_append(&names, &req_names[r], 1);
+		}
+		if (array_count(&names) > 0) {
+			array_append_zero(&names);
+			sieve_binary_dumpf(denv, "requires = %s\n",
+					   t_strarray_join(array_idx(&names, 0),
+							   ", "));
+		}
+	} T_END;
+
 	/* Dump list of used extensions */
 
 	count = sieve_binary_extensions_count(sbin);
@@ -23,6 +23,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -63,37 +64,11 @@ struct sieve_binary_block_header {
  */
 
 static int
-sieve_binary_file_read_header(struct sieve_binary *sbin, int fd,
-			      struct sieve_binary_header *header_r,
-			      enum sieve_error *error_r)
+sieve_binary_file_check_header(struct sieve_binary *sbin,
+			       struct sieve_binary_header header,
+			       struct sieve_binary_header *header_r,
+			       enum sieve_error *error_r)
 {
-	struct sieve_binary_header header;
-	enum sieve_error error;
-	ssize_t rret;
-
-	if (error_r == NULL)
-		error_r = &error;
-	*error_r = SIEVE_ERROR_NONE;
-
-	rret = pread(fd, &header, sizeof(header), 0);
-	if (rret == 0) {
-		e_error(sbin->event, "read: "
-			"file is not large enough to contain the header");
-		*error_r = SIEVE_ERROR_NOT_VALID;
-		return -1;
-	} else if (rret < 0) {
-		e_error(sbin->event, "read: "
-			"failed to read from binary: %m");
-		*error_r = SIEVE_ERROR_TEMP_FAILURE;
-		return -1;
-	} else if (rret != sizeof(header)) {
-		e_error(sbin->event, "read: "
-			"header read only partially %zd/%zu",
-			rret, sizeof(header));
-		*error_r = SIEVE_ERROR_TEMP_FAILURE;
-		return -1;
-	}
-
 	/* Check header validity */
 	if (header.magic != SIEVE_BINARY_MAGIC) {
 		if (header.magic != SIEVE_BINARY_MAGIC_OTHER_ENDIAN) {
@@ -147,6 +122,65 @@ sieve_binary_file_read_header(struct sieve_binary *sbin, int fd,
 	return 0;
 }
 
+static int
+sieve_binary_file_read_header(struct sieve_binary *sbin, int fd,
+			      struct sieve_binary_header *header_r,
+			      enum sieve_error *error_r)
+{
+	struct sieve_binary_header header;
+	enum sieve_error error;
+	ssize_t rret;
+
+	if (error_r == NULL)
+		error_r = &error;
+	*error_r = SIEVE_ERROR_NONE;
+
+	rret = pread(fd, &header, sizeof(header), 0);
+	if (rret == 0) {
+		e_error(sbin->event, "read: "
+			"file is not large enough to contain the header");
+		*error_r = SIEVE_ERROR_NOT_VALID;
+		return -1;
+	} else if (rret < 0) {
+		e_error(sbin->event, "read: "
+			"failed to read from binary: %m");
+		*error_r = SIEVE_ERROR_TEMP_FAILURE;
+		return -1;
+	} else if (rret != sizeof(header)) {
+		e_error(sbin->event, "read: "
+			"header read only partially %zd/%zu",
+			rret, sizeof(header));
+		*error_r = SIEVE_ERROR_TEMP_FAILURE;
+		return -1;
+	}
+
+	return sieve_binary_file_check_header(sbin, header, header_r, error_r);
+}
+
+static int
+sieve_binary_file_map_header(struct sieve_binary *sbin,
+			     const struct sieve_binary_file *file,
+			     struct sieve_binary_header *header_r,
+			     enum sieve_error *error_r)
+{
+	struct sieve_binary_header header;
+	enum sieve_error error;
+
+	if (error_r == NULL)
+		error_r = &error;
+	*error_r = SIEVE_ERROR_NONE;
+
+	if (file->map_size < sizeof(header)) {
+		e_error(sbin->event, "read: "
+			"binary is not large enough to contain the header");
+		*error_r = SIEVE_ERROR_NOT_VALID;
+		return -1;
+	}
+	memcpy(&header, file->map, sizeof(header));
+
+	return sieve_binary_file_check_header(sbin, header, header_r, error_r);
+}
+
 static int
 sieve_binary_file_write_header(struct sieve_binary *sbin, int fd,
 			       struct sieve_binary_header *header,
@@ -407,6 +441,44 @@ sieve_binary_save_to_stream(struct sieve_binary *sbin, struct ostream *stream)
 	return TRUE;
 }
 
+static bool
+sieve_binary_signal_pre_save(struct sieve_binary *sbin,
+			     enum sieve_error *error_r)
+{
+	struct sieve_binary_extension_reg *const *regs;
+	unsigned int ext_count, i;
+
+	regs = array_get(&sbin->extensions, &ext_count);
+	for (i = 0; i < ext_count; i++) {
+		const struct sieve_binary_extension *binext = regs[i]->binext;
+
+		if (binext != NULL && binext->binary_pre_save != NULL &&
+		    !binext->binary_pre_save(regs[i]->extension, sbin,
+					     regs[i]->context, error_r))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static bool
+sieve_binary_signal_post_save(struct sieve_binary *sbin,
+			      enum sieve_error *error_r)
+{
+	struct sieve_binary_extension_reg *const *regs;
+	unsigned int ext_count, i;
+
+	regs = array_get(&sbin->extensions, &ext_count);
+	for (i = 0; i < ext_count; i++) {
+		const struct sieve_binary_extension *binext = regs[i]->binext;
+
+		if (binext != NULL && binext->binary_post_save != NULL &&
+		    !binext->binary_post_save(regs[i]->extension, sbin,
+					      regs[i]->context, error_r))
+			return FALSE;
+	}
+	return TRUE;
+}
+
 static int
 sieve_binary_do_save(struct sieve_binary *sbin, const char *path, bool update,
 		     mode_t save_mode, enum sieve_error *error_r)
@@ -414,8 +486,6 @@ sieve_binary_do_save(struct sieve_binary *sbin, const char *path, bool update,
 	int result, fd;
 	string_t *temp_path;
 	struct ostream *stream;
-	struct sieve_binary_extension_reg *const *regs;
-	unsigned int ext_count, i;
 
 	if (error_r != NULL)
 		*error_r = SIEVE_ERROR_NONE;
@@ -451,15 +521,8 @@ sieve_binary_do_save(struct sieve_binary *sbin, const char *path, bool update,
 	}
 
 	/* Signal all extensions that we're about to save the binary */
-	regs = array_get(&sbin->extensions, &ext_count);
-	for (i = 0; i < ext_count; i++) {
-		const struct sieve_binary_extension *binext = regs[i]->binext;
-
-		if (binext != NULL && binext->binary_pre_save != NULL &&
-		    !binext->binary_pre_save(regs[i]->extension, sbin,
-					     regs[i]->context, error_r))
-			return -1;
-	}
+	if (!sieve_binary_signal_pre_save(sbin, error_r))
+		return -1;
 
 	/* Save binary */
 	result = 1;
@@ -511,20 +574,8 @@ sieve_binary_do_save(struct sieve_binary *sbin, const char *path, bool update,
 
 		/* Signal all extensions that we successfully saved the binary.
 		 */
-		regs = array_get(&sbin->extensions, &ext_count);
-		for (i = 0; i < ext_count; i++) {
-			const struct sieve_binary_extension *binext =
-				regs[i]->binext;
-
-			if (binext != NULL &&
-			    binext->binary_post_save != NULL &&
-			    !binext->binary_post_save(regs[i]->extension, sbin,
-						      regs[i]->context,
-						      error_r)) {
-				result = -1;
-				break;
-			}
-		}
+		if (!sieve_binary_signal_post_save(sbin, error_r))
+			result = -1;
 
 		if (result < 0 && unlink(path) < 0 && errno != ENOENT) {
 			e_error(sbin->event, "failed to clean up after error: "
@@ -548,6 +599,32 @@ int sieve_binary_save(struct sieve_binary *sbin, const char *path, bool update,
 }
 
 
+int sieve_binary_save_to_buffer(struct sieve_binary *sbin, buffer_t *buffer,
+				enum sieve_error *error_r)
+{
+	struct ostream *stream;
+	int result = 0;
+
+	if (error_r != NULL)
+		*error_r = SIEVE_ERROR_NONE;
+
+	if (!sieve_binary_signal_pre_save(sbin, error_r))
+		return -1;
+
+	stream = o_stream_create_buffer(buffer);
+	if (!sieve_binary_save_to_stream(sbin, stream)) {
+		result = -1;
+		if (error_r != NULL)
+			*error_r = SIEVE_ERROR_TEMP_FAILURE;
+		o_stream_ignore_last_errors(stream);
+	}
+	o_stream_destroy(&stream);
+
+	if (result == 0 && !sieve_binary_signal_post_save(sbin, error_r))
+		result = -1;
+	return result;
+}
+
 /*
  * Binary file management
  */
@@ -633,6 +710,23 @@ sieve_binary_file_open(struct sieve_binary *sbin, const char *path,
 	file->st = st;
 	file->sbin = sbin;
 
+	/* Map the file, so that the blocks need not be copied into memory; the
+	   pages are then shared with other processes using the same binary.
+	   Binaries are always replaced rather than rewritten, so the mapped
+	   data doesn't change underneath us. */
+	if (st.st_size > 0 && (uoff_t)st.st_size <= SIZE_MAX) {
+		void *map = mmap(NULL, (size_t)st.st_size, PROT_READ,
+				 MAP_SHARED, fd, 0);
+
+		if (map == MAP_FAILED) {
+			e_debug(sbin->event, "open: "
+				"mmap() failed, reading binary instead: %m");
+		} else {
+			file->map = map;
+			file->map_size = (size_t)st.st_size;
+		}
+	}
+
 	*file_r = file;
 	return 0;
 }
@@ -645,6 +739,12 @@ void sieve_binary_file_close(struct sieve_binary_file **_file)
 	if (file == NULL)
 		return;
 
+	if (file->map != NULL && !file->in_memory &&
+	    munmap((void *)file->map, file->map_size) < 0) {
+		e_error(file->sbin->event, "close: "
+			"failed to unmap: munmap() failed: %m");
+	}
+
 	if (file->fd != -1) {
 		if (close(file->fd) < 0) {
 			e_error(file->sbin->event, "close: "
@@ -704,12 +804,36 @@ sieve_binary_file_read(struct sieve_binary_file *file, off_t *offset,
 	return 1;
 }
 
+static const void *
+sieve_binary_file_map_data(struct sieve_binary_file *file,
+			   off_t *offset, size_t size)
+{
+	const void *data;
+
+	*offset = SIEVE_BINARY_ALIGN(*offset);
+
+	if (*offset < 0 || (uoff_t)*offset > file->map_size ||
+	    size > file->map_size - (size_t)*offset) {
+		e_error(file->sbin->event, "read: "
+			"binary is truncated (more data expected)");
+		return NULL;
+	}
+
+	data = CONST_PTR_OFFSET(file->map, *offset);
+	*offset += size;
+	return data;
+}
+
 static const void *
 sieve_binary_file_load_data(struct sieve_binary_file *file,
 			    off_t *offset, size_t size)
 {
-	void *data = t_malloc_no0(size);
+	void *data;
+
+	if (file->map != NULL)
+		return sieve_binary_file_map_data(file, offset, size);
 
+	data = t_malloc_no0(size);
 	if (sieve_binary_file_read(file, offset, data, size) > 0)
 		return data;
 
@@ -718,9 +842,26 @@ sieve_binary_file_load_data(struct sieve_binary_file *file,
 
 static buffer_t *
 sieve_binary_file_load_buffer(struct sieve_binary_file *file,
-			      off_t *offset, size_t size)
+			      off_t *offset, size_t size, bool *mapped_r)
 {
-	buffer_t *buffer = buffer_create_dynamic(file->pool, size);
+	buffer_t *buffer;
+
+	*mapped_r = FALSE;
+	if (file->map != NULL) {
+		const void *data =
+			sieve_binary_file_map_data(file, offset, size);
+
+		if (data == NULL)
+			return NULL;
+
+		/* Refer to the mapped data directly */
+		buffer = p_new(file->pool, buffer_t, 1);
+		buffer_create_from_const_data(buffer, data, size);
+		*mapped_r = TRUE;
+		return buffer;
+	}
+
+	buffer = buffer_create_dynamic(file->pool, size);
 
 	if (sieve_binary_file_read(file, offset,
 				   buffer_get_space_unsafe(buffer, 0, size),
@@ -746,6 +887,7 @@ bool sieve_binary_load_block(struct sieve_binary_block *sblock)
 	const struct sieve_binary_block_header *header =
 		LOAD_HEADER(sbin, &offset,
 			    const struct sieve_binary_block_header);
+	bool mapped;
 
 	if (header == NULL) {
 		e_error(sbin->event, "load: binary is corrupt: "
@@ -761,13 +903,14 @@ bool sieve_binary_load_block(struct sieve_binary_block *sblock)
 	}
 
 	sblock->data = sieve_binary_file_load_buffer(sbin->file, &offset,
-						     header->size);
+						     header->size, &mapped);
 	if (sblock->data == NULL) {
 		e_error(sbin->event, "load: "
 			"failed to read block %d of binary (size=%d)",
 			id, header->size);
 		return FALSE;
 	}
+	sblock->mapped = mapped;
 
 	return TRUE;
 }
@@ -864,8 +1007,13 @@ _sieve_binary_open(struct sieve_binary *sbin, enum sieve_error *error_r)
 
 	/* Read header */
 
-	ret = sieve_binary_file_read_header(sbin, sbin->file->fd,
-					    &sbin->header, error_r);
+	if (sbin->file->fd == -1) {
+		ret = sieve_binary_file_map_header(sbin, sbin->file,
+						   &sbin->header, error_r);
+	} else {
+		ret = sieve_binary_file_read_header(sbin, sbin->file->fd,
+						    &sbin->header, error_r);
+	}
 	if (ret < 0)
 		return FALSE;
 	offset = sbin->header.hdr_size;
@@ -909,12 +1057,38 @@ _sieve_binary_open(struct sieve_binary *sbin, enum sieve_error *error_r)
 	return TRUE;
 }
 
+static bool
+sieve_binary_do_open(struct sieve_binary *sbin, enum sieve_error *error_r)
+{
+	struct sieve_binary_extension_reg *const *regs;
+	unsigned int ext_count, i;
+
+	if (!_sieve_binary_open(sbin, error_r))
+		return FALSE;
+
+	sieve_binary_activate(sbin);
+
+	/* Signal open event to extensions */
+	regs = array_get(&sbin->extensions, &ext_count);
+	for (i = 0; i < ext_count; i++) {
+		const struct sieve_binary_extension *binext = regs[i]->binext;
+
+		if (binext != NULL && binext->binary_open != NULL &&
+		    !binext->binary_open(regs[i]->extension, sbin,
+					 regs[i]->context)) {
+			/* Extension thinks its corrupt */
+			if (error_r != NULL)
+				*error_r = SIEVE_ERROR_NOT_VALID;
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
 struct sieve_binary *
 sieve_binary_open(struct sieve_instance *svinst, const char *path,
 		  struct sieve_script *script, enum sieve_error *error_r)
 {
-	struct sieve_binary_extension_reg *const *regs;
-	unsigned int ext_count, i;
 	struct sieve_binary *sbin;
 	struct sieve_binary_file *file;
 
@@ -935,27 +1109,52 @@ sieve_binary_open(struct sieve_instance *svinst, const char *path,
 		sbin->event,
 		t_strdup_printf("binary %s: ", path));
 
-	if (!_sieve_binary_open(sbin, error_r)) {
+	if (!sieve_binary_do_open(sbin, error_r)) {
 		sieve_binary_unref(&sbin);
 		return NULL;
 	}
+	return sbin;
+}
 
-	sieve_binary_activate(sbin);
+struct sieve_binary *
+sieve_binary_open_data(struct sieve_instance *svinst,
+		       const void *data, size_t size,
+		       struct sieve_script *script, enum sieve_error *error_r)
+{
+	struct sieve_binary *sbin;
+	struct sieve_binary_file *file;
+	pool_t pool;
 
-	/* Signal open event to extensions */
-	regs = array_get(&sbin->extensions, &ext_count);
-	for (i = 0; i < ext_count; i++) {
-		const struct sieve_binary_extension *binext = regs[i]->binext;
+	i_assert(script == NULL || sieve_script_svinst(script) == svinst);
 
-		if (binext != NULL && binext->binary_open != NULL &&
-		    !binext->binary_open(regs[i]->extension, sbin,
-					 regs[i]->context)) {
-			/* Extension thinks its corrupt */
-			if (error_r != NULL)
-				*error_r = SIEVE_ERROR_NOT_VALID;
-			sieve_binary_unref(&sbin);
-			return NULL;
-		}
+	if (error_r != NULL)
+		*error_r = SIEVE_ERROR_NONE;
+
+	/* Create binary object */
+	sbin = sieve_binary_create(svinst, script);
+
+	/* The data is copied, so that the blocks can refer to it directly
+	   just like they do for a mapped file. */
+	pool = pool_alloconly_create("sieve_binary_file", 1024);
+	file = p_new(pool, struct sieve_binary_file, 1);
+	file->pool = pool;
+	file->sbin = sbin;
+	file->fd = -1;
+	file->map = p_memdup(pool, data, size);
+	file->map_size = size;
+	file->in_memory = TRUE;
+
+	sbin->file = file;
+
+	event_set_append_log_prefix(
+		sbin->event,
+		(script == NULL ? "binary: " :
+		 t_strdup_printf("binary for %s: ",
+				 sieve_script_location(script))));
+
+	if (!sieve_binary_do_open(sbin, error_r)) {
+		sieve_binary_unref(&sbin);
+		return NULL;
 	}
 	return sbin;
 }
@@ -40,6 +40,14 @@ struct sieve_binary_file {
 	struct stat st;
 	int fd;
 	off_t offset;
+
+	/* Read-only mapping of the whole file; blocks loaded from the file
+	   refer to it directly. NULL if the file could not be mapped. */
+	const void *map;
+	size_t map_size;
+	/* The map is a copy of the binary data in the pool rather than a
+	   mapped file (fd is -1) */
+	bool in_memory:1;
 };
 
 void sieve_binary_file_close(struct sieve_binary_file **_file);
@@ -72,6 +80,11 @@ struct sieve_binary_extension_reg {
 
 /* Block */
 
+struct sieve_binary_operation {
+	const struct sieve_operation_def *def;
+	const struct sieve_extension *ext;
+};
+
 struct sieve_binary_block {
 	struct sieve_binary *sbin;
 	unsigned int id;
@@ -80,6 +93,16 @@ struct sieve_binary_block {
 	buffer_t *data;
 
 	uoff_t offset;
+
+	/* Data refers to the mapped binary file (read-only) */
+	bool mapped:1;
+
+	/* Distinct operations decoded from this block so far */
+	ARRAY(struct sieve_binary_operation) operations;
+	/* For each code address: index of the operation found there + 1
+	   (upper 24 bits) and the size of its code (lower 8 bits); 0 if not
+	   decoded yet */
+	ARRAY(uint32_t) operation_map;
 };
 
 /*
@@ -122,6 +145,14 @@ struct sieve_binary {
 	/* Blocks */
 	ARRAY(struct sieve_binary_block *) blocks;
 
+	/* Header fields accessed by the script (and its includes) */
+	ARRAY_TYPE(const_string) header_fields;
+	/* Estimated cost of the script and its includes (0 if unknown) */
+	unsigned int script_cost;
+	/* Script (or one of its includes) reads match values */
+	bool match_values_used:1;
+	bool script_info_read:1;
+
 	bool rusage_updated:1;
 };
 
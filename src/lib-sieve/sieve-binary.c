@@ -12,6 +12,7 @@
 #include "eacces-error.h"
 #include "safe-mkstemp.h"
 
+#include "sieve-limits.h"
 #include "sieve-error.h"
 #include "sieve-extensions.h"
 #include "sieve-code.h"
@@ -180,6 +181,13 @@ void sieve_binary_close(struct sieve_binary **_sbin)
 	if (sbin == NULL)
 		return;
 
+	if (sbin->refcount > 1) {
+		/* Still in use elsewhere (e.g. by the binary cache); the file
+		   is closed once the last reference is dropped */
+		sieve_binary_unref(&sbin);
+		return;
+	}
+
 	sieve_binary_file_close(&sbin->file);
 	sieve_binary_update_resource_usage(sbin);
 	sieve_binary_unref(&sbin);
@@ -218,16 +226,51 @@ bool sieve_binary_check_resource_usage(struct sieve_binary *sbin)
 	return TRUE;
 }
 
+static void
+sieve_binary_check_resource_usage_warning(
+	struct sieve_binary *sbin, const struct sieve_resource_usage *rusage_old,
+	const struct sieve_resource_usage *rusage_new)
+{
+	struct sieve_instance *svinst = sbin->svinst;
+	unsigned int warn_msecs;
+
+	if (svinst->resource_usage_warn_percent == 0 ||
+	    svinst->max_cpu_time_secs == 0)
+		return;
+
+	warn_msecs = (unsigned int)(((unsigned long long)
+				     svinst->max_cpu_time_secs * 1000 *
+				     svinst->resource_usage_warn_percent) / 100);
+
+	/* Only warn once when the threshold is crossed */
+	if (rusage_old->cpu_time_msecs > warn_msecs ||
+	    rusage_new->cpu_time_msecs <= warn_msecs)
+		return;
+
+	struct event_passthrough *e =
+		event_create_passthrough(sbin->event)->
+		set_name("sieve_script_resource_usage_high")->
+		add_int("cpu_time_msecs", rusage_new->cpu_time_msecs)->
+		add_int("max_cpu_time_msecs", svinst->max_cpu_time_secs * 1000);
+	e_warning(e->event(), "Script is approaching its cumulative resource "
+		  "usage limit (%s, limit = %u ms); "
+		  "it will be disabled once the limit is exceeded",
+		  sieve_resource_usage_get_summary(rusage_new),
+		  svinst->max_cpu_time_secs * 1000);
+}
+
 bool sieve_binary_record_resource_usage(
 	struct sieve_binary *sbin, const struct sieve_resource_usage *rusage)
 {
-	struct sieve_resource_usage rusage_total;
+	struct sieve_resource_usage rusage_old, rusage_total;
 
 	if (sbin == NULL)
 		return TRUE;
 	if (!sieve_resource_usage_is_high(sbin->svinst, rusage))
 		return TRUE;
 
+	sieve_binary_get_resource_usage(sbin, &rusage_old);
+
 	sieve_resource_usage_add(&sbin->rusage, rusage);
 	sbin->rusage_updated = TRUE;
 
@@ -236,6 +279,8 @@ bool sieve_binary_record_resource_usage(
 	e_debug(sbin->event, "Updated cumulative resource usage: %s",
 		sieve_resource_usage_get_summary(&rusage_total));
 
+	sieve_binary_check_resource_usage_warning(sbin, &rusage_old,
+						  &rusage_total);
 	return sieve_binary_check_resource_usage(sbin);
 }
 
@@ -399,7 +444,18 @@ sieve_binary_block_get(struct sieve_binary *sbin, unsigned int id)
 
 void sieve_binary_block_clear(struct sieve_binary_block *sblock)
 {
-	buffer_set_used_size(sblock->data, 0);
+	if (sblock->mapped) {
+		/* Mapped data is read-only; start a new buffer */
+		sblock->data = buffer_create_dynamic(sblock->sbin->pool, 64);
+		sblock->mapped = FALSE;
+	} else {
+		buffer_set_used_size(sblock->data, 0);
+	}
+
+	if (array_is_created(&sblock->operation_map)) {
+		array_clear(&sblock->operations);
+		array_clear(&sblock->operation_map);
+	}
 }
 
 buffer_t *sieve_binary_block_get_buffer(struct sieve_binary_block *sblock)
@@ -604,3 +660,195 @@ int sieve_binary_extensions_count(struct sieve_binary *sbin)
 {
 	return (int)array_count(&sbin->extensions);
 }
+
+/*
+ * Script info
+ */
+
+void sieve_binary_add_header_fields(struct sieve_binary *sbin,
+				    const char *const *fields,
+				    unsigned int count)
+{
+	const char *const *cur_fields;
+	const char *field;
+	unsigned int cur_count, i, j;
+
+	if (!array_is_created(&sbin->header_fields))
+		p_array_init(&sbin->header_fields, sbin->pool, count + 1);
+	sbin->script_info_read = TRUE;
+
+	for (i = 0; i < count; i++) {
+		cur_fields = array_get(&sbin->header_fields, &cur_count);
+		if (cur_count >= SIEVE_MAX_WANTED_HEADERS)
+			break;
+		for (j = 0; j < cur_count; j++) {
+			if (strcasecmp(cur_fields[j], fields[i]) == 0)
+				break;
+		}
+		if (j < cur_count)
+			continue;
+
+		field = p_strdup(sbin->pool, fields[i]);
+		array_append(&sbin->header_fields, &field, 1);
+	}
+}
+
+void sieve_binary_set_match_values_used(struct sieve_binary *sbin)
+{
+	sbin->match_values_used = TRUE;
+	sbin->script_info_read = TRUE;
+}
+
+void sieve_binary_add_script_cost(struct sieve_binary *sbin,
+				  unsigned int cost)
+{
+	if (sbin->script_cost > UINT_MAX - cost)
+		sbin->script_cost = UINT_MAX;
+	else
+		sbin->script_cost += cost;
+	sbin->script_info_read = TRUE;
+}
+
+void sieve_binary_write_script_info(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+	const char *const *fields = NULL;
+	unsigned int count = 0, i;
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_SCRIPT_DATA);
+	i_assert(sblock != NULL);
+
+	/* Appended after the script metadata; older binaries simply lack this
+	   list and the match values flag and cost estimate that follow it */
+	if (array_is_created(&sbin->header_fields))
+		fields = array_get(&sbin->header_fields, &count);
+	(void)sieve_binary_emit_unsigned(sblock, count);
+	for (i = 0; i < count; i++)
+		(void)sieve_binary_emit_cstring(sblock, fields[i]);
+	(void)sieve_binary_emit_byte(sblock,
+				     (sbin->match_values_used ? 1 : 0));
+	(void)sieve_binary_emit_unsigned(sblock, sbin->script_cost);
+}
+
+static void sieve_binary_read_script_info(struct sieve_binary *sbin)
+{
+	struct sieve_binary_block *sblock;
+	sieve_size_t offset = 0;
+	unsigned int count, i;
+	unsigned int mvalues_used, cost;
+
+	/* Binaries without this information may use match values */
+	sbin->match_values_used = TRUE;
+
+	sblock = sieve_binary_block_get(sbin, SBIN_SYSBLOCK_SCRIPT_DATA);
+	if (sblock == NULL || sbin->script == NULL)
+		return;
+
+	/* Skip the script metadata */
+	if (sieve_script_binary_read_metadata(sbin->script, sblock,
+					      &offset) <= 0)
+		return;
+	if (!sieve_binary_read_unsigned(sblock, &offset, &count) ||
+	    count > SIEVE_MAX_WANTED_HEADERS)
+		return;
+
+	p_array_init(&sbin->header_fields, sbin->pool, count + 1);
+	for (i = 0; i < count; i++) {
+		string_t *field;
+		const char *field_name;
+
+		if (!sieve_binary_read_string(sblock, &offset, &field)) {
+			array_clear(&sbin->header_fields);
+			return;
+		}
+		field_name = p_strdup(sbin->pool, str_c(field));
+		array_append(&sbin->header_fields, &field_name, 1);
+	}
+
+	if (!sieve_binary_read_byte(sblock, &offset, &mvalues_used))
+		return;
+	sbin->match_values_used = (mvalues_used != 0);
+
+	if (sieve_binary_read_unsigned(sblock, &offset, &cost))
+		sbin->script_cost = cost;
+}
+
+static void sieve_binary_get_script_info(struct sieve_binary *sbin)
+{
+	if (!sbin->script_info_read) {
+		sbin->script_info_read = TRUE;
+		T_BEGIN {
+			sieve_binary_read_script_info(sbin);
+		} T_END;
+	}
+}
+
+bool sieve_binary_get_match_values_used(struct sieve_binary *sbin)
+{
+	sieve_binary_get_script_info(sbin);
+	return sbin->match_values_used;
+}
+
+unsigned int sieve_binary_get_script_cost(struct sieve_binary *sbin)
+{
+	sieve_binary_get_script_info(sbin);
+	return sbin->script_cost;
+}
+
+const char *const *sieve_binary_get_header_fields(struct sieve_binary *sbin)
+{
+	sieve_binary_get_script_info(sbin);
+
+	if (!array_is_created(&sbin->header_fields) ||
+	    array_count(&sbin->header_fields) == 0)
+		return NULL;
+
+	/* Keep the list NULL-terminated without counting the terminator */
+	array_append_zero(&sbin->header_fields);
+	array_delete(&sbin->header_fields,
+		     array_count(&sbin->header_fields) - 1, 1);
+	return array_idx(&sbin->header_fields, 0);
+}
+
+/*
+ * Message requirements
+ */
+
+static const struct {
+	const char *name;
+	enum sieve_binary_requirements reqs;
+} sieve_binary_ext_requirements[] = {
+	{ "body", SIEVE_BINARY_REQUIRE_BODY },
+	{ "extracttext", SIEVE_BINARY_REQUIRE_BODY | SIEVE_BINARY_REQUIRE_MIME },
+	{ "mime", SIEVE_BINARY_REQUIRE_MIME },
+	{ "foreverypart", SIEVE_BINARY_REQUIRE_MIME },
+	{ "envelope", SIEVE_BINARY_REQUIRE_ENVELOPE },
+	{ "date", SIEVE_BINARY_REQUIRE_DATE },
+	{ "editheader", SIEVE_BINARY_REQUIRE_EDIT },
+	{ "vnd.dovecot.filter",
+	  SIEVE_BINARY_REQUIRE_BODY | SIEVE_BINARY_REQUIRE_EDIT },
+	{ "vnd.dovecot.pipe", SIEVE_BINARY_REQUIRE_BODY },
+	{ "vnd.dovecot.execute", SIEVE_BINARY_REQUIRE_BODY },
+};
+
+enum sieve_binary_requirements
+sieve_binary_get_requirements(struct sieve_binary *sbin)
+{
+	struct sieve_binary_extension_reg *const *regs;
+	enum sieve_binary_requirements reqs = 0;
+	unsigned int i, j, ext_count;
+
+	regs = array_get(&sbin->linked_extensions, &ext_count);
+	for (i = 0; i < ext_count; i++) {
+		const struct sieve_extension *ext = regs[i]->extension;
+
+		if (ext == NULL || ext->def == NULL)
+			continue;
+		for (j = 0; j < N_ELEMENTS(sieve_binary_ext_requirements); j++) {
+			if (sieve_extension_name_is(
+				ext, sieve_binary_ext_requirements[j].name))
+				reqs |= sieve_binary_ext_requirements[j].reqs;
+		}
+	}
+	return reqs;
+}
@@ -74,6 +74,10 @@ void sieve_binary_activate(struct sieve_binary *sbin);
 
 int sieve_binary_save(struct sieve_binary *sbin, const char *path, bool update,
 		      mode_t save_mode, enum sieve_error *error_r);
+/* Write the binary into the buffer rather than a file, e.g. for storing it
+   along with the script. */
+int sieve_binary_save_to_buffer(struct sieve_binary *sbin, buffer_t *buffer,
+				enum sieve_error *error_r);
 
 /*
  * Loading the binary
@@ -82,6 +86,12 @@ int sieve_binary_save(struct sieve_binary *sbin, const char *path, bool update,
 struct sieve_binary *
 sieve_binary_open(struct sieve_instance *svinst, const char *path,
 		  struct sieve_script *script, enum sieve_error *error_r);
+/* Open a binary previously written by sieve_binary_save_to_buffer(). The
+   data is copied. */
+struct sieve_binary *
+sieve_binary_open_data(struct sieve_instance *svinst,
+		       const void *data, size_t size,
+		       struct sieve_script *script, enum sieve_error *error_r);
 bool sieve_binary_up_to_date(struct sieve_binary *sbin,
 			     enum sieve_compile_flags cpflags);
 
@@ -167,6 +177,54 @@ int sieve_binary_extension_get_index(struct sieve_binary *sbin,
 				     const struct sieve_extension *ext);
 int sieve_binary_extensions_count(struct sieve_binary *sbin);
 
+/*
+ * Script info
+ */
+
+/* Records header fields accessed by the script (used by the generator). */
+void sieve_binary_add_header_fields(struct sieve_binary *sbin,
+				    const char *const *fields,
+				    unsigned int count);
+/* Records that the script reads match values (used by the generator). */
+void sieve_binary_set_match_values_used(struct sieve_binary *sbin);
+/* Adds the estimated cost of a script (used by the generator). */
+void sieve_binary_add_script_cost(struct sieve_binary *sbin,
+				  unsigned int cost);
+/* Stores the recorded script info with the script metadata. */
+void sieve_binary_write_script_info(struct sieve_binary *sbin);
+
+/* Returns the NULL-terminated list of header fields accessed by the script
+   or NULL if unknown. */
+const char *const *sieve_binary_get_header_fields(struct sieve_binary *sbin);
+/* Returns FALSE if the script is known never to read match values. */
+bool sieve_binary_get_match_values_used(struct sieve_binary *sbin);
+/* Returns the estimated cost of the script and its includes or 0 if
+   unknown. */
+unsigned int sieve_binary_get_script_cost(struct sieve_binary *sbin);
+
+/*
+ * Message requirements
+ */
+
+enum sieve_binary_requirements {
+	/* Script reads the message body */
+	SIEVE_BINARY_REQUIRE_BODY = BIT(0),
+	/* Script looks at the MIME structure of the message */
+	SIEVE_BINARY_REQUIRE_MIME = BIT(1),
+	/* Script uses the message envelope */
+	SIEVE_BINARY_REQUIRE_ENVELOPE = BIT(2),
+	/* Script parses date header fields */
+	SIEVE_BINARY_REQUIRE_DATE = BIT(3),
+	/* Script modifies the message */
+	SIEVE_BINARY_REQUIRE_EDIT = BIT(4),
+};
+
+/* Returns which parts of the message the script may access, as derived from
+   the extensions it is linked against. This is conservative: a bit that is
+   not set means the script never needs that part. */
+enum sieve_binary_requirements
+sieve_binary_get_requirements(struct sieve_binary *sbin);
+
 /*
  * Code emission
  */
@@ -231,6 +289,12 @@ bool sieve_binary_read_offset(struct sieve_binary_block *sblock,
 bool sieve_binary_read_integer(struct sieve_binary_block *sblock,
 			       sieve_size_t *address, sieve_number_t *int_r)
 			       ATTR_NULL(3);
+/* Returns the string data in place; it is NUL-terminated and remains valid
+   for as long as the binary block does. */
+bool sieve_binary_read_string_data(struct sieve_binary_block *sblock,
+				   sieve_size_t *address,
+				   const char **data_r, size_t *size_r)
+				   ATTR_NULL(3, 4);
 bool sieve_binary_read_string(struct sieve_binary_block *sblock,
 			      sieve_size_t *address, string_t **str_r)
 			      ATTR_NULL(3);
@@ -258,6 +322,20 @@ sieve_binary_read_extension_object(struct sieve_binary_block *sblock,
 				   sieve_size_t *address,
 				   const struct sieve_extension_objects *objs);
 
+/* Decoded operations */
+
+/* Operations are decoded only once for each address in a block: once
+   recorded with sieve_binary_operation_cache(), the lookup yields the
+   operation at *address and moves *address past its code. */
+bool sieve_binary_operation_lookup(struct sieve_binary_block *sblock,
+				   sieve_size_t *address,
+				   const struct sieve_operation_def **def_r,
+				   const struct sieve_extension **ext_r);
+void sieve_binary_operation_cache(struct sieve_binary_block *sblock,
+				  sieve_size_t address, sieve_size_t code_size,
+				  const struct sieve_operation_def *def,
+				  const struct sieve_extension *ext);
+
 /*
  * Debug info
  */
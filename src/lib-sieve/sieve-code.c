@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "buffer.h"
 #include "str.h"
 #include "str-sanitize.h"
 
@@ -42,6 +43,10 @@ struct sieve_code_stringlist {
 	sieve_size_t current_offset;
 	int length;
 	int index;
+
+	/* Refers directly to the current literal item in the binary; valid
+	   until the next item is read */
+	string_t literal_item;
 };
 
 static struct sieve_stringlist *sieve_code_stringlist_create
@@ -54,6 +59,7 @@ static struct sieve_stringlist *sieve_code_stringlist_create
   		return NULL;
 
 	strlist = t_new(struct sieve_code_stringlist, 1);
+	sieve_runtime_alloc_audit(renv, SIEVE_ALLOC_STRINGLIST, sizeof(*strlist));
 	strlist->strlist.runenv = renv;
 	strlist->strlist.exec_status = SIEVE_EXEC_OK;
 	strlist->strlist.next_item = sieve_code_stringlist_next_item;
@@ -75,25 +81,51 @@ static int sieve_code_stringlist_next_item
 {
 	struct sieve_code_stringlist *strlist =
 		(struct sieve_code_stringlist *) _strlist;
+	const struct sieve_runtime_env *renv = _strlist->runenv;
+	struct sieve_operand operand;
 	sieve_size_t address;
-	*str_r = NULL;
 	int ret;
 
+	*str_r = NULL;
+
 	/* Check for end of list */
 	if ( strlist->index >= strlist->length )
 		return 0;
 
 	/* Read next item */
 	address = strlist->current_offset;
-	if ( (ret=sieve_opr_string_read(_strlist->runenv, &address, NULL, str_r))
-		== SIEVE_EXEC_OK ) {
-		strlist->index++;
-		strlist->current_offset = address;
-		return 1;
+	if ( (ret=sieve_operand_runtime_read
+		(renv, &address, NULL, &operand)) <= 0 ) {
+		_strlist->exec_status = ret;
+		return -1;
+	}
+
+	if ( sieve_operand_is_string_literal(&operand) ) {
+		const char *data;
+		size_t size;
+
+		/* Literal items need no copy: point into the binary data, which
+		   is NUL-terminated */
+		if ( !sieve_binary_read_string_data
+			(renv->sblock, &address, &data, &size) ) {
+			sieve_runtime_trace_operand_error(renv, &operand,
+				"invalid string operand");
+			_strlist->exec_status = SIEVE_EXEC_BIN_CORRUPT;
+			return -1;
+		}
+
+		buffer_create_from_const_data(&strlist->literal_item, data, size + 1);
+		buffer_set_used_size(&strlist->literal_item, size);
+		*str_r = &strlist->literal_item;
+	} else if ( (ret=sieve_opr_string_read_data
+		(renv, &operand, &address, NULL, str_r)) != SIEVE_EXEC_OK ) {
+		_strlist->exec_status = ret;
+		return -1;
 	}
 
-	_strlist->exec_status = ret;
-	return -1;
+	strlist->index++;
+	strlist->current_offset = address;
+	return 1;
 }
 
 static void sieve_code_stringlist_reset
@@ -810,6 +842,7 @@ int sieve_opr_stringlist_read_data
 
 			*strlist_r = sieve_single_stringlist_create
 				(renv, stritem, FALSE);
+			(*strlist_r)->address = oprnd->address;
 		}
 		return SIEVE_EXEC_OK;
 	}
@@ -855,6 +888,42 @@ int sieve_opr_stringlist_read_ex
 		(renv, &operand, address, field_name, strlist_r);
 }
 
+bool sieve_opr_stringlist_is_literal(struct sieve_stringlist *strlist)
+{
+	const struct sieve_runtime_env *renv = strlist->runenv;
+	struct sieve_operand operand;
+	sieve_size_t address = strlist->address, pc;
+	sieve_offset_t end_offset;
+	unsigned int length = 0, i;
+
+	if ( address == 0 || renv == NULL )
+		return FALSE;
+
+	/* Read the operand again; the list contents were already validated when
+	   the list was read, so any failure here just means 'not literal' */
+	if ( !sieve_operand_read(renv->sblock, &address, NULL, &operand) )
+		return FALSE;
+
+	if ( sieve_operand_is_string_literal(&operand) )
+		return TRUE;
+	if ( !sieve_operand_is(&operand, stringlist_operand) )
+		return FALSE;
+
+	pc = address;
+	if ( !sieve_binary_read_offset(renv->sblock, &address, &end_offset) ||
+		!sieve_binary_read_unsigned(renv->sblock, &address, &length) )
+		return FALSE;
+
+	for ( i = 0; i < length; i++ ) {
+		if ( !sieve_operand_read(renv->sblock, &address, NULL, &operand) ||
+			!sieve_operand_is_string_literal(&operand) ||
+			!sieve_binary_read_string(renv->sblock, &address, NULL) )
+			return FALSE;
+	}
+
+	return ( address == pc + end_offset );
+}
+
 static bool opr_stringlist_dump
 (const struct sieve_dumptime_env *denv, const struct sieve_operand *oprnd,
 	sieve_size_t *address)
@@ -899,9 +968,12 @@ static int opr_stringlist_read
 		return SIEVE_EXEC_BIN_CORRUPT;
 	}
 
-	if ( strlist_r != NULL )
+	if ( strlist_r != NULL ) {
 		*strlist_r = sieve_code_stringlist_create
 			(renv, *address, (unsigned int) length, end);
+		if ( *strlist_r != NULL )
+			(*strlist_r)->address = oprnd->address;
+	}
 
 	/* Skip over the string list for now */
 	*address = end;
@@ -1098,6 +1170,11 @@ bool sieve_operation_read
 	oprtn->def = NULL;
 	oprtn->ext = NULL;
 
+	/* Operations executed before need not be decoded again */
+	if ( sieve_binary_operation_lookup
+		(sblock, address, &oprtn->def, &oprtn->ext) )
+		return TRUE;
+
 	if ( !sieve_binary_read_extension(sblock, address, &code, &oprtn->ext) )
 		return FALSE;
 
@@ -1105,15 +1182,18 @@ bool sieve_operation_read
 		if ( code < sieve_operation_count ) {
 			oprtn->def = sieve_operations[code];
 		}
-
-		return ( oprtn->def != NULL );
+	} else {
+		oprtn->def = (const struct sieve_operation_def *)
+			sieve_binary_read_extension_object(sblock, address,
+				&oprtn->ext->def->operations);
 	}
 
-	oprtn->def = (const struct sieve_operation_def *)
-		sieve_binary_read_extension_object(sblock, address,
-			&oprtn->ext->def->operations);
+	if ( oprtn->def == NULL )
+		return FALSE;
 
-	return ( oprtn->def != NULL );
+	sieve_binary_operation_cache(sblock, oprtn->address,
+		*address - oprtn->address, oprtn->def, oprtn->ext);
+	return TRUE;
 }
 
 /*
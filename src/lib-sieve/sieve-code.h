@@ -263,6 +263,11 @@ int sieve_opr_stringlist_read_ex
 	(const struct sieve_runtime_env *renv, sieve_size_t *address,
 		const char *field_name, bool optional, struct sieve_stringlist **strlist_r);
 
+/* Returns TRUE when the list was read directly from a string or stringlist
+   operand that contains only string literals. Such a list yields the same
+   items for every execution of the binary. */
+bool sieve_opr_stringlist_is_literal(struct sieve_stringlist *strlist);
+
 static inline bool sieve_operand_is_stringlist
 (const struct sieve_operand *operand)
 {
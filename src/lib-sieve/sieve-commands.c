@@ -392,6 +392,9 @@ static int _verify_header_name_item
 		return 0;
 	}
 
+	if ( sieve_argument_is_string_literal(header) )
+		sieve_ast_header_field_add(header->ast, str_c(name));
+
 	return 1;
 }
 
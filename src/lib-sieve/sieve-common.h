@@ -85,10 +85,12 @@ struct sieve_operand;
 struct sieve_operand_def;
 struct sieve_operand_class;
 struct sieve_operation;
+struct sieve_operation_def;
 struct sieve_coded_stringlist;
 
 /* sieve-binary.h */
 struct sieve_binary;
+struct sieve_binary_cache;
 struct sieve_binary_block;
 struct sieve_binary_debug_writer;
 struct sieve_binary_debug_reader;
@@ -197,18 +199,38 @@ struct sieve_instance {
 
 	/* Plugin modules */
 	struct sieve_plugin *plugins;
+
+	/* Recently opened binaries */
+	struct sieve_binary_cache *binary_cache;
+
 	enum sieve_env_location env_location;
 	enum sieve_delivery_phase delivery_phase;
 
 	/* Settings */
 	size_t max_script_size;
+	unsigned int max_script_cost;
 	unsigned int max_actions;
 	unsigned int max_redirects;
 	unsigned int max_cpu_time_secs;
+	size_t max_memory;
 	unsigned int resource_usage_timeout_secs;
+	unsigned int resource_usage_warn_percent;
+	unsigned int binary_cache_period_secs;
+	unsigned int mailbox_cache_size;
+	unsigned int mailbox_cache_idle_timeout_secs;
+	bool runtime_profile;
+	bool alloc_audit;
 	const struct smtp_address *user_email, *user_email_implicit;
 	struct sieve_address_source redirect_from;
 	unsigned int redirect_duplicate_period;
+	bool redirect_batch;
+
+	/* Raw mail user for substituted messages (created on first use) */
+	struct mail_user *raw_mail_user;
+
+	/* Built-in duplicate database (opened on first use) */
+	struct duplicate_log *dup_log;
+	bool dup_log_checked:1;
 };
 
 /*
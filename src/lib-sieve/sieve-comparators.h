@@ -53,6 +53,12 @@ struct sieve_comparator_def {
 		const char **key, const char *key_end);
 	bool (*char_skip)(const struct sieve_comparator *cmp,
 		const char **val, const char *val_end);
+
+	/* Substring search (optional); returns the offset of the first
+	   occurrence of key in val or (size_t)-1 */
+	size_t (*find)(const struct sieve_comparator *cmp,
+		const char *val, size_t val_size,
+		const char *key, size_t key_size);
 };
 
 /*
@@ -160,6 +160,13 @@ void sieve_direct_logv(struct sieve_instance *svinst,
 			event_params.log_type = LOG_TYPE_INFO;
 	}
 
+	/* Don't format a message that nobody will see */
+	if (event_log && !ehandler_log &&
+	    !event_want_log_level(event, event_params.log_type,
+				  params->csrc.filename,
+				  params->csrc.linenum))
+		event_log = FALSE;
+
 	if (event_log) {
 		event_params.no_send = FALSE;
 		if (params->location != NULL && *params->location != '\0') {
@@ -995,6 +1002,10 @@ static void sieve_logfile_start(struct sieve_logfile_ehandler *ehandler)
 	ehandler->started = TRUE;
 
 	if (ostream != NULL) {
+		/* Collect all messages of this run and write them at once
+		   when the handler is freed (or the buffer fills up) */
+		o_stream_cork(ostream);
+
 		now = time(NULL);
 		tm = localtime(&now);
 
@@ -1026,6 +1037,12 @@ static void sieve_logfile_free(struct sieve_error_handler *ehandler)
 		(struct sieve_logfile_ehandler *) ehandler;
 
 	if (handler->stream != NULL) {
+		o_stream_uncork(handler->stream);
+		if (handler->stream->stream_errno != 0) {
+			e_error(ehandler->svinst->event,
+				"write(%s) failed: %s", handler->logfile,
+				o_stream_get_error(handler->stream));
+		}
 		o_stream_destroy(&(handler->stream));
 		if (handler->fd != STDERR_FILENO) {
 			if (close(handler->fd) < 0) {
@@ -2,11 +2,19 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
+#include "buffer.h"
+#include "home-expand.h"
+#include "duplicate-log.h"
+
+#include "sieve-common.h"
+#include "sieve-settings.h"
 
 #include "sieve-execute.h"
 
 struct sieve_execute_state {
 	void *dup_trans;
+	struct duplicate_log_transaction *dlog_trans;
 };
 
 struct event_category event_category_sieve_execute = {
@@ -29,6 +37,7 @@ sieve_execute_state_free(struct sieve_execute_state **_estate,
 
 	*_estate = NULL;
 
+	duplicate_log_transaction_rollback(&estate->dlog_trans);
 	if (senv->duplicate_transaction_rollback != NULL)
 		senv->duplicate_transaction_rollback(&estate->dup_trans);
 }
@@ -70,6 +79,17 @@ void sieve_execute_init(struct sieve_execute_env *eenv,
 void sieve_execute_finish(struct sieve_execute_env *eenv, int status)
 {
 	const struct sieve_script_env *senv = eenv->scriptenv;
+	const char *error;
+
+	if (eenv->state->dlog_trans == NULL)
+		;
+	else if (status != SIEVE_EXEC_OK)
+		duplicate_log_transaction_rollback(&eenv->state->dlog_trans);
+	else if (duplicate_log_transaction_commit(&eenv->state->dlog_trans,
+						  &error) < 0) {
+		e_error(eenv->svinst->event,
+			"Failed to record duplicate IDs: %s", error);
+	}
 
 	if (status == SIEVE_EXEC_OK) {
 		if (senv->duplicate_transaction_commit != NULL) {
@@ -95,6 +115,75 @@ void sieve_execute_deinit(struct sieve_execute_env *eenv)
  * Checking for duplicates
  */
 
+/* Returns the built-in duplicate database if it is configured using the
+   sieve_duplicate_log setting. It is then used instead of the duplicate
+   checking interface provided by the script environment. */
+static struct duplicate_log *
+sieve_execute_get_duplicate_log(struct sieve_instance *svinst)
+{
+	const char *path;
+
+	if (svinst->dup_log_checked)
+		return svinst->dup_log;
+	svinst->dup_log_checked = TRUE;
+
+	path = sieve_setting_get(svinst, "sieve_duplicate_log");
+	if (path == NULL || *path == '\0')
+		return NULL;
+	if (path[0] != '/') {
+		if (svinst->home_dir == NULL) {
+			e_error(svinst->event,
+				"sieve_duplicate_log: "
+				"Relative path `%s' used without home directory",
+				path);
+			return NULL;
+		}
+		if (path[0] == '~')
+			path = home_expand_tilde(path, svinst->home_dir);
+		else
+			path = t_strconcat(svinst->home_dir, "/", path, NULL);
+	}
+
+	svinst->dup_log = duplicate_log_init(path);
+	return svinst->dup_log;
+}
+
+static struct duplicate_log_transaction *
+sieve_execute_get_dlog_transaction(const struct sieve_execute_env *eenv)
+{
+	struct duplicate_log *dlog =
+		sieve_execute_get_duplicate_log(eenv->svinst);
+
+	if (dlog == NULL)
+		return NULL;
+	if (eenv->state->dlog_trans == NULL) {
+		eenv->state->dlog_trans =
+			duplicate_log_transaction_begin(dlog);
+	}
+	return eenv->state->dlog_trans;
+}
+
+/* The duplicate log may be shared by several users when it is configured with
+   an absolute path, so the ID is recorded together with the username, like
+   the LDA duplicate database does. The username cannot contain NUL, so it is
+   put first. */
+static const void *
+sieve_execute_get_dlog_id(const struct sieve_execute_env *eenv,
+			  const void *id, size_t id_size, size_t *key_size_r)
+{
+	const char *username = eenv->svinst->username;
+	buffer_t *key;
+
+	if (username == NULL)
+		username = "";
+	key = t_buffer_create(strlen(username) + 1 + id_size);
+	buffer_append(key, username, strlen(username) + 1);
+	buffer_append(key, id, id_size);
+
+	*key_size_r = key->used;
+	return key->data;
+}
+
 static void *
 sieve_execute_get_dup_transaction(const struct sieve_execute_env *eenv)
 {
@@ -114,6 +203,8 @@ bool sieve_execute_duplicate_check_available(
 {
 	const struct sieve_script_env *senv = eenv->scriptenv;
 
+	if (sieve_execute_get_duplicate_log(eenv->svinst) != NULL)
+		return TRUE;
 	return (senv->duplicate_transaction_begin != NULL);
 }
 
@@ -122,13 +213,35 @@ int sieve_execute_duplicate_check(const struct sieve_execute_env *eenv,
 				  bool *duplicate_r)
 {
 	const struct sieve_script_env *senv = eenv->scriptenv;
-	void *dup_trans = sieve_execute_get_dup_transaction(eenv);
+	struct duplicate_log_transaction *dlog_trans;
+	void *dup_trans;
+	const char *error;
 	int ret;
 
 	*duplicate_r = FALSE;
 
+	dlog_trans = sieve_execute_get_dlog_transaction(eenv);
+	if (dlog_trans != NULL) {
+		const void *key;
+		size_t key_size;
+
+		e_debug(eenv->svinst->event, "Check duplicate ID");
+
+		key = sieve_execute_get_dlog_id(eenv, id, id_size, &key_size);
+		ret = duplicate_log_check(dlog_trans, key, key_size,
+					  ioloop_time, &error);
+		if (ret < 0) {
+			e_error(eenv->svinst->event,
+				"Failed to check duplicate ID: %s", error);
+			return SIEVE_EXEC_TEMP_FAILURE;
+		}
+		*duplicate_r = (ret > 0);
+		return SIEVE_EXEC_OK;
+	}
+
 	if (senv->duplicate_check == NULL)
 		return SIEVE_EXEC_OK;
+	dup_trans = sieve_execute_get_dup_transaction(eenv);
 
 	e_debug(eenv->svinst->event, "Check duplicate ID");
 
@@ -151,10 +264,24 @@ void sieve_execute_duplicate_mark(const struct sieve_execute_env *eenv,
 				  const void *id, size_t id_size, time_t time)
 {
 	const struct sieve_script_env *senv = eenv->scriptenv;
-	void *dup_trans = sieve_execute_get_dup_transaction(eenv);
+	struct duplicate_log_transaction *dlog_trans;
+	void *dup_trans;
+
+	dlog_trans = sieve_execute_get_dlog_transaction(eenv);
+	if (dlog_trans != NULL) {
+		const void *key;
+		size_t key_size;
+
+		e_debug(eenv->svinst->event, "Mark ID as duplicate");
+
+		key = sieve_execute_get_dlog_id(eenv, id, id_size, &key_size);
+		duplicate_log_mark(dlog_trans, key, key_size, time);
+		return;
+	}
 
 	if (senv->duplicate_mark == NULL)
 		return;
+	dup_trans = sieve_execute_get_dup_transaction(eenv);
 
 	e_debug(eenv->svinst->event, "Mark ID as duplicate");
 
@@ -401,12 +401,22 @@ bool sieve_generate_block(const struct sieve_codegen_env *cgenv,
 			  struct sieve_ast_node *block)
 {
 	bool result = TRUE;
+	struct sieve_command *block_cmd = block->command;
 	struct sieve_ast_node *cmd_node;
 
 	T_BEGIN {
 		cmd_node = sieve_ast_command_first(block);
 		while (result && cmd_node != NULL) {
+			struct sieve_command *cmd = cmd_node->command;
+
 			result = sieve_generate_command(cgenv, cmd_node);
+
+			/* Commands following one that unconditionally exits
+			   the block (e.g. stop) are unreachable */
+			if (sieve_command_is(cmd, cmd_stop) ||
+			    (block_cmd != NULL &&
+			     block_cmd->block_exit_command == cmd))
+				break;
 			cmd_node = sieve_ast_command_next(cmd_node);
 		}
 	} T_END;
@@ -479,8 +489,24 @@ sieve_generator_run(struct sieve_generator *gentr,
 		if (!sieve_generate_block(&gentr->genenv,
 					  sieve_ast_root(gentr->genenv.ast))) {
 			result = FALSE;
-		} else if (topmost) {
-			sieve_binary_activate(sbin);
+		} else {
+			const char *const *fields;
+			unsigned int count;
+
+			/* Included scripts add their header fields to the same
+			   binary before the topmost script is finished */
+			fields = sieve_ast_header_fields_get(gentr->genenv.ast,
+							     &count);
+			sieve_binary_add_header_fields(sbin, fields, count);
+			if (sieve_ast_match_values_are_used(gentr->genenv.ast))
+				sieve_binary_set_match_values_used(sbin);
+			sieve_binary_add_script_cost(
+				sbin, sieve_ast_cost_get(gentr->genenv.ast));
+
+			if (topmost) {
+				sieve_binary_write_script_info(sbin);
+				sieve_binary_activate(sbin);
+			}
 		}
 	}
 
@@ -27,6 +27,10 @@
 #include "sieve-interpreter.h"
 
 #include <string.h>
+#include <time.h>
+
+/* Number of operations executed between checks of the CPU time limit */
+#define SIEVE_INTERPRETER_CPU_CHECK_INTERVAL 64
 
 static struct event_category event_category_sieve_runtime = {
 	.parent = &event_category_sieve,
@@ -47,6 +51,18 @@ struct sieve_interpreter_extension_reg {
 	bool started:1;
 };
 
+/*
+ * Runtime profile
+ */
+
+struct sieve_interpreter_profile_entry {
+	sieve_size_t address;
+	const char *mnemonic;
+
+	unsigned int count;
+	unsigned long long nsecs;
+};
+
 /*
  * Code loop
  */
@@ -88,10 +104,34 @@ struct sieve_interpreter {
 	/* Current operation */
 	struct sieve_operation oprtn;
 
+	/* CPU time limit (while running) */
+	struct cpu_limit *cpu_limit;
+	unsigned int cpu_check_countdown;
+	/* Peak memory usage seen by the limit checks */
+	size_t memory_peak;
+
 	/* Location information */
 	struct sieve_binary_debug_reader *dreader;
 	unsigned int command_line;
 
+	/* Runtime profile (only when sieve_runtime_profile is enabled) */
+	HASH_TABLE(void *, struct sieve_interpreter_profile_entry *) profile;
+
+	/* Cleared match context pools kept for reuse */
+	ARRAY(pool_t) match_pools;
+
+	/* Execution statistics (reported when the script finishes) */
+	unsigned int stat_operations;
+	unsigned int stat_match_values;
+	unsigned int stat_start_actions;
+	uint64_t stat_cpu_usecs;
+
+	/* Allocation audit (only when sieve_alloc_audit is enabled) */
+	struct sieve_alloc_audit *alloc_audit;
+	size_t alloc_audit_pool_size;
+	size_t alloc_audit_msgctx_size;
+	size_t alloc_audit_result_size;
+
 	bool running:1;		    /* Interpreter is running
 				       (may be interrupted) */
 	bool interrupted:1;         /* Interpreter interrupt requested */
@@ -142,6 +182,11 @@ _sieve_interpreter_create(struct sieve_binary *sbin,
 
 	svinst = sieve_binary_svinst(sbin);
 
+	if (svinst->runtime_profile)
+		hash_table_create_direct(&interp->profile, pool, 0);
+	if (svinst->alloc_audit)
+		interp->alloc_audit = p_new(pool, struct sieve_alloc_audit, 1);
+
 	if (senv->trace_log != NULL) {
 		interp->trace.log = senv->trace_log;
 		interp->trace.config = senv->trace_config;
@@ -309,6 +354,14 @@ void sieve_interpreter_free(struct sieve_interpreter **_interp)
 			pool_unref(&loops[i].pool);
 	}
 
+	if (array_is_created(&interp->match_pools)) {
+		pool_t *pools = array_get_modifiable(&interp->match_pools,
+						     &count);
+
+		for (i = 0; i < count; i++)
+			pool_unref(&pools[i]);
+	}
+
 	interp->trace.indent = 0;
 	sieve_runtime_trace_end(renv);
 
@@ -321,6 +374,9 @@ void sieve_interpreter_free(struct sieve_interpreter **_interp)
 		}
 	}
 
+	if (hash_table_is_created(interp->profile))
+		hash_table_destroy(&interp->profile);
+
 	sieve_binary_debug_reader_deinit(&interp->dreader);
 	sieve_binary_unref(&renv->sbin);
 	sieve_error_handler_unref(&renv->ehandler);
@@ -546,6 +602,7 @@ int sieve_interpreter_loop_start(struct sieve_interpreter *interp,
 	loop->begin = interp->runenv.pc;
 	loop->end = loop_end;
 	loop->pool =  pool_alloconly_create("sieve_interpreter", 128);
+	sieve_runtime_alloc_audit(&interp->runenv, SIEVE_ALLOC_INTERPRETER, 0);
 
 	/* Set new loop limit */
 	interp->loop_limit = loop_end;
@@ -630,6 +687,11 @@ int sieve_interpreter_loop_break(struct sieve_interpreter *interp,
 
 	i = count;
 	do {
+		if (interp->alloc_audit != NULL) {
+			interp->alloc_audit->bytes[SIEVE_ALLOC_INTERPRETER] +=
+				pool_alloconly_get_total_used_size(
+					loops[i-1].pool);
+		}
 		pool_unref(&loops[i-1].pool);
 		i--;
 	} while (i > 0 && &loops[i] != loop);
@@ -742,6 +804,44 @@ void sieve_interpreter_loop_set_context(struct sieve_interpreter_loop *loop,
 	loop->context = context;
 }
 
+/*
+ * Match context pools
+ */
+
+pool_t sieve_interpreter_match_pool_get(struct sieve_interpreter *interp)
+{
+	unsigned int count;
+	pool_t pool;
+
+	if (!array_is_created(&interp->match_pools) ||
+	    (count = array_count(&interp->match_pools)) == 0)
+		return pool_alloconly_create("sieve_match_context", 1024);
+
+	pool = *array_idx(&interp->match_pools, count - 1);
+	array_delete(&interp->match_pools, count - 1, 1);
+	return pool;
+}
+
+void sieve_interpreter_match_pool_put(struct sieve_interpreter *interp,
+				      pool_t *_pool)
+{
+	pool_t pool = *_pool;
+
+	*_pool = NULL;
+
+	if (!array_is_created(&interp->match_pools)) {
+		p_array_init(&interp->match_pools, interp->pool,
+			     SIEVE_MAX_MATCH_POOLS_FREE);
+	}
+	if (array_count(&interp->match_pools) >= SIEVE_MAX_MATCH_POOLS_FREE) {
+		pool_unref(&pool);
+		return;
+	}
+
+	p_clear(pool);
+	array_push_back(&interp->match_pools, &pool);
+}
+
 /*
  * Program flow
  */
@@ -880,13 +980,224 @@ bool sieve_interpreter_get_test_result(struct sieve_interpreter *interp)
  * Code execute
  */
 
+static void
+sieve_interpreter_profile_add(struct sieve_interpreter *interp,
+			      const struct timespec *ts_start)
+{
+	struct sieve_operation *oprtn = &(interp->oprtn);
+	struct sieve_interpreter_profile_entry *entry;
+	struct timespec ts_end;
+	void *key = POINTER_CAST(oprtn->address + 1);
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts_end) < 0)
+		return;
+
+	entry = hash_table_lookup(interp->profile, key);
+	if (entry == NULL) {
+		entry = p_new(interp->pool,
+			      struct sieve_interpreter_profile_entry, 1);
+		entry->address = oprtn->address;
+		entry->mnemonic = sieve_operation_mnemonic(oprtn);
+		hash_table_insert(interp->profile, key, entry);
+	}
+
+	entry->count++;
+	entry->nsecs += (ts_end.tv_sec - ts_start->tv_sec) * 1000000000ULL +
+		ts_end.tv_nsec - ts_start->tv_nsec;
+}
+
+static int
+sieve_interpreter_profile_entry_cmp(
+	struct sieve_interpreter_profile_entry *const *entry1,
+	struct sieve_interpreter_profile_entry *const *entry2)
+{
+	if ((*entry1)->address < (*entry2)->address)
+		return -1;
+	return ((*entry1)->address > (*entry2)->address ? 1 : 0);
+}
+
+/*
+ * Execution statistics
+ */
+
+void sieve_interpreter_count_match_value(struct sieve_interpreter *interp)
+{
+	interp->stat_match_values++;
+}
+
+static bool sieve_interpreter_get_cpu_time(struct timespec *ts_r)
+{
+	return (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, ts_r) == 0);
+}
+
+static void
+sieve_interpreter_stats_add_cpu(struct sieve_interpreter *interp,
+				const struct timespec *ts_start)
+{
+	struct timespec ts_end;
+	long long usecs;
+
+	if (!sieve_interpreter_get_cpu_time(&ts_end))
+		return;
+	usecs = (ts_end.tv_sec - ts_start->tv_sec) * 1000000LL +
+		(ts_end.tv_nsec - ts_start->tv_nsec) / 1000;
+	if (usecs > 0)
+		interp->stat_cpu_usecs += usecs;
+}
+
+static void
+sieve_interpreter_stats_finish(struct sieve_interpreter *interp,
+			       struct event_passthrough *e)
+{
+	unsigned int actions =
+		sieve_result_get_action_count(interp->runenv.result);
+
+	e->add_int("cpu_usecs", interp->stat_cpu_usecs);
+	e->add_int("operations", interp->stat_operations);
+	e->add_int("match_values", interp->stat_match_values);
+	e->add_int("actions", (actions > interp->stat_start_actions ?
+			       actions - interp->stat_start_actions : 0));
+}
+
+static void sieve_interpreter_profile_emit(struct sieve_interpreter *interp)
+{
+	ARRAY(struct sieve_interpreter_profile_entry *) entries;
+	struct sieve_interpreter_profile_entry *entry;
+	struct sieve_interpreter_profile_entry *const *entryp;
+	struct hash_iterate_context *hctx;
+	void *key;
+
+	if (!hash_table_is_created(interp->profile) ||
+	    hash_table_count(interp->profile) == 0)
+		return;
+
+	/* Emit the entries in code order, so that the debug reader can find
+	   the source lines efficiently */
+	t_array_init(&entries, hash_table_count(interp->profile));
+	hctx = hash_table_iterate_init(interp->profile);
+	while (hash_table_iterate(hctx, interp->profile, &key, &entry))
+		array_append(&entries, &entry, 1);
+	hash_table_iterate_deinit(&hctx);
+	array_sort(&entries, sieve_interpreter_profile_entry_cmp);
+
+	array_foreach(&entries, entryp) {
+		unsigned int line = 0;
+
+		entry = *entryp;
+		if (interp->dreader != NULL) {
+			line = sieve_binary_debug_read_line(interp->dreader,
+							    entry->address);
+		}
+
+		struct event_passthrough *e =
+			event_create_passthrough(interp->runenv.event)->
+			set_name("sieve_runtime_profile")->
+			add_int("address", entry->address)->
+			add_str("operation", entry->mnemonic)->
+			add_int("line", line)->
+			add_int("count", entry->count)->
+			add_int("exec_usecs", entry->nsecs / 1000);
+		e_debug(e->event(), "Profile: %08llx: %s (line %u): "
+			"executed %u times in %llu us",
+			(unsigned long long)entry->address, entry->mnemonic,
+			line, entry->count, entry->nsecs / 1000);
+	}
+
+	hash_table_clear(interp->profile, TRUE);
+}
+
+/*
+ * Allocation audit
+ */
+
+static inline size_t
+sieve_interpreter_alloc_audit_delta(size_t start, size_t end)
+{
+	/* Pools can be replaced while running */
+	return (end > start ? end - start : 0);
+}
+
+void sieve_runtime_alloc_audit(const struct sieve_runtime_env *renv,
+			       enum sieve_alloc_subsystem subsys, size_t size)
+{
+	struct sieve_alloc_audit *audit = renv->interp->alloc_audit;
+
+	if (audit == NULL)
+		return;
+
+	i_assert(subsys < SIEVE_ALLOC_SUBSYSTEM_COUNT);
+	audit->count[subsys]++;
+	audit->bytes[subsys] += size;
+}
+
+static void sieve_interpreter_alloc_audit_start(struct sieve_interpreter *interp)
+{
+	struct sieve_runtime_env *renv = &interp->runenv;
+
+	if (interp->alloc_audit == NULL)
+		return;
+
+	i_zero(interp->alloc_audit);
+	interp->alloc_audit_pool_size =
+		pool_alloconly_get_total_used_size(interp->pool);
+	interp->alloc_audit_msgctx_size =
+		sieve_message_context_get_used_size(renv->msgctx);
+	interp->alloc_audit_result_size =
+		pool_alloconly_get_total_used_size(
+			sieve_result_pool(renv->result));
+}
+
+static void
+sieve_interpreter_alloc_audit_finish(struct sieve_interpreter *interp,
+				     struct event_passthrough *e)
+{
+	struct sieve_runtime_env *renv = &interp->runenv;
+	const struct sieve_execute_env *eenv = renv->exec_env;
+	struct sieve_alloc_audit *audit = interp->alloc_audit;
+	unsigned int i;
+
+	if (audit == NULL)
+		return;
+
+	audit->bytes[SIEVE_ALLOC_INTERPRETER] +=
+		sieve_interpreter_alloc_audit_delta(
+			interp->alloc_audit_pool_size,
+			pool_alloconly_get_total_used_size(interp->pool));
+	audit->bytes[SIEVE_ALLOC_MESSAGE] +=
+		sieve_interpreter_alloc_audit_delta(
+			interp->alloc_audit_msgctx_size,
+			sieve_message_context_get_used_size(renv->msgctx));
+	audit->bytes[SIEVE_ALLOC_RESULT] +=
+		sieve_interpreter_alloc_audit_delta(
+			interp->alloc_audit_result_size,
+			pool_alloconly_get_total_used_size(
+				sieve_result_pool(renv->result)));
+
+	for (i = 0; i < SIEVE_ALLOC_SUBSYSTEM_COUNT; i++) {
+		const char *name = sieve_alloc_subsystem_name(i);
+
+		e->add_int(t_strdup_printf("alloc_%s_count", name),
+			   audit->count[i]);
+		e->add_int(t_strdup_printf("alloc_%s_bytes", name),
+			   audit->bytes[i]);
+	}
+
+	if (eenv->exec_status != NULL)
+		sieve_alloc_audit_add(&eenv->exec_status->alloc_audit, audit);
+}
+
 static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 {
 	struct sieve_operation *oprtn = &(interp->oprtn);
 	sieve_size_t *address = &(interp->runenv.pc);
+	struct timespec ts_start;
+	bool profile = FALSE;
 
 	sieve_runtime_trace_toplevel(&interp->runenv);
 
+	if (hash_table_is_created(interp->profile))
+		profile = (clock_gettime(CLOCK_MONOTONIC, &ts_start) == 0);
+
 	/* Read the operation */
 	if (sieve_operation_read(interp->runenv.sblock, address, oprtn)) {
 		const struct sieve_operation_def *op = oprtn->def;
@@ -894,6 +1205,7 @@ static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 
 		/* Reset cached command location */
 		interp->command_line = 0;
+		interp->stat_operations++;
 
 		/* Execute the operation */
 		if (op->execute != NULL) { /* Noop ? */
@@ -908,6 +1220,8 @@ static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 					    sieve_operation_mnemonic(oprtn));
 		}
 
+		if (profile)
+			sieve_interpreter_profile_add(interp, &ts_start);
 		return result;
 	}
 
@@ -917,16 +1231,57 @@ static int sieve_interpreter_operation_execute(struct sieve_interpreter *interp)
 	return SIEVE_EXEC_BIN_CORRUPT;
 }
 
+static size_t
+sieve_interpreter_get_memory_usage(struct sieve_interpreter *interp)
+{
+	struct sieve_runtime_env *renv = &interp->runenv;
+
+	/* The message context and the result are shared by all scripts
+	   executed for the message, so this covers the whole delivery so far.
+	   Variables are allocated from the interpreter pool. */
+	return (pool_alloconly_get_total_used_size(interp->pool) +
+		sieve_message_context_get_used_size(renv->msgctx) +
+		pool_alloconly_get_total_used_size(
+			sieve_result_pool(renv->result)));
+}
+
+static int sieve_interpreter_check_limits(struct sieve_interpreter *interp)
+{
+	const struct sieve_execute_env *eenv = interp->runenv.exec_env;
+	size_t max_memory = eenv->svinst->max_memory;
+	size_t memory;
+
+	interp->cpu_check_countdown = SIEVE_INTERPRETER_CPU_CHECK_INTERVAL;
+
+	if (interp->cpu_limit != NULL && cpu_limit_exceeded(interp->cpu_limit)) {
+		sieve_runtime_error(&interp->runenv, NULL,
+				    "execution exceeded CPU time limit");
+		return SIEVE_EXEC_RESOURCE_LIMIT;
+	}
+
+	if (max_memory > 0) {
+		memory = sieve_interpreter_get_memory_usage(interp);
+		interp->memory_peak = I_MAX(interp->memory_peak, memory);
+		if (memory > max_memory) {
+			sieve_runtime_error(&interp->runenv, NULL,
+					    "execution exceeded memory limit");
+			return SIEVE_EXEC_RESOURCE_LIMIT;
+		}
+	}
+	return SIEVE_EXEC_OK;
+}
+
 int sieve_interpreter_continue(struct sieve_interpreter *interp,
 			       bool *interrupted)
 {
 	const struct sieve_runtime_env *renv = &interp->runenv;
 	const struct sieve_execute_env *eenv = renv->exec_env;
-	struct cpu_limit *climit = NULL;
 	sieve_size_t *address = &(interp->runenv.pc);
 	struct sieve_instance *svinst = eenv->svinst;
 	struct sieve_exec_status *exec_status = eenv->exec_status;
 	struct sieve_resource_usage rusage;
+	struct timespec ts_cpu_start;
+	bool cpu_start_valid;
 	int ret = SIEVE_EXEC_OK;
 
 	sieve_result_ref(renv->result);
@@ -936,19 +1291,20 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 		*interrupted = FALSE;
 
 	if (svinst->max_cpu_time_secs > 0) {
-		climit = cpu_limit_init(svinst->max_cpu_time_secs,
-					CPU_LIMIT_TYPE_USER);
+		interp->cpu_limit = cpu_limit_init(svinst->max_cpu_time_secs,
+						   CPU_LIMIT_TYPE_USER);
 	}
+	interp->cpu_check_countdown = SIEVE_INTERPRETER_CPU_CHECK_INTERVAL;
+	cpu_start_valid = sieve_interpreter_get_cpu_time(&ts_cpu_start);
 
 	while (ret == SIEVE_EXEC_OK && !interp->interrupted &&
 	       *address < sieve_binary_block_get_size(renv->sblock)) {
-		if (climit != NULL && cpu_limit_exceeded(climit)) {
-			sieve_runtime_error(
-				renv, NULL,
-				"execution exceeded CPU time limit");
-			ret = SIEVE_EXEC_RESOURCE_LIMIT;
+		/* Reading the CPU time is relatively expensive, so it is only
+		   checked once in a while. All backward jumps in the program
+		   are made by loop operations, which count as well. */
+		if (--interp->cpu_check_countdown == 0 &&
+		    (ret = sieve_interpreter_check_limits(interp)) <= 0)
 			break;
-		}
 		if (interp->loop_limit != 0 && *address > interp->loop_limit) {
 			sieve_runtime_trace_error(
 				renv, "program crossed loop boundary");
@@ -959,13 +1315,24 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 		ret = sieve_interpreter_operation_execute(interp);
 	}
 
-	if (climit != NULL) {
+	if (cpu_start_valid)
+		sieve_interpreter_stats_add_cpu(interp, &ts_cpu_start);
+
+	if (interp->cpu_limit != NULL) {
 		sieve_resource_usage_init(&rusage);
 		rusage.cpu_time_msecs =
-			cpu_limit_get_usage_msecs(climit, CPU_LIMIT_TYPE_USER);
+			cpu_limit_get_usage_msecs(interp->cpu_limit,
+						  CPU_LIMIT_TYPE_USER);
 		sieve_resource_usage_add(&interp->rusage, &rusage);
 
-		cpu_limit_deinit(&climit);
+		cpu_limit_deinit(&interp->cpu_limit);
+	}
+	if (svinst->max_memory > 0) {
+		sieve_resource_usage_init(&rusage);
+		rusage.memory_bytes = I_MAX(
+			interp->memory_peak,
+			sieve_interpreter_get_memory_usage(interp));
+		sieve_resource_usage_add(&interp->rusage, &rusage);
 	}
 
 	if (ret != SIEVE_EXEC_OK) {
@@ -979,9 +1346,15 @@ int sieve_interpreter_continue(struct sieve_interpreter *interp,
 	if (!interp->interrupted) {
 		exec_status->resource_usage = interp->rusage;
 
+		T_BEGIN {
+			sieve_interpreter_profile_emit(interp);
+		} T_END;
+
 		struct event_passthrough *e =
 			event_create_passthrough(interp->runenv.event)->
 			set_name("sieve_runtime_script_finished");
+		sieve_interpreter_stats_finish(interp, e);
+		sieve_interpreter_alloc_audit_finish(interp, e);
 		switch (ret) {
 		case SIEVE_EXEC_OK:
 			break;
@@ -1031,6 +1404,24 @@ int sieve_interpreter_start(struct sieve_interpreter *interp,
 	interp->runenv.msgctx = sieve_result_get_message_context(result);
 
 	sieve_resource_usage_init(&interp->rusage);
+	interp->stat_operations = 0;
+	interp->stat_match_values = 0;
+	interp->stat_cpu_usecs = 0;
+	interp->stat_start_actions = sieve_result_get_action_count(result);
+	sieve_interpreter_alloc_audit_start(interp);
+
+	/* Have the storage fetch the parts of the message the script looks at
+	   in one go */
+	if (interp->parent == NULL && interp->runenv.msgctx != NULL) {
+		enum sieve_binary_requirements reqs =
+			sieve_binary_get_requirements(interp->runenv.sbin);
+
+		sieve_message_add_wanted_fields(
+			interp->runenv.msgctx,
+			(reqs & (SIEVE_BINARY_REQUIRE_BODY |
+				 SIEVE_BINARY_REQUIRE_MIME)) != 0,
+			sieve_binary_get_header_fields(interp->runenv.sbin));
+	}
 
 	/* Signal registered extensions that the interpreter is being run */
 	eregs = array_get_modifiable(&interp->extensions, &ext_count);
@@ -45,6 +45,14 @@ sieve_interpreter_svinst(struct sieve_interpreter *interp);
 void sieve_interpreter_set_result(struct sieve_interpreter *interp,
 				  struct sieve_result *result);
 
+/*
+ * Execution statistics
+ */
+
+/* Count one value matched against a key list (reported in the
+   sieve_runtime_script_finished event). */
+void sieve_interpreter_count_match_value(struct sieve_interpreter *interp);
+
 /*
  * Loop handling
  */
@@ -83,6 +91,17 @@ void *sieve_interpreter_loop_get_context(struct sieve_interpreter_loop *loop)
 void sieve_interpreter_loop_set_context(struct sieve_interpreter_loop *loop,
 					void *context);
 
+/*
+ * Match context pools
+ */
+
+/* Returns a pool for a match context, reusing a previously released one
+   when available. */
+pool_t sieve_interpreter_match_pool_get(struct sieve_interpreter *interp);
+/* Releases a match context pool; it is cleared and kept for reuse. */
+void sieve_interpreter_match_pool_put(struct sieve_interpreter *interp,
+				      pool_t *_pool);
+
 /*
  * Program flow
  */
@@ -153,6 +172,16 @@ int sieve_interpreter_handle_optional_operands(
 	const struct sieve_runtime_env *renv, sieve_size_t *address,
 	struct sieve_side_effects_list **list);
 
+/*
+ * Allocation audit
+ */
+
+/* Records a pool or object created by the given subsystem, with the size
+   allocated for it (if known). Does nothing unless sieve_alloc_audit is
+   enabled. */
+void sieve_runtime_alloc_audit(const struct sieve_runtime_env *renv,
+			       enum sieve_alloc_subsystem subsys, size_t size);
+
 /*
  * Code execute
  */
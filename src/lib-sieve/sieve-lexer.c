@@ -340,6 +340,102 @@ static inline int sieve_lexer_curchar(struct sieve_lexical_scanner *scanner)
 	return scanner->buffer[scanner->buffer_pos];
 }
 
+/* Fast paths for runs of characters that need no individual attention: these
+   are skipped directly in the current input buffer rather than one by one
+   through sieve_lexer_shift(). The last character in the buffer is always left
+   for sieve_lexer_shift(), which takes care of reading more input. */
+
+static inline const unsigned char *
+sieve_lexer_run_end(struct sieve_lexical_scanner *scanner)
+{
+	i_assert(scanner->buffer_size > 0);
+	return scanner->buffer + scanner->buffer_size - 1;
+}
+
+static inline void
+sieve_lexer_run_skip(struct sieve_lexical_scanner *scanner,
+		     const unsigned char *p)
+{
+	scanner->buffer_pos = p - scanner->buffer;
+}
+
+static void sieve_lexer_skip_whitespace(struct sieve_lexical_scanner *scanner)
+{
+	const unsigned char *p, *pend;
+
+	if (scanner->buffer_size == 0)
+		return;
+
+	p = scanner->buffer + scanner->buffer_pos;
+	pend = sieve_lexer_run_end(scanner);
+	while (p < pend &&
+	       (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+		if (*p == '\n')
+			scanner->current_line++;
+		p++;
+	}
+	sieve_lexer_run_skip(scanner, p);
+}
+
+static void
+sieve_lexer_skip_hash_comment_text(struct sieve_lexical_scanner *scanner)
+{
+	const unsigned char *p, *pend;
+
+	if (scanner->buffer_size == 0)
+		return;
+
+	p = scanner->buffer + scanner->buffer_pos;
+	pend = sieve_lexer_run_end(scanner);
+	while (p < pend && *p != '\n' && *p != '\0')
+		p++;
+	sieve_lexer_run_skip(scanner, p);
+}
+
+static void
+sieve_lexer_skip_bracket_comment_text(struct sieve_lexical_scanner *scanner)
+{
+	const unsigned char *p, *pend;
+
+	if (scanner->buffer_size == 0)
+		return;
+
+	p = scanner->buffer + scanner->buffer_pos;
+	pend = sieve_lexer_run_end(scanner);
+	while (p < pend && *p != '*' && *p != '\0') {
+		if (*p == '\n')
+			scanner->current_line++;
+		p++;
+	}
+	sieve_lexer_run_skip(scanner, p);
+}
+
+static void
+sieve_lexer_scan_quoted_text(struct sieve_lexical_scanner *scanner,
+			     string_t *str)
+{
+	const unsigned char *p, *poff, *pend;
+	size_t len;
+
+	if (scanner->buffer_size == 0)
+		return;
+
+	poff = p = scanner->buffer + scanner->buffer_pos;
+	pend = sieve_lexer_run_end(scanner);
+	while (p < pend && *p != '"' && *p != '\\' && *p != '\r' &&
+	       *p != '\n' && *p != '\0')
+		p++;
+
+	/* Keep at most one byte beyond the limit; the caller reports the
+	   error once the string is complete. */
+	if (str_len(str) <= SIEVE_MAX_STRING_LEN) {
+		len = I_MIN((size_t)(p - poff),
+			    SIEVE_MAX_STRING_LEN + 1 - str_len(str));
+		str_append_data(str, poff, len);
+	}
+	sieve_lexer_run_skip(scanner, p);
+}
+
 static inline const char *_char_sanitize(int ch)
 {
 	if (ch > 31 && ch < 127)
@@ -418,7 +514,11 @@ sieve_lexer_scan_hash_comment(struct sieve_lexical_scanner *scanner)
 {
 	struct sieve_lexer *lexer = &scanner->lexer;
 
-	while (sieve_lexer_curchar(scanner) != '\n') {
+	while (TRUE) {
+		sieve_lexer_skip_hash_comment_text(scanner);
+		if (sieve_lexer_curchar(scanner) == '\n')
+			break;
+
 		switch(sieve_lexer_curchar(scanner)) {
 		case -1:
 			if (!scanner->input->eof) {
@@ -493,6 +593,8 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 			sieve_lexer_shift(scanner);
 
 			while (TRUE) {
+				sieve_lexer_skip_bracket_comment_text(scanner);
+
 				switch (sieve_lexer_curchar(scanner)) {
 				case -1:
 					if (scanner->input->eof) {
@@ -547,6 +649,7 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 	case '\n':
 	case ' ':
 		sieve_lexer_shift(scanner);
+		sieve_lexer_skip_whitespace(scanner);
 
 		while (sieve_lexer_curchar(scanner) == '\t' ||
 		       sieve_lexer_curchar(scanner) == '\r' ||
@@ -554,6 +657,7 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 		       sieve_lexer_curchar(scanner) == ' ') {
 
 			sieve_lexer_shift(scanner);
+			sieve_lexer_skip_whitespace(scanner);
 		}
 
 		lexer->token_type = STT_WHITESPACE;
@@ -566,7 +670,11 @@ sieve_lexer_scan_raw_token(struct sieve_lexical_scanner *scanner)
 		str_truncate(lexer->token_str_value, 0);
 		str = lexer->token_str_value;
 
-		while (sieve_lexer_curchar(scanner) != '"') {
+		while (TRUE) {
+			sieve_lexer_scan_quoted_text(scanner, str);
+			if (sieve_lexer_curchar(scanner) == '"')
+				break;
+
 			if (sieve_lexer_curchar(scanner) == '\\')
 				sieve_lexer_shift(scanner);
 
@@ -11,6 +11,17 @@
 
 #define SIEVE_MAX_LOOP_DEPTH                            4
 
+#define SIEVE_DEFAULT_MAX_SCRIPT_COST                   0
+
+/* Weights of the static cost estimate */
+#define SIEVE_COST_COMMAND                              1
+#define SIEVE_COST_KEY                                  1
+#define SIEVE_COST_REGEX_KEY                            20
+#define SIEVE_COST_HEADER_FETCH                         5
+#define SIEVE_COST_BODY_TEST                            50
+#define SIEVE_COST_INCLUDE                              10
+#define SIEVE_COST_LOOP_FACTOR                          4
+
 /*
  * Lexer
  */
@@ -25,16 +36,32 @@
 #define SIEVE_MAX_COMMAND_ARGUMENTS                     32
 #define SIEVE_MAX_BLOCK_NESTING                         32
 #define SIEVE_MAX_TEST_NESTING                          32
+#define SIEVE_MAX_WANTED_HEADERS                        64
 
 /*
  * Runtime
  */
 
 #define SIEVE_MAX_MATCH_VALUES                          32
+#define SIEVE_MAX_MATCH_POOLS_FREE                      4
 #define SIEVE_HIGH_CPU_TIME_MSECS                       1500
 #define SIEVE_DEFAULT_MAX_CPU_TIME_SECS                 30
 #define SIEVE_DEFAULT_RESOURCE_USAGE_TIMEOUT_SECS       (60 * 60)
 
+/*
+ * Binary cache
+ */
+
+#define SIEVE_DEFAULT_BINARY_CACHE_PERIOD_SECS          0
+#define SIEVE_BINARY_CACHE_MAX_ENTRIES                  16
+
+/*
+ * Mailbox cache
+ */
+
+#define SIEVE_DEFAULT_MAILBOX_CACHE_SIZE                0
+#define SIEVE_DEFAULT_MAILBOX_CACHE_IDLE_TIMEOUT_SECS   (5 * 60)
+
 /*
  * Actions
  */
@@ -0,0 +1,166 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "module-context.h"
+#include "mail-storage.h"
+#include "mail-user.h"
+
+#include "sieve-common.h"
+#include "sieve-limits.h"
+
+#include "sieve-mailbox-cache.h"
+
+#define SIEVE_MAILBOX_CACHE_USER_CONTEXT(obj) \
+	MODULE_CONTEXT(obj, sieve_mailbox_cache_user_module)
+
+struct sieve_mailbox_cache_entry {
+	char *vname;
+	enum mailbox_flags flags;
+
+	struct mailbox *box;
+	time_t last_used;
+};
+
+struct sieve_mailbox_cache_user {
+	union mail_user_module_context module_ctx;
+
+	/* Most recently used first */
+	ARRAY(struct sieve_mailbox_cache_entry) entries;
+};
+
+static MODULE_CONTEXT_DEFINE_INIT(sieve_mailbox_cache_user_module,
+				  &mail_user_module_register);
+
+static void
+sieve_mailbox_cache_entry_free(struct sieve_mailbox_cache_entry *entry)
+{
+	mailbox_free(&entry->box);
+	i_free(entry->vname);
+}
+
+static void sieve_mailbox_cache_user_deinit(struct mail_user *user)
+{
+	struct sieve_mailbox_cache_user *cuser =
+		SIEVE_MAILBOX_CACHE_USER_CONTEXT(user);
+	struct sieve_mailbox_cache_entry *entry;
+
+	array_foreach_modifiable(&cuser->entries, entry)
+		sieve_mailbox_cache_entry_free(entry);
+	array_free(&cuser->entries);
+
+	cuser->module_ctx.super.deinit(user);
+}
+
+static struct sieve_mailbox_cache_user *
+sieve_mailbox_cache_user_get(struct mail_user *user, bool create)
+{
+	struct sieve_mailbox_cache_user *cuser =
+		SIEVE_MAILBOX_CACHE_USER_CONTEXT(user);
+	struct mail_user_vfuncs *v = user->vlast;
+
+	if (cuser != NULL || !create)
+		return cuser;
+
+	cuser = p_new(user->pool, struct sieve_mailbox_cache_user, 1);
+	i_array_init(&cuser->entries, 4);
+	cuser->module_ctx.super = *v;
+	user->vlast = &cuser->module_ctx.super;
+	v->deinit = sieve_mailbox_cache_user_deinit;
+	MODULE_CONTEXT_SET(user, sieve_mailbox_cache_user_module, cuser);
+	return cuser;
+}
+
+static void
+sieve_mailbox_cache_expire(struct sieve_instance *svinst,
+			   struct sieve_mailbox_cache_user *cuser)
+{
+	struct sieve_mailbox_cache_entry *entries;
+	unsigned int count, i;
+
+	if (svinst->mailbox_cache_idle_timeout_secs == 0)
+		return;
+
+	/* Entries are ordered by last use, so expired ones are at the end */
+	entries = array_get_modifiable(&cuser->entries, &count);
+	for (i = count; i > 0; i--) {
+		if (ioloop_time >= entries[i-1].last_used &&
+		    (ioloop_time - entries[i-1].last_used) <
+			(time_t)svinst->mailbox_cache_idle_timeout_secs)
+			break;
+		sieve_mailbox_cache_entry_free(&entries[i-1]);
+	}
+	if (i < count)
+		array_delete(&cuser->entries, i, count - i);
+}
+
+struct mailbox *
+sieve_mailbox_cache_lookup(struct sieve_instance *svinst,
+			   struct mail_user *user, const char *vname,
+			   enum mailbox_flags flags)
+{
+	struct sieve_mailbox_cache_user *cuser;
+	struct sieve_mailbox_cache_entry *entries;
+	struct mailbox *box;
+	unsigned int count, i;
+
+	if (svinst->mailbox_cache_size == 0)
+		return NULL;
+	if ((cuser = sieve_mailbox_cache_user_get(user, FALSE)) == NULL)
+		return NULL;
+
+	sieve_mailbox_cache_expire(svinst, cuser);
+
+	entries = array_get_modifiable(&cuser->entries, &count);
+	for (i = 0; i < count; i++) {
+		if (entries[i].flags == flags &&
+		    strcmp(entries[i].vname, vname) == 0)
+			break;
+	}
+	if (i == count)
+		return NULL;
+
+	/* The mailbox is handed over to the caller until it is released */
+	box = entries[i].box;
+	i_free(entries[i].vname);
+	array_delete(&cuser->entries, i, 1);
+	return box;
+}
+
+void sieve_mailbox_cache_release(struct sieve_instance *svinst,
+				 struct mail_user *user, const char *vname,
+				 enum mailbox_flags flags,
+				 struct mailbox **_box)
+{
+	struct sieve_mailbox_cache_user *cuser;
+	struct sieve_mailbox_cache_entry entry;
+	unsigned int count;
+
+	if (svinst->mailbox_cache_size == 0) {
+		mailbox_free(_box);
+		return;
+	}
+
+	cuser = sieve_mailbox_cache_user_get(user, TRUE);
+	sieve_mailbox_cache_expire(svinst, cuser);
+
+	count = array_count(&cuser->entries);
+	if (count >= svinst->mailbox_cache_size) {
+		struct sieve_mailbox_cache_entry *last =
+			array_idx_modifiable(&cuser->entries, count - 1);
+
+		sieve_mailbox_cache_entry_free(last);
+		array_delete(&cuser->entries, count - 1, 1);
+	}
+
+	i_zero(&entry);
+	entry.vname = i_strdup(vname);
+	entry.flags = flags;
+	entry.box = *_box;
+	entry.last_used = ioloop_time;
+	*_box = NULL;
+
+	array_insert(&cuser->entries, 0, &entry, 1);
+}
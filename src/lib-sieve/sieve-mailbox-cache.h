@@ -0,0 +1,26 @@
+#ifndef SIEVE_MAILBOX_CACHE_H
+#define SIEVE_MAILBOX_CACHE_H
+
+#include "sieve-common.h"
+
+/*
+ * Mailbox cache
+ */
+
+/* Mailboxes opened for storing messages can be kept open for the lifetime of
+   the mail user, so that a long-running process delivering several messages
+   for the same user (e.g. LMTP) does not need to open the target mailboxes
+   again for each delivery. At most sieve_mailbox_cache_size mailboxes are kept
+   per user; mailboxes unused for sieve_mailbox_cache_idle_timeout are closed.
+   The cache is disabled when the size is set to 0. */
+
+struct mailbox *
+sieve_mailbox_cache_lookup(struct sieve_instance *svinst,
+			   struct mail_user *user, const char *vname,
+			   enum mailbox_flags flags);
+void sieve_mailbox_cache_release(struct sieve_instance *svinst,
+				 struct mail_user *user, const char *vname,
+				 enum mailbox_flags flags,
+				 struct mailbox **_box);
+
+#endif
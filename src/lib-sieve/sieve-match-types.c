@@ -14,10 +14,12 @@
 #include "sieve-code.h"
 #include "sieve-binary.h"
 #include "sieve-comparators.h"
+#include "sieve-stringlist.h"
 #include "sieve-validator.h"
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 #include "sieve-dump.h"
+#include "sieve-match.h"
 
 #include "sieve-match-types.h"
 
@@ -339,6 +341,129 @@ void sieve_match_values_get
 	*value_r = NULL;
 }
 
+/*
+ * Binary context:
+ *   data derived from literal key lists
+ */
+
+struct mtch_key_data_entry {
+	struct sieve_match_key_data key_data;
+
+	unsigned int block_id;
+	sieve_size_t address;
+	const struct sieve_match_type_def *mcht_def;
+	const struct sieve_comparator_def *cmp_def;
+
+	bool literal:1;
+};
+
+struct mtch_binary_context {
+	HASH_TABLE(const struct mtch_key_data_entry *,
+		struct mtch_key_data_entry *) key_data;
+};
+
+static unsigned int mtch_key_data_entry_hash
+(const struct mtch_key_data_entry *entry)
+{
+	return ( entry->block_id * 0x1f1f1f1f ) ^ (unsigned int) entry->address;
+}
+
+static int mtch_key_data_entry_cmp
+(const struct mtch_key_data_entry *entry1,
+	const struct mtch_key_data_entry *entry2)
+{
+	if ( entry1->block_id != entry2->block_id )
+		return ( entry1->block_id < entry2->block_id ? -1 : 1 );
+	if ( entry1->address != entry2->address )
+		return ( entry1->address < entry2->address ? -1 : 1 );
+	if ( entry1->mcht_def != entry2->mcht_def ||
+		entry1->cmp_def != entry2->cmp_def )
+		return 1;
+	return 0;
+}
+
+static void mtch_binary_free
+(const struct sieve_extension *ext ATTR_UNUSED,
+	struct sieve_binary *sbin ATTR_UNUSED, void *context)
+{
+	struct mtch_binary_context *ctx = (struct mtch_binary_context *) context;
+	struct hash_iterate_context *iter;
+	const struct mtch_key_data_entry *key;
+	struct mtch_key_data_entry *entry;
+
+	iter = hash_table_iterate_init(ctx->key_data);
+	while ( hash_table_iterate(iter, ctx->key_data, &key, &entry) ) {
+		if ( entry->key_data.data != NULL && entry->key_data.free != NULL )
+			entry->key_data.free(entry->key_data.data);
+	}
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_destroy(&ctx->key_data);
+}
+
+const struct sieve_binary_extension mtch_binary_extension = {
+	.extension = &match_type_extension,
+	.binary_free = mtch_binary_free
+};
+
+static struct mtch_binary_context *get_binary_context
+(struct sieve_binary *sbin)
+{
+	struct sieve_instance *svinst = sieve_binary_svinst(sbin);
+	const struct sieve_extension *mcht_ext =
+		sieve_get_match_type_extension(svinst);
+	struct mtch_binary_context *ctx;
+
+	ctx = (struct mtch_binary_context *)
+		sieve_binary_extension_get_context(sbin, mcht_ext);
+	if ( ctx == NULL ) {
+		ctx = p_new(sieve_binary_pool(sbin), struct mtch_binary_context, 1);
+		hash_table_create(&ctx->key_data, default_pool, 0,
+			mtch_key_data_entry_hash, mtch_key_data_entry_cmp);
+
+		sieve_binary_extension_set
+			(sbin, mcht_ext, &mtch_binary_extension, (void *) ctx);
+	}
+
+	return ctx;
+}
+
+struct sieve_match_key_data *sieve_match_key_data_get
+(struct sieve_match_context *mctx, struct sieve_stringlist *key_list)
+{
+	struct sieve_binary_block *sblock;
+	struct sieve_binary *sbin;
+	struct mtch_binary_context *ctx;
+	struct mtch_key_data_entry lookup, *entry;
+
+	if ( key_list->address == 0 || key_list->runenv == NULL )
+		return NULL;
+
+	sblock = key_list->runenv->sblock;
+	sbin = sieve_binary_block_get_binary(sblock);
+	ctx = get_binary_context(sbin);
+
+	i_zero(&lookup);
+	lookup.block_id = sieve_binary_block_get_id(sblock);
+	lookup.address = key_list->address;
+	lookup.mcht_def = mctx->match_type->def;
+	lookup.cmp_def = mctx->comparator->def;
+
+	entry = hash_table_lookup(ctx->key_data, &lookup);
+	if ( entry == NULL ) {
+		/* First time this list is used with this binary: determine once
+		   whether it is literal and remember the outcome either way */
+		entry = p_new(sieve_binary_pool(sbin), struct mtch_key_data_entry, 1);
+		*entry = lookup;
+		entry->key_data.pool = sieve_binary_pool(sbin);
+		entry->literal = sieve_opr_stringlist_is_literal(key_list);
+
+		hash_table_insert(ctx->key_data, entry, entry);
+	}
+
+	return ( entry->literal ? &entry->key_data : NULL );
+}
+
 /*
  * Match-type tagged argument
  */
@@ -54,6 +54,10 @@ struct sieve_match_type_def {
 
 	/* Default match loop */
 
+	/* The context pool is cleared and reused for later matches once
+	   match_deinit() returns, so nothing allocated from it may be referenced
+	   afterwards. State that needs to survive across matches, like compiled
+	   keys, belongs in the key data (see sieve_match_key_data_get()). */
 	void (*match_init)(struct sieve_match_context *mctx);
 
 	int (*match_keys)
@@ -63,6 +67,12 @@ struct sieve_match_type_def {
 		(struct sieve_match_context *mctx, const char *val, size_t val_size,
 			const char *key, size_t key_size);
 
+	/* Streaming match (optional); matches a single value that is read from
+	   an input stream in chunks, without reading it into memory */
+	int (*match_keys_stream)
+		(struct sieve_match_context *mctx, struct istream *input,
+			struct sieve_stringlist *key_list);
+
 	void (*match_deinit)(struct sieve_match_context *mctx);
 };
 
@@ -152,6 +162,30 @@ void sieve_match_values_abort
 void sieve_match_values_get
 	(const struct sieve_runtime_env *renv, unsigned int index, string_t **value_r);
 
+/*
+ * Literal key data
+ */
+
+/* Match types can derive data from key lists that consist only of string
+ * literals, such as compiled expressions or lookup tables. That data is
+ * stored with the binary, so it is built only once for each loaded binary
+ * and reused by every subsequent execution.
+ */
+
+struct sieve_match_key_data {
+	/* Pool with the lifetime of the binary */
+	pool_t pool;
+
+	/* Data built by the match type; NULL until it is first built */
+	void *data;
+	/* Called for the data when the binary is freed */
+	void (*free)(void *data);
+};
+
+/* Returns NULL when the key list is not literal */
+struct sieve_match_key_data *sieve_match_key_data_get
+	(struct sieve_match_context *mctx, struct sieve_stringlist *key_list);
+
 /*
  * Match type tagged argument
  */
@@ -5,6 +5,8 @@
 #include "mempool.h"
 #include "hash.h"
 #include "array.h"
+#include "buffer.h"
+#include "istream.h"
 #include "str-sanitize.h"
 
 #include "sieve-extensions.h"
@@ -40,7 +42,7 @@ struct sieve_match_context *sieve_match_begin
 			return NULL;
 
 	/* Create match context */
-	pool = pool_alloconly_create("sieve_match_context", 1024);
+	pool = sieve_interpreter_match_pool_get(renv->interp);
 	mctx = p_new(pool, struct sieve_match_context, 1);
 	mctx->pool = pool;
 	mctx->runenv = renv;
@@ -65,14 +67,96 @@ struct sieve_match_context *sieve_match_begin
 	return mctx;
 }
 
-int sieve_match_value
+int sieve_match_keys_default
 (struct sieve_match_context *mctx, const char *value, size_t value_size,
 	struct sieve_stringlist *key_list)
 {
 	const struct sieve_match_type *mcht = mctx->match_type;
 	const struct sieve_runtime_env *renv = mctx->runenv;
+	string_t *key_item = NULL;
+	int match, ret;
+
+	i_assert( mcht->def->match_key != NULL );
+
+	match = 0;
+	while ( match == 0 &&
+		(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
+		T_BEGIN {
+			match = mcht->def->match_key
+				(mctx, value, value_size, str_c(key_item), str_len(key_item));
+
+			if ( mctx->trace ) {
+				sieve_runtime_trace(renv, 0,
+					"with key `%s' => %d", str_sanitize(str_c(key_item), 80),
+					match);
+			}
+		} T_END;
+	}
+
+	if ( ret < 0 ) {
+		mctx->exec_status = key_list->exec_status;
+		match = -1;
+	}
+
+	return match;
+}
+
+int sieve_match_stream_error
+(struct sieve_match_context *mctx, struct istream *input)
+{
+	sieve_runtime_critical(mctx->runenv, NULL,
+		"failed to read input message",
+		"read(%s) failed: %s",
+		i_stream_get_name(input),
+		i_stream_get_error(input));
+	mctx->exec_status = SIEVE_EXEC_TEMP_FAILURE;
+	return -1;
+}
+
+int sieve_match_keys_stream_default
+(struct sieve_match_context *mctx, struct istream *input,
+	struct sieve_stringlist *key_list)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+	const unsigned char *data;
+	buffer_t *buf;
+	size_t size;
 	int match, ret;
 
+	/* Read the whole value */
+	buf = buffer_create_dynamic(default_pool, 8192);
+	while ( (ret=i_stream_read_more(input, &data, &size)) > 0 ) {
+		buffer_append(buf, data, size);
+		i_stream_skip(input, size);
+	}
+	if ( ret < 0 && input->stream_errno != 0 ) {
+		buffer_free(&buf);
+		return sieve_match_stream_error(mctx, input);
+	}
+	buffer_append_c(buf, '\0');
+
+	if ( mcht->def->match_keys != NULL ) {
+		match = mcht->def->match_keys
+			(mctx, buf->data, buf->used - 1, key_list);
+	} else {
+		match = sieve_match_keys_default
+			(mctx, buf->data, buf->used - 1, key_list);
+	}
+
+	buffer_free(&buf);
+	return match;
+}
+
+int sieve_match_value
+(struct sieve_match_context *mctx, const char *value, size_t value_size,
+	struct sieve_stringlist *key_list)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	int match;
+
+	sieve_interpreter_count_match_value(renv->interp);
+
 	if ( mctx->trace ) {
 		sieve_runtime_trace(renv, 0,
 			"matching value `%s'", str_sanitize(value, 80));
@@ -91,28 +175,50 @@ int sieve_match_value
 		/* Call match-type's own key match handler */
 		match = mcht->def->match_keys(mctx, value, value_size, key_list);
 	} else {
-		string_t *key_item = NULL;
-
 		/* Default key match loop */
-		match = 0;
-		while ( match == 0 &&
-			(ret=sieve_stringlist_next_item(key_list, &key_item)) > 0 ) {
-			T_BEGIN {
-				match = mcht->def->match_key
-					(mctx, value, value_size, str_c(key_item), str_len(key_item));
-
-				if ( mctx->trace ) {
-					sieve_runtime_trace(renv, 0,
-						"with key `%s' => %d", str_sanitize(str_c(key_item), 80),
-						match);
-				}
-			} T_END;
-		}
+		match = sieve_match_keys_default(mctx, value, value_size, key_list);
+	}
 
-		if ( ret < 0 ) {
-			mctx->exec_status = key_list->exec_status;
-			match = -1;
-		}
+	sieve_runtime_trace_ascend(renv);
+
+	if ( mctx->match_status < 0 || match < 0 )
+		mctx->match_status = -1;
+	else
+		mctx->match_status =
+			( mctx->match_status > match ? mctx->match_status : match );
+	return match;
+}
+
+int sieve_match_value_stream
+(struct sieve_match_context *mctx, struct istream *input,
+	struct sieve_stringlist *key_list)
+{
+	const struct sieve_match_type *mcht = mctx->match_type;
+	const struct sieve_runtime_env *renv = mctx->runenv;
+	int match;
+
+	sieve_interpreter_count_match_value(renv->interp);
+
+	if ( mctx->trace ) {
+		sieve_runtime_trace(renv, 0,
+			"matching value read from `%s'", i_stream_get_name(input));
+	}
+
+	/* Match to key values */
+
+	sieve_stringlist_reset(key_list);
+
+	if ( mctx->trace )
+		sieve_stringlist_set_trace(key_list, TRUE);
+
+	sieve_runtime_trace_descend(renv);
+
+	if ( mcht->def->match_keys_stream != NULL ) {
+		/* Call match-type's own streaming key match handler */
+		match = mcht->def->match_keys_stream(mctx, input, key_list);
+	} else {
+		/* Read the value into memory */
+		match = sieve_match_keys_stream_default(mctx, input, key_list);
 	}
 
 	sieve_runtime_trace_ascend(renv);
@@ -137,7 +243,9 @@ int sieve_match_end(struct sieve_match_context **mctx, int *exec_status)
 	if ( exec_status != NULL )
 		*exec_status = (*mctx)->exec_status;
 
-	pool_unref(&(*mctx)->pool);
+	sieve_runtime_alloc_audit(renv, SIEVE_ALLOC_MATCH,
+		pool_alloconly_get_total_used_size((*mctx)->pool));
+	sieve_interpreter_match_pool_put(renv->interp, &(*mctx)->pool);
 
 	sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
 		"finishing match with result: %s",
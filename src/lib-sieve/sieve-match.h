@@ -37,6 +37,29 @@ int sieve_match_value
 		struct sieve_stringlist *key_list);
 int sieve_match_end(struct sieve_match_context **mctx, int *exec_status);
 
+/* Match a single value that is read from an input stream; match types that
+   have no match_keys_stream() function get the whole value read into memory
+   first */
+int sieve_match_value_stream
+	(struct sieve_match_context *mctx, struct istream *input,
+		struct sieve_stringlist *key_list);
+
+/* Default key match loop using the match type's match_key() function; match
+   types implementing match_keys() can fall back to this */
+int sieve_match_keys_default
+	(struct sieve_match_context *mctx, const char *value, size_t value_size,
+		struct sieve_stringlist *key_list);
+
+/* Default streaming key match: reads the stream into memory and matches it
+   as a normal value; match types implementing match_keys_stream() can fall
+   back to this */
+int sieve_match_keys_stream_default
+	(struct sieve_match_context *mctx, struct istream *input,
+		struct sieve_stringlist *key_list);
+/* Report a read error on the matched input stream; returns -1 */
+int sieve_match_stream_error
+	(struct sieve_match_context *mctx, struct istream *input);
+
 /* Default matching operation */
 int sieve_match
 	(const struct sieve_runtime_env *renv,
@@ -5,13 +5,19 @@
 #include "ioloop.h"
 #include "mempool.h"
 #include "array.h"
+#include "hash.h"
 #include "str.h"
 #include "str-sanitize.h"
+#include "strfuncs.h"
+#include "unichar.h"
 #include "istream.h"
 #include "time-util.h"
 #include "rfc822-parser.h"
+#include "rfc2231-parser.h"
 #include "message-date.h"
+#include "message-address.h"
 #include "message-parser.h"
+#include "message-header-parser.h"
 #include "message-decoder.h"
 #include "message-header-decode.h"
 #include "mail-html2text.h"
@@ -80,6 +86,57 @@ struct sieve_message_part {
 	bool epilogue:1;  /* this is a multipart epilogue */
 };
 
+struct sieve_message_header_values {
+	/* NULL-terminated; empty if the field is absent */
+	const char *const *values;
+};
+HASH_TABLE_DEFINE_TYPE(sieve_message_header_values,
+	const char *, struct sieve_message_header_values *);
+
+struct sieve_message_address_list {
+	/* NULL if the value contains no addresses */
+	const struct message_address *addresses;
+};
+HASH_TABLE_DEFINE_TYPE(sieve_message_address_list,
+	const char *, struct sieve_message_address_list *);
+
+struct sieve_message_date {
+	time_t time;
+	int zone_offset;
+	bool valid;
+};
+HASH_TABLE_DEFINE_TYPE(sieve_message_date,
+	const char *, struct sieve_message_date *);
+HASH_TABLE_DEFINE_TYPE(sieve_message_content_header,
+	const char *, struct sieve_message_content_header *);
+
+struct sieve_message_header_cache {
+	/* Values of the header fields looked up so far: raw [0] and decoded
+	   [1] */
+	HASH_TABLE_TYPE(sieve_message_header_values) header_values[2];
+	/* Address lists parsed from header field values, keyed by the value;
+	   these need no invalidation when the message is edited */
+	HASH_TABLE_TYPE(sieve_message_address_list) address_lists;
+	/* Dates parsed from header field values, keyed by the value */
+	HASH_TABLE_TYPE(sieve_message_date) dates;
+	/* Parsed Content-Disposition [0] and Content-Type [1] values, keyed
+	   by the value */
+	HASH_TABLE_TYPE(sieve_message_content_header) content_headers[2];
+	/* Names of the header fields present in the original message; built
+	   with a single pass over the header */
+	HASH_TABLE(const char *, void *) field_names;
+	bool field_names_failed:1;
+};
+
+struct sieve_message_cache {
+	pool_t pool;
+	int refcount;
+
+	/* Only the caches keyed by value are used here; the header values and
+	   field names belong to one particular mail object */
+	struct sieve_message_header_cache hdr_cache;
+};
+
 struct sieve_message_version {
 	struct mail *mail;
 	struct mailbox *box;
@@ -113,10 +170,27 @@ struct sieve_message_context {
 	ARRAY(struct sieve_message_part_data) return_body_parts;
 	buffer_t *raw_body;
 
+	/* Header fields */
+
+	/* Header cache private to this context; the values are cleared
+	   whenever the message is edited */
+	struct sieve_message_header_cache hdr_cache;
+
 	bool edit_snapshot:1;
 	bool substitute_snapshot:1;
+	/* The MIME structure and part headers are in cached_body_parts */
+	bool body_part_headers_cached:1;
 };
 
+/*
+ * Forward declarations
+ */
+
+static void sieve_message_header_values_deinit
+	(struct sieve_message_context *msgctx);
+static void sieve_message_header_values_clear
+	(struct sieve_message_context *msgctx);
+
 /*
  * Message versions
  */
@@ -212,6 +286,7 @@ void sieve_message_context_unref(struct sieve_message_context **msgctx)
 		mail_user_unref(&(*msgctx)->raw_mail_user);
 
 	sieve_message_context_clear(*msgctx);
+	sieve_message_header_values_deinit(*msgctx);
 
 	if ( (*msgctx)->context_pool != NULL )
 		pool_unref(&((*msgctx)->context_pool));
@@ -224,6 +299,7 @@ static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 {
 	pool_t pool;
 
+	sieve_message_header_values_deinit(msgctx);
 	if ( msgctx->context_pool != NULL )
 		pool_unref(&(msgctx->context_pool));
 
@@ -236,6 +312,7 @@ static void sieve_message_context_flush(struct sieve_message_context *msgctx)
 	p_array_init(&msgctx->cached_body_parts, pool, 8);
 	p_array_init(&msgctx->return_body_parts, pool, 8);
 	msgctx->raw_body = NULL;
+	msgctx->body_part_headers_cached = FALSE;
 }
 
 void sieve_message_context_reset(struct sieve_message_context *msgctx)
@@ -254,6 +331,13 @@ pool_t sieve_message_context_pool(struct sieve_message_context *msgctx)
 	return msgctx->context_pool;
 }
 
+size_t sieve_message_context_get_used_size
+(struct sieve_message_context *msgctx)
+{
+	return pool_alloconly_get_total_used_size(msgctx->pool) +
+		pool_alloconly_get_total_used_size(msgctx->context_pool);
+}
+
 void sieve_message_context_time(struct sieve_message_context *msgctx,
    struct timeval *time)
 {
@@ -324,6 +408,32 @@ const struct smtp_address *sieve_message_get_sender
  * Mail
  */
 
+static struct mail_user *
+sieve_message_raw_mail_user_get(struct sieve_message_context *msgctx)
+{
+	struct sieve_instance *svinst = msgctx->svinst;
+	struct mail_user *mail_user = msgctx->mail_user;
+	struct mail_storage_service_ctx *storage_service;
+	struct settings_instance *set_instance;
+
+	/* Setting up the raw storage involves a settings lookup and a full
+	   user initialization, so the raw user is kept in the instance and
+	   shared by all its message contexts. An instance serves only one
+	   user, so the raw user is created from that user's settings. The
+	   user itself is not referenced: the plugins deinitialize the
+	   instance from the user's own deinit, which would then never run. */
+	if ( svinst->raw_mail_user != NULL )
+		return svinst->raw_mail_user;
+
+	storage_service = mail_storage_service_user_get_service_ctx(
+		mail_user->service_user);
+	set_instance = mail_storage_service_user_get_settings_instance(
+		mail_user->service_user);
+	svinst->raw_mail_user =
+		raw_storage_create_from_set(storage_service, set_instance);
+	return svinst->raw_mail_user;
+}
+
 int sieve_message_substitute
 (struct sieve_message_context *msgctx, struct istream *input)
 {
@@ -334,7 +444,6 @@ int sieve_message_substitute
 		.localpart = DEFAULT_ENVELOPE_SENDER,
 		.domain = NULL,
 	};
-	struct mail_user *mail_user = msgctx->mail_user;
 	struct sieve_message_version *version;
 	struct mailbox_header_lookup_ctx *headers_ctx;
 	struct mailbox *box = NULL;
@@ -344,15 +453,16 @@ int sieve_message_substitute
 	i_assert(input->blocking);
 
 	if ( msgctx->raw_mail_user == NULL ) {
-		struct mail_storage_service_ctx *storage_service =
-			mail_storage_service_user_get_service_ctx(
-				mail_user->service_user);
-		struct settings_instance *set_instance =
-			mail_storage_service_user_get_settings_instance(mail_user->service_user);
 		msgctx->raw_mail_user =
-			raw_storage_create_from_set(storage_service, set_instance);
+			sieve_message_raw_mail_user_get(msgctx);
+		mail_user_ref(msgctx->raw_mail_user);
 	}
 
+	/* A raw mailbox is bound to the stream it is opened with, so each
+	   version needs its own. The raw mail user is shared between all
+	   versions and message contexts. Versions kept as snapshot may still
+	   be referenced by actions in the result, so they cannot be recycled
+	   either. */
 	i_stream_seek(input, 0);
 	sender = sieve_message_get_sender(msgctx);
 	sender = (sender == NULL ? &default_sender : sender);
@@ -420,6 +530,9 @@ struct edit_mail *sieve_message_edit
 
 	msgctx->edit_snapshot = FALSE;
 
+	/* The caller is about to change the header */
+	sieve_message_header_values_clear(msgctx);
+
 	return version->edit_mail;
 }
 
@@ -430,6 +543,470 @@ void sieve_message_snapshot
 	msgctx->substitute_snapshot = TRUE;
 }
 
+/*
+ * Message header values
+ */
+
+static void sieve_message_header_cache_deinit
+(struct sieve_message_header_cache *hdr_cache)
+{
+	unsigned int i;
+
+	for ( i = 0; i < N_ELEMENTS(hdr_cache->header_values); i++ ) {
+		if ( hash_table_is_created(hdr_cache->header_values[i]) )
+			hash_table_destroy(&hdr_cache->header_values[i]);
+	}
+	if ( hash_table_is_created(hdr_cache->address_lists) )
+		hash_table_destroy(&hdr_cache->address_lists);
+	if ( hash_table_is_created(hdr_cache->dates) )
+		hash_table_destroy(&hdr_cache->dates);
+	for ( i = 0; i < N_ELEMENTS(hdr_cache->content_headers); i++ ) {
+		if ( hash_table_is_created(hdr_cache->content_headers[i]) )
+			hash_table_destroy(&hdr_cache->content_headers[i]);
+	}
+	if ( hash_table_is_created(hdr_cache->field_names) )
+		hash_table_destroy(&hdr_cache->field_names);
+}
+
+static void sieve_message_header_values_deinit
+(struct sieve_message_context *msgctx)
+{
+	sieve_message_header_cache_deinit(&msgctx->hdr_cache);
+}
+
+static void sieve_message_header_values_clear
+(struct sieve_message_context *msgctx)
+{
+	struct sieve_message_header_cache *hdr_cache = &msgctx->hdr_cache;
+	unsigned int i;
+
+	/* Values handed out earlier stay allocated until the context is
+	   flushed */
+	for ( i = 0; i < N_ELEMENTS(hdr_cache->header_values); i++ ) {
+		if ( hash_table_is_created(hdr_cache->header_values[i]) )
+			hash_table_clear(hdr_cache->header_values[i], TRUE);
+	}
+}
+
+/* Returns the header cache applicable to the given mail along with the pool
+   its contents are allocated from. Data read from a mail object stays in the
+   private cache, since other deliveries use a different mail object that may
+   carry recipient-specific headers. Only data that depends on nothing but a
+   value (mail is NULL) comes from the shared cache. */
+static struct sieve_message_header_cache *sieve_message_header_cache_get
+(struct sieve_message_context *msgctx, struct mail *mail, pool_t *pool_r)
+{
+	struct sieve_message_cache *cache = msgctx->msgdata->cache;
+
+	if ( cache != NULL && mail == NULL ) {
+		*pool_r = cache->pool;
+		return &cache->hdr_cache;
+	}
+
+	*pool_r = msgctx->context_pool;
+	return &msgctx->hdr_cache;
+}
+
+static int sieve_message_header_index_build
+(struct sieve_message_header_cache *hdr_cache, pool_t pool,
+	struct mail *mail)
+{
+	struct message_header_parser_ctx *hparser;
+	struct message_header_line *hdr;
+	struct istream *input;
+	int ret;
+
+	if ( mail_get_hdr_stream(mail, NULL, &input) < 0 )
+		return -1;
+
+	hash_table_create(&hdr_cache->field_names,
+		pool, 0, strcase_hash, strcasecmp);
+
+	hparser = message_parse_header_init(input, NULL, 0);
+	while ( (ret=message_parse_header_next(hparser, &hdr)) > 0 ) {
+		if ( hdr->continued || hdr->eoh )
+			continue;
+		if ( hash_table_lookup(hdr_cache->field_names, hdr->name) == NULL ) {
+			hash_table_insert(hdr_cache->field_names,
+				p_strdup(pool, hdr->name), POINTER_CAST(1));
+		}
+	}
+	message_parse_header_deinit(&hparser);
+
+	if ( input->stream_errno != 0 ) {
+		hash_table_destroy(&hdr_cache->field_names);
+		return -1;
+	}
+	return 0;
+}
+
+int sieve_message_header_is_present
+(struct sieve_message_context *msgctx, const char *field_name)
+{
+	struct sieve_message_header_cache *hdr_cache;
+	struct mail *mail = sieve_message_get_mail(msgctx);
+	pool_t pool;
+
+	/* Edited versions of the message are not indexed */
+	if ( mail == NULL || mail != msgctx->msgdata->mail )
+		return -1;
+
+	hdr_cache = sieve_message_header_cache_get(msgctx, mail, &pool);
+	if ( hdr_cache->field_names_failed )
+		return -1;
+	if ( !hash_table_is_created(hdr_cache->field_names) &&
+		sieve_message_header_index_build(hdr_cache, pool, mail) < 0 ) {
+		/* Let the regular lookups find out what is wrong */
+		hdr_cache->field_names_failed = TRUE;
+		return -1;
+	}
+
+	return ( hash_table_lookup(hdr_cache->field_names, field_name) != NULL ?
+		1 : 0 );
+}
+
+void sieve_message_add_wanted_fields
+(struct sieve_message_context *msgctx, bool body, const char *const *headers)
+{
+	struct mailbox_header_lookup_ctx *headers_ctx = NULL;
+	enum mail_fetch_field fields = 0;
+	struct mail *mail;
+
+	if ( body )
+		fields |= MAIL_FETCH_STREAM_HEADER | MAIL_FETCH_STREAM_BODY;
+	if ( headers != NULL && headers[0] == NULL )
+		headers = NULL;
+	if ( fields == 0 && headers == NULL )
+		return;
+	if ( (mail=sieve_message_get_mail(msgctx)) == NULL )
+		return;
+
+	if ( headers != NULL )
+		headers_ctx = mailbox_header_lookup_init(mail->box, headers);
+	mail_add_temp_wanted_fields(mail, fields, headers_ctx);
+	if ( headers_ctx != NULL )
+		mailbox_header_lookup_unref(&headers_ctx);
+}
+
+/* Returns TRUE when decoding the header field value to UTF-8 could change it,
+   i.e. when it contains something that looks like the start of a MIME
+   encoded-word or it is not valid UTF-8. Most values pass this check, which
+   is much cheaper than the decoder. */
+static bool
+sieve_message_header_value_needs_decode(const unsigned char *value,
+	size_t value_len)
+{
+	const unsigned char *p = value, *pend = value + value_len;
+
+	while ( p < pend &&
+		(p = memchr(p, '=', pend - p)) != NULL ) {
+		if ( p + 1 < pend && p[1] == '?' )
+			return TRUE;
+		p++;
+	}
+	return !uni_utf8_data_is_valid(value, value_len);
+}
+
+/* Unfolds the raw header field value the way mail_get_headers_utf8() does:
+   each line break is replaced by a single space, together with the folding
+   whitespace that follows it. Returns the value itself when it is not
+   folded. */
+static const char *
+sieve_message_header_value_unfold(pool_t pool, const char *value,
+	size_t *value_len)
+{
+	const char *p = memchr(value, '\n', *value_len);
+	const char *pend = value + *value_len;
+	string_t *str;
+
+	if ( p == NULL )
+		return value;
+
+	str = str_new(pool, *value_len);
+	for ( p = value; p < pend; p++ ) {
+		if ( *p == '\n' ) {
+			str_append_c(str, ' ');
+			if ( p + 1 < pend && (p[1] == ' ' || p[1] == '\t') )
+				p++;
+		} else if ( *p != '\r' ) {
+			str_append_c(str, *p);
+		}
+	}
+	*value_len = str_len(str);
+	return str_c(str);
+}
+
+/* Returns the values of the header field like mail_get_headers() or (when
+   mime_decode is TRUE) mail_get_headers_utf8(). Each field is fetched and
+   decoded only once for each version of the message. */
+static int sieve_message_get_header_values
+(struct sieve_message_context *msgctx, struct mail *mail,
+	const char *field_name, bool mime_decode,
+	const char *const **values_r)
+{
+	struct sieve_message_header_cache *hdr_cache;
+	struct sieve_message_header_values *hvalues;
+	const char *const *values;
+	unsigned int idx = ( mime_decode ? 1 : 0 );
+	pool_t pool;
+	int ret;
+
+	hdr_cache = sieve_message_header_cache_get(msgctx, mail, &pool);
+
+	if ( !hash_table_is_created(hdr_cache->header_values[idx]) ) {
+		hash_table_create(&hdr_cache->header_values[idx],
+			pool, 0, strcase_hash, strcasecmp);
+	} else {
+		hvalues = hash_table_lookup
+			(hdr_cache->header_values[idx], field_name);
+		if ( hvalues != NULL ) {
+			*values_r = hvalues->values;
+			return ( hvalues->values[0] == NULL ? 0 : 1 );
+		}
+	}
+
+	if ( mail == msgctx->msgdata->mail &&
+		sieve_message_header_is_present(msgctx, field_name) == 0 ) {
+		/* Known to be absent; no need to fetch anything */
+		values = NULL;
+		ret = 0;
+	} else if ( mime_decode ) {
+		/* Decode from the raw values, which are cached as well; values
+		   are unfolded and only those that need it go through the
+		   decoder, the others are shared with the raw cache */
+		ret = sieve_message_get_header_values(msgctx, mail, field_name,
+			FALSE, &values);
+	} else {
+		ret = mail_get_headers(mail, field_name, &values);
+	}
+	if ( ret < 0 )
+		return -1;
+
+	hvalues = p_new(pool, struct sieve_message_header_values, 1);
+	if ( ret == 0 || values == NULL ) {
+		hvalues->values = p_new(pool, const char *, 1);
+	} else if ( mime_decode ) {
+		unsigned int count = str_array_length(values), i;
+		const char **dvalues = p_new(pool, const char *, count + 1);
+
+		for ( i = 0; i < count; i++ ) {
+			size_t len = strlen(values[i]);
+			const char *value =
+				sieve_message_header_value_unfold(pool, values[i], &len);
+
+			if ( !sieve_message_header_value_needs_decode
+				((const unsigned char *)value, len) ) {
+				dvalues[i] = value;
+				continue;
+			}
+			T_BEGIN {
+				string_t *str = t_str_new(len + 32);
+
+				message_header_decode_utf8
+					((const unsigned char *)value, len, str, NULL);
+				dvalues[i] = p_strdup(pool, str_c(str));
+			} T_END;
+		}
+		hvalues->values = dvalues;
+	} else {
+		hvalues->values = (const char *const *)p_strarray_dup(pool, values);
+	}
+	hash_table_insert(hdr_cache->header_values[idx],
+		p_strdup(pool, field_name), hvalues);
+
+	*values_r = hvalues->values;
+	return ( hvalues->values[0] == NULL ? 0 : 1 );
+}
+
+const struct message_address *sieve_message_parse_addresses
+(struct sieve_message_context *msgctx, const char *value,
+	size_t value_len)
+{
+	struct sieve_message_header_cache *hdr_cache;
+	struct sieve_message_address_list *alist;
+	pool_t pool;
+
+	/* Values with NUL characters cannot serve as a key */
+	if ( memchr(value, '\0', value_len) != NULL ) {
+		return message_address_parse(pool_datastack_create(),
+			(const unsigned char *)value, value_len, 256, 0);
+	}
+
+	/* Address lists only depend on the value, so the shared cache is
+	   used for any version of the message */
+	hdr_cache = sieve_message_header_cache_get(msgctx, NULL, &pool);
+
+	if ( !hash_table_is_created(hdr_cache->address_lists) ) {
+		hash_table_create(&hdr_cache->address_lists,
+			pool, 0, str_hash, strcmp);
+	} else {
+		alist = hash_table_lookup(hdr_cache->address_lists, value);
+		if ( alist != NULL )
+			return alist->addresses;
+	}
+
+	alist = p_new(pool, struct sieve_message_address_list, 1);
+	alist->addresses = message_address_parse(pool,
+		(const unsigned char *)value, value_len, 256, 0);
+	hash_table_insert(hdr_cache->address_lists,
+		p_strndup(pool, value, value_len), alist);
+	return alist->addresses;
+}
+
+bool sieve_message_parse_date
+(struct sieve_message_context *msgctx, const char *value,
+	time_t *time_r, int *zone_offset_r)
+{
+	struct sieve_message_header_cache *hdr_cache;
+	struct sieve_message_date *date;
+	pool_t pool;
+
+	/* Like address lists, dates only depend on the value */
+	hdr_cache = sieve_message_header_cache_get(msgctx, NULL, &pool);
+
+	if ( !hash_table_is_created(hdr_cache->dates) ) {
+		hash_table_create(&hdr_cache->dates,
+			pool, 0, str_hash, strcmp);
+		date = NULL;
+	} else {
+		date = hash_table_lookup(hdr_cache->dates, value);
+	}
+
+	if ( date == NULL ) {
+		date = p_new(pool, struct sieve_message_date, 1);
+		date->valid = message_date_parse((const unsigned char *)value,
+			strlen(value), &date->time, &date->zone_offset);
+		hash_table_insert(hdr_cache->dates, p_strdup(pool, value), date);
+	}
+
+	if ( !date->valid )
+		return FALSE;
+	*time_r = date->time;
+	*zone_offset_r = date->zone_offset;
+	return TRUE;
+}
+
+/* Uses data stack memory for intermediate results; the caller decides about
+   the frame, since the result may be allocated from the data stack, too. */
+static void sieve_message_content_header_parse
+(pool_t pool, bool content_type, const char *value, size_t value_len,
+	struct sieve_message_content_header *chdr)
+{
+	struct rfc822_parser_context parser;
+	const char *const *params;
+	string_t *content;
+	int ret;
+
+	i_zero(chdr);
+
+	rfc822_parser_init(&parser,
+		(const unsigned char *)value, value_len, NULL);
+	(void)rfc822_skip_lwsp(&parser);
+
+	/* Parse content type/disposition */
+	content = t_str_new(64);
+	if ( content_type )
+		ret = rfc822_parse_content_type(&parser, content);
+	else
+		ret = rfc822_parse_mime_token(&parser, content);
+
+	/* The value must end here, or be followed by parameters */
+	if ( ret >= 0 ) {
+		(void)rfc822_skip_lwsp(&parser);
+		if ( parser.data != parser.end && *parser.data != ';' )
+			ret = -1;
+	}
+
+	if ( ret >= 0 ) {
+		chdr->content = p_strdup(pool, str_c(content));
+		rfc2231_parse(&parser, &params);
+		chdr->params = (const char *const *)
+			p_strarray_dup(pool, params);
+	}
+}
+
+bool sieve_message_parse_content_header
+(struct sieve_message_context *msgctx, bool content_type,
+	const char *value, size_t value_len,
+	const struct sieve_message_content_header **chdr_r)
+{
+	struct sieve_message_header_cache *hdr_cache;
+	struct sieve_message_content_header *chdr;
+	unsigned int idx = ( content_type ? 1 : 0 );
+	pool_t pool;
+
+	/* Values with NUL characters cannot serve as a key */
+	if ( memchr(value, '\0', value_len) != NULL ) {
+		chdr = t_new(struct sieve_message_content_header, 1);
+		sieve_message_content_header_parse(pool_datastack_create(),
+			content_type, value, value_len, chdr);
+		*chdr_r = chdr;
+		return ( chdr->content != NULL );
+	}
+
+	/* Like address lists, these only depend on the value */
+	hdr_cache = sieve_message_header_cache_get(msgctx, NULL, &pool);
+
+	if ( !hash_table_is_created(hdr_cache->content_headers[idx]) ) {
+		hash_table_create(&hdr_cache->content_headers[idx],
+			pool, 0, str_hash, strcmp);
+		chdr = NULL;
+	} else {
+		chdr = hash_table_lookup(hdr_cache->content_headers[idx], value);
+	}
+
+	if ( chdr == NULL ) {
+		chdr = p_new(pool, struct sieve_message_content_header, 1);
+		T_BEGIN {
+			sieve_message_content_header_parse(pool, content_type,
+				value, value_len, chdr);
+		} T_END;
+		hash_table_insert(hdr_cache->content_headers[idx],
+			p_strndup(pool, value, value_len), chdr);
+	}
+
+	*chdr_r = chdr;
+	return ( chdr->content != NULL );
+}
+
+/*
+ * Shared message cache
+ */
+
+struct sieve_message_cache *sieve_message_cache_create(void)
+{
+	struct sieve_message_cache *cache;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_message_cache", 4096);
+	cache = p_new(pool, struct sieve_message_cache, 1);
+	cache->pool = pool;
+	cache->refcount = 1;
+
+	return cache;
+}
+
+void sieve_message_cache_ref(struct sieve_message_cache *cache)
+{
+	cache->refcount++;
+}
+
+void sieve_message_cache_unref(struct sieve_message_cache **_cache)
+{
+	struct sieve_message_cache *cache = *_cache;
+
+	*_cache = NULL;
+	if ( cache == NULL )
+		return;
+
+	i_assert(cache->refcount > 0);
+	if ( --cache->refcount != 0 )
+		return;
+
+	sieve_message_header_cache_deinit(&cache->hdr_cache);
+	pool_unref(&cache->pool);
+}
+
 /*
  * Message header list
  */
@@ -443,6 +1020,10 @@ static int sieve_message_header_list_next_value
 	(struct sieve_stringlist *_strlist, string_t **value_r);
 static void sieve_message_header_list_reset
 	(struct sieve_stringlist *_strlist);
+static int sieve_message_header_list_get_length
+	(struct sieve_stringlist *_strlist);
+static int sieve_message_header_list_skip_items
+	(struct sieve_stringlist *_strlist, unsigned int count);
 
 /* String list object */
 
@@ -470,6 +1051,10 @@ struct sieve_header_list *sieve_message_header_list_create
 	hdrlist->hdrlist.strlist.exec_status = SIEVE_EXEC_OK;
 	hdrlist->hdrlist.strlist.next_item = sieve_message_header_list_next_value;
 	hdrlist->hdrlist.strlist.reset = sieve_message_header_list_reset;
+	hdrlist->hdrlist.strlist.get_length =
+		sieve_message_header_list_get_length;
+	hdrlist->hdrlist.strlist.skip_items =
+		sieve_message_header_list_skip_items;
 	hdrlist->hdrlist.next_item = sieve_message_header_list_next_item;
 	hdrlist->field_names = field_names;
 	hdrlist->mime_decode = mime_decode;
@@ -484,33 +1069,29 @@ static inline string_t *_header_right_trim(const char *raw)
 	const char *p, *pend;
 
 	pend = raw + strlen(raw);
-	if (raw == pend) {
-		result = t_str_new(1);
-	} else {
-		for ( p = pend-1; p >= raw; p-- ) {
-			if ( *p != ' ' && *p != '\t' ) break;
-		}
-		result = t_str_new(p - raw + 1);
-		str_append_data(result, raw, p - raw + 1);
+	for ( p = pend; p > raw; p-- ) {
+		if ( p[-1] != ' ' && p[-1] != '\t' ) break;
 	}
+
+	if ( p == pend ) {
+		/* Nothing to trim; refer to the cached header value directly */
+		return t_str_new_const(raw, pend - raw);
+	}
+
+	result = t_str_new(p - raw + 1);
+	str_append_data(result, raw, p - raw);
 	return result;
 }
 
 /* String list implementation */
 
-static int sieve_message_header_list_next_item
-(struct sieve_header_list *_hdrlist, const char **name_r,
-	string_t **value_r)
+static int sieve_message_header_list_fetch
+(struct sieve_message_header_list *hdrlist)
 {
-	struct sieve_message_header_list *hdrlist =
-		(struct sieve_message_header_list *) _hdrlist;
+	struct sieve_header_list *_hdrlist = &hdrlist->hdrlist;
 	const struct sieve_runtime_env *renv = _hdrlist->strlist.runenv;
 	struct mail *mail = sieve_message_get_mail(renv->msgctx);
 
-	if ( name_r != NULL )
-		*name_r = NULL;
-	*value_r = NULL;
-
 	/* Check for end of current header list */
 	if ( hdrlist->headers == NULL ) {
 		hdrlist->headers_index = 0;
@@ -538,13 +1119,8 @@ static int sieve_message_header_list_next_item
 		}
 
 		/* Fetch all matching headers from the e-mail */
-		if ( hdrlist->mime_decode ) {
-			ret = mail_get_headers_utf8(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		} else {
-			ret = mail_get_headers(mail,
-				str_c(hdr_item), &hdrlist->headers);
-		}
+		ret = sieve_message_get_header_values(renv->msgctx, mail,
+			str_c(hdr_item), hdrlist->mime_decode, &hdrlist->headers);
 
 		if (ret < 0) {
 			_hdrlist->strlist.exec_status =
@@ -558,6 +1134,23 @@ static int sieve_message_header_list_next_item
 			hdrlist->headers = NULL;
 		}
 	}
+	return 1;
+}
+
+static int sieve_message_header_list_next_item
+(struct sieve_header_list *_hdrlist, const char **name_r,
+	string_t **value_r)
+{
+	struct sieve_message_header_list *hdrlist =
+		(struct sieve_message_header_list *) _hdrlist;
+	int ret;
+
+	if ( name_r != NULL )
+		*name_r = NULL;
+	*value_r = NULL;
+
+	if ( (ret=sieve_message_header_list_fetch(hdrlist)) <= 0 )
+		return ret;
 
 	/* Return next item */
 	if ( name_r != NULL )
@@ -587,6 +1180,66 @@ static void sieve_message_header_list_reset
 	sieve_stringlist_reset(hdrlist->field_names);
 }
 
+static int sieve_message_header_list_get_length
+(struct sieve_stringlist *_strlist)
+{
+	struct sieve_message_header_list *hdrlist =
+		(struct sieve_message_header_list *) _strlist;
+	const struct sieve_runtime_env *renv = _strlist->runenv;
+	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	string_t *hdr_item = NULL;
+	int count = 0, ret;
+
+	/* Count the header values without trimming or copying them */
+	sieve_message_header_list_reset(_strlist);
+	while ( (ret=sieve_stringlist_next_item
+		(hdrlist->field_names, &hdr_item)) > 0 ) {
+		const char *const *headers;
+
+		if ( _strlist->trace ) {
+			sieve_runtime_trace(renv, 0,
+				"counting `%s' headers in message",
+				str_sanitize(str_c(hdr_item), 80));
+		}
+
+		ret = sieve_message_get_header_values(renv->msgctx, mail,
+			str_c(hdr_item), hdrlist->mime_decode, &headers);
+		if ( ret < 0 ) {
+			_strlist->exec_status =
+				sieve_runtime_mail_error(renv, mail,
+					"failed to read header field `%s'", str_c(hdr_item));
+			break;
+		}
+		if ( ret > 0 )
+			count += str_array_length(headers);
+	}
+	sieve_message_header_list_reset(_strlist);
+
+	return ( ret < 0 ? -1 : count );
+}
+
+static int sieve_message_header_list_skip_items
+(struct sieve_stringlist *_strlist, unsigned int count)
+{
+	struct sieve_message_header_list *hdrlist =
+		(struct sieve_message_header_list *) _strlist;
+	int ret;
+
+	/* Step through the cached header values directly, without creating
+	   a string for each of them */
+	while ( count > 0 ) {
+		if ( (ret=sieve_message_header_list_fetch(hdrlist)) <= 0 )
+			return ret;
+
+		while ( count > 0 &&
+			hdrlist->headers[hdrlist->headers_index] != NULL ) {
+			hdrlist->headers_index++;
+			count--;
+		}
+	}
+	return 1;
+}
+
 /*
  * Header override operand
  */
@@ -910,6 +1563,14 @@ ATTR_NULL(1)
 	return FALSE;
 }
 
+static inline bool _is_cached_part
+(const struct sieve_message_part *body_part, bool extract_text)
+{
+	return ( extract_text ?
+		body_part->text_body != NULL :
+		body_part->decoded_body != NULL );
+}
+
 static bool sieve_message_body_get_return_parts
 (const struct sieve_runtime_env *renv,
 	const char * const *wanted_types,
@@ -1074,7 +1735,9 @@ _parse_content_disposition(const struct message_header_line *hdr)
 }
 
 /* sieve_message_parts_add_missing():
- *   Add requested message body parts to the cache that are missing.
+ *   Add requested message body parts to the cache that are missing. With
+ *   iter_all, only the MIME structure and the part headers are collected;
+ *   the part bodies are skipped without decoding them.
  */
 static int sieve_message_parts_add_missing
 (const struct sieve_runtime_env *renv,
@@ -1102,6 +1765,10 @@ static int sieve_message_parts_add_missing
 	string_t *hdr_content = NULL;
 
 	/* First check whether any are missing */
+	if ( iter_all && msgctx->body_part_headers_cached ) {
+		/* Cache hit; structure and headers are present */
+		return SIEVE_EXEC_OK;
+	}
 	if ( !iter_all && sieve_message_body_get_return_parts
 		(renv, content_types, extract_text) ) {
 		/* Cache hit; all are present */
@@ -1186,8 +1853,10 @@ static int sieve_message_parts_add_missing
 				body_part->content_type = epipart->content_type;
 				body_part->have_body = TRUE;
 				body_part->epilogue = TRUE;
-				save_body = iter_all || _is_wanted_content_type
-					(content_types, body_part->content_type);
+				save_body = !iter_all &&
+					!_is_cached_part(body_part, extract_text) &&
+					_is_wanted_content_type
+						(content_types, body_part->content_type);
 
 			} else {
 				struct sieve_message_part *parent = NULL;
@@ -1221,7 +1890,7 @@ static int sieve_message_parts_add_missing
 			/* If this is message/rfc822 content, retain the enveloping part for
 			 * storing headers as content.
 			 */
-			if ( message_rfc822 ) {
+			if ( message_rfc822 && !iter_all ) {
 				i_assert(idx > 0);
 				body_part_idx = array_idx_modifiable
 					(&msgctx->cached_body_parts, idx-1);
@@ -1257,9 +1926,14 @@ static int sieve_message_parts_add_missing
 					header_part = NULL;
 				}
 
-				/* Save bodies only if we have a wanted content-type */
-				save_body = iter_all || _is_wanted_content_type
-					(content_types, body_part->content_type);
+				/* Save bodies only if we have a wanted content-type that
+				 * is not cached yet; parts decoded or converted to text
+				 * by an earlier body test are not processed again.
+				 */
+				save_body = !iter_all &&
+					!_is_cached_part(body_part, extract_text) &&
+					_is_wanted_content_type
+						(content_types, body_part->content_type);
 				continue;
 			}
 
@@ -1320,8 +1994,12 @@ static int sieve_message_parts_add_missing
 	
 				/* Decode MIME encoded-words. */
 				str_truncate(hdr_content, 0);
-				message_header_decode_utf8
-					(value, vlen, hdr_content, NULL);
+				if ( sieve_message_header_value_needs_decode(value, vlen) ) {
+					message_header_decode_utf8
+						(value, vlen, hdr_content, NULL);
+				} else {
+					str_append_data(hdr_content, value, vlen);
+				}
 				if ( vlen != str_len(hdr_content) ||
 					strncmp(str_c(hdr_content), (const char *)value,
 						vlen) != 0 ) {
@@ -1420,6 +2098,8 @@ static int sieve_message_parts_add_missing
 			i_stream_get_error(input));
 		return SIEVE_EXEC_TEMP_FAILURE;
 	}
+	if ( iter_all )
+		msgctx->body_part_headers_cached = TRUE;
 	return SIEVE_EXEC_OK;
 }
 
@@ -1555,6 +2235,42 @@ int sieve_message_body_get_raw
 	return SIEVE_EXEC_OK;
 }
 
+int sieve_message_body_get_raw_stream
+(const struct sieve_runtime_env *renv, struct istream **input_r)
+{
+	struct mail *mail = sieve_message_get_mail(renv->msgctx);
+	struct istream *input;
+	struct message_size hdr_size, body_size;
+
+	*input_r = NULL;
+
+	/* Get stream for message */
+	if ( mail_get_stream(mail, &hdr_size, &body_size, &input) < 0 ) {
+		return sieve_runtime_mail_error(renv, mail,
+			"failed to open input message");
+	}
+
+	/* Limit it to the body */
+	input = i_stream_create_range
+		(input, hdr_size.physical_size, (uoff_t)-1);
+	if ( !i_stream_have_bytes_left(input) ) {
+		if ( input->stream_errno != 0 ) {
+			sieve_runtime_critical(renv, NULL,
+				"failed to read input message",
+				"read(%s) failed: %s",
+				i_stream_get_name(input),
+				i_stream_get_error(input));
+			i_stream_unref(&input);
+			return SIEVE_EXEC_TEMP_FAILURE;
+		}
+		i_stream_unref(&input);
+		return SIEVE_EXEC_OK;
+	}
+
+	*input_r = input;
+	return SIEVE_EXEC_OK;
+}
+
 /*
  * Message part iterator
  */
@@ -1672,6 +2388,37 @@ void sieve_message_part_iter_reset
 	iter->index = iter->offset;
 }
 
+int sieve_message_part_iter_get_data
+(struct sieve_message_part_iter *iter,
+	struct sieve_message_part_data *data, bool text)
+{
+	const struct sieve_runtime_env *renv = iter->renv;
+	struct sieve_message_part *mpart;
+	int status;
+
+	mpart = sieve_message_part_iter_current(iter);
+	i_assert( mpart != NULL );
+
+	T_BEGIN {
+		/* Add the bodies of all parts to the cache */
+		status = sieve_message_parts_add_missing
+			(renv, NULL, text, FALSE);
+	} T_END;
+
+	/* Check status */
+	if ( status <= 0 )
+		return status;
+
+	sieve_message_part_get_data(mpart, data, text);
+
+	/* Parts without a body are not checked for the cache */
+	if ( data->content == NULL ) {
+		data->content = "";
+		data->size = 0;
+	}
+	return SIEVE_EXEC_OK;
+}
+
 /*
  * MIME header list
  */
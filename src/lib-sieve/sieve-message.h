@@ -11,6 +11,22 @@
 
 const char *sieve_message_get_new_id(const struct sieve_instance *svinst);
 
+/*
+ * Shared message cache
+ */
+
+/* Data derived from header field values that can be shared between the
+   message contexts of several deliveries of the same message (e.g. to
+   multiple recipients of one LMTP transaction): parsed addresses, dates and
+   content headers. The header values themselves are read from each
+   delivery's own mail object. */
+
+struct sieve_message_cache;
+
+struct sieve_message_cache *sieve_message_cache_create(void);
+void sieve_message_cache_ref(struct sieve_message_cache *cache);
+void sieve_message_cache_unref(struct sieve_message_cache **_cache);
+
 /*
  * Message context
  */
@@ -27,6 +43,8 @@ void sieve_message_context_reset(struct sieve_message_context *msgctx);
 
 pool_t sieve_message_context_pool
 	(struct sieve_message_context *msgctx) ATTR_PURE;
+size_t sieve_message_context_get_used_size
+	(struct sieve_message_context *msgctx);
 void sieve_message_context_time(struct sieve_message_context *msgctx,
 	struct timeval *time);
 
@@ -192,6 +210,45 @@ int sieve_message_get_header_fields
 		ARRAY_TYPE(sieve_message_override) *svmos,
 		bool mime_decode, struct sieve_stringlist **fields_r);
 
+/* Returns 1 if the header field occurs in the current message, 0 if it is
+   absent and -1 when this cannot be determined cheaply (e.g. because the
+   message was edited). The field names are indexed once per message. */
+int sieve_message_header_is_present
+	(struct sieve_message_context *msgctx, const char *field_name);
+
+/* Lets the mail storage fetch the listed header fields and (when body is
+   TRUE) the full message stream up front */
+void sieve_message_add_wanted_fields
+	(struct sieve_message_context *msgctx, bool body,
+		const char *const *headers) ATTR_NULL(3);
+
+/* Parses an address header field value; the result is cached in the message
+   context, so each distinct value is only parsed once */
+const struct message_address *sieve_message_parse_addresses
+	(struct sieve_message_context *msgctx, const char *value,
+		size_t value_len);
+/* Parses a date-time value (RFC 2822); the result is cached like for
+   sieve_message_parse_addresses() */
+bool sieve_message_parse_date
+	(struct sieve_message_context *msgctx, const char *value,
+		time_t *time_r, int *zone_offset_r);
+
+struct sieve_message_content_header {
+	/* "type/subtype" for Content-Type, the disposition type for
+	   Content-Disposition; NULL if the value is invalid */
+	const char *content;
+	/* Parameter names and values as returned by rfc2231_parse() */
+	const char *const *params;
+};
+
+/* Parses a Content-Type (content_type=TRUE) or Content-Disposition header
+   field value; the result is cached like for sieve_message_parse_addresses().
+   Returns FALSE if the value is invalid. */
+bool sieve_message_parse_content_header
+	(struct sieve_message_context *msgctx, bool content_type,
+		const char *value, size_t value_len,
+		const struct sieve_message_content_header **chdr_r);
+
 /*
  * Message part
  */
@@ -240,6 +297,10 @@ int sieve_message_body_get_text
 int sieve_message_body_get_raw
 	(const struct sieve_runtime_env *renv,
 		struct sieve_message_part_data **parts_r);
+/* Returns a stream for the raw body, which is read directly from the message
+   rather than being cached; *input_r is NULL when the body is empty */
+int sieve_message_body_get_raw_stream
+	(const struct sieve_runtime_env *renv, struct istream **input_r);
 
 /*
  * Message part iterator
@@ -267,6 +328,12 @@ struct sieve_message_part *sieve_message_part_iter_next
 void sieve_message_part_iter_reset
 (struct sieve_message_part_iter *iter);
 
+/* The iterator only provides the MIME structure and the part headers; this
+   loads the part bodies on demand */
+int sieve_message_part_iter_get_data
+(struct sieve_message_part_iter *iter,
+	struct sieve_message_part_data *data, bool text);
+
 /*
  * MIME header list
  */
@@ -45,6 +45,8 @@ struct sieve_result_action {
 	struct sieve_action action;
 
 	struct sieve_side_effects_list *seffects;
+	/* Execution of this action by the result execution (if any) */
+	struct sieve_action_execution *aexec;
 
 	struct sieve_result_action *prev, *next;
 };
@@ -216,6 +218,11 @@ unsigned int sieve_result_get_exec_seq(struct sieve_result *result)
 	return result->exec_seq;
 }
 
+unsigned int sieve_result_get_action_count(struct sieve_result *result)
+{
+	return result->action_count;
+}
+
 /*
  * Extension support
  */
@@ -643,8 +650,6 @@ _sieve_result_add_action(const struct sieve_runtime_env *renv,
 	} else {
 		raction->action.mail = NULL;
 	}
-
-	sieve_result_init_action_event(result, &raction->action, !keep);
 	return 0;
 }
 
@@ -1056,10 +1061,19 @@ static void
 sieve_action_execution_pre(struct sieve_result_execution *rexec,
 			   struct sieve_action_execution *aexec)
 {
+	struct sieve_action *act = &aexec->action->action;
+
 	if (aexec->ehandler == NULL)
 		aexec->ehandler = rexec->ehandler;
-	rexec->action_env.action = &aexec->action->action;
-	rexec->action_env.event = aexec->action->action.event;
+
+	/* The action event is only created once the action is actually
+	   executed, so that actions that are canceled or merged before that
+	   never create one. It lasts for all execution rounds. */
+	sieve_result_init_action_event(rexec->action_env.result, act,
+				       !act->keep);
+
+	rexec->action_env.action = act;
+	rexec->action_env.event = act->event;
 	rexec->action_env.ehandler = aexec->ehandler;
 }
 
@@ -1373,6 +1387,7 @@ sieve_result_action_abort(struct sieve_result_execution *rexec,
 	    aexec->state < SIEVE_ACTION_EXECUTION_STATE_FINALIZED)
 		sieve_result_action_rollback(rexec, aexec);
 	DLLIST2_REMOVE(&rexec->actions_head, &rexec->actions_tail, aexec);
+	aexec->action->aexec = NULL;
 }
 
 static void
@@ -1381,16 +1396,11 @@ sieve_action_execution_update(struct sieve_result_execution *rexec,
 {
 	const struct sieve_action_exec_env *aenv = &rexec->action_env;
 	struct sieve_result *result = aenv->result;
-	struct sieve_result_action *rac;
-
-	rac = result->actions_head;
-	while (rac != NULL) {
-		if (aexec->action == rac)
-			break;
-		rac = rac->next;
-	}
+	struct sieve_result_action *rac = aexec->action;
 
-	if (rac == NULL) {
+	/* Detached actions are unlinked from the list (see
+	   sieve_result_action_detach()) */
+	if (rac->prev == NULL && result->actions_head != rac) {
 		/* Action was removed; abort it. */
 		sieve_result_action_abort(rexec, aexec);
 		return;
@@ -1413,15 +1423,12 @@ sieve_result_execution_add_action(struct sieve_result_execution *rexec,
 {
 	struct sieve_action_execution *aexec;
 
-	aexec = rexec->actions_head;
-	while (aexec != NULL) {
-		if (aexec->action == rac)
-			return;
-		aexec = aexec->next;
-	}
+	if (rac->aexec != NULL)
+		return;
 
 	aexec = p_new(rexec->pool, struct sieve_action_execution, 1);
 	aexec->action = rac;
+	rac->aexec = aexec;
 	aexec->exec_seq = rac->action.exec_seq;
 	aexec->ehandler = rexec->ehandler;
 
@@ -1460,12 +1467,19 @@ sieve_result_execution_create(struct sieve_result *result, pool_t pool)
 void sieve_result_execution_destroy(struct sieve_result_execution **_rexec)
 {
 	struct sieve_result_execution *rexec = *_rexec;
+	struct sieve_action_execution *aexec;
 
 	*_rexec = NULL;
 
 	if (rexec == NULL)
 		return;
 
+	aexec = rexec->actions_head;
+	while (aexec != NULL) {
+		aexec->action->aexec = NULL;
+		aexec = aexec->next;
+	}
+
 	rexec->action_env.result->exec = NULL;
 	sieve_result_unref(&rexec->action_env.result);
 	pool_unref(&rexec->pool);
@@ -1937,6 +1951,7 @@ int sieve_result_execute(struct sieve_result_execution *rexec, int status,
 	const struct sieve_action_exec_env *aenv = &rexec->action_env;
 	struct sieve_result *result = aenv->result;
 	int result_status, ret;
+	bool have_actions;
 
 	e_debug(rexec->event, "Executing result (status=%s, commit=%s)",
 		sieve_execution_exitcode_to_str(status),
@@ -1954,11 +1969,16 @@ int sieve_result_execute(struct sieve_result_execution *rexec, int status,
 
 	sieve_result_execution_update(rexec);
 
+	/* A result without any actions (e.g. only an implicit keep, possibly
+	   with implicit side effects) has nothing to start, execute, commit or
+	   finish, so the transaction phases are skipped entirely. */
+	have_actions = (rexec->actions_head != NULL);
+
 	/* Transaction start and execute */
 
 	if (status != SIEVE_EXEC_OK) {
 		sieve_result_execute_update_status(rexec, status);
-	} else if (rexec->status == SIEVE_EXEC_OK) {
+	} else if (rexec->status == SIEVE_EXEC_OK && have_actions) {
 		/* Transaction start */
 
 		status = sieve_result_transaction_start(rexec);
@@ -1997,8 +2017,11 @@ int sieve_result_execute(struct sieve_result_execution *rexec, int status,
 
 	/* Transaction commit/rollback */
 
-	status = sieve_result_transaction_commit_or_rollback(rexec, status);
-	sieve_result_execute_update_status(rexec, status);
+	if (have_actions) {
+		status = sieve_result_transaction_commit_or_rollback(
+			rexec, status);
+		sieve_result_execute_update_status(rexec, status);
+	}
 
 	/* Commit implicit keep if necessary */
 
@@ -2030,7 +2053,8 @@ int sieve_result_execute(struct sieve_result_execution *rexec, int status,
 
 	/* Finish execution */
 
-	sieve_result_transaction_finish(rexec, rexec->status);
+	if (have_actions)
+		sieve_result_transaction_finish(rexec, rexec->status);
 
 	sieve_action_execution_post(rexec);
 	rexec->ehandler = NULL;
@@ -2122,6 +2146,9 @@ void sieve_result_iterate_delete(struct sieve_result_iterate_context *rictx)
 	else
 		rac->next->prev = rac->prev;
 
+	rac->next = NULL;
+	rac->prev = NULL;
+
 	sieve_result_action_deinit(rac);
 
 	/* Skip to next action in iteration */
@@ -38,6 +38,7 @@ sieve_result_get_message_data(struct sieve_result *result);
 struct sieve_message_context *
 sieve_result_get_message_context(struct sieve_result *result);
 unsigned int sieve_result_get_exec_seq(struct sieve_result *result);
+unsigned int sieve_result_get_action_count(struct sieve_result *result);
 
 /*
  * Extension support
@@ -50,29 +50,35 @@ static inline void _trace_line_print_empty
  */
 
 void _sieve_runtime_trace_error
-(const struct sieve_runtime_env *renv, const char *fmt, va_list args)
+(const struct sieve_runtime_env *renv, const char *fmt, ...)
 {
 	string_t *trline = _trace_line_new(renv, renv->pc, 0);
+	va_list args;
 
 	str_printfa(trline, "%s: #ERROR#: ", sieve_operation_mnemonic(renv->oprtn));
+	va_start(args, fmt);
 	str_vprintfa(trline, fmt, args);
+	va_end(args);
 
 	_trace_line_print(trline, renv);
 }
 
 void _sieve_runtime_trace_operand_error
 (const struct sieve_runtime_env *renv, const struct sieve_operand *oprnd,
-	const char *fmt, va_list args)
+	const char *fmt, ...)
 {
 	string_t *trline = _trace_line_new(renv, oprnd->address,
 		sieve_runtime_get_source_location(renv, oprnd->address));
+	va_list args;
 
 	str_printfa(trline, "%s: #ERROR#: ", sieve_operation_mnemonic(renv->oprtn));
 
 	if ( oprnd->field_name != NULL )
 		str_printfa(trline, "%s: ", oprnd->field_name);
 
+	va_start(args, fmt);
 	str_vprintfa(trline, fmt, args);
+	va_end(args);
 
 	_trace_line_print(trline, renv);
 }
@@ -103,21 +109,29 @@ static inline void ATTR_FORMAT(4, 5) _sieve_runtime_trace_printf
 	va_end(args);
 }
 
-void ATTR_FORMAT(2, 0) _sieve_runtime_trace
-(const struct sieve_runtime_env *renv, const char *fmt, va_list args)
+void _sieve_runtime_trace
+(const struct sieve_runtime_env *renv, const char *fmt, ...)
 {
+	va_list args;
+
+	va_start(args, fmt);
 	_sieve_runtime_trace_vprintf
 		(renv, renv->oprtn->address, sieve_runtime_get_command_location(renv),
 			fmt, args);
+	va_end(args);
 }
 
 void _sieve_runtime_trace_address
 (const struct sieve_runtime_env *renv, sieve_size_t address,
-	const char *fmt, va_list args)
+	const char *fmt, ...)
 {
+	va_list args;
+
+	va_start(args, fmt);
 	_sieve_runtime_trace_vprintf
 		(renv, address, sieve_runtime_get_source_location(renv, address), fmt,
 			args);
+	va_end(args);
 }
 
 /*
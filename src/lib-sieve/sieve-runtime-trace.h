@@ -50,107 +50,56 @@ static inline void sieve_runtime_trace_toplevel
 
 /* Trace errors */
 
-void _sieve_runtime_trace_error
-	(const struct sieve_runtime_env *renv, const char *fmt, va_list args)
-		ATTR_FORMAT(2, 0);
+/* The trace macros below check whether tracing is active before anything
+   else; when it is not, the arguments are not even evaluated. */
 
-void _sieve_runtime_trace_operand_error
-	(const struct sieve_runtime_env *renv, const struct sieve_operand *oprnd,
-		const char *fmt, va_list args) ATTR_FORMAT(3, 0);
-
-static inline void sieve_runtime_trace_error
+void _sieve_runtime_trace_error
 	(const struct sieve_runtime_env *renv, const char *fmt, ...)
 		ATTR_FORMAT(2, 3);
 
-static inline void sieve_runtime_trace_operand_error
+void _sieve_runtime_trace_operand_error
 	(const struct sieve_runtime_env *renv, const struct sieve_operand *oprnd,
 		const char *fmt, ...) ATTR_FORMAT(3, 4);
 
-static inline void ATTR_FORMAT(2, 3) sieve_runtime_trace_error
-	(const struct sieve_runtime_env *renv, const char *fmt, ...)
-{
-	va_list args;
-
-	va_start(args, fmt);
-	if ( renv->trace != NULL )
-		_sieve_runtime_trace_error(renv, fmt, args);
-	va_end(args);
-}
-
-static inline void ATTR_FORMAT(3, 4) sieve_runtime_trace_operand_error
-	(const struct sieve_runtime_env *renv, const struct sieve_operand *oprnd,
-		const char *fmt, ...)
-{
-	va_list args;
+#define sieve_runtime_trace_error(renv, ...) \
+	STMT_START { \
+		if ( (renv)->trace != NULL ) \
+			_sieve_runtime_trace_error(renv, __VA_ARGS__); \
+	} STMT_END
 
-	va_start(args, fmt);
-	if ( renv->trace != NULL )
-		_sieve_runtime_trace_operand_error(renv, oprnd, fmt, args);
-	va_end(args);
-}
+#define sieve_runtime_trace_operand_error(renv, oprnd, ...) \
+	STMT_START { \
+		if ( (renv)->trace != NULL ) \
+			_sieve_runtime_trace_operand_error(renv, oprnd, __VA_ARGS__); \
+	} STMT_END
 
 /* Trace info */
 
 void _sieve_runtime_trace
-	(const struct sieve_runtime_env *renv, const char *fmt, va_list args)
-		ATTR_FORMAT(2, 0);
-
-static inline void sieve_runtime_trace
-	(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-		const char *fmt, ...) ATTR_FORMAT(3, 4);
-
-static inline void ATTR_FORMAT(3, 4) sieve_runtime_trace
-(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-	const char *fmt, ...)
-{
-	va_list args;
-
-	va_start(args, fmt);
-
-	if ( renv->trace != NULL && trace_level <= renv->trace->config.level ) {
-		_sieve_runtime_trace(renv, fmt, args);
-	}
-
-	va_end(args);
-}
+	(const struct sieve_runtime_env *renv, const char *fmt, ...)
+		ATTR_FORMAT(2, 3);
 
 void _sieve_runtime_trace_address
 	(const struct sieve_runtime_env *renv, sieve_size_t address,
-		const char *fmt, va_list args) ATTR_FORMAT(3, 0);
-
-static inline void sieve_runtime_trace_address
-	(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-		sieve_size_t address, const char *fmt, ...) ATTR_FORMAT(4, 5);
-
-static inline void ATTR_FORMAT(4, 5) sieve_runtime_trace_address
-(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-	sieve_size_t address, const char *fmt, ...)
-{
-	va_list args;
-
-	va_start(args, fmt);
-
-	if ( renv->trace != NULL && trace_level <= renv->trace->config.level ) {
-		_sieve_runtime_trace_address(renv, address, fmt, args);
-	}
-
-	va_end(args);
-}
-
-static inline void ATTR_FORMAT(3, 4) sieve_runtime_trace_here
-(const struct sieve_runtime_env *renv, sieve_trace_level_t trace_level,
-	const char *fmt, ...)
-{
-	va_list args;
-
-	va_start(args, fmt);
-
-	if ( renv->trace != NULL && trace_level <= renv->trace->config.level ) {
-		_sieve_runtime_trace_address(renv, renv->pc, fmt, args);
-	}
+		const char *fmt, ...) ATTR_FORMAT(3, 4);
 
-	va_end(args);
-}
+#define sieve_runtime_trace(renv, trace_level, ...) \
+	STMT_START { \
+		if ( sieve_runtime_trace_active(renv, trace_level) ) \
+			_sieve_runtime_trace(renv, __VA_ARGS__); \
+	} STMT_END
+
+#define sieve_runtime_trace_address(renv, trace_level, address, ...) \
+	STMT_START { \
+		if ( sieve_runtime_trace_active(renv, trace_level) ) \
+			_sieve_runtime_trace_address(renv, address, __VA_ARGS__); \
+	} STMT_END
+
+#define sieve_runtime_trace_here(renv, trace_level, ...) \
+	STMT_START { \
+		if ( sieve_runtime_trace_active(renv, trace_level) ) \
+			_sieve_runtime_trace_address(renv, (renv)->pc, __VA_ARGS__); \
+	} STMT_END
 
 /* Trace boundaries */
 
@@ -62,6 +62,9 @@ int sieve_script_check(struct sieve_instance *svinst, const char *location,
 struct sieve_script *
 sieve_data_script_create_from_input(struct sieve_instance *svinst,
 				    const char *name, struct istream *input);
+/* Drop the script's input once it is compiled and its binary is kept for
+   later use. Only the name and location of the script remain available. */
+void sieve_data_script_release_input(struct sieve_script *script);
 
 /*
  * Binary
@@ -206,6 +206,11 @@ void sieve_settings_load(struct sieve_instance *svinst)
 					 &size_setting))
 		svinst->max_script_size = size_setting;
 
+	svinst->max_script_cost = SIEVE_DEFAULT_MAX_SCRIPT_COST;
+	if (sieve_setting_get_uint_value(svinst, "sieve_max_script_cost",
+					 &uint_setting))
+		svinst->max_script_cost = (unsigned int)uint_setting;
+
 	svinst->max_actions = SIEVE_DEFAULT_MAX_ACTIONS;
 	if (sieve_setting_get_uint_value(svinst, "sieve_max_actions",
 					 &uint_setting))
@@ -226,6 +231,10 @@ void sieve_settings_load(struct sieve_instance *svinst)
 		else
 			svinst->max_cpu_time_secs = (unsigned int)period;
 	}
+	svinst->max_memory = 0;
+	if (sieve_setting_get_size_value(svinst, "sieve_max_memory",
+					 &size_setting))
+		svinst->max_memory = size_setting;
 	svinst->resource_usage_timeout_secs =
 		SIEVE_DEFAULT_RESOURCE_USAGE_TIMEOUT_SECS;
 	if (sieve_setting_get_duration_value(
@@ -238,6 +247,59 @@ void sieve_settings_load(struct sieve_instance *svinst)
 		}
 	}
 
+	svinst->resource_usage_warn_percent = 0;
+	if (sieve_setting_get_uint_value(
+		svinst, "sieve_resource_usage_warn_percent", &uint_setting)) {
+		if (uint_setting >= 100) {
+			e_warning(svinst->event, "sieve_resource_usage_warn_percent "
+				  "must be below 100 (setting ignored)");
+		} else {
+			svinst->resource_usage_warn_percent =
+				(unsigned int)uint_setting;
+		}
+	}
+
+	svinst->binary_cache_period_secs =
+		SIEVE_DEFAULT_BINARY_CACHE_PERIOD_SECS;
+	if (sieve_setting_get_duration_value(
+		svinst, "sieve_binary_cache_period", &period)) {
+		if (period > UINT_MAX)
+			svinst->binary_cache_period_secs = UINT_MAX;
+		else {
+			svinst->binary_cache_period_secs =
+				(unsigned int)period;
+		}
+	}
+
+	svinst->mailbox_cache_size = SIEVE_DEFAULT_MAILBOX_CACHE_SIZE;
+	if (sieve_setting_get_uint_value(svinst, "sieve_mailbox_cache_size",
+					 &uint_setting)) {
+		if (uint_setting > UINT_MAX)
+			svinst->mailbox_cache_size = UINT_MAX;
+		else
+			svinst->mailbox_cache_size = (unsigned int)uint_setting;
+	}
+
+	svinst->mailbox_cache_idle_timeout_secs =
+		SIEVE_DEFAULT_MAILBOX_CACHE_IDLE_TIMEOUT_SECS;
+	if (sieve_setting_get_duration_value(
+		svinst, "sieve_mailbox_cache_idle_timeout", &period)) {
+		if (period > UINT_MAX)
+			svinst->mailbox_cache_idle_timeout_secs = UINT_MAX;
+		else {
+			svinst->mailbox_cache_idle_timeout_secs =
+				(unsigned int)period;
+		}
+	}
+
+	svinst->runtime_profile = FALSE;
+	(void)sieve_setting_get_bool_value(svinst, "sieve_runtime_profile",
+					   &svinst->runtime_profile);
+
+	svinst->alloc_audit = FALSE;
+	(void)sieve_setting_get_bool_value(svinst, "sieve_alloc_audit",
+					   &svinst->alloc_audit);
+
 	(void)sieve_address_source_parse_from_setting(
 		svinst,	svinst->pool, "sieve_redirect_envelope_from",
 		&svinst->redirect_from);
@@ -253,6 +315,10 @@ void sieve_settings_load(struct sieve_instance *svinst)
 		}
 	}
 
+	svinst->redirect_batch = FALSE;
+	(void)sieve_setting_get_bool_value(svinst, "sieve_redirect_batch",
+					   &svinst->redirect_batch);
+
 	str_setting = sieve_setting_get(svinst, "sieve_user_email");
 	if (str_setting != NULL && *str_setting != '\0') {
 		struct smtp_address *address;
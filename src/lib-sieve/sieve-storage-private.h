@@ -128,6 +128,10 @@ sieve_storage_alloc(struct sieve_instance *svinst, struct event *event,
 		    const struct sieve_storage *storage_class, const char *data,
 		    enum sieve_storage_flags flags, bool main) ATTR_NULL(2, 4);
 
+/* Assigns a binary directory below the sieve_storage_bindir setting when the
+   location specifies none. Meant for storages that cannot put binaries next
+   to their scripts. */
+void sieve_storage_set_default_bindir(struct sieve_storage *storage);
 int sieve_storage_setup_bindir(struct sieve_storage *storage, mode_t mode);
 
 /*
@@ -8,6 +8,8 @@
 #include "eacces-error.h"
 #include "mkdir-parents.h"
 #include "ioloop.h"
+#include "md5.h"
+#include "hex-binary.h"
 
 #include "sieve-common.h"
 #include "sieve-settings.h"
@@ -251,6 +253,44 @@ sieve_storage_data_parse(struct sieve_storage *storage, const char *data,
 	return 0;
 }
 
+void sieve_storage_set_default_bindir(struct sieve_storage *storage)
+{
+	struct sieve_instance *svinst = storage->svinst;
+	unsigned char digest[MD5_RESULTLEN];
+	const char *bin_dir;
+
+	if (storage->bin_dir != NULL)
+		return;
+
+	bin_dir = sieve_setting_get(svinst, "sieve_storage_bindir");
+	if (bin_dir == NULL || *bin_dir == '\0')
+		return;
+
+	if (bin_dir[0] == '~') {
+		/* home-relative path. change to absolute. */
+		const char *home = sieve_environment_get_homedir(svinst);
+
+		if (home != NULL) {
+			bin_dir = home_expand_tilde(bin_dir, home);
+		} else if (bin_dir[1] == '/' || bin_dir[1] == '\0') {
+			e_error(storage->event,
+				"sieve_storage_bindir is relative to "
+				"home directory (~/), but home directory "
+				"cannot be determined");
+			return;
+		}
+	}
+
+	/* Each location gets a directory of its own, so that binaries of
+	   equally named scripts from different locations never collide */
+	md5_get_digest(storage->location, strlen(storage->location), digest);
+	storage->bin_dir = p_strconcat(storage->pool, bin_dir, "/",
+				       binary_to_hex(digest, sizeof(digest)),
+				       NULL);
+
+	e_debug(storage->event, "Using binary directory %s", storage->bin_dir);
+}
+
 struct event *
 sieve_storage_event_create(struct sieve_instance *svinst,
 			   const struct sieve_storage *storage_class)
@@ -1443,6 +1483,11 @@ const char *sieve_storage_location(const struct sieve_storage *storage)
 	return storage->location;
 }
 
+const char *sieve_storage_driver_name(const struct sieve_storage *storage)
+{
+	return storage->driver_name;
+}
+
 bool sieve_storage_is_default(const struct sieve_storage *storage)
 {
 	return storage->is_default;
@@ -155,6 +155,8 @@ int sieve_storage_quota_havespace(struct sieve_storage *storage,
 
 const char *sieve_storage_location(const struct sieve_storage *storage)
 	ATTR_PURE;
+const char *sieve_storage_driver_name(const struct sieve_storage *storage)
+	ATTR_PURE;
 bool sieve_storage_is_default(const struct sieve_storage *storage) ATTR_PURE;
 
 int sieve_storage_is_singular(struct sieve_storage *storage);
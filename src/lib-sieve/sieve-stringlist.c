@@ -61,6 +61,22 @@ int sieve_stringlist_get_length
 	return strlist->get_length(strlist);
 }
 
+int sieve_stringlist_skip_items
+(struct sieve_stringlist *strlist, unsigned int count)
+{
+	string_t *item;
+	int ret;
+
+	if ( strlist->skip_items != NULL )
+		return strlist->skip_items(strlist, count);
+
+	for ( ; count > 0; count-- ) {
+		if ( (ret=sieve_stringlist_next_item(strlist, &item)) <= 0 )
+			return ret;
+	}
+	return 1;
+}
+
 /*
  * Single Stringlist
  */
@@ -219,17 +235,19 @@ static int sieve_index_stringlist_next_item
 	}
 
 	i_assert(index > 0);
-	while ( index > 0 ) {
-		if ( (ret=sieve_stringlist_next_item(strlist->source, str_r)) <= 0 ) {
-			if (ret < 0)
-				_strlist->exec_status = strlist->source->exec_status;
-			return ret;
-		}
-	
-		index--;
-	}
-		
 	strlist->end = TRUE;
+
+	/* Skip to the requested item, which the source may do without
+	   retrieving the items before it */
+	if ( (ret=sieve_stringlist_skip_items
+		(strlist->source, (unsigned int)(index - 1))) > 0 )
+		ret = sieve_stringlist_next_item(strlist->source, str_r);
+	if ( ret <= 0 ) {
+		*str_r = NULL;
+		if (ret < 0)
+			_strlist->exec_status = strlist->source->exec_status;
+		return ret;
+	}
 	return 1;
 }
 
@@ -12,6 +12,8 @@ struct sieve_stringlist {
 		(struct sieve_stringlist *strlist);
 	int (*get_length)
 		(struct sieve_stringlist *strlist);
+	int (*skip_items)
+		(struct sieve_stringlist *strlist, unsigned int count);
 
 	int (*read_all)
 		(struct sieve_stringlist *strlist, pool_t pool,
@@ -23,6 +25,10 @@ struct sieve_stringlist {
 	const struct sieve_runtime_env *runenv;
 	int exec_status;
 
+	/* Address of the operand this list was read from, or 0 when the list
+	   was not read directly from the binary */
+	sieve_size_t address;
+
 	bool trace:1;
 };
 
@@ -50,6 +56,11 @@ static inline void sieve_stringlist_reset
 int sieve_stringlist_get_length
 	(struct sieve_stringlist *strlist);
 
+/* Skips the next count items. Returns 1 when all were skipped, 0 when the end
+   of the list was reached first and -1 on error. */
+int sieve_stringlist_skip_items
+	(struct sieve_stringlist *strlist, unsigned int count);
+
 int sieve_stringlist_read_all
 	(struct sieve_stringlist *strlist, pool_t pool,
 		const char * const **list_r);
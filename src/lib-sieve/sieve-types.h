@@ -20,6 +20,7 @@ struct sieve_script;
 struct sieve_binary;
 
 struct sieve_message_data;
+struct sieve_message_cache;
 struct sieve_script_env;
 struct sieve_exec_status;
 struct sieve_trace_log;
@@ -145,6 +146,9 @@ struct sieve_message_data {
 		const struct smtp_address *rcpt_to;
 		const struct smtp_params_rcpt *rcpt_params;
 	} envelope;
+
+	/* Optional cache shared with other deliveries of the same message */
+	struct sieve_message_cache *cache;
 };
 
 /*
@@ -281,6 +285,66 @@ struct sieve_resource_usage {
 	/* The total amount of system + user CPU time consumed while executing
 	   the Sieve script. */
 	unsigned int cpu_time_msecs;
+	/* The peak amount of memory allocated for the message context, the
+	   result and the interpreter while executing the Sieve script. */
+	size_t memory_bytes;
+};
+
+/*
+ * Allocation audit
+ */
+
+enum sieve_alloc_subsystem {
+	SIEVE_ALLOC_INTERPRETER = 0,
+	SIEVE_ALLOC_MATCH,
+	SIEVE_ALLOC_MESSAGE,
+	SIEVE_ALLOC_RESULT,
+	SIEVE_ALLOC_STRINGLIST,
+
+	SIEVE_ALLOC_SUBSYSTEM_COUNT
+};
+
+struct sieve_alloc_audit {
+	/* The number of pools and objects that were created for each subsystem
+	   while executing the Sieve script and the number of bytes allocated
+	   from them. Only recorded when sieve_alloc_audit is enabled. */
+	unsigned int count[SIEVE_ALLOC_SUBSYSTEM_COUNT];
+	uoff_t bytes[SIEVE_ALLOC_SUBSYSTEM_COUNT];
+};
+
+/*
+ * Delivery timing
+ */
+
+enum sieve_delivery_timing_phase {
+	/* Finding and opening the scripts in their storages */
+	SIEVE_DELIVERY_TIMING_FIND_SCRIPTS = 0,
+	/* Loading or compiling the script binaries */
+	SIEVE_DELIVERY_TIMING_COMPILE,
+	/* Running the scripts, including parsing the message as needed and
+	   starting the actions */
+	SIEVE_DELIVERY_TIMING_EXECUTE,
+	/* Committing the actions at the end of the sequence */
+	SIEVE_DELIVERY_TIMING_COMMIT,
+
+	SIEVE_DELIVERY_TIMING_PHASE_COUNT
+};
+
+struct sieve_delivery_timing {
+	/* Wall-clock time spent in each phase (monotonic, in microseconds) */
+	uint64_t usecs[SIEVE_DELIVERY_TIMING_PHASE_COUNT];
+
+	/* The script that took the longest to compile and execute */
+	char *slowest_script;
+	uint64_t slowest_script_usecs;
+	/* The script the last phase was attributed to */
+	char *cur_script;
+	uint64_t cur_script_usecs;
+
+	/* Currently running phase */
+	enum sieve_delivery_timing_phase phase;
+	uint64_t phase_start;
+	bool running:1;
 };
 
 /*
@@ -291,6 +355,7 @@ struct sieve_exec_status {
 	struct mail_storage *last_storage;
 
 	struct sieve_resource_usage resource_usage;
+	struct sieve_alloc_audit alloc_audit;
 
 	bool message_saved:1;
 	bool message_forwarded:1;
@@ -10,6 +10,7 @@
 #include "hash.h"
 
 #include "sieve-common.h"
+#include "sieve-limits.h"
 #include "sieve-extensions.h"
 #include "sieve-script.h"
 #include "sieve-ast.h"
@@ -1568,9 +1569,123 @@ sieve_validate_block(struct sieve_validator *valdtr,
 	return result && !fatal;
 }
 
+/*
+ * Cost estimate
+ */
+
+/* A rough static estimate of how expensive a script is to execute, made up
+   of the number of commands and tests and the number of keys they compare,
+   weighted by what they need to retrieve from the message. Everything within
+   a foreverypart loop is weighted by the loop factor for each level of
+   nesting. */
+
+static bool
+sieve_validator_cost_is_header_test(const char *identifier)
+{
+	return (strcasecmp(identifier, "header") == 0 ||
+		strcasecmp(identifier, "address") == 0 ||
+		strcasecmp(identifier, "exists") == 0 ||
+		strcasecmp(identifier, "envelope") == 0 ||
+		strcasecmp(identifier, "date") == 0);
+}
+
+static unsigned int
+sieve_validator_cost_node(struct sieve_ast_node *node, unsigned int weight)
+{
+	struct sieve_ast_argument *arg;
+	struct sieve_ast_node *child;
+	unsigned int cost = SIEVE_COST_COMMAND, keys = 0, total;
+	bool regex = FALSE;
+
+	if (node->identifier != NULL) {
+		if (sieve_validator_cost_is_header_test(node->identifier))
+			cost += SIEVE_COST_HEADER_FETCH;
+		else if (strcasecmp(node->identifier, "body") == 0)
+			cost += SIEVE_COST_BODY_TEST;
+		else if (strcasecmp(node->identifier, "include") == 0)
+			cost += SIEVE_COST_INCLUDE;
+		else if (strcasecmp(node->identifier, "foreverypart") == 0)
+			weight *= SIEVE_COST_LOOP_FACTOR;
+	}
+
+	/* The last string (list) argument is normally the key list */
+	arg = sieve_ast_argument_first(node);
+	while (arg != NULL) {
+		switch (sieve_ast_argument_type(arg)) {
+		case SAAT_TAG:
+			if (strcasecmp(sieve_ast_argument_tag(arg),
+				       "regex") == 0)
+				regex = TRUE;
+			break;
+		case SAAT_STRING:
+			keys = 1;
+			break;
+		case SAAT_STRING_LIST:
+			keys = sieve_ast_strlist_count(arg);
+			break;
+		default:
+			break;
+		}
+		arg = sieve_ast_argument_next(arg);
+	}
+	cost += keys * (regex ? SIEVE_COST_REGEX_KEY : SIEVE_COST_KEY);
+
+	total = cost * weight;
+	child = sieve_ast_test_first(node);
+	while (child != NULL) {
+		total += sieve_validator_cost_node(child, weight);
+		child = sieve_ast_test_next(child);
+	}
+	child = sieve_ast_command_first(node);
+	while (child != NULL) {
+		total += sieve_validator_cost_node(child, weight);
+		child = sieve_ast_command_next(child);
+	}
+	return total;
+}
+
+unsigned int sieve_validator_estimate_cost(struct sieve_validator *valdtr)
+{
+	struct sieve_ast_node *root = sieve_ast_root(valdtr->ast);
+	struct sieve_ast_node *cmd;
+	unsigned int total = 0;
+
+	cmd = sieve_ast_command_first(root);
+	while (cmd != NULL) {
+		total += sieve_validator_cost_node(cmd, 1);
+		cmd = sieve_ast_command_next(cmd);
+	}
+	return total;
+}
+
+static bool sieve_validator_check_cost(struct sieve_validator *valdtr)
+{
+	struct sieve_instance *svinst = valdtr->svinst;
+	unsigned int cost;
+
+	cost = sieve_validator_estimate_cost(valdtr);
+	e_debug(svinst->event, "Script `%s': estimated cost %u",
+		sieve_script_name(valdtr->script), cost);
+	sieve_ast_cost_set(valdtr->ast, cost);
+
+	/* Only scripts uploaded by the user are held to the limit, so that
+	   existing scripts keep working when it is lowered */
+	if ((valdtr->flags & SIEVE_COMPILE_FLAG_UPLOADED) == 0 ||
+	    svinst->max_script_cost == 0 || cost <= svinst->max_script_cost)
+		return TRUE;
+
+	sieve_validator_error(valdtr, 0,
+		"script is too complex: estimated cost %u exceeds the limit "
+		"of %u (simplify the tests or reduce the number of keys)",
+		cost, svinst->max_script_cost);
+	return FALSE;
+}
+
 bool sieve_validator_run(struct sieve_validator *valdtr)
 {
-	return sieve_validate_block(valdtr, sieve_ast_root(valdtr->ast));
+	if (!sieve_validate_block(valdtr, sieve_ast_root(valdtr->ast)))
+		return FALSE;
+	return sieve_validator_check_cost(valdtr);
 }
 
 /*
@@ -35,6 +35,8 @@ pool_t sieve_validator_pool(struct sieve_validator *valdtr);
 
 bool sieve_validator_run(struct sieve_validator *valdtr);
 
+unsigned int sieve_validator_estimate_cost(struct sieve_validator *valdtr);
+
 /*
  * Accessors
  */
@@ -10,15 +10,18 @@
 #include "eacces-error.h"
 #include "home-expand.h"
 #include "hostpid.h"
+#include "randgen.h"
+#include "write-full.h"
 #include "message-address.h"
 #include "mail-user.h"
+#include "duplicate-log.h"
 
 #include "sieve-settings.h"
 #include "sieve-extensions.h"
 #include "sieve-plugins.h"
 
 #include "sieve-address.h"
-#include "sieve-script.h"
+#include "sieve-script-private.h"
 #include "sieve-storage-private.h"
 #include "sieve-ast.h"
 #include "sieve-binary.h"
@@ -30,6 +33,7 @@
 #include "sieve-generator.h"
 #include "sieve-interpreter.h"
 #include "sieve-binary-dumper.h"
+#include "sieve-binary-cache.h"
 
 #include "sieve.h"
 #include "sieve-common.h"
@@ -42,6 +46,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <dirent.h>
+#include <time.h>
 
 struct event_category event_category_sieve = {
 	.name = "sieve",
@@ -129,6 +134,8 @@ sieve_init(const struct sieve_environment *env,
 	/* Configure extensions */
 	sieve_extensions_configure(svinst);
 
+	sieve_binary_cache_init(svinst);
+
 	return svinst;
 }
 
@@ -136,6 +143,10 @@ void sieve_deinit(struct sieve_instance **_svinst)
 {
 	struct sieve_instance *svinst = *_svinst;
 
+	duplicate_log_deinit(&svinst->dup_log);
+	if (svinst->raw_mail_user != NULL)
+		mail_user_unref(&svinst->raw_mail_user);
+	sieve_binary_cache_deinit(svinst);
 	sieve_plugins_unload(svinst);
 	sieve_storages_deinit(svinst);
 	sieve_extensions_deinit(svinst);
@@ -374,7 +385,7 @@ sieve_load(struct sieve_instance *svinst, const char *bin_path,
 }
 
 static struct sieve_binary *
-sieve_open_script_real(struct sieve_script *script,
+sieve_open_script_load(struct sieve_script *script,
 		       struct sieve_error_handler *ehandler,
 		       enum sieve_compile_flags flags,
 		       enum sieve_error *error_r)
@@ -382,12 +393,6 @@ sieve_open_script_real(struct sieve_script *script,
 	struct sieve_instance *svinst = sieve_script_svinst(script);
 	struct sieve_resource_usage rusage;
 	struct sieve_binary *sbin;
-	enum sieve_error error;
-	const char *errorstr = NULL;
-	int ret;
-
-	if (error_r == NULL)
-		error_r = &error;
 
 	sieve_resource_usage_init(&rusage);
 
@@ -427,6 +432,41 @@ sieve_open_script_real(struct sieve_script *script,
 		sieve_binary_set_resource_usage(sbin, &rusage);
 	}
 
+	return sbin;
+}
+
+static struct sieve_binary *
+sieve_open_script_real(struct sieve_script *script,
+		       struct sieve_error_handler *ehandler,
+		       enum sieve_compile_flags flags,
+		       enum sieve_error *error_r)
+{
+	struct sieve_instance *svinst = sieve_script_svinst(script);
+	const char *location = sieve_script_location(script);
+	const char *name = sieve_script_name(script);
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+	const char *errorstr = NULL;
+	bool cached = FALSE;
+	int ret;
+
+	if (error_r == NULL)
+		error_r = &error;
+
+	/* Try the binaries opened recently */
+	sbin = sieve_binary_cache_lookup(script, flags);
+	if (sbin != NULL) {
+		e_debug(svinst->event,
+			"Script binary for `%s' from %s found in cache",
+			name, location);
+		*error_r = SIEVE_ERROR_NONE;
+		cached = TRUE;
+	} else {
+		sbin = sieve_open_script_load(script, ehandler, flags, error_r);
+		if (sbin == NULL)
+			return NULL;
+	}
+
 	/* Check whether binary can be executed. */
 	ret = sieve_binary_check_executable(sbin, error_r, &errorstr);
 	if (ret <= 0) {
@@ -450,6 +490,8 @@ sieve_open_script_real(struct sieve_script *script,
 				    "%s", errorstr);
 		}
 		sieve_binary_close(&sbin);
+	} else if (!cached) {
+		sieve_binary_cache_add(script, flags, sbin);
 	}
 
 	return sbin;
@@ -1009,8 +1051,48 @@ sieve_user_get_log_path(struct sieve_instance *svinst,
 struct sieve_trace_log {
 	struct sieve_instance *svinst;
 	struct ostream *output;
+
+	/* Limit on the size of the trace (0 = unlimited) */
+	uoff_t max_size, size;
+	bool truncated:1;
+
+	/* Sampled trace: the output is buffered and only written to path
+	   once the trace log is freed, if the run took at least min_msecs. */
+	char *path;
+	buffer_t *buffer;
+	struct timeval start_time;
+	unsigned int min_msecs;
 };
 
+static void sieve_trace_log_init_limit(struct sieve_trace_log *trace_log)
+{
+	size_t max_size = 0;
+
+	(void)sieve_setting_get_size_value(trace_log->svinst,
+					   "sieve_trace_max_size", &max_size);
+	trace_log->max_size = max_size;
+}
+
+/* Returns FALSE when writing the given amount would exceed the size limit;
+   the trace is then ended with a note. */
+static bool
+sieve_trace_log_check_size(struct sieve_trace_log *trace_log, size_t size)
+{
+	if (trace_log->truncated)
+		return FALSE;
+	if (trace_log->max_size == 0)
+		return TRUE;
+	if (trace_log->size + size > trace_log->max_size) {
+		o_stream_nsend_str(trace_log->output,
+				   "\n[trace truncated: "
+				   "sieve_trace_max_size reached]\n");
+		trace_log->truncated = TRUE;
+		return FALSE;
+	}
+	trace_log->size += size;
+	return TRUE;
+}
+
 int sieve_trace_log_create(struct sieve_instance *svinst, const char *path,
 			   struct sieve_trace_log **trace_log_r)
 {
@@ -1031,40 +1113,105 @@ int sieve_trace_log_create(struct sieve_instance *svinst, const char *path,
 		}
 		output = o_stream_create_fd_autoclose(&fd, 0);
 		o_stream_set_name(output, path);
+		/* Trace files are only read afterwards; write them in large
+		   blocks rather than a line at a time */
+		o_stream_cork(output);
 	}
 
 	trace_log = i_new(struct sieve_trace_log, 1);
 	trace_log->svinst = svinst;
 	trace_log->output = output;
+	sieve_trace_log_init_limit(trace_log);
 
 	*trace_log_r = trace_log;
 	return 0;
 }
 
-int sieve_trace_log_create_dir(struct sieve_instance *svinst, const char *dir,
-			       struct sieve_trace_log **trace_log_r)
+static const char *
+sieve_trace_log_get_dir_path(struct sieve_instance *svinst, const char *dir)
 {
 	static unsigned int counter = 0;
-	const char *timestamp, *prefix;
+	const char *timestamp;
 	struct stat st;
 
-	*trace_log_r = NULL;
-
 	if (stat(dir, &st) < 0) {
 		if (errno != ENOENT && errno != EACCES) {
 			e_error(svinst->event, "trace: "
 				"stat(%s) failed: %m", dir);
 		}
-		return -1;
+		return NULL;
 	}
 
 	timestamp = t_strflocaltime("%Y%m%d-%H%M%S", ioloop_time);
 
 	counter++;
 
-	prefix = t_strdup_printf("%s/%s.%s.%u.trace",
-				 dir, timestamp, my_pid, counter);
-	return sieve_trace_log_create(svinst, prefix, trace_log_r);
+	return t_strdup_printf("%s/%s.%s.%u.trace",
+			       dir, timestamp, my_pid, counter);
+}
+
+int sieve_trace_log_create_dir(struct sieve_instance *svinst, const char *dir,
+			       struct sieve_trace_log **trace_log_r)
+{
+	const char *path;
+
+	*trace_log_r = NULL;
+
+	path = sieve_trace_log_get_dir_path(svinst, dir);
+	if (path == NULL)
+		return -1;
+	return sieve_trace_log_create(svinst, path, trace_log_r);
+}
+
+/* Returns -1 without a trace log when this run is not sampled, just like
+   when tracing is not configured at all. */
+static int
+sieve_trace_log_create_sampled(struct sieve_instance *svinst, const char *dir,
+			       struct sieve_trace_log **trace_log_r)
+{
+	unsigned long long int rate = 0, min_msecs = 0;
+	struct sieve_trace_log *trace_log;
+	const char *path;
+	bool selected;
+
+	(void)sieve_setting_get_uint_value(svinst, "sieve_trace_sample_rate",
+					   &rate);
+	(void)sieve_setting_get_uint_value(svinst,
+					   "sieve_trace_sample_min_msecs",
+					   &min_msecs);
+	if (rate == 0 && min_msecs == 0)
+		return sieve_trace_log_create_dir(svinst, dir, trace_log_r);
+
+	/* Trace 1 in `rate' runs */
+	if (rate > UINT32_MAX)
+		rate = UINT32_MAX;
+	selected = (rate == 1 || (rate > 1 && i_rand_limit(rate) == 0));
+	if (selected) {
+		/* Already decided; write the trace directly */
+		return sieve_trace_log_create_dir(svinst, dir, trace_log_r);
+	}
+	*trace_log_r = NULL;
+	if (min_msecs == 0)
+		return -1;
+
+	path = sieve_trace_log_get_dir_path(svinst, dir);
+	if (path == NULL)
+		return -1;
+
+	/* Runs that take at least `min_msecs' are traced as well; buffer the
+	   output until the duration is known */
+	trace_log = i_new(struct sieve_trace_log, 1);
+	trace_log->svinst = svinst;
+	trace_log->path = i_strdup(path);
+	trace_log->buffer = buffer_create_dynamic(default_pool, 4096);
+	trace_log->output = o_stream_create_buffer(trace_log->buffer);
+	sieve_trace_log_init_limit(trace_log);
+	trace_log->min_msecs = (min_msecs > UINT_MAX ?
+				UINT_MAX : (unsigned int)min_msecs);
+	i_gettimeofday(&trace_log->start_time);
+
+	*trace_log_r = trace_log;
+	return 0;
 }
 
 int sieve_trace_log_open(struct sieve_instance *svinst,
@@ -1088,7 +1235,7 @@ int sieve_trace_log_open(struct sieve_instance *svinst,
 		}
 	}
 
-	return sieve_trace_log_create_dir(svinst, trace_dir, trace_log_r);
+	return sieve_trace_log_create_sampled(svinst, trace_dir, trace_log_r);
 }
 
 void sieve_trace_log_write_line(struct sieve_trace_log *trace_log,
@@ -1097,9 +1244,12 @@ void sieve_trace_log_write_line(struct sieve_trace_log *trace_log,
 	struct const_iovec iov[2];
 
 	if (line == NULL) {
-		o_stream_nsend_str(trace_log->output, "\n");
+		if (sieve_trace_log_check_size(trace_log, 1))
+			o_stream_nsend_str(trace_log->output, "\n");
 		return;
 	}
+	if (!sieve_trace_log_check_size(trace_log, str_len(line) + 1))
+		return;
 
 	memset(iov, 0, sizeof(iov));
 	iov[0].iov_base = str_data(line);
@@ -1116,20 +1266,59 @@ void sieve_trace_log_printf(struct sieve_trace_log *trace_log,
 
 	va_start(args, fmt);
 	T_BEGIN {
-		o_stream_nsend_str(trace_log->output,
-				   t_strdup_vprintf(fmt, args));
+		const char *text = t_strdup_vprintf(fmt, args);
+
+		if (sieve_trace_log_check_size(trace_log, strlen(text)))
+			o_stream_nsend_str(trace_log->output, text);
 	} T_END;
 	va_end(args);
 }
 
+static void sieve_trace_log_flush_sampled(struct sieve_trace_log *trace_log)
+{
+	struct timeval now;
+	int fd;
+
+	o_stream_destroy(&trace_log->output);
+
+	i_gettimeofday(&now);
+	if (timeval_diff_msecs(&now, &trace_log->start_time) <
+	    (long long)trace_log->min_msecs) {
+		/* Fast enough; drop the trace */
+		return;
+	}
+
+	fd = open(trace_log->path, O_CREAT | O_APPEND | O_WRONLY, 0600);
+	if (fd == -1) {
+		e_error(trace_log->svinst->event, "trace: "
+			"creat(%s) failed: %m", trace_log->path);
+		return;
+	}
+	if (write_full(fd, trace_log->buffer->data,
+		       trace_log->buffer->used) < 0) {
+		e_error(trace_log->svinst->event, "trace: "
+			"write(%s) failed: %m", trace_log->path);
+	}
+	i_close_fd(&fd);
+}
+
 void sieve_trace_log_free(struct sieve_trace_log **_trace_log)
 {
 	struct sieve_trace_log *trace_log = *_trace_log;
 
 	*_trace_log = NULL;
 
+	if (trace_log->buffer != NULL) {
+		sieve_trace_log_flush_sampled(trace_log);
+		buffer_free(&trace_log->buffer);
+		i_free(trace_log->path);
+		i_free(trace_log);
+		return;
+	}
+
 	if (o_stream_finish(trace_log->output) < 0) {
-		e_error(trace_log->svinst->event, "write(%s) failed: %s",
+		e_error(trace_log->svinst->event, "trace: "
+			"write(%s) failed: %s",
 			o_stream_get_name(trace_log->output),
 			o_stream_get_error(trace_log->output));
 	}
@@ -1277,18 +1466,33 @@ void sieve_resource_usage_add(struct sieve_resource_usage *dst,
 		dst->cpu_time_msecs = UINT_MAX;
 	else
 		dst->cpu_time_msecs += src->cpu_time_msecs;
+
+	/* Memory is not cumulative; only the peak counts */
+	dst->memory_bytes = I_MAX(dst->memory_bytes, src->memory_bytes);
 }
 
-bool sieve_resource_usage_is_high(struct sieve_instance *svinst ATTR_UNUSED,
+static bool
+sieve_resource_usage_memory_exceeded(struct sieve_instance *svinst,
+				     const struct sieve_resource_usage *rusage)
+{
+	return (svinst->max_memory > 0 &&
+		rusage->memory_bytes > svinst->max_memory);
+}
+
+bool sieve_resource_usage_is_high(struct sieve_instance *svinst,
 				  const struct sieve_resource_usage *rusage)
 {
-	return (rusage->cpu_time_msecs > SIEVE_HIGH_CPU_TIME_MSECS);
+	return (rusage->cpu_time_msecs > SIEVE_HIGH_CPU_TIME_MSECS ||
+		sieve_resource_usage_memory_exceeded(svinst, rusage));
 }
 
 bool sieve_resource_usage_is_excessive(
 	struct sieve_instance *svinst,
 	const struct sieve_resource_usage *rusage)
 {
+	if (sieve_resource_usage_memory_exceeded(svinst, rusage))
+		return TRUE;
+
 	i_assert(svinst->max_cpu_time_secs <= (UINT_MAX / 1000));
 	if (svinst->max_cpu_time_secs == 0)
 		return FALSE;
@@ -1298,8 +1502,173 @@ bool sieve_resource_usage_is_excessive(
 const char *
 sieve_resource_usage_get_summary(const struct sieve_resource_usage *rusage)
 {
-	if (rusage->cpu_time_msecs == 0)
+	if (rusage->cpu_time_msecs == 0 && rusage->memory_bytes == 0)
 		return "no usage recorded";
+	if (rusage->memory_bytes == 0)
+		return t_strdup_printf("cpu time = %u ms", rusage->cpu_time_msecs);
+
+	return t_strdup_printf("cpu time = %u ms, memory = %zu bytes",
+			       rusage->cpu_time_msecs, rusage->memory_bytes);
+}
+
+/*
+ * Delivery timing
+ */
+
+static const char *sieve_delivery_timing_phase_names[] = {
+	"find_scripts",
+	"compile",
+	"execute",
+	"commit",
+};
+static_assert_array_size(sieve_delivery_timing_phase_names,
+			 SIEVE_DELIVERY_TIMING_PHASE_COUNT);
+
+static uint64_t sieve_delivery_timing_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sieve_delivery_timing_init(struct sieve_delivery_timing *timing)
+{
+	i_zero(timing);
+}
+
+void sieve_delivery_timing_begin(struct sieve_delivery_timing *timing,
+				 enum sieve_delivery_timing_phase phase)
+{
+	i_assert(phase < SIEVE_DELIVERY_TIMING_PHASE_COUNT);
 
-	return t_strdup_printf("cpu time = %u ms", rusage->cpu_time_msecs);
+	if (timing->running)
+		sieve_delivery_timing_end(timing, NULL);
+
+	timing->phase = phase;
+	timing->phase_start = sieve_delivery_timing_now();
+	timing->running = TRUE;
+}
+
+void sieve_delivery_timing_end(struct sieve_delivery_timing *timing,
+			       const char *script)
+{
+	uint64_t now, usecs;
+
+	if (!timing->running)
+		return;
+	timing->running = FALSE;
+
+	now = sieve_delivery_timing_now();
+	usecs = (now > timing->phase_start ? now - timing->phase_start : 0);
+	timing->usecs[timing->phase] += usecs;
+
+	if (script == NULL)
+		return;
+
+	if (timing->cur_script == NULL ||
+	    strcmp(timing->cur_script, script) != 0) {
+		i_free(timing->cur_script);
+		timing->cur_script = i_strdup(script);
+		timing->cur_script_usecs = 0;
+	}
+	timing->cur_script_usecs += usecs;
+
+	if (timing->cur_script_usecs >= timing->slowest_script_usecs) {
+		if (timing->slowest_script == NULL ||
+		    strcmp(timing->slowest_script, script) != 0) {
+			i_free(timing->slowest_script);
+			timing->slowest_script = i_strdup(script);
+		}
+		timing->slowest_script_usecs = timing->cur_script_usecs;
+	}
+}
+
+void sieve_delivery_timing_finish(struct sieve_instance *svinst,
+				  struct sieve_delivery_timing *timing)
+{
+	struct event_passthrough *e;
+	unsigned long long int warn_msecs = 0;
+	uint64_t total = 0;
+	unsigned int i, slowest = 0;
+
+	sieve_delivery_timing_end(timing, NULL);
+
+	e = event_create_passthrough(svinst->event)->
+		set_name("sieve_delivery_finished");
+	for (i = 0; i < SIEVE_DELIVERY_TIMING_PHASE_COUNT; i++) {
+		e->add_int(t_strconcat(sieve_delivery_timing_phase_names[i],
+				       "_usecs", NULL), timing->usecs[i]);
+		total += timing->usecs[i];
+		if (timing->usecs[i] > timing->usecs[slowest])
+			slowest = i;
+	}
+	e->add_int("total_usecs", total);
+	if (timing->slowest_script != NULL)
+		e->add_str("slowest_script", timing->slowest_script);
+
+	e_debug(e->event(), "Delivery finished in %llu.%03llu ms",
+		(unsigned long long)(total / 1000),
+		(unsigned long long)(total % 1000));
+
+	(void)sieve_setting_get_uint_value(svinst, "sieve_delivery_warn_msecs",
+					   &warn_msecs);
+	if (warn_msecs > 0 && total / 1000 >= warn_msecs) {
+		e_warning(svinst->event,
+			  "Slow delivery: took %llu ms, mostly in %s phase "
+			  "(%llu ms)%s%s",
+			  (unsigned long long)(total / 1000),
+			  sieve_delivery_timing_phase_names[slowest],
+			  (unsigned long long)(timing->usecs[slowest] / 1000),
+			  (timing->slowest_script == NULL ?
+			   "" : "; slowest script: "),
+			  (timing->slowest_script == NULL ?
+			   "" : timing->slowest_script));
+	}
+
+	i_free(timing->slowest_script);
+	i_free(timing->cur_script);
+}
+
+/*
+ * Allocation audit
+ */
+
+static const char *sieve_alloc_subsystem_names[] = {
+	"interpreter",
+	"match",
+	"message",
+	"result",
+	"stringlist",
+};
+static_assert_array_size(sieve_alloc_subsystem_names,
+			 SIEVE_ALLOC_SUBSYSTEM_COUNT);
+
+const char *sieve_alloc_subsystem_name(enum sieve_alloc_subsystem subsys)
+{
+	i_assert(subsys < SIEVE_ALLOC_SUBSYSTEM_COUNT);
+	return sieve_alloc_subsystem_names[subsys];
+}
+
+void sieve_alloc_audit_add(struct sieve_alloc_audit *dst,
+			   const struct sieve_alloc_audit *src)
+{
+	unsigned int i;
+
+	for (i = 0; i < SIEVE_ALLOC_SUBSYSTEM_COUNT; i++) {
+		dst->count[i] += src->count[i];
+		dst->bytes[i] += src->bytes[i];
+	}
+}
+
+bool sieve_alloc_audit_is_empty(const struct sieve_alloc_audit *audit)
+{
+	unsigned int i;
+
+	for (i = 0; i < SIEVE_ALLOC_SUBSYSTEM_COUNT; i++) {
+		if (audit->count[i] > 0 || audit->bytes[i] > 0)
+			return FALSE;
+	}
+	return TRUE;
 }
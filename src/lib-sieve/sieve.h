@@ -214,6 +214,10 @@ int sieve_trace_log_create_dir(struct sieve_instance *svinst, const char *dir,
 			       struct sieve_trace_log **trace_log_r)
 			       ATTR_NULL(3);
 
+/* Opens the trace log configured by sieve_trace_dir. Returns -1 when no trace
+   is to be written for this run: either tracing is not configured, it failed,
+   or the run is not selected by sieve_trace_sample_rate and
+   sieve_trace_sample_min_msecs. */
 int sieve_trace_log_open(struct sieve_instance *svinst,
 			 struct sieve_trace_log **trace_log_r) ATTR_NULL(2);
 
@@ -258,4 +262,35 @@ bool sieve_resource_usage_is_excessive(
 const char *
 sieve_resource_usage_get_summary(const struct sieve_resource_usage *rusage);
 
+/*
+ * Delivery timing
+ */
+
+void sieve_delivery_timing_init(struct sieve_delivery_timing *timing);
+/* Start timing the given phase. */
+void sieve_delivery_timing_begin(struct sieve_delivery_timing *timing,
+				 enum sieve_delivery_timing_phase phase);
+/* Stop timing the current phase. When script is not NULL, the time is
+   attributed to that script for determining the slowest one. */
+void sieve_delivery_timing_end(struct sieve_delivery_timing *timing,
+			       const char *script);
+/* Emit the sieve_delivery_finished event with the collected timings and log a
+   warning when the total exceeds sieve_delivery_warn_msecs. This also frees
+   the timing data. */
+void sieve_delivery_timing_finish(struct sieve_instance *svinst,
+				  struct sieve_delivery_timing *timing);
+
+/*
+ * Allocation audit
+ */
+
+/* Returns the name of the subsystem as used in event fields (e.g. "match"). */
+const char *sieve_alloc_subsystem_name(enum sieve_alloc_subsystem subsys);
+/* Calculate the sum of the provided allocation counters, writing the result to
+   the first. */
+void sieve_alloc_audit_add(struct sieve_alloc_audit *dst,
+			   const struct sieve_alloc_audit *src);
+/* Returns TRUE if no allocation was recorded at all. */
+bool sieve_alloc_audit_is_empty(const struct sieve_alloc_audit *audit);
+
 #endif
@@ -53,12 +53,26 @@ struct sieve_script *sieve_data_script_create_from_input
 	return &dscript->script;
 }
 
+void sieve_data_script_release_input(struct sieve_script *script)
+{
+	struct sieve_data_script *dscript =
+		(struct sieve_data_script *)script;
+
+	i_assert(script->script_class == &sieve_data_script);
+
+	if ( script->stream != NULL )
+		i_stream_unref(&script->stream);
+	if ( dscript->data != NULL )
+		i_stream_unref(&dscript->data);
+}
+
 static void sieve_data_script_destroy(struct sieve_script *script)
 {
 	struct sieve_data_script *dscript =
 		(struct sieve_data_script *)script;
 
-	i_stream_unref(&dscript->data);
+	if ( dscript->data != NULL )
+		i_stream_unref(&dscript->data);
 }
 
 static int sieve_data_script_get_stream
@@ -68,6 +82,13 @@ static int sieve_data_script_get_stream
 	struct sieve_data_script *dscript =
 		(struct sieve_data_script *)script;
 
+	if ( dscript->data == NULL ) {
+		sieve_script_set_error(script, SIEVE_ERROR_NOT_FOUND,
+			"Script data is no longer available");
+		*error_r = SIEVE_ERROR_NOT_FOUND;
+		return -1;
+	}
+
 	i_stream_ref(dscript->data);
 	i_stream_seek(dscript->data, 0);
 
@@ -26,5 +26,6 @@ struct sieve_data_script {
 struct sieve_script *sieve_data_script_create_from_input
 	(struct sieve_instance *svinst, const char *name,
 		struct istream *input);
+void sieve_data_script_release_input(struct sieve_script *script);
 
 #endif
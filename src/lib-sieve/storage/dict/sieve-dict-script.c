@@ -2,18 +2,136 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
 #include "strfuncs.h"
 #include "istream.h"
+#include "base64.h"
+#include "crc32.h"
 #include "dict.h"
 
 #include "sieve-common.h"
 #include "sieve-error.h"
+#include "sieve-extensions.h"
 #include "sieve-dump.h"
 #include "sieve-binary.h"
 
 #include "sieve-dict-storage.h"
 
+/*
+ * Script data cache
+ */
+
+/* The data ID of a script changes whenever its content changes, so once read
+   the data can be kept and reused for as long as the script still reports the
+   same ID. This avoids a dict round trip for each script that needs to be
+   compiled again. The cache is kept by the process rather than the Sieve
+   instance, because an instance usually lives for only one delivery. Entries
+   are keyed by dict URI, user and script name. */
+
+struct sieve_dict_script_cache_entry {
+	char *uri, *username, *name;
+	char *data_id, *data;
+};
+
+/* Most recently used first */
+static ARRAY(struct sieve_dict_script_cache_entry) dict_script_cache;
+
+static void
+sieve_dict_script_cache_entry_free(struct sieve_dict_script_cache_entry *entry)
+{
+	i_free(entry->uri);
+	i_free(entry->username);
+	i_free(entry->name);
+	i_free(entry->data_id);
+	i_free(entry->data);
+}
+
+static void sieve_dict_script_cache_deinit(void)
+{
+	struct sieve_dict_script_cache_entry *entry;
+
+	array_foreach_modifiable(&dict_script_cache, entry)
+		sieve_dict_script_cache_entry_free(entry);
+	array_free(&dict_script_cache);
+}
+
+static int sieve_dict_script_cache_find
+(struct sieve_dict_storage *dstorage, const char *name)
+{
+	const struct sieve_dict_script_cache_entry *entries;
+	unsigned int count, i;
+
+	if ( !array_is_created(&dict_script_cache) )
+		return -1;
+
+	entries = array_get(&dict_script_cache, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( strcmp(entries[i].name, name) == 0 &&
+			strcmp(entries[i].username, dstorage->username) == 0 &&
+			strcmp(entries[i].uri, dstorage->uri) == 0 )
+			return (int)i;
+	}
+	return -1;
+}
+
+static const char *sieve_dict_script_cache_lookup
+(struct sieve_dict_storage *dstorage, const char *name, const char *data_id)
+{
+	struct sieve_dict_script_cache_entry entry;
+	int idx;
+
+	idx = sieve_dict_script_cache_find(dstorage, name);
+	if ( idx < 0 )
+		return NULL;
+
+	entry = *array_idx(&dict_script_cache, idx);
+	if ( strcmp(entry.data_id, data_id) != 0 )
+		return NULL;
+
+	/* Move to front */
+	if ( idx > 0 ) {
+		array_delete(&dict_script_cache, idx, 1);
+		array_insert(&dict_script_cache, 0, &entry, 1);
+	}
+	return entry.data;
+}
+
+static void sieve_dict_script_cache_add
+(struct sieve_dict_storage *dstorage, const char *name, const char *data_id,
+	const char *data)
+{
+	struct sieve_dict_script_cache_entry entry;
+	unsigned int count;
+	int idx;
+
+	if ( !array_is_created(&dict_script_cache) ) {
+		i_array_init(&dict_script_cache,
+			SIEVE_DICT_SCRIPT_CACHE_MAX_ENTRIES);
+		lib_atexit(sieve_dict_script_cache_deinit);
+	}
+
+	/* Drop the outdated data of this script or, when the cache is full,
+	   the least recently used entry */
+	idx = sieve_dict_script_cache_find(dstorage, name);
+	count = array_count(&dict_script_cache);
+	if ( idx < 0 && count >= SIEVE_DICT_SCRIPT_CACHE_MAX_ENTRIES )
+		idx = (int)count - 1;
+	if ( idx >= 0 ) {
+		sieve_dict_script_cache_entry_free
+			(array_idx_modifiable(&dict_script_cache, idx));
+		array_delete(&dict_script_cache, idx, 1);
+	}
+
+	i_zero(&entry);
+	entry.uri = i_strdup(dstorage->uri);
+	entry.username = i_strdup(dstorage->username);
+	entry.name = i_strdup(name);
+	entry.data_id = i_strdup(data_id);
+	entry.data = i_strdup(data);
+	array_insert(&dict_script_cache, 0, &entry, 1);
+}
+
 /*
  * Script dict implementation
  */
@@ -117,6 +235,17 @@ static int sieve_dict_script_get_stream
 	const char *path, *name = script->name, *data, *error;
 	int ret;
 
+	data = sieve_dict_script_cache_lookup
+		(dstorage, name, dscript->data_id);
+	if ( data != NULL ) {
+		e_debug(script->event,
+			"Using cached data with id `%s'", dscript->data_id);
+		dscript->data = p_strdup(script->pool, data);
+		*stream_r = i_stream_create_from_data
+			(dscript->data, strlen(dscript->data));
+		return 0;
+	}
+
 	dscript->data_pool =
 		pool_alloconly_create("sieve_dict_script data pool", 1024);
 
@@ -145,6 +274,8 @@ static int sieve_dict_script_get_stream
 	}
 	
 	dscript->data = p_strdup(script->pool, data);
+	sieve_dict_script_cache_add
+		(dstorage, name, dscript->data_id, dscript->data);
 	*stream_r = i_stream_create_from_data(dscript->data, strlen(dscript->data));
 	return 0;
 }
@@ -220,11 +351,110 @@ static const char * sieve_dict_script_get_binpath
 	return dscript->binpath;
 }
 
+/* Binaries stored in the dict are shared by all hosts that use it. These
+   binaries are only valid for the set of extensions they were compiled with,
+   so hosts with a different configuration use a different key. */
+static const char *sieve_dict_script_get_binkey
+(struct sieve_dict_script *dscript)
+{
+	struct sieve_instance *svinst = dscript->script.storage->svinst;
+	const char *extensions = sieve_extensions_get_string(svinst);
+
+	return t_strdup_printf("%s%s/%08x", DICT_SIEVE_BINARY_PATH,
+		dict_escape_string(dscript->data_id),
+		crc32_data(extensions, strlen(extensions)));
+}
+
+static struct sieve_binary *sieve_dict_script_binary_load_dict
+(struct sieve_dict_script *dscript, enum sieve_error *error_r)
+{
+	struct sieve_script *script = &dscript->script;
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)script->storage;
+	const char *key, *value, *error;
+	buffer_t *data;
+	int ret;
+
+	key = sieve_dict_script_get_binkey(dscript);
+
+	struct dict_op_settings set = {
+		.username = dstorage->username,
+	};
+	ret = dict_lookup(dscript->dict, &set, pool_datastack_create(),
+		key, &value, &error);
+	if ( ret <= 0 ) {
+		if ( ret < 0 ) {
+			e_error(script->event,
+				"Failed to lookup binary from path %s: %s",
+				key, error);
+			*error_r = SIEVE_ERROR_TEMP_FAILURE;
+		} else {
+			e_debug(script->event,
+				"No binary found at path %s", key);
+			*error_r = SIEVE_ERROR_NOT_FOUND;
+		}
+		return NULL;
+	}
+
+	data = t_buffer_create(MAX_BASE64_DECODED_SIZE(strlen(value)));
+	if ( base64_decode(value, strlen(value), data) < 0 ) {
+		e_error(script->event,
+			"Binary at path %s is corrupt: invalid base64 data", key);
+		*error_r = SIEVE_ERROR_NOT_VALID;
+		return NULL;
+	}
+
+	return sieve_binary_open_data(script->storage->svinst,
+		data->data, data->used, script, error_r);
+}
+
+static int sieve_dict_script_binary_save_dict
+(struct sieve_dict_script *dscript, struct sieve_binary *sbin,
+	enum sieve_error *error_r)
+{
+	struct sieve_script *script = &dscript->script;
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)script->storage;
+	struct dict_transaction_context *trans;
+	const char *key, *error;
+	buffer_t *data;
+	string_t *value;
+
+	data = t_buffer_create(4096);
+	if ( sieve_binary_save_to_buffer(sbin, data, error_r) < 0 )
+		return -1;
+
+	value = t_str_new(MAX_BASE64_ENCODED_SIZE(data->used));
+	base64_encode(data->data, data->used, value);
+
+	key = sieve_dict_script_get_binkey(dscript);
+
+	struct dict_op_settings set = {
+		.username = dstorage->username,
+	};
+	trans = dict_transaction_begin(dscript->dict, &set);
+	dict_set(trans, key, str_c(value));
+	if ( dict_transaction_commit(&trans, &error) < 0 ) {
+		e_error(script->event,
+			"Failed to store binary at path %s: %s", key, error);
+		*error_r = SIEVE_ERROR_TEMP_FAILURE;
+		return -1;
+	}
+
+	e_debug(script->event, "Stored binary at path %s", key);
+	return 0;
+}
+
 static struct sieve_binary *sieve_dict_script_binary_load
 (struct sieve_script *script, enum sieve_error *error_r)
 {
 	struct sieve_dict_script *dscript =
 		(struct sieve_dict_script *)script;
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)script->storage;
+
+	if ( dstorage->bindict && dscript->data_id != NULL )
+		return sieve_dict_script_binary_load_dict(dscript, error_r);
 
 	if ( sieve_dict_script_get_binpath(dscript) == NULL )
 		return NULL;
@@ -239,6 +469,15 @@ static int sieve_dict_script_binary_save
 {
 	struct sieve_dict_script *dscript =
 		(struct sieve_dict_script *)script;
+	struct sieve_dict_storage *dstorage =
+		(struct sieve_dict_storage *)script->storage;
+
+	if ( dstorage->bindict && dscript->data_id != NULL ) {
+		/* A loaded binary came from the dict in the first place */
+		if ( !update && sieve_binary_loaded(sbin) )
+			return 0;
+		return sieve_dict_script_binary_save_dict(dscript, sbin, error_r);
+	}
 
 	if ( sieve_dict_script_get_binpath(dscript) == NULL )
 		return 0;
@@ -42,6 +42,8 @@ static int sieve_dict_storage_init
 			if (str_begins_icase(option, "user=", &value) &&
 			    *value != '\0' ) {
 				username = option+5;
+			} else if ( strcasecmp(option, "bindict") == 0 ) {
+				dstorage->bindict = TRUE;
 			} else {
 				sieve_storage_set_critical(storage,
 					"Invalid option `%s'", option);
@@ -79,6 +81,7 @@ static int sieve_dict_storage_init
 		SIEVE_DICT_STORAGE_DRIVER_NAME, ":", storage->location,
 		";user=", username, NULL);
 
+	sieve_storage_set_default_bindir(storage);
 	return 0;
 }
 
@@ -8,9 +8,14 @@
 #define DICT_SIEVE_PATH DICT_PATH_PRIVATE"sieve/"
 #define DICT_SIEVE_NAME_PATH DICT_SIEVE_PATH"name/"
 #define DICT_SIEVE_DATA_PATH DICT_SIEVE_PATH"data/"
+#define DICT_SIEVE_BINARY_PATH DICT_SIEVE_PATH"binary/"
 
 #define SIEVE_DICT_SCRIPT_DEFAULT "default"
 
+/* Number of script data items kept by the process; see
+   sieve_dict_script_cache_lookup() */
+#define SIEVE_DICT_SCRIPT_CACHE_MAX_ENTRIES 16
+
 /*
  * Storage class
  */
@@ -22,6 +27,9 @@ struct sieve_dict_storage {
 	const char *uri;
 
 	struct dict *dict;
+
+	/* Store compiled binaries in the dict */
+	bool bindict:1;
 };
 
 int sieve_dict_storage_get_dict
@@ -4,6 +4,7 @@
 #include "lib.h"
 #include "str.h"
 #include "array.h"
+#include "ioloop.h"
 #include "eacces-error.h"
 
 #include "sieve-common.h"
@@ -12,6 +13,7 @@
 #include "sieve-file-storage.h"
 
 #include <stdio.h>
+#include <unistd.h>
 #include <dirent.h>
 
 /*
@@ -28,13 +30,139 @@ struct sieve_file_script_sequence {
 	bool storage_is_file:1;
 };
 
+/*
+ * Directory cache
+ */
+
+/* Sorted listings of sequence directories read earlier in this process.
+   These are mostly the global sieve_before/sieve_after directories shared by
+   all users, so a listing is reused for as long as the directory itself is
+   unchanged. Listings are identified by the directory's device and inode
+   rather than by its path, since the same path can refer to a different
+   directory for another user (e.g. a home-relative location). Which entries
+   are accessible depends on the process credentials, so a listing is only
+   reused under the effective UID that read it. */
+
+#define SIEVE_FILE_SEQUENCE_DIR_CACHE_MAX 8
+
+struct sieve_file_sequence_dir {
+	pool_t pool;
+	struct stat st;
+	uid_t uid;
+	ARRAY_TYPE(const_string) files;
+};
+
+static ARRAY(struct sieve_file_sequence_dir) sequence_dir_cache;
+
+static void sieve_file_sequence_dir_cache_deinit(void)
+{
+	struct sieve_file_sequence_dir *dir;
+
+	array_foreach_modifiable(&sequence_dir_cache, dir)
+		pool_unref(&dir->pool);
+	array_free(&sequence_dir_cache);
+}
+
+static bool sieve_file_sequence_dir_is
+(const struct sieve_file_sequence_dir *dir, const struct stat *st, uid_t uid)
+{
+	return ( dir->st.st_ino == st->st_ino && dir->st.st_dev == st->st_dev &&
+		dir->uid == uid );
+}
+
+static bool sieve_file_sequence_dir_cache_lookup
+(struct sieve_file_script_sequence *fseq, const struct stat *st)
+{
+	const struct sieve_file_sequence_dir *dir;
+	const char *const *filep;
+	uid_t uid = geteuid();
+
+	if ( !array_is_created(&sequence_dir_cache) )
+		return FALSE;
+
+	array_foreach(&sequence_dir_cache, dir) {
+		if ( !sieve_file_sequence_dir_is(dir, st, uid) )
+			continue;
+		if ( dir->st.st_mtime != st->st_mtime ||
+			dir->st.st_ctime != st->st_ctime )
+			return FALSE;
+
+		array_foreach(&dir->files, filep) {
+			const char *file = p_strdup(fseq->pool, *filep);
+
+			array_append(&fseq->script_files, &file, 1);
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void sieve_file_sequence_dir_cache_update
+(struct sieve_file_script_sequence *fseq, const struct stat *st)
+{
+	struct sieve_file_sequence_dir *dirs, new_dir;
+	const char *const *filep;
+	uid_t uid = geteuid();
+	unsigned int count, i;
+
+	/* Changes made within the current second cannot be detected through
+	   the mtime, so such a listing is not cached */
+	if ( st->st_mtime >= ioloop_time )
+		return;
+
+	if ( !array_is_created(&sequence_dir_cache) ) {
+		i_array_init(&sequence_dir_cache,
+			SIEVE_FILE_SEQUENCE_DIR_CACHE_MAX);
+		lib_atexit(sieve_file_sequence_dir_cache_deinit);
+	}
+
+	/* Drop the outdated listing of this directory or, when the cache is
+	   full, the oldest one */
+	dirs = array_get_modifiable(&sequence_dir_cache, &count);
+	for ( i = 0; i < count; i++ ) {
+		if ( sieve_file_sequence_dir_is(&dirs[i], st, uid) )
+			break;
+	}
+	if ( i == count && count >= SIEVE_FILE_SEQUENCE_DIR_CACHE_MAX )
+		i = 0;
+	if ( i < count ) {
+		pool_unref(&dirs[i].pool);
+		array_delete(&sequence_dir_cache, i, 1);
+	}
+
+	i_zero(&new_dir);
+	new_dir.pool = pool_alloconly_create
+		("sieve_file_sequence_dir", 1024);
+	new_dir.st = *st;
+	new_dir.uid = uid;
+	p_array_init(&new_dir.files, new_dir.pool,
+		array_count(&fseq->script_files) + 1);
+	array_foreach(&fseq->script_files, filep) {
+		const char *file = p_strdup(new_dir.pool, *filep);
+
+		array_append(&new_dir.files, &file, 1);
+	}
+	array_append(&sequence_dir_cache, &new_dir, 1);
+}
+
+/*
+ * Directory reading
+ */
+
 static int sieve_file_script_sequence_read_dir
-(struct sieve_file_script_sequence *fseq, const char *path)
+(struct sieve_file_script_sequence *fseq, const char *path,
+	const struct stat *st)
 {
 	struct sieve_storage *storage = fseq->seq.storage;
 	DIR *dirp;
 	int ret = 0;
 
+	if ( sieve_file_sequence_dir_cache_lookup(fseq, st) ) {
+		e_debug(storage->event,
+			"Using cached script sequence listing");
+		return 0;
+	}
+
 	/* Open the directory */
 	if ( (dirp = opendir(path)) == NULL ) {
 		switch ( errno ) {
@@ -117,6 +245,9 @@ static int sieve_file_script_sequence_read_dir
 			"Failed to close sequence directory: "
 			"closedir(%s) failed: %m", path);
 	}
+
+	if ( ret == 0 )
+		sieve_file_sequence_dir_cache_update(fseq, st);
 	return ret;
 }
 
@@ -170,7 +301,7 @@ struct sieve_script_sequence *sieve_file_storage_get_script_sequence
 		if (name == 0 || *name == '\0') {
 			/* Read all '.sieve' files in directory */
 			if (sieve_file_script_sequence_read_dir
-				(fseq, fstorage->path) < 0) {
+				(fseq, fstorage->path, &st) < 0) {
 				*error_r = storage->error_code;
 				sieve_file_script_sequence_destroy(&fseq->seq);
 				return NULL;
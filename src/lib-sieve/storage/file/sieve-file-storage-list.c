@@ -2,7 +2,9 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
+#include "ioloop.h"
 #include "eacces-error.h"
 
 #include "sieve-common.h"
@@ -17,21 +19,138 @@ struct sieve_file_list_context {
 	struct sieve_storage_list_context context;
 	pool_t pool;
 
-	const char *active;
+	const char *active, *active_file;
 	const char *dir;
 	DIR *dirp;
+
+	/* Listing read from the storage cache */
+	const char *const *cached;
+	unsigned int cached_count, cached_idx;
+
+	/* Listing collected for the storage cache */
+	ARRAY_TYPE(const_string) collected;
+	struct stat dir_st, link_st;
+
+	bool cacheable:1;
+	bool finished:1;
 };
 
+/*
+ * Listing cache
+ */
+
+/* The listing is cached in the storage and reused as long as neither the
+   storage directory nor the active script link has changed. This saves the
+   readdir() and readlink() calls, which are slow on network filesystems. */
+
+static bool sieve_file_storage_list_stat
+(struct sieve_file_storage *fstorage, struct stat *dir_st_r,
+	struct stat *link_st_r)
+{
+	if ( stat(fstorage->path, dir_st_r) < 0 )
+		return FALSE;
+	if ( lstat(fstorage->active_path, link_st_r) < 0 ) {
+		if ( errno != ENOENT )
+			return FALSE;
+		i_zero(link_st_r);
+	}
+	return TRUE;
+}
+
+static bool sieve_file_storage_list_stat_equals
+(const struct stat *st1, const struct stat *st2)
+{
+	return ( st1->st_ino == st2->st_ino && st1->st_dev == st2->st_dev &&
+		st1->st_mtime == st2->st_mtime &&
+		ST_MTIME_NSEC(*st1) == ST_MTIME_NSEC(*st2) &&
+		st1->st_ctime == st2->st_ctime );
+}
+
+void sieve_file_storage_list_cache_clear
+(struct sieve_file_storage *fstorage)
+{
+	if ( fstorage->list_cache_pool == NULL )
+		return;
+
+	pool_unref(&fstorage->list_cache_pool);
+	i_zero(&fstorage->list_cache);
+	fstorage->list_cache_active = NULL;
+}
+
+static void sieve_file_storage_list_cache_update
+(struct sieve_file_list_context *flctx)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)flctx->context.storage;
+	const char *const *names;
+	unsigned int count, i;
+	pool_t pool;
+
+	sieve_file_storage_list_cache_clear(fstorage);
+
+	names = array_get(&flctx->collected, &count);
+	pool = pool_alloconly_create("sieve_file_storage_list_cache", 1024);
+	p_array_init(&fstorage->list_cache, pool, count + 1);
+	for ( i = 0; i < count; i++ ) {
+		const char *name = p_strdup(pool, names[i]);
+
+		array_append(&fstorage->list_cache, &name, 1);
+	}
+	fstorage->list_cache_active = p_strdup(pool, flctx->active_file);
+	fstorage->list_cache_dir_st = flctx->dir_st;
+	fstorage->list_cache_link_st = flctx->link_st;
+	fstorage->list_cache_pool = pool;
+}
+
+static struct sieve_file_list_context *sieve_file_storage_list_init_cached
+(struct sieve_file_storage *fstorage, const char *active)
+{
+	struct sieve_file_list_context *flctx;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sieve_file_list_context", 1024);
+	flctx = p_new(pool, struct sieve_file_list_context, 1);
+	flctx->pool = pool;
+	flctx->active = flctx->active_file = p_strdup(pool, active);
+	flctx->cached = array_get(&fstorage->list_cache, &flctx->cached_count);
+	return flctx;
+}
+
+/*
+ * Listing
+ */
+
 struct sieve_storage_list_context *sieve_file_storage_list_init
 (struct sieve_storage *storage)
 {
 	struct sieve_file_storage *fstorage =
 		(struct sieve_file_storage *)storage;
 	struct sieve_file_list_context *flctx;
+	struct stat dir_st, link_st;
 	const char *active = NULL;
+	bool cacheable = FALSE;
 	pool_t pool;
 	DIR *dirp;
 
+	/* Use the cached listing if nothing changed */
+	if ( sieve_file_storage_list_stat(fstorage, &dir_st, &link_st) ) {
+		if ( array_is_created(&fstorage->list_cache) &&
+			sieve_file_storage_list_stat_equals
+				(&dir_st, &fstorage->list_cache_dir_st) &&
+			sieve_file_storage_list_stat_equals
+				(&link_st, &fstorage->list_cache_link_st) ) {
+			e_debug(storage->event, "Using cached script listing");
+			flctx = sieve_file_storage_list_init_cached
+				(fstorage, fstorage->list_cache_active);
+			return &flctx->context;
+		}
+
+		/* Changes made within the current second cannot be detected
+		   through the mtime, so such a listing is not cached */
+		cacheable = ( dir_st.st_mtime < ioloop_time &&
+			link_st.st_mtime < ioloop_time );
+	}
+
 	/* Open the directory */
 	if ( (dirp = opendir(fstorage->path)) == NULL ) {
 		switch ( errno ) {
@@ -65,7 +184,14 @@ struct sieve_storage_list_context *sieve_file_storage_list_init
 			flctx = p_new(pool, struct sieve_file_list_context, 1);
 			flctx->pool = pool;
 			flctx->dirp = dirp;
-			flctx->active = ( active != NULL ? p_strdup(pool, active) : NULL );
+			flctx->active = flctx->active_file =
+				( active != NULL ? p_strdup(pool, active) : NULL );
+			if ( cacheable ) {
+				flctx->cacheable = TRUE;
+				flctx->dir_st = dir_st;
+				flctx->link_st = link_st;
+				p_array_init(&flctx->collected, pool, 16);
+			}
 		}
 	} T_END;
 
@@ -87,13 +213,26 @@ const char *sieve_file_storage_list_next
 	const struct sieve_file_storage *fstorage =
 		(const struct sieve_file_storage *)ctx->storage;
 	struct dirent *dp;
-	const char *scriptname;
+	const char *fname, *scriptname;
 
 	*active = FALSE;
 
 	for (;;) {
-		if ( (dp = readdir(flctx->dirp)) == NULL )
+		if ( flctx->dirp == NULL ) {
+			/* Listing from cache */
+			if ( flctx->cached_idx >= flctx->cached_count )
+				return NULL;
+			fname = flctx->cached[flctx->cached_idx++];
+			scriptname = sieve_script_file_get_scriptname(fname);
+			i_assert( scriptname != NULL );
+			break;
+		}
+
+		errno = 0;
+		if ( (dp = readdir(flctx->dirp)) == NULL ) {
+			flctx->finished = ( errno == 0 );
 			return NULL;
+		}
 
 		scriptname = sieve_script_file_get_scriptname(dp->d_name);
 		if (scriptname != NULL ) {
@@ -105,11 +244,16 @@ const char *sieve_file_storage_list_next
 				strcmp(fstorage->active_fname, dp->d_name) == 0 )
 				continue;
 
+			fname = dp->d_name;
+			if ( flctx->cacheable ) {
+				fname = p_strdup(flctx->pool, fname);
+				array_append(&flctx->collected, &fname, 1);
+			}
 			break;
 		}
 	}
 
-	if ( flctx->active != NULL && strcmp(dp->d_name, flctx->active) == 0 ) {
+	if ( flctx->active != NULL && strcmp(fname, flctx->active) == 0 ) {
 		*active = TRUE;
 		flctx->active = NULL;
 	}
@@ -124,7 +268,10 @@ int sieve_file_storage_list_deinit(struct sieve_storage_list_context *lctx)
 	const struct sieve_file_storage *fstorage =
 		(const struct sieve_file_storage *)lctx->storage;
 
-	if (closedir(flctx->dirp) < 0) {
+	if ( flctx->cacheable && flctx->finished )
+		sieve_file_storage_list_cache_update(flctx);
+
+	if (flctx->dirp != NULL && closedir(flctx->dirp) < 0) {
 		e_error(lctx->storage->event,
 			"closedir(%s) failed: %m", fstorage->path);
 	}
@@ -2,7 +2,9 @@
  */
 
 #include "lib.h"
+#include "array.h"
 #include "str.h"
+#include "ioloop.h"
 
 #include "sieve.h"
 #include "sieve-script.h"
@@ -14,17 +16,76 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-int sieve_file_storage_quota_havespace
-(struct sieve_storage *storage, const char *scriptname, size_t size,
-	enum sieve_storage_quota *quota_r, uint64_t *limit_r)
+/*
+ * Quota usage cache
+ */
+
+/* The scripts found in the storage directory are remembered, so that
+   subsequent quota checks (e.g. HAVESPACE followed by PUTSCRIPT) need not read
+   the directory again. The list is valid as long as the directory is
+   unchanged: saving, deleting or renaming a script always modifies the
+   directory. A script file can also be rewritten in place, which leaves the
+   directory untouched, so the sizes are refreshed for each check. */
+
+struct sieve_file_storage_quota_script {
+	const char *name, *fname;
+	uoff_t size;
+};
+
+void sieve_file_storage_quota_cache_clear
+(struct sieve_file_storage *fstorage)
 {
-	struct sieve_file_storage *fstorage =
-		(struct sieve_file_storage *)storage;
+	if ( fstorage->quota_cache_pool == NULL )
+		return;
+
+	pool_unref(&fstorage->quota_cache_pool);
+	i_zero(&fstorage->quota_cache);
+}
+
+static bool sieve_file_storage_quota_cache_valid
+(struct sieve_file_storage *fstorage, const struct stat *st)
+{
+	const struct stat *cst = &fstorage->quota_cache_dir_st;
+
+	return ( array_is_created(&fstorage->quota_cache) &&
+		st->st_ino == cst->st_ino && st->st_dev == cst->st_dev &&
+		st->st_mtime == cst->st_mtime &&
+		ST_MTIME_NSEC(*st) == ST_MTIME_NSEC(*cst) &&
+		st->st_ctime == cst->st_ctime );
+}
+
+static int sieve_file_storage_quota_cache_refresh
+(struct sieve_file_storage *fstorage)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_storage_quota_script *qscript;
+
+	if ( storage->max_storage == 0 )
+		return 0;
+
+	array_foreach_modifiable(&fstorage->quota_cache, qscript) {
+		const char *path;
+		struct stat st;
+
+		path = t_strconcat(fstorage->path, "/", qscript->fname, NULL);
+		if ( stat(path, &st) < 0 ) {
+			/* Let the caller scan the directory again */
+			return -1;
+		}
+		qscript->size = st.st_size;
+	}
+	return 0;
+}
+
+static int sieve_file_storage_quota_scan
+(struct sieve_file_storage *fstorage, const struct stat *dir_st)
+{
+	struct sieve_storage *storage = &fstorage->storage;
+	struct sieve_file_storage_quota_script *qscript;
 	struct dirent *dp;
 	DIR *dirp;
-	uint64_t script_count = 1;
-	uint64_t script_storage = size;
-	int result = 1;
+	pool_t pool;
+	int result = 0;
 
 	/* Open the directory */
 	if ( (dirp = opendir(fstorage->path)) == NULL ) {
@@ -33,10 +94,14 @@ int sieve_file_storage_quota_havespace
 		return -1;
 	}
 
+	sieve_file_storage_quota_cache_clear(fstorage);
+	pool = pool_alloconly_create("sieve_file_storage_quota_cache", 1024);
+	p_array_init(&fstorage->quota_cache, pool, 16);
+	fstorage->quota_cache_pool = pool;
+
 	/* Scan all files */
 	for (;;) {
 		const char *name;
-		bool replaced = FALSE;
 
 		/* Read next entry */
 		errno = 0;
@@ -64,24 +129,11 @@ int sieve_file_storage_quota_havespace
 			strcmp(fstorage->active_fname, dp->d_name) == 0 )
 			continue;
 
-		if ( strcmp(name, scriptname) == 0 )
-			replaced = TRUE;
+		qscript = array_append_space(&fstorage->quota_cache);
+		qscript->name = p_strdup(pool, name);
+		qscript->fname = p_strdup(pool, dp->d_name);
 
-		/* Check count quota if necessary */
-		if ( storage->max_scripts > 0 ) {
-			if ( !replaced ) {
-				script_count++;
-
-				if ( script_count > storage->max_scripts ) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
-					*limit_r = storage->max_scripts;
-					result = 0;
-					break;
-				}
-			}
-		}
-
-		/* Check storage quota if necessary */
+		/* Determine size if necessary */
 		if ( storage->max_storage > 0 ) {
 			const char *path;
 			struct stat st;
@@ -93,17 +145,7 @@ int sieve_file_storage_quota_havespace
 					  "quota: stat(%s) failed: %m", path);
 				continue;
 			}
-
-			if ( !replaced ) {
-				script_storage += st.st_size;
-
-				if ( script_storage > storage->max_storage ) {
-					*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
-					*limit_r = storage->max_storage;
-					result = 0;
-					break;
-				}
-			}
+			qscript->size = st.st_size;
 		}
 	}
 
@@ -112,9 +154,77 @@ int sieve_file_storage_quota_havespace
 		sieve_storage_set_critical(storage,
 			"quota: closedir(%s) failed: %m", fstorage->path);
 	}
+
+	if ( result < 0 )
+		sieve_file_storage_quota_cache_clear(fstorage);
+	else
+		fstorage->quota_cache_dir_st = *dir_st;
 	return result;
 }
 
+/*
+ * Quota checking
+ */
+
+int sieve_file_storage_quota_havespace
+(struct sieve_storage *storage, const char *scriptname, size_t size,
+	enum sieve_storage_quota *quota_r, uint64_t *limit_r)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+	const struct sieve_file_storage_quota_script *qscript;
+	struct stat dir_st;
+	uint64_t script_count = 1;
+	uint64_t script_storage = size;
+	int result = 1;
 
+	if ( stat(fstorage->path, &dir_st) < 0 ) {
+		sieve_storage_set_critical(storage,
+			"quota: stat(%s) failed: %m", fstorage->path);
+		return -1;
+	}
 
+	if ( !sieve_file_storage_quota_cache_valid(fstorage, &dir_st) ||
+		sieve_file_storage_quota_cache_refresh(fstorage) < 0 ) {
+		if ( sieve_file_storage_quota_scan(fstorage, &dir_st) < 0 )
+			return -1;
+	} else {
+		e_debug(storage->event, "quota: Using cached script list");
+	}
 
+	array_foreach(&fstorage->quota_cache, qscript) {
+		/* The script being replaced is not counted */
+		if ( strcmp(qscript->name, scriptname) == 0 )
+			continue;
+
+		/* Check count quota if necessary */
+		if ( storage->max_scripts > 0 ) {
+			script_count++;
+
+			if ( script_count > storage->max_scripts ) {
+				*quota_r = SIEVE_STORAGE_QUOTA_MAXSCRIPTS;
+				*limit_r = storage->max_scripts;
+				result = 0;
+				break;
+			}
+		}
+
+		/* Check storage quota if necessary */
+		if ( storage->max_storage > 0 ) {
+			script_storage += qscript->size;
+
+			if ( script_storage > storage->max_storage ) {
+				*quota_r = SIEVE_STORAGE_QUOTA_MAXSTORAGE;
+				*limit_r = storage->max_storage;
+				result = 0;
+				break;
+			}
+		}
+	}
+
+	/* Changes made within the current second cannot be detected through
+	   the mtime, so don't keep such a result */
+	if ( dir_st.st_mtime >= ioloop_time )
+		sieve_file_storage_quota_cache_clear(fstorage);
+	return result;
+}
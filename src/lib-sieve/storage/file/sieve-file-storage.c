@@ -230,6 +230,15 @@ static struct sieve_storage *sieve_file_storage_alloc(void)
 	return &fstorage->storage;
 }
 
+static void sieve_file_storage_destroy(struct sieve_storage *storage)
+{
+	struct sieve_file_storage *fstorage =
+		(struct sieve_file_storage *)storage;
+
+	sieve_file_storage_list_cache_clear(fstorage);
+	sieve_file_storage_quota_cache_clear(fstorage);
+}
+
 static int
 sieve_file_storage_get_full_path(struct sieve_file_storage *fstorage,
 				 const char **storage_path,
@@ -877,6 +886,7 @@ const struct sieve_storage sieve_file_storage = {
 	.allows_synchronization = TRUE,
 	.v = {
 		.alloc = sieve_file_storage_alloc,
+		.destroy = sieve_file_storage_destroy,
 		.init = sieve_file_storage_init,
 
 		.get_last_change = sieve_file_storage_get_last_change,
@@ -40,6 +40,19 @@ struct sieve_file_storage {
 	gid_t file_create_gid;
 
 	time_t prev_mtime;
+
+	/* Cached script listing and active script, valid as long as neither
+	   the storage directory nor the active link changes */
+	pool_t list_cache_pool;
+	ARRAY_TYPE(const_string) list_cache;
+	const char *list_cache_active;
+	struct stat list_cache_dir_st;
+	struct stat list_cache_link_st;
+
+	/* Cached script list for quota checking */
+	pool_t quota_cache_pool;
+	ARRAY(struct sieve_file_storage_quota_script) quota_cache;
+	struct stat quota_cache_dir_st;
 };
 
 const char *sieve_file_storage_path_extend
@@ -78,6 +91,9 @@ int sieve_file_storage_active_script_get_last_change
 
 /* Listing */
 
+void sieve_file_storage_list_cache_clear
+	(struct sieve_file_storage *fstorage);
+
 struct sieve_storage_list_context *sieve_file_storage_list_init
 	(struct sieve_storage *storage);
 const char *sieve_file_storage_list_next
@@ -111,6 +127,9 @@ int sieve_file_storage_save_as_active
 
 /* Quota */
 
+void sieve_file_storage_quota_cache_clear
+	(struct sieve_file_storage *fstorage);
+
 int sieve_file_storage_quota_havespace
 (struct sieve_storage *storage, const char *scriptname, size_t size,
 	enum sieve_storage_quota *quota_r, uint64_t *limit_r);
@@ -16,6 +16,7 @@
 #include "ioloop.h"
 #include "array.h"
 #include "hash.h"
+#include "llist.h"
 #include "aqueue.h"
 #include "str.h"
 #include "time-util.h"
@@ -57,6 +58,23 @@ struct db_ldap_sasl_bind_context {
 
 static struct ldap_connection *ldap_connections = NULL;
 
+/* Results of script lookups, kept for sieve_ldap_lookup_cache_secs; most
+   recently added first. The cache lives as long as the process. */
+struct db_ldap_lookup_cache_entry {
+	struct db_ldap_lookup_cache_entry *prev, *next;
+
+	char *key;
+	char *dn, *modattr;
+	time_t expires;
+};
+HASH_TABLE_DEFINE_TYPE(db_ldap_lookup_cache,
+	const char *, struct db_ldap_lookup_cache_entry *);
+
+static HASH_TABLE_TYPE(db_ldap_lookup_cache) ldap_lookup_cache;
+static struct db_ldap_lookup_cache_entry *ldap_lookup_cache_head = NULL;
+static struct db_ldap_lookup_cache_entry *ldap_lookup_cache_tail = NULL;
+static unsigned int ldap_lookup_cache_count = 0;
+
 static int db_ldap_bind(struct ldap_connection *conn);
 static void db_ldap_conn_close(struct ldap_connection *conn);
 
@@ -1207,6 +1225,101 @@ db_ldap_get_var_expand_table(struct ldap_connection *conn,
 	return tab;
 }
 
+/*
+ * Lookup cache
+ */
+
+static const char *
+db_ldap_lookup_cache_key(struct ldap_connection *conn,
+			 const struct ldap_request *request)
+{
+	struct sieve_ldap_storage *lstorage = conn->lstorage;
+
+	/* The configuration determines the server and the attributes */
+	return t_strdup_printf("%s\n%ld\n%d\n%s\n%s",
+			       lstorage->config_file,
+			       (long)lstorage->set_mtime, request->scope,
+			       request->base, request->filter);
+}
+
+static void
+db_ldap_lookup_cache_entry_free(struct db_ldap_lookup_cache_entry *entry)
+{
+	hash_table_remove(ldap_lookup_cache, entry->key);
+	DLLIST2_REMOVE(&ldap_lookup_cache_head, &ldap_lookup_cache_tail,
+		       entry);
+	ldap_lookup_cache_count--;
+
+	i_free(entry->key);
+	i_free(entry->dn);
+	i_free(entry->modattr);
+	i_free(entry);
+}
+
+static struct db_ldap_lookup_cache_entry *
+db_ldap_lookup_cache_find(const char *key)
+{
+	struct db_ldap_lookup_cache_entry *entry;
+
+	if (!hash_table_is_created(ldap_lookup_cache))
+		return NULL;
+
+	entry = hash_table_lookup(ldap_lookup_cache, key);
+	if (entry == NULL)
+		return NULL;
+	if (ioloop_time >= entry->expires) {
+		db_ldap_lookup_cache_entry_free(entry);
+		return NULL;
+	}
+	return entry;
+}
+
+static void
+db_ldap_lookup_cache_add(const char *key, unsigned int ttl_secs,
+			 const char *dn, const char *modattr)
+{
+	struct db_ldap_lookup_cache_entry *entry;
+
+	if (!hash_table_is_created(ldap_lookup_cache)) {
+		hash_table_create(&ldap_lookup_cache, default_pool, 0,
+				  str_hash, strcmp);
+#ifndef PLUGIN_BUILD
+		/* The plugin is unloaded before the atexit callbacks run;
+		   its deinit function frees the cache instead */
+		lib_atexit(sieve_ldap_db_lookup_cache_clear);
+#endif
+	}
+
+	entry = hash_table_lookup(ldap_lookup_cache, key);
+	if (entry != NULL)
+		db_ldap_lookup_cache_entry_free(entry);
+	if (ldap_lookup_cache_count >= DB_LDAP_LOOKUP_CACHE_MAX_ENTRIES)
+		db_ldap_lookup_cache_entry_free(ldap_lookup_cache_tail);
+
+	entry = i_new(struct db_ldap_lookup_cache_entry, 1);
+	entry->key = i_strdup(key);
+	entry->dn = i_strdup(dn);
+	entry->modattr = i_strdup(modattr);
+	entry->expires = ioloop_time + ttl_secs;
+
+	hash_table_insert(ldap_lookup_cache, entry->key, entry);
+	DLLIST2_PREPEND(&ldap_lookup_cache_head, &ldap_lookup_cache_tail,
+			entry);
+	ldap_lookup_cache_count++;
+}
+
+void sieve_ldap_db_lookup_cache_clear(void)
+{
+	while (ldap_lookup_cache_head != NULL)
+		db_ldap_lookup_cache_entry_free(ldap_lookup_cache_head);
+	if (hash_table_is_created(ldap_lookup_cache))
+		hash_table_destroy(&ldap_lookup_cache);
+}
+
+/*
+ * Script lookup
+ */
+
 struct sieve_ldap_script_lookup_request {
 	struct ldap_request request;
 
@@ -1224,6 +1337,8 @@ sieve_ldap_lookup_script_callback(struct ldap_connection *conn,
 		(struct sieve_ldap_script_lookup_request *)request;
 
 	if (res == NULL) {
+		/* Search failed or was aborted */
+		request->failed = TRUE;
 		io_loop_stop(conn->ioloop);
 		return;
 	}
@@ -1254,7 +1369,7 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 	struct sieve_ldap_script_lookup_request *request;
 	const struct var_expand_table *tab;
 	char **attr_names;
-	const char *error;
+	const char *cache_key = NULL, *error;
 	string_t *str;
 
 	pool_t pool = pool_alloconly_create
@@ -1293,12 +1408,33 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 		request->request.filter,
 		t_strarray_join((const char **)attr_names, ","));
 
+	if (set->sieve_ldap_lookup_cache_secs > 0) {
+		struct db_ldap_lookup_cache_entry *entry;
+
+		cache_key = db_ldap_lookup_cache_key(conn, &request->request);
+		entry = db_ldap_lookup_cache_find(cache_key);
+		if (entry != NULL) {
+			e_debug(storage->event, "db: "
+				"Using cached lookup result (dn=%s)",
+				(entry->dn == NULL ? "<not found>" : entry->dn));
+			*dn_r = t_strdup(entry->dn);
+			*modattr_r = t_strdup(entry->modattr);
+			pool_unref(&request->request.pool);
+			return (*dn_r == NULL ? 0 : 1);
+		}
+	}
+
 	request->request.callback = sieve_ldap_lookup_script_callback;
 	db_ldap_request(conn, &request->request);
 	db_ldap_wait(conn);
 
 	*dn_r = t_strdup(request->result_dn);
 	*modattr_r = t_strdup(request->result_modattr);
+	if (cache_key != NULL && !request->request.failed) {
+		db_ldap_lookup_cache_add(cache_key,
+					 set->sieve_ldap_lookup_cache_secs,
+					 *dn_r, *modattr_r);
+	}
 	pool_unref(&request->request.pool);
 	return (*dn_r == NULL ? 0 : 1);
 }
@@ -15,6 +15,8 @@
 /* If server disconnects us, don't reconnect if no requests have been sent
    for this many seconds. */
 #define DB_LDAP_IDLE_RECONNECT_SECS 60
+/* Maximum number of script lookup results kept in the lookup cache. */
+#define DB_LDAP_LOOKUP_CACHE_MAX_ENTRIES 1024
 
 #include <ldap.h>
 
@@ -137,4 +139,6 @@ int sieve_ldap_db_lookup_script(struct ldap_connection *conn,
 int sieve_ldap_db_read_script(struct ldap_connection *conn,
 	const char *dn, struct istream **script_r);
 
+void sieve_ldap_db_lookup_cache_clear(void);
+
 #endif
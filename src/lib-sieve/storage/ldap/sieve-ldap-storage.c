@@ -90,6 +90,7 @@ static int sieve_ldap_storage_init
 		SIEVE_LDAP_STORAGE_DRIVER_NAME, ":", storage->location,
 		";user=", username, NULL);
 
+	sieve_storage_set_default_bindir(storage);
 	return 0;
 }
 
@@ -220,7 +221,7 @@ void sieve_storage_ldap_plugin_init(void)
 
 void sieve_storage_ldap_plugin_deinit(void)
 {
-	/* Nothing */
+	sieve_ldap_db_lookup_cache_clear();
 }
 #endif
 
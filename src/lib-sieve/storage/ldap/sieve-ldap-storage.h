@@ -47,6 +47,7 @@ struct sieve_ldap_storage_settings {
 	const char *sieve_ldap_script_attr;
 	const char *sieve_ldap_mod_attr;
 	const char *sieve_ldap_filter;
+	unsigned int sieve_ldap_lookup_cache_secs;
 
 	/* ... */
 	int ldap_deref, ldap_scope, ldap_tls_require_cert;
@@ -8,6 +8,8 @@
 #include "sieve-binary.h"
 #include "sieve-code.h"
 #include "sieve-binary.h"
+#include "sieve-comparators.h"
+#include "sieve-match-types.h"
 
 /*
  * Anyof test
@@ -56,6 +58,172 @@ static bool tst_anyof_validate_const
  * Code generation
  */
 
+/* Merging of header tests
+ *
+ * Adjacent header tests that only differ in their key list are merged into a
+ * single test with the union of both key lists. This way, the header values
+ * are read and decoded only once. This is only done for literal arguments and
+ * for the match types that do not assign match values.
+ */
+
+static bool tst_anyof_header_args_mergeable
+(struct sieve_command *tst, const struct sieve_comparator **cmp_r,
+	const struct sieve_match_type **mcht_r)
+{
+	struct sieve_ast_argument *arg = sieve_command_first_argument(tst);
+	struct sieve_ast_argument *hdrs, *keys, *item;
+
+	*cmp_r = NULL;
+	*mcht_r = NULL;
+
+	/* Optional arguments: only comparator and match type are allowed */
+	while ( arg != NULL && arg != tst->first_positional ) {
+		if ( arg->argument == NULL )
+			return FALSE;
+
+		if ( sieve_argument_is_comparator(arg) ) {
+			*cmp_r = sieve_comparator_tag_get(arg);
+		} else if ( sieve_argument_is_match_type(arg) ) {
+			struct sieve_match_type_context *mtctx =
+				(struct sieve_match_type_context *) arg->argument->data;
+
+			if ( mtctx == NULL || mtctx->match_type == NULL )
+				return FALSE;
+			*mcht_r = mtctx->match_type;
+		} else {
+			return FALSE;
+		}
+		arg = sieve_ast_argument_next(arg);
+	}
+
+	if ( *mcht_r != NULL && !sieve_match_type_is(*mcht_r, is_match_type) &&
+		!sieve_match_type_is(*mcht_r, contains_match_type) )
+		return FALSE;
+
+	/* Positional arguments must be literal strings */
+	hdrs = tst->first_positional;
+	if ( hdrs == NULL || (keys=sieve_ast_argument_next(hdrs)) == NULL ||
+		sieve_ast_argument_next(keys) != NULL )
+		return FALSE;
+
+	for ( arg = hdrs; arg != NULL; arg = sieve_ast_argument_next(arg) ) {
+		if ( arg->argument == NULL )
+			return FALSE;
+		if ( sieve_ast_argument_type(arg) == SAAT_STRING ) {
+			if ( !sieve_argument_is_string_literal(arg) )
+				return FALSE;
+			continue;
+		}
+		if ( sieve_ast_argument_type(arg) != SAAT_STRING_LIST ||
+			!sieve_argument_is(arg, string_list_argument) )
+			return FALSE;
+
+		item = sieve_ast_strlist_first(arg);
+		while ( item != NULL ) {
+			if ( item->argument == NULL ||
+				!sieve_argument_is_string_literal(item) )
+				return FALSE;
+			item = sieve_ast_strlist_next(item);
+		}
+	}
+	return TRUE;
+}
+
+static bool tst_anyof_header_names_equal
+(struct sieve_ast_argument *hdrs1, struct sieve_ast_argument *hdrs2)
+{
+	struct sieve_ast_argument *item1, *item2;
+
+	if ( sieve_ast_argument_type(hdrs1) == SAAT_STRING ||
+		sieve_ast_argument_type(hdrs2) == SAAT_STRING ) {
+		item1 = ( sieve_ast_argument_type(hdrs1) == SAAT_STRING ?
+			hdrs1 : sieve_ast_strlist_first(hdrs1) );
+		item2 = ( sieve_ast_argument_type(hdrs2) == SAAT_STRING ?
+			hdrs2 : sieve_ast_strlist_first(hdrs2) );
+
+		if ( (sieve_ast_argument_type(hdrs1) == SAAT_STRING_LIST &&
+				sieve_ast_strlist_count(hdrs1) != 1) ||
+			(sieve_ast_argument_type(hdrs2) == SAAT_STRING_LIST &&
+				sieve_ast_strlist_count(hdrs2) != 1) )
+			return FALSE;
+
+		return ( strcasecmp(sieve_ast_argument_strc(item1),
+			sieve_ast_argument_strc(item2)) == 0 );
+	}
+
+	if ( sieve_ast_strlist_count(hdrs1) != sieve_ast_strlist_count(hdrs2) )
+		return FALSE;
+
+	item1 = sieve_ast_strlist_first(hdrs1);
+	item2 = sieve_ast_strlist_first(hdrs2);
+	while ( item1 != NULL && item2 != NULL ) {
+		if ( strcasecmp(sieve_ast_argument_strc(item1),
+			sieve_ast_argument_strc(item2)) != 0 )
+			return FALSE;
+		item1 = sieve_ast_strlist_next(item1);
+		item2 = sieve_ast_strlist_next(item2);
+	}
+	return TRUE;
+}
+
+static bool tst_anyof_header_tests_merge
+(struct sieve_command *tst1, struct sieve_command *tst2)
+{
+	const struct sieve_comparator *cmp1, *cmp2;
+	const struct sieve_match_type *mcht1, *mcht2;
+	struct sieve_ast_argument *keys1, *keys2, *keys;
+
+	if ( !tst_anyof_header_args_mergeable(tst1, &cmp1, &mcht1) ||
+		!tst_anyof_header_args_mergeable(tst2, &cmp2, &mcht2) )
+		return FALSE;
+
+	/* Comparator and match type must be the same (explicitly or by default) */
+	if ( (cmp1 == NULL) != (cmp2 == NULL) ||
+		(cmp1 != NULL && cmp1->def != cmp2->def) )
+		return FALSE;
+	if ( (mcht1 == NULL) != (mcht2 == NULL) ||
+		(mcht1 != NULL && mcht1->def != mcht2->def) )
+		return FALSE;
+
+	if ( !tst_anyof_header_names_equal
+		(tst1->first_positional, tst2->first_positional) )
+		return FALSE;
+
+	/* Move the keys of the second test to the first */
+	keys1 = sieve_ast_argument_next(tst1->first_positional);
+	keys2 = sieve_ast_argument_next(tst2->first_positional);
+	if ( (keys=sieve_ast_stringlist_join(keys1, keys2)) == NULL )
+		return FALSE;
+	if ( keys->argument == NULL ) {
+		keys->argument = sieve_argument_create
+			(keys->ast, &string_list_argument, NULL, 0);
+	}
+	return TRUE;
+}
+
+static void tst_anyof_merge_header_tests(struct sieve_command *ctx)
+{
+	struct sieve_ast_node *test, *next;
+
+	test = sieve_ast_test_first(ctx->ast_node);
+	while ( test != NULL ) {
+		next = sieve_ast_test_next(test);
+		if ( next == NULL )
+			break;
+
+		if ( test->command != NULL && next->command != NULL &&
+			sieve_command_is(test->command, tst_header) &&
+			sieve_command_is(next->command, tst_header) &&
+			tst_anyof_header_tests_merge(test->command, next->command) ) {
+			/* Drop the second test; try merging the next one as well */
+			(void)sieve_ast_node_detach(next);
+			continue;
+		}
+
+		test = next;
+	}
+}
+
 static bool tst_anyof_generate
 	(const struct sieve_codegen_env *cgenv, struct sieve_command *ctx,
 		struct sieve_jumplist *jumps, bool jump_true)
@@ -64,6 +232,8 @@ static bool tst_anyof_generate
 	struct sieve_ast_node *test;
 	struct sieve_jumplist true_jumps;
 
+	tst_anyof_merge_header_tests(ctx);
+
 	if ( sieve_ast_test_count(ctx->ast_node) > 1 ) {
 		if ( !jump_true ) {
 			/* Prepare jumplist */
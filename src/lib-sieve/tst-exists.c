@@ -145,6 +145,22 @@ static int tst_exists_operation_execute
 		(ret=sieve_stringlist_next_item(hdr_list, &hdr_item)) > 0 ) {
 		struct sieve_stringlist *value_list;
 		string_t *dummy;
+		int present = -1;
+
+		/* Without overrides, the header index of the message can answer
+		   this without fetching any values */
+		if ( !array_is_created(&svmos) || array_count(&svmos) == 0 ) {
+			present = sieve_message_header_is_present
+				(renv->msgctx, str_c(hdr_item));
+		}
+		if ( present >= 0 ) {
+			matched = ( present > 0 );
+
+			sieve_runtime_trace(renv, SIEVE_TRLVL_MATCHING,
+				"header `%s' %s", str_sanitize(str_c(hdr_item), 80),
+				( matched ? "exists" : "is missing" ));
+			continue;
+		}
 
 		/* Get header */
 		if ( (ret=sieve_message_get_header_fields
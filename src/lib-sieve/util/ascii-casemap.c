@@ -0,0 +1,118 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+
+#include "ascii-casemap.h"
+
+#include <string.h>
+
+/* The kernels below process the input one machine word at a time: a whole
+ * word is folded with a few arithmetic operations and the folded words are
+ * compared at once. Only the word in which the first difference occurs is
+ * examined octet by octet.
+ */
+
+typedef uintmax_t ascii_casemap_word_t;
+
+#define WORD_SIZE sizeof(ascii_casemap_word_t)
+#define WORD_ONES ((ascii_casemap_word_t)-1 / 0xff)
+#define WORD_BYTE(c) (WORD_ONES * (c))
+
+static inline ascii_casemap_word_t ascii_casemap_word_load(const char *p)
+{
+	ascii_casemap_word_t w;
+
+	memcpy(&w, p, WORD_SIZE);
+	return w;
+}
+
+static inline ascii_casemap_word_t
+ascii_casemap_word_fold(ascii_casemap_word_t w)
+{
+	ascii_casemap_word_t low7 = w & WORD_BYTE(0x7f);
+	/* High bit of each octet set when it is >= 'A' resp. > 'Z' */
+	ascii_casemap_word_t ge_a = low7 + WORD_BYTE(0x80 - 'A');
+	ascii_casemap_word_t gt_z = low7 + WORD_BYTE(0x80 - 'Z' - 1);
+	ascii_casemap_word_t upper = ge_a & ~gt_z & ~w & WORD_BYTE(0x80);
+
+	/* 0x80 >> 2 == 0x20 == 'a' - 'A' */
+	return w | (upper >> 2);
+}
+
+size_t ascii_casemap_prefix_len
+(const char *data1, const char *data2, size_t size)
+{
+	size_t i = 0;
+
+	while ( size - i >= WORD_SIZE ) {
+		if ( ascii_casemap_word_fold(ascii_casemap_word_load(data1 + i)) !=
+			ascii_casemap_word_fold(ascii_casemap_word_load(data2 + i)) )
+			break;
+		i += WORD_SIZE;
+	}
+
+	for ( ; i < size; i++ ) {
+		if ( ascii_casemap_fold(data1[i]) != ascii_casemap_fold(data2[i]) )
+			break;
+	}
+	return i;
+}
+
+int ascii_casemap_memcmp(const char *data1, const char *data2, size_t size)
+{
+	size_t i = ascii_casemap_prefix_len(data1, data2, size);
+
+	if ( i == size )
+		return 0;
+	return (int)ascii_casemap_fold(data1[i]) -
+		(int)ascii_casemap_fold(data2[i]);
+}
+
+size_t ascii_casemap_find
+(const char *data, size_t data_size, const char *needle, size_t needle_size)
+{
+	unsigned char first, first_upper;
+	const char *p, *pend, *lower, *upper;
+
+	if ( needle_size == 0 )
+		return 0;
+	if ( needle_size > data_size )
+		return (size_t)-1;
+
+	/* Skip ahead to candidate positions using memchr() on both cases of
+	   the first character of the needle */
+	first = ascii_casemap_fold(needle[0]);
+	first_upper = ( first >= 'a' && first <= 'z' ? first - ('a' - 'A') :
+		first );
+
+	p = data;
+	pend = data + (data_size - needle_size) + 1;
+	lower = upper = NULL;
+	while ( p < pend ) {
+		if ( lower != NULL && lower < p )
+			lower = NULL;
+		if ( lower == NULL &&
+			(lower = memchr(p, first, pend - p)) == NULL )
+			lower = pend;
+		if ( first_upper == first ) {
+			upper = lower;
+		} else {
+			if ( upper != NULL && upper < p )
+				upper = NULL;
+			if ( upper == NULL &&
+				(upper = memchr(p, first_upper, pend - p)) == NULL )
+				upper = pend;
+		}
+
+		p = ( lower < upper ? lower : upper );
+		if ( p >= pend )
+			break;
+
+		if ( ascii_casemap_prefix_len(p + 1, needle + 1, needle_size - 1) ==
+			needle_size - 1 )
+			return p - data;
+		p++;
+	}
+	return (size_t)-1;
+}
@@ -0,0 +1,34 @@
+#ifndef ASCII_CASEMAP_H
+#define ASCII_CASEMAP_H
+
+#include "lib.h"
+
+/*
+ * ASCII case folding
+ */
+
+/* Only the letters A-Z are folded; all other octets, including those with the
+   high bit set, are compared as they are. This matches the i;ascii-casemap
+   comparator (RFC 4790) independent of the current locale. */
+
+static inline unsigned char ascii_casemap_fold(unsigned char c)
+{
+	return ( c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c );
+}
+
+/* Returns the number of leading octets the two buffers have in common after
+   case folding (at most size). */
+size_t ascii_casemap_prefix_len
+	(const char *data1, const char *data2, size_t size);
+
+/* Compares the first size octets of both buffers after case folding. Returns
+   <0, 0 or >0 like memcmp(). */
+int ascii_casemap_memcmp(const char *data1, const char *data2, size_t size);
+
+/* Returns the offset of the first case-folded occurrence of needle in data, or
+   (size_t)-1 if there is none. */
+size_t ascii_casemap_find
+	(const char *data, size_t data_size, const char *needle,
+		size_t needle_size);
+
+#endif
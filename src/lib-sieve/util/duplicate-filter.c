@@ -0,0 +1,531 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "md5.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "file-dotlock.h"
+
+#include "duplicate-filter.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+ * Configuration
+ */
+
+/* Magic number; "SDF1" */
+#define DUPLICATE_FILTER_MAGIC 0x53444631
+
+/* IDs are grouped by the day they expire */
+#define DUPLICATE_FILTER_BUCKET_SECS (24*3600)
+/* Bits per bucket; with 4 hashes this gives a false positive rate of about
+   0.2% for a thousand IDs a day */
+#define DUPLICATE_FILTER_BUCKET_BITS (16*1024)
+#define DUPLICATE_FILTER_BUCKET_SIZE (DUPLICATE_FILTER_BUCKET_BITS / 8)
+#define DUPLICATE_FILTER_HASHES 4
+/* Maximum number of buckets; IDs that expire beyond the last bucket are
+   merged into it */
+#define DUPLICATE_FILTER_MAX_BUCKETS 400
+
+static const struct dotlock_settings duplicate_filter_dotlock_set = {
+	.timeout = 10,
+	.stale_timeout = 60,
+};
+
+/*
+ * Types
+ */
+
+struct duplicate_filter_file_header {
+	uint32_t magic;
+	uint32_t bucket_bits;
+	uint32_t bucket_count;
+	uint32_t unused;
+	int64_t valid_from;
+};
+
+struct duplicate_filter_bucket {
+	uint64_t id;
+	unsigned char bits[DUPLICATE_FILTER_BUCKET_SIZE];
+};
+
+struct duplicate_filter_pending {
+	uint64_t h1, h2;
+	time_t expire;
+};
+
+struct duplicate_filter {
+	char *path;
+
+	ARRAY(struct duplicate_filter_bucket *) buckets;
+	ARRAY(struct duplicate_filter_pending) pending;
+
+	time_t valid_from;
+	/* Delay before a filter file created by this instance can be trusted */
+	unsigned int warmup_secs;
+
+	/* Identity of the file contents that were last read */
+	ino_t file_ino;
+	off_t file_size;
+	time_t file_mtime;
+	long file_mtime_nsec;
+
+	bool exists:1;
+	bool stat_valid:1;
+	/* Create (or rebuild) the filter file when committing */
+	bool create:1;
+};
+
+/*
+ * Filter object
+ */
+
+struct duplicate_filter *
+duplicate_filter_init(const char *path, bool create, unsigned int warmup_secs)
+{
+	struct duplicate_filter *filter;
+
+	filter = i_new(struct duplicate_filter, 1);
+	filter->path = i_strdup(path);
+	filter->create = create;
+	filter->warmup_secs = warmup_secs;
+	i_array_init(&filter->buckets, 16);
+	i_array_init(&filter->pending, 8);
+
+	return filter;
+}
+
+static void duplicate_filter_clear(struct duplicate_filter *filter)
+{
+	struct duplicate_filter_bucket **bucketp;
+
+	array_foreach_modifiable(&filter->buckets, bucketp)
+		i_free(*bucketp);
+	array_clear(&filter->buckets);
+}
+
+void duplicate_filter_deinit(struct duplicate_filter **_filter)
+{
+	struct duplicate_filter *filter = *_filter;
+
+	*_filter = NULL;
+	if (filter == NULL)
+		return;
+
+	duplicate_filter_clear(filter);
+	array_free(&filter->buckets);
+	array_free(&filter->pending);
+	i_free(filter->path);
+	i_free(filter);
+}
+
+/*
+ * Hashing
+ */
+
+static void
+duplicate_filter_hash(const void *id, size_t id_size,
+		      uint64_t *h1_r, uint64_t *h2_r)
+{
+	unsigned char digest[MD5_RESULTLEN];
+
+	md5_get_digest(id, id_size, digest);
+	memcpy(h1_r, digest, sizeof(*h1_r));
+	memcpy(h2_r, digest + sizeof(*h1_r), sizeof(*h2_r));
+	/* Make sure the probe sequence doesn't get stuck */
+	*h2_r |= 1;
+}
+
+static bool
+duplicate_filter_bucket_test(const struct duplicate_filter_bucket *bucket,
+			     uint64_t h1, uint64_t h2)
+{
+	unsigned int i;
+
+	for (i = 0; i < DUPLICATE_FILTER_HASHES; i++) {
+		uint64_t pos = (h1 + i * h2) % DUPLICATE_FILTER_BUCKET_BITS;
+
+		if ((bucket->bits[pos / 8] & (1 << (pos % 8))) == 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+duplicate_filter_bucket_set(struct duplicate_filter_bucket *bucket,
+			    uint64_t h1, uint64_t h2)
+{
+	unsigned int i;
+
+	for (i = 0; i < DUPLICATE_FILTER_HASHES; i++) {
+		uint64_t pos = (h1 + i * h2) % DUPLICATE_FILTER_BUCKET_BITS;
+
+		bucket->bits[pos / 8] |= (1 << (pos % 8));
+	}
+}
+
+/*
+ * Buckets
+ */
+
+static inline bool
+duplicate_filter_bucket_expired(const struct duplicate_filter_bucket *bucket,
+				time_t now)
+{
+	return ((bucket->id + 1) * DUPLICATE_FILTER_BUCKET_SECS <=
+		(uint64_t)now);
+}
+
+static struct duplicate_filter_bucket *
+duplicate_filter_get_bucket(struct duplicate_filter *filter, uint64_t id)
+{
+	struct duplicate_filter_bucket *const *buckets, *bucket, *last = NULL;
+	unsigned int i, count;
+
+	buckets = array_get(&filter->buckets, &count);
+	for (i = 0; i < count; i++) {
+		if (buckets[i]->id == id)
+			return buckets[i];
+		if (last == NULL || buckets[i]->id > last->id)
+			last = buckets[i];
+	}
+
+	if (count >= DUPLICATE_FILTER_MAX_BUCKETS) {
+		/* Merge into the bucket that expires last; this only makes
+		   that bucket live longer than strictly necessary */
+		i_assert(last != NULL);
+		if (last->id < id)
+			last->id = id;
+		return last;
+	}
+
+	bucket = i_new(struct duplicate_filter_bucket, 1);
+	bucket->id = id;
+	array_append(&filter->buckets, &bucket, 1);
+	return bucket;
+}
+
+static void
+duplicate_filter_apply(struct duplicate_filter *filter,
+		       const struct duplicate_filter_pending *pend)
+{
+	struct duplicate_filter_bucket *bucket;
+	uint64_t id = (pend->expire <= 0 ? 0 :
+		       (uint64_t)pend->expire / DUPLICATE_FILTER_BUCKET_SECS);
+
+	bucket = duplicate_filter_get_bucket(filter, id);
+	duplicate_filter_bucket_set(bucket, pend->h1, pend->h2);
+}
+
+static void duplicate_filter_expire(struct duplicate_filter *filter, time_t now)
+{
+	struct duplicate_filter_bucket **buckets;
+	unsigned int i, count;
+
+	buckets = array_get_modifiable(&filter->buckets, &count);
+	for (i = count; i > 0; i--) {
+		if (duplicate_filter_bucket_expired(buckets[i-1], now)) {
+			i_free(buckets[i-1]);
+			array_delete(&filter->buckets, i-1, 1);
+			buckets = array_get_modifiable(&filter->buckets, &count);
+		}
+	}
+}
+
+/*
+ * Lookup
+ */
+
+bool duplicate_filter_is_valid(struct duplicate_filter *filter, time_t now)
+{
+	return (filter->exists && now >= filter->valid_from);
+}
+
+bool duplicate_filter_may_contain(struct duplicate_filter *filter,
+				  const void *id, size_t id_size, time_t now)
+{
+	struct duplicate_filter_bucket *const *bucketp;
+	uint64_t h1, h2;
+
+	duplicate_filter_hash(id, id_size, &h1, &h2);
+	array_foreach(&filter->buckets, bucketp) {
+		if (duplicate_filter_bucket_expired(*bucketp, now))
+			continue;
+		if (duplicate_filter_bucket_test(*bucketp, h1, h2))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+void duplicate_filter_add(struct duplicate_filter *filter,
+			  const void *id, size_t id_size, time_t expire)
+{
+	struct duplicate_filter_pending *pend;
+
+	pend = array_append_space(&filter->pending);
+	duplicate_filter_hash(id, id_size, &pend->h1, &pend->h2);
+	pend->expire = expire;
+
+	duplicate_filter_apply(filter, pend);
+}
+
+/*
+ * File access
+ */
+
+static int
+duplicate_filter_read_fd(struct duplicate_filter *filter, int fd,
+			 const char **error_r)
+{
+	struct duplicate_filter_file_header hdr;
+	unsigned int i;
+	int ret;
+
+	duplicate_filter_clear(filter);
+
+	if ((ret = read_full(fd, &hdr, sizeof(hdr))) <= 0) {
+		*error_r = (ret < 0 ?
+			    t_strdup_printf("read(%s) failed: %m",
+					    filter->path) :
+			    t_strdup_printf("%s: File is truncated",
+					    filter->path));
+		return -1;
+	}
+	if (hdr.magic != DUPLICATE_FILTER_MAGIC ||
+	    hdr.bucket_bits != DUPLICATE_FILTER_BUCKET_BITS ||
+	    hdr.bucket_count > DUPLICATE_FILTER_MAX_BUCKETS) {
+		*error_r = t_strdup_printf("%s: Invalid file header",
+					   filter->path);
+		return -1;
+	}
+
+	for (i = 0; i < hdr.bucket_count; i++) {
+		struct duplicate_filter_bucket *bucket;
+
+		bucket = i_new(struct duplicate_filter_bucket, 1);
+		array_append(&filter->buckets, &bucket, 1);
+
+		if ((ret = read_full(fd, &bucket->id,
+				     sizeof(bucket->id))) > 0) {
+			ret = read_full(fd, bucket->bits,
+					sizeof(bucket->bits));
+		}
+		if (ret <= 0) {
+			*error_r = (ret < 0 ?
+				    t_strdup_printf("read(%s) failed: %m",
+						    filter->path) :
+				    t_strdup_printf("%s: File is truncated",
+						    filter->path));
+			duplicate_filter_clear(filter);
+			return -1;
+		}
+	}
+
+	filter->valid_from = (time_t)hdr.valid_from;
+	return 0;
+}
+
+static void
+duplicate_filter_set_stat(struct duplicate_filter *filter,
+			  const struct stat *st)
+{
+	filter->file_ino = st->st_ino;
+	filter->file_size = st->st_size;
+	filter->file_mtime = st->st_mtime;
+	filter->file_mtime_nsec = ST_MTIME_NSEC(*st);
+	filter->stat_valid = TRUE;
+}
+
+static bool
+duplicate_filter_stat_changed(struct duplicate_filter *filter,
+			      const struct stat *st)
+{
+	return (!filter->stat_valid ||
+		filter->file_ino != st->st_ino ||
+		filter->file_size != st->st_size ||
+		filter->file_mtime != st->st_mtime ||
+		filter->file_mtime_nsec != ST_MTIME_NSEC(*st));
+}
+
+static int
+duplicate_filter_read(struct duplicate_filter *filter, bool force,
+		      const char **error_r)
+{
+	struct stat st;
+	int fd, ret;
+
+	fd = open(filter->path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			*error_r = t_strdup_printf("open(%s) failed: %m",
+						   filter->path);
+			return -1;
+		}
+		duplicate_filter_clear(filter);
+		filter->exists = FALSE;
+		filter->stat_valid = FALSE;
+		return 0;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m",
+					   filter->path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (!force && filter->exists &&
+	    !duplicate_filter_stat_changed(filter, &st)) {
+		i_close_fd(&fd);
+		return 1;
+	}
+
+	filter->exists = FALSE;
+	filter->stat_valid = FALSE;
+	ret = duplicate_filter_read_fd(filter, fd, error_r);
+	i_close_fd(&fd);
+	if (ret < 0)
+		return -1;
+
+	duplicate_filter_set_stat(filter, &st);
+	filter->exists = TRUE;
+	return 1;
+}
+
+int duplicate_filter_refresh(struct duplicate_filter *filter,
+			     const char **error_r)
+{
+	const struct duplicate_filter_pending *pend;
+	int ret;
+
+	ret = duplicate_filter_read(filter, FALSE, error_r);
+
+	/* Keep our uncommitted changes */
+	array_foreach(&filter->pending, pend)
+		duplicate_filter_apply(filter, pend);
+	return ret;
+}
+
+static int
+duplicate_filter_write_fd(struct duplicate_filter *filter, int fd,
+			  const char *path, const char **error_r)
+{
+	struct duplicate_filter_file_header hdr;
+	struct duplicate_filter_bucket *const *bucketp;
+
+	i_zero(&hdr);
+	hdr.magic = DUPLICATE_FILTER_MAGIC;
+	hdr.bucket_bits = DUPLICATE_FILTER_BUCKET_BITS;
+	hdr.bucket_count = array_count(&filter->buckets);
+	hdr.valid_from = (int64_t)filter->valid_from;
+
+	if (write_full(fd, &hdr, sizeof(hdr)) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m", path);
+		return -1;
+	}
+	array_foreach(&filter->buckets, bucketp) {
+		if (write_full(fd, &(*bucketp)->id,
+			       sizeof((*bucketp)->id)) < 0 ||
+		    write_full(fd, (*bucketp)->bits,
+			       sizeof((*bucketp)->bits)) < 0) {
+			*error_r = t_strdup_printf("write(%s) failed: %m",
+						   path);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void duplicate_filter_invalidate(struct duplicate_filter *filter)
+{
+	/* The file no longer covers all recorded IDs; remove it so that it is
+	   not trusted anymore. Whoever creates it again starts a new warmup. */
+	if (unlink(filter->path) < 0 && errno != ENOENT)
+		i_error("unlink(%s) failed: %m", filter->path);
+	filter->exists = FALSE;
+	filter->stat_valid = FALSE;
+}
+
+int duplicate_filter_commit(struct duplicate_filter *filter, time_t now,
+			    const char **error_r)
+{
+	const struct duplicate_filter_pending *pend;
+	struct dotlock *dotlock;
+	struct stat st;
+	const char *error;
+	int fd, ret;
+
+	if (array_count(&filter->pending) == 0)
+		return 0;
+
+	fd = file_dotlock_open(&duplicate_filter_dotlock_set, filter->path,
+			       0, &dotlock);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("file_dotlock_open(%s) failed: %m",
+					   filter->path);
+		duplicate_filter_invalidate(filter);
+		return -1;
+	}
+
+	/* Merge our changes into the current file contents */
+	ret = duplicate_filter_read(filter, TRUE, &error);
+	if (ret <= 0 && !filter->create) {
+		/* Leave creating the file to its owner */
+		file_dotlock_delete(&dotlock);
+		if (ret == 0) {
+			array_clear(&filter->pending);
+			return 0;
+		}
+		*error_r = error;
+		duplicate_filter_invalidate(filter);
+		return -1;
+	}
+	if (ret <= 0) {
+		/* A new (or rebuilt) file does not know the IDs that are
+		   already recorded in the database */
+		duplicate_filter_clear(filter);
+		filter->valid_from = now + filter->warmup_secs;
+	}
+	array_foreach(&filter->pending, pend)
+		duplicate_filter_apply(filter, pend);
+	duplicate_filter_expire(filter, now);
+
+	if (duplicate_filter_write_fd(filter, fd,
+				      file_dotlock_get_lock_path(dotlock),
+				      error_r) < 0) {
+		file_dotlock_delete(&dotlock);
+		duplicate_filter_invalidate(filter);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m",
+					   file_dotlock_get_lock_path(dotlock));
+		file_dotlock_delete(&dotlock);
+		duplicate_filter_invalidate(filter);
+		return -1;
+	}
+	if (file_dotlock_replace(&dotlock, 0) < 0) {
+		*error_r = t_strdup_printf("file_dotlock_replace(%s) failed: %m",
+					   filter->path);
+		duplicate_filter_invalidate(filter);
+		return -1;
+	}
+
+	duplicate_filter_set_stat(filter, &st);
+	filter->exists = TRUE;
+	array_clear(&filter->pending);
+	return 1;
+}
+
+void duplicate_filter_rollback(struct duplicate_filter *filter)
+{
+	/* Drop the in-memory state; the next refresh reads the file again */
+	array_clear(&filter->pending);
+	duplicate_filter_clear(filter);
+	filter->exists = FALSE;
+	filter->stat_valid = FALSE;
+}
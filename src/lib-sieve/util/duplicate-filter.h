@@ -0,0 +1,58 @@
+#ifndef DUPLICATE_FILTER_H
+#define DUPLICATE_FILTER_H
+
+/*
+ * Duplicate filter
+ *
+ * Time-bucketed Bloom filter that sits in front of a duplicate database. Each
+ * ID is recorded in the bucket of the day it expires, so that whole buckets
+ * can be dropped once they expire. The filter never forgets an ID before it
+ * expires, so a negative answer means the ID is definitely not recorded.
+ * Positive answers must be verified with the database.
+ *
+ * This only holds when every writer of the database also records its IDs in
+ * the filter. Writers that don't use the filter for lookups open it with
+ * create=FALSE: they only update an existing filter file and remove it when
+ * they fail to do so.
+ */
+
+/* Name of the filter file that belongs to the "lda-dupes" duplicate database
+   in the user's home directory */
+#define DUPLICATE_FILTER_LDA_DUPES_FNAME ".dovecot.lda-dupes.filter"
+
+struct duplicate_filter;
+
+/* When create is TRUE, the filter file is created (or rebuilt when it cannot
+   be read) with the first commit; it is only trusted warmup_secs after that,
+   once the IDs that were recorded in the database without it have expired. */
+struct duplicate_filter *
+duplicate_filter_init(const char *path, bool create, unsigned int warmup_secs);
+void duplicate_filter_deinit(struct duplicate_filter **_filter);
+
+/* (Re-)read the filter file when it changed since it was last read. Returns
+   1 when the filter file exists, 0 when it doesn't and -1 on error. */
+int duplicate_filter_refresh(struct duplicate_filter *filter,
+			     const char **error_r);
+
+/* Returns TRUE when negative answers from the filter can be trusted. */
+bool duplicate_filter_is_valid(struct duplicate_filter *filter, time_t now);
+
+/* Returns FALSE if the ID is definitely not recorded (or already expired). */
+bool duplicate_filter_may_contain(struct duplicate_filter *filter,
+				  const void *id, size_t id_size, time_t now);
+/* Record the ID until the given expiry time. The change is only written to
+   the filter file by duplicate_filter_commit(). */
+void duplicate_filter_add(struct duplicate_filter *filter,
+			  const void *id, size_t id_size, time_t expire);
+
+/* Write the recorded IDs to the filter file, merging them with any changes
+   made by other processes in the meantime. Expired buckets are dropped.
+   Returns 1 when the file was written, 0 when there was nothing to write (or
+   the file doesn't exist and create is FALSE) and -1 on error. On error, the
+   filter file is removed. */
+int duplicate_filter_commit(struct duplicate_filter *filter, time_t now,
+			    const char **error_r);
+/* Forget the IDs recorded since the last commit. */
+void duplicate_filter_rollback(struct duplicate_filter *filter);
+
+#endif
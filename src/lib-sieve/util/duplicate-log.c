@@ -0,0 +1,661 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hash.h"
+#include "hex-binary.h"
+#include "crc32.h"
+#include "md5.h"
+#include "write-full.h"
+#include "file-lock.h"
+#include "mkdir-parents.h"
+
+#include "duplicate-log.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+ * Configuration
+ */
+
+#define DUPLICATE_LOG_SHARDS 16
+#define DUPLICATE_LOG_RECORD_MAGIC 0x5344524c
+/* Longer IDs are replaced by their MD5 digest */
+#define DUPLICATE_LOG_MAX_ID_SIZE 1024
+#define DUPLICATE_LOG_LOCK_TIMEOUT 10
+/* Shards are compacted once they are at least this large and less than half
+   of their records are still needed */
+#define DUPLICATE_LOG_COMPACT_MIN_SIZE (64*1024)
+/* Number of times an append is retried when the shard is replaced by
+   compaction while waiting for the lock */
+#define DUPLICATE_LOG_APPEND_RETRIES 3
+
+/*
+ * Types
+ */
+
+struct duplicate_log_record_header {
+	uint32_t magic;
+	uint32_t id_size;
+	uint32_t crc;
+	uint32_t unused;
+	int64_t expire;
+};
+
+struct duplicate_log_entry {
+	const unsigned char *id;
+	size_t id_size;
+	time_t expire;
+};
+
+struct duplicate_log_shard {
+	char *path;
+
+	int fd;
+	ino_t ino;
+	void *mmap_base;
+	size_t mmap_size;
+
+	/* Offset up to which the records are indexed */
+	size_t offset;
+	unsigned int records;
+
+	pool_t pool;
+	HASH_TABLE(const char *, struct duplicate_log_entry *) entries;
+};
+
+struct duplicate_log {
+	char *path;
+
+	struct duplicate_log_shard shards[DUPLICATE_LOG_SHARDS];
+};
+
+struct duplicate_log_mark {
+	unsigned int shard;
+	const unsigned char *id;
+	size_t id_size;
+	time_t expire;
+};
+
+struct duplicate_log_transaction {
+	pool_t pool;
+	struct duplicate_log *dlog;
+
+	ARRAY(struct duplicate_log_mark) marks;
+};
+
+/*
+ * Log object
+ */
+
+struct duplicate_log *duplicate_log_init(const char *path)
+{
+	struct duplicate_log *dlog;
+	unsigned int i;
+
+	dlog = i_new(struct duplicate_log, 1);
+	dlog->path = i_strdup(path);
+
+	for (i = 0; i < DUPLICATE_LOG_SHARDS; i++) {
+		struct duplicate_log_shard *shard = &dlog->shards[i];
+
+		shard->path = i_strdup_printf("%s/shard-%02x.log", path, i);
+		shard->fd = -1;
+		shard->pool = pool_alloconly_create("duplicate log shard",
+						    4096);
+		hash_table_create(&shard->entries, default_pool, 0,
+				  str_hash, strcmp);
+	}
+	return dlog;
+}
+
+static void duplicate_log_shard_reset(struct duplicate_log_shard *shard)
+{
+	if (shard->mmap_base != NULL) {
+		if (munmap(shard->mmap_base, shard->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", shard->path);
+		shard->mmap_base = NULL;
+		shard->mmap_size = 0;
+	}
+	i_close_fd(&shard->fd);
+	shard->ino = 0;
+	shard->offset = 0;
+	shard->records = 0;
+
+	hash_table_clear(shard->entries, FALSE);
+	p_clear(shard->pool);
+}
+
+void duplicate_log_deinit(struct duplicate_log **_dlog)
+{
+	struct duplicate_log *dlog = *_dlog;
+	unsigned int i;
+
+	*_dlog = NULL;
+	if (dlog == NULL)
+		return;
+
+	for (i = 0; i < DUPLICATE_LOG_SHARDS; i++) {
+		struct duplicate_log_shard *shard = &dlog->shards[i];
+
+		duplicate_log_shard_reset(shard);
+		hash_table_destroy(&shard->entries);
+		pool_unref(&shard->pool);
+		i_free(shard->path);
+	}
+	i_free(dlog->path);
+	i_free(dlog);
+}
+
+/*
+ * Records
+ */
+
+static uint32_t
+duplicate_log_record_crc(const struct duplicate_log_record_header *hdr,
+			 const void *id)
+{
+	uint32_t crc;
+
+	crc = crc32_data(&hdr->id_size, sizeof(hdr->id_size));
+	crc = crc32_data_more(crc, &hdr->expire, sizeof(hdr->expire));
+	return crc32_data_more(crc, id, hdr->id_size);
+}
+
+static void
+duplicate_log_record_append(buffer_t *buf, const void *id, size_t id_size,
+			    time_t expire)
+{
+	struct duplicate_log_record_header hdr;
+
+	i_assert(id_size <= DUPLICATE_LOG_MAX_ID_SIZE);
+
+	i_zero(&hdr);
+	hdr.magic = DUPLICATE_LOG_RECORD_MAGIC;
+	hdr.id_size = id_size;
+	hdr.expire = (int64_t)expire;
+	hdr.crc = duplicate_log_record_crc(&hdr, id);
+
+	buffer_append(buf, &hdr, sizeof(hdr));
+	buffer_append(buf, id, id_size);
+}
+
+static void
+duplicate_log_id_normalize(const void **id, size_t *id_size,
+			   unsigned char digest[MD5_RESULTLEN])
+{
+	if (*id_size <= DUPLICATE_LOG_MAX_ID_SIZE)
+		return;
+	md5_get_digest(*id, *id_size, digest);
+	*id = digest;
+	*id_size = MD5_RESULTLEN;
+}
+
+static unsigned int duplicate_log_id_shard(const void *id, size_t id_size)
+{
+	return crc32_data(id, id_size) % DUPLICATE_LOG_SHARDS;
+}
+
+/*
+ * Shard index
+ */
+
+static void
+duplicate_log_shard_index(struct duplicate_log_shard *shard,
+			  const unsigned char *id, size_t id_size,
+			  time_t expire)
+{
+	struct duplicate_log_entry *entry;
+	const char *key;
+
+	key = binary_to_hex(id, id_size);
+	entry = hash_table_lookup(shard->entries, key);
+	if (entry == NULL) {
+		entry = p_new(shard->pool, struct duplicate_log_entry, 1);
+		entry->id = p_memdup(shard->pool, id, id_size);
+		entry->id_size = id_size;
+		key = p_strdup(shard->pool, key);
+		hash_table_insert(shard->entries, key, entry);
+	}
+	/* The last record for an ID wins */
+	entry->expire = expire;
+}
+
+static void duplicate_log_shard_scan(struct duplicate_log_shard *shard)
+{
+	const unsigned char *data = shard->mmap_base;
+	size_t size = shard->mmap_size, offset = shard->offset;
+	struct duplicate_log_record_header hdr;
+
+	while (offset + sizeof(hdr) <= size) {
+		size_t rec_size;
+
+		memcpy(&hdr, data + offset, sizeof(hdr));
+		if (hdr.magic != DUPLICATE_LOG_RECORD_MAGIC ||
+		    hdr.id_size == 0 ||
+		    hdr.id_size > DUPLICATE_LOG_MAX_ID_SIZE) {
+			/* Garbage left by a failed write; resynchronize */
+			offset++;
+			continue;
+		}
+
+		rec_size = sizeof(hdr) + hdr.id_size;
+		if (offset + rec_size > size) {
+			/* Record is still being written */
+			break;
+		}
+		if (hdr.crc != duplicate_log_record_crc(
+			&hdr, data + offset + sizeof(hdr))) {
+			if (offset + rec_size == size) {
+				/* Possibly still being written */
+				break;
+			}
+			offset++;
+			continue;
+		}
+
+		T_BEGIN {
+			duplicate_log_shard_index(
+				shard, data + offset + sizeof(hdr),
+				hdr.id_size, (time_t)hdr.expire);
+		} T_END;
+		shard->records++;
+		offset += rec_size;
+	}
+	shard->offset = offset;
+}
+
+/* Bring the index of the shard up to date with the file. This doesn't lock
+   the file. Returns 1 if the shard exists, 0 if not and -1 on error. */
+static int
+duplicate_log_shard_refresh(struct duplicate_log_shard *shard,
+			    const char **error_r)
+{
+	struct stat st;
+
+	if (stat(shard->path, &st) < 0) {
+		if (errno != ENOENT) {
+			*error_r = t_strdup_printf("stat(%s) failed: %m",
+						   shard->path);
+			return -1;
+		}
+		duplicate_log_shard_reset(shard);
+		return 0;
+	}
+	if (shard->fd != -1 && st.st_ino != shard->ino) {
+		/* Replaced by compaction */
+		duplicate_log_shard_reset(shard);
+	}
+
+	if (shard->fd == -1) {
+		shard->fd = open(shard->path, O_RDONLY);
+		if (shard->fd == -1) {
+			if (errno == ENOENT)
+				return 0;
+			*error_r = t_strdup_printf("open(%s) failed: %m",
+						   shard->path);
+			return -1;
+		}
+	}
+	if (fstat(shard->fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m",
+					   shard->path);
+		duplicate_log_shard_reset(shard);
+		return -1;
+	}
+	shard->ino = st.st_ino;
+
+	if ((size_t)st.st_size <= shard->mmap_size)
+		return 1;
+
+	if (shard->mmap_base != NULL &&
+	    munmap(shard->mmap_base, shard->mmap_size) < 0)
+		i_error("munmap(%s) failed: %m", shard->path);
+	shard->mmap_size = st.st_size;
+	shard->mmap_base = mmap(NULL, shard->mmap_size, PROT_READ, MAP_SHARED,
+				shard->fd, 0);
+	if (shard->mmap_base == MAP_FAILED) {
+		shard->mmap_base = NULL;
+		*error_r = t_strdup_printf("mmap(%s) failed: %m",
+					   shard->path);
+		duplicate_log_shard_reset(shard);
+		return -1;
+	}
+
+	duplicate_log_shard_scan(shard);
+	return 1;
+}
+
+/*
+ * Shard writing
+ */
+
+static int
+duplicate_log_shard_lock(struct duplicate_log_shard *shard, int fd,
+			 int lock_type, struct file_lock **lock_r,
+			 const char **error_r)
+{
+	struct file_lock_settings lock_set = {
+		.lock_method = FILE_LOCK_METHOD_FCNTL,
+	};
+	struct stat st1, st2;
+	int ret;
+
+	ret = file_wait_lock(fd, shard->path, lock_type, &lock_set,
+			     DUPLICATE_LOG_LOCK_TIMEOUT, lock_r, error_r);
+	if (ret <= 0)
+		return -1;
+
+	/* Make sure the file wasn't replaced while we were waiting */
+	if (fstat(fd, &st1) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m",
+					   shard->path);
+		file_lock_free(lock_r);
+		return -1;
+	}
+	if (stat(shard->path, &st2) < 0) {
+		if (errno != ENOENT) {
+			*error_r = t_strdup_printf("stat(%s) failed: %m",
+						   shard->path);
+			file_lock_free(lock_r);
+			return -1;
+		}
+	} else if (st1.st_ino == st2.st_ino) {
+		return 1;
+	}
+	file_lock_free(lock_r);
+	return 0;
+}
+
+static int
+duplicate_log_shard_append(struct duplicate_log *dlog,
+			   struct duplicate_log_shard *shard,
+			   const buffer_t *buf, const char **error_r)
+{
+	struct file_lock *lock;
+	unsigned int i;
+	int fd, ret;
+
+	for (i = 0; i < DUPLICATE_LOG_APPEND_RETRIES; i++) {
+		fd = open(shard->path, O_RDWR | O_APPEND | O_CREAT, 0600);
+		if (fd == -1 && errno == ENOENT) {
+			if (mkdir_parents(dlog->path, 0700) < 0 &&
+			    errno != EEXIST) {
+				*error_r = t_strdup_printf(
+					"mkdir_parents(%s) failed: %m",
+					dlog->path);
+				return -1;
+			}
+			fd = open(shard->path, O_RDWR | O_APPEND | O_CREAT,
+				  0600);
+		}
+		if (fd == -1) {
+			*error_r = t_strdup_printf("open(%s) failed: %m",
+						   shard->path);
+			return -1;
+		}
+
+		/* Appenders share the lock; only compaction excludes them */
+		ret = duplicate_log_shard_lock(shard, fd, F_RDLCK, &lock,
+					       error_r);
+		if (ret < 0) {
+			i_close_fd(&fd);
+			return -1;
+		}
+		if (ret == 0) {
+			i_close_fd(&fd);
+			continue;
+		}
+
+		ret = write_full(fd, buf->data, buf->used);
+		if (ret < 0) {
+			*error_r = t_strdup_printf("write(%s) failed: %m",
+						   shard->path);
+		}
+		file_lock_free(&lock);
+		i_close_fd(&fd);
+		return ret;
+	}
+
+	*error_r = t_strdup_printf("%s: File keeps being replaced",
+				   shard->path);
+	return -1;
+}
+
+static bool
+duplicate_log_shard_need_compact(struct duplicate_log_shard *shard,
+				 time_t now)
+{
+	struct hash_iterate_context *iter;
+	const char *key;
+	struct duplicate_log_entry *entry;
+	unsigned int live = 0;
+
+	if (shard->mmap_size < DUPLICATE_LOG_COMPACT_MIN_SIZE)
+		return FALSE;
+
+	iter = hash_table_iterate_init(shard->entries);
+	while (hash_table_iterate(iter, shard->entries, &key, &entry)) {
+		if (entry->expire > now)
+			live++;
+	}
+	hash_table_iterate_deinit(&iter);
+
+	return (live * 2 < shard->records);
+}
+
+static int
+duplicate_log_shard_compact(struct duplicate_log_shard *shard, time_t now,
+			    const char **error_r)
+{
+	struct hash_iterate_context *iter;
+	const char *key, *temp_path;
+	struct duplicate_log_entry *entry;
+	struct file_lock *lock;
+	buffer_t *buf;
+	int fd, temp_fd, ret;
+
+	fd = open(shard->path, O_RDWR);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m", shard->path);
+		return -1;
+	}
+	ret = duplicate_log_shard_lock(shard, fd, F_WRLCK, &lock, error_r);
+	if (ret <= 0) {
+		/* Already compacted by someone else */
+		i_close_fd(&fd);
+		return ret;
+	}
+
+	/* Nobody is appending now; read everything */
+	if ((ret = duplicate_log_shard_refresh(shard, error_r)) <= 0) {
+		file_lock_free(&lock);
+		i_close_fd(&fd);
+		return ret;
+	}
+
+	buf = t_buffer_create(shard->mmap_size / 2);
+	iter = hash_table_iterate_init(shard->entries);
+	while (hash_table_iterate(iter, shard->entries, &key, &entry)) {
+		if (entry->expire > now) {
+			duplicate_log_record_append(buf, entry->id,
+						    entry->id_size,
+						    entry->expire);
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+
+	temp_path = t_strconcat(shard->path, ".tmp", NULL);
+	temp_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (temp_fd == -1) {
+		*error_r = t_strdup_printf("open(%s) failed: %m", temp_path);
+		ret = -1;
+	} else if (write_full(temp_fd, buf->data, buf->used) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m", temp_path);
+		ret = -1;
+	} else if (fdatasync(temp_fd) < 0) {
+		*error_r = t_strdup_printf("fdatasync(%s) failed: %m",
+					   temp_path);
+		ret = -1;
+	} else if (rename(temp_path, shard->path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   temp_path, shard->path);
+		ret = -1;
+	} else {
+		ret = 1;
+	}
+	if (temp_fd != -1) {
+		i_close_fd(&temp_fd);
+		if (ret < 0)
+			i_unlink_if_exists(temp_path);
+	}
+
+	file_lock_free(&lock);
+	i_close_fd(&fd);
+
+	/* Re-read the compacted file on next access */
+	duplicate_log_shard_reset(shard);
+	return ret;
+}
+
+/*
+ * Transactions
+ */
+
+struct duplicate_log_transaction *
+duplicate_log_transaction_begin(struct duplicate_log *dlog)
+{
+	struct duplicate_log_transaction *trans;
+	pool_t pool;
+
+	pool = pool_alloconly_create("duplicate log transaction", 512);
+	trans = p_new(pool, struct duplicate_log_transaction, 1);
+	trans->pool = pool;
+	trans->dlog = dlog;
+	p_array_init(&trans->marks, pool, 4);
+
+	return trans;
+}
+
+void duplicate_log_transaction_rollback(
+	struct duplicate_log_transaction **_trans)
+{
+	struct duplicate_log_transaction *trans = *_trans;
+
+	*_trans = NULL;
+	if (trans == NULL)
+		return;
+	pool_unref(&trans->pool);
+}
+
+static int
+duplicate_log_transaction_commit_shard(struct duplicate_log_transaction *trans,
+				       unsigned int shard_idx,
+				       const char **error_r)
+{
+	struct duplicate_log *dlog = trans->dlog;
+	struct duplicate_log_shard *shard = &dlog->shards[shard_idx];
+	const struct duplicate_log_mark *mark;
+	time_t now = time(NULL);
+	buffer_t *buf;
+
+	/* Batch all marks for this shard into a single append */
+	buf = t_buffer_create(256);
+	array_foreach(&trans->marks, mark) {
+		if (mark->shard != shard_idx)
+			continue;
+		duplicate_log_record_append(buf, mark->id, mark->id_size,
+					    mark->expire);
+	}
+	if (buf->used == 0)
+		return 0;
+
+	if (duplicate_log_shard_append(dlog, shard, buf, error_r) < 0)
+		return -1;
+
+	if (duplicate_log_shard_refresh(shard, error_r) < 0)
+		return -1;
+	if (duplicate_log_shard_need_compact(shard, now) &&
+	    duplicate_log_shard_compact(shard, now, error_r) < 0)
+		return -1;
+	return 0;
+}
+
+int duplicate_log_transaction_commit(struct duplicate_log_transaction **_trans,
+				     const char **error_r)
+{
+	struct duplicate_log_transaction *trans = *_trans;
+	unsigned int i;
+	int ret = 0;
+
+	*_trans = NULL;
+
+	for (i = 0; i < DUPLICATE_LOG_SHARDS && ret == 0; i++) {
+		T_BEGIN {
+			ret = duplicate_log_transaction_commit_shard(
+				trans, i, error_r);
+			if (ret < 0)
+				*error_r = p_strdup(trans->pool, *error_r);
+		} T_END;
+	}
+	if (ret < 0)
+		*error_r = t_strdup(*error_r);
+
+	pool_unref(&trans->pool);
+	return ret;
+}
+
+/*
+ * Lookup
+ */
+
+int duplicate_log_check(struct duplicate_log_transaction *trans,
+			const void *id, size_t id_size, time_t now,
+			const char **error_r)
+{
+	struct duplicate_log_shard *shard;
+	const struct duplicate_log_mark *mark;
+	const struct duplicate_log_entry *entry;
+	unsigned char digest[MD5_RESULTLEN];
+	unsigned int shard_idx;
+	int ret;
+
+	duplicate_log_id_normalize(&id, &id_size, digest);
+	shard_idx = duplicate_log_id_shard(id, id_size);
+
+	/* IDs marked in this transaction */
+	array_foreach(&trans->marks, mark) {
+		if (mark->shard == shard_idx && mark->id_size == id_size &&
+		    memcmp(mark->id, id, id_size) == 0 && mark->expire > now)
+			return 1;
+	}
+
+	shard = &trans->dlog->shards[shard_idx];
+	if ((ret = duplicate_log_shard_refresh(shard, error_r)) <= 0)
+		return ret;
+
+	entry = hash_table_lookup(shard->entries, binary_to_hex(id, id_size));
+	return (entry != NULL && entry->expire > now ? 1 : 0);
+}
+
+void duplicate_log_mark(struct duplicate_log_transaction *trans,
+			const void *id, size_t id_size, time_t expire)
+{
+	struct duplicate_log_mark *mark;
+	unsigned char digest[MD5_RESULTLEN];
+
+	duplicate_log_id_normalize(&id, &id_size, digest);
+
+	mark = array_append_space(&trans->marks);
+	mark->shard = duplicate_log_id_shard(id, id_size);
+	mark->id = p_memdup(trans->pool, id, id_size);
+	mark->id_size = id_size;
+	mark->expire = expire;
+}
@@ -0,0 +1,38 @@
+#ifndef DUPLICATE_LOG_H
+#define DUPLICATE_LOG_H
+
+/*
+ * Duplicate log
+ *
+ * Duplicate database stored as a number of append-only log files (shards) in
+ * one directory. The shard of an ID is determined by its hash. Lookups read
+ * the memory-mapped shard without locking; the log is indexed in memory and
+ * the index is updated incrementally as the file grows. Writers only lock the
+ * shards they append to, and only exclusively when compacting a shard to
+ * remove expired entries.
+ */
+
+struct duplicate_log;
+struct duplicate_log_transaction;
+
+struct duplicate_log *duplicate_log_init(const char *path);
+void duplicate_log_deinit(struct duplicate_log **_dlog);
+
+struct duplicate_log_transaction *
+duplicate_log_transaction_begin(struct duplicate_log *dlog);
+/* Write all marked IDs. Returns 0 on success and -1 on error. */
+int duplicate_log_transaction_commit(struct duplicate_log_transaction **_trans,
+				     const char **error_r);
+void duplicate_log_transaction_rollback(
+	struct duplicate_log_transaction **_trans);
+
+/* Returns 1 if the ID is recorded and not expired, 0 if not, and -1 on
+   error. */
+int duplicate_log_check(struct duplicate_log_transaction *trans,
+			const void *id, size_t id_size, time_t now,
+			const char **error_r);
+/* Record the ID until the given expiry time. */
+void duplicate_log_mark(struct duplicate_log_transaction *trans,
+			const void *id, size_t id_size, time_t expire);
+
+#endif
@@ -96,6 +96,8 @@ struct _header_field {
 
 struct _header_field_index {
 	struct _header_field_index *prev, *next;
+	/* Fields with the same name, in message order */
+	struct _header_field_index *header_prev, *header_next;
 
 	struct _header_field *field;
 	struct _header_index *header;
@@ -177,6 +179,91 @@ static inline void _header_field_unref(struct _header_field *hfield)
 	i_free(hfield);
 }
 
+/* The fields of a header index (first/last) are linked through
+   header_prev/header_next, so that indexed access only visits the
+   fields with that name. */
+
+static void
+_header_index_append_field(struct _header_index *header_idx,
+			   struct _header_field_index *field_idx)
+{
+	field_idx->header_prev = header_idx->last;
+	field_idx->header_next = NULL;
+	if (header_idx->last != NULL)
+		header_idx->last->header_next = field_idx;
+	else
+		header_idx->first = field_idx;
+	header_idx->last = field_idx;
+}
+
+static void
+_header_index_prepend_field(struct _header_index *header_idx,
+			    struct _header_field_index *field_idx)
+{
+	field_idx->header_prev = NULL;
+	field_idx->header_next = header_idx->first;
+	if (header_idx->first != NULL)
+		header_idx->first->header_prev = field_idx;
+	else
+		header_idx->last = field_idx;
+	header_idx->first = field_idx;
+}
+
+static void
+_header_index_insert_field(struct _header_index *header_idx,
+			   struct _header_field_index *field_idx)
+{
+	struct _header_field_index *after = field_idx->prev;
+
+	/* Find the preceding field with this name in the main list */
+	while (after != NULL && after->header != header_idx)
+		after = after->prev;
+	if (after == NULL) {
+		_header_index_prepend_field(header_idx, field_idx);
+		return;
+	}
+
+	field_idx->header_prev = after;
+	field_idx->header_next = after->header_next;
+	if (after->header_next != NULL)
+		after->header_next->header_prev = field_idx;
+	else
+		header_idx->last = field_idx;
+	after->header_next = field_idx;
+}
+
+static void
+_header_index_remove_field(struct _header_index *header_idx,
+			   struct _header_field_index *field_idx)
+{
+	if (field_idx->header_prev != NULL)
+		field_idx->header_prev->header_next = field_idx->header_next;
+	else
+		header_idx->first = field_idx->header_next;
+	if (field_idx->header_next != NULL)
+		field_idx->header_next->header_prev = field_idx->header_prev;
+	else
+		header_idx->last = field_idx->header_prev;
+	field_idx->header_prev = field_idx->header_next = NULL;
+}
+
+static void
+_header_index_replace_field(struct _header_index *header_idx,
+			    struct _header_field_index *field_idx,
+			    struct _header_field_index *field_idx_new)
+{
+	field_idx_new->header_prev = field_idx->header_prev;
+	field_idx_new->header_next = field_idx->header_next;
+	if (field_idx->header_prev != NULL)
+		field_idx->header_prev->header_next = field_idx_new;
+	else
+		header_idx->first = field_idx_new;
+	if (field_idx->header_next != NULL)
+		field_idx->header_next->header_prev = field_idx_new;
+	else
+		header_idx->last = field_idx_new;
+}
+
 /*
  * Edit mail object
  */
@@ -328,10 +415,8 @@ struct edit_mail *edit_mail_snapshot(struct edit_mail *edmail)
 				       field_idx_new);
 
 			field_idx_new->header->count++;
-			if (field_idx->header->first == field_idx)
-				field_idx_new->header->first = field_idx_new;
-			if (field_idx->header->last == field_idx)
-				field_idx_new->header->last = field_idx_new;
+			_header_index_append_field(field_idx_new->header,
+						   field_idx_new);
 
 			if (field_idx == edmail->header_fields_appended) {
 				edmail_new->header_fields_appended =
@@ -581,31 +666,12 @@ edit_mail_header_field_delete(struct edit_mail *edmail,
 	edmail->hdr_size.lines -= field->lines;
 
 	header_idx->count--;
-	if (update_index) {
-		if (header_idx->count == 0) {
-			DLLIST2_REMOVE(&edmail->headers_head,
-				       &edmail->headers_tail, header_idx);
-			_header_unref(header_idx->header);
-			i_free(header_idx);
-		} else if (header_idx->first == field_idx) {
-			struct _header_field_index *hfield =
-				header_idx->first->next;
-
-			while (hfield != NULL && hfield->header != header_idx)
-				hfield = hfield->next;
-
-			i_assert(hfield != NULL);
-			header_idx->first = hfield;
-		} else if (header_idx->last == field_idx) {
-			struct _header_field_index *hfield =
-				header_idx->last->prev;
-
-			while (hfield != NULL && hfield->header != header_idx)
-				hfield = hfield->prev;
-
-			i_assert(hfield != NULL);
-			header_idx->last = hfield;
-		}
+	_header_index_remove_field(header_idx, field_idx);
+	if (update_index && header_idx->count == 0) {
+		DLLIST2_REMOVE(&edmail->headers_head,
+			       &edmail->headers_tail, header_idx);
+		_header_unref(header_idx->header);
+		i_free(header_idx);
 	}
 
 	DLLIST2_REMOVE(&edmail->header_fields_head, &edmail->header_fields_tail,
@@ -657,61 +723,20 @@ edit_mail_header_field_replace(struct edit_mail *edmail,
 		edmail->header_fields_tail = field_idx_new;
 
 	if (header_idx_new == header_idx) {
-		if (header_idx->first == field_idx)
-			header_idx->first = field_idx_new;
-		if (header_idx->last == field_idx)
-			header_idx->last = field_idx_new;
+		_header_index_replace_field(header_idx, field_idx,
+					    field_idx_new);
 	} else {
 		header_idx->count--;
 		header_idx_new->count++;
 
-		if (update_index) {
-			if (header_idx->count == 0) {
-				DLLIST2_REMOVE(&edmail->headers_head,
-					       &edmail->headers_tail,
-					       header_idx);
-				_header_unref(header_idx->header);
-				i_free(header_idx);
-			} else if (header_idx->first == field_idx) {
-				struct _header_field_index *hfield =
-					header_idx->first->next;
-
-				while (hfield != NULL &&
-				       hfield->header != header_idx)
-					hfield = hfield->next;
-
-				i_assert(hfield != NULL);
-				header_idx->first = hfield;
-			} else if (header_idx->last == field_idx) {
-				struct _header_field_index *hfield =
-					header_idx->last->prev;
-
-				while (hfield != NULL &&
-				       hfield->header != header_idx)
-					hfield = hfield->prev;
-
-				i_assert(hfield != NULL);
-				header_idx->last = hfield;
-			}
-			if (header_idx_new->count > 0) {
-				struct _header_field_index *hfield;
-
-				hfield = edmail->header_fields_head;
-				while (hfield != NULL &&
-				       hfield->header != header_idx_new)
-					hfield = hfield->next;
-
-				i_assert(hfield != NULL);
-				header_idx_new->first = hfield;
+		_header_index_remove_field(header_idx, field_idx);
+		_header_index_insert_field(header_idx_new, field_idx_new);
 
-				hfield = edmail->header_fields_tail;
-				while (hfield != NULL &&
-				       hfield->header != header_idx_new)
-					hfield = hfield->prev;
-
-				i_assert(hfield != NULL);
-				header_idx_new->last = hfield;
-			}
+		if (update_index && header_idx->count == 0) {
+			DLLIST2_REMOVE(&edmail->headers_head,
+				       &edmail->headers_tail, header_idx);
+			_header_unref(header_idx->header);
+			i_free(header_idx);
 		}
 	}
 
@@ -891,12 +916,12 @@ static int edit_mail_headers_parse(struct edit_mail *edmail)
 	}
 
 	/* Rebuild header index */
+	for (header_idx = edmail->headers_head; header_idx != NULL;
+	     header_idx = header_idx->next)
+		header_idx->first = header_idx->last = NULL;
 	current = edmail->header_fields_head;
 	while (current != NULL) {
-		if (current->header->first == NULL)
-			current->header->first = current;
-		current->header->last = current;
-
+		_header_index_append_field(current->header, current);
 		current = current->next;
 	}
 
@@ -912,6 +937,25 @@ static int edit_mail_headers_parse(struct edit_mail *edmail)
 	return 1;
 }
 
+static int
+edit_mail_header_lookup(struct edit_mail *edmail, const char *field_name)
+{
+	const char *value;
+
+	/* Once the headers are parsed, the index is authoritative */
+	if (edmail->headers_parsed)
+		return 1;
+
+	/* Added header */
+	if (edit_mail_header_find(edmail, field_name) != NULL)
+		return 1;
+
+	/* Original message; this is usually answered from the mail's own
+	   header cache */
+	return edmail->wrapped->v.get_first_header(
+		&edmail->wrapped->mail, field_name, FALSE, &value);
+}
+
 void edit_mail_header_add(struct edit_mail *edmail, const char *field_name,
 			  const char *value, bool last)
 {
@@ -929,10 +973,7 @@ void edit_mail_header_add(struct edit_mail *edmail, const char *field_name,
 	if (last) {
 		DLLIST2_APPEND(&edmail->header_fields_head,
 			       &edmail->header_fields_tail, field_idx);
-
-		header_idx->last = field_idx;
-		if (header_idx->first == NULL)
-			header_idx->first = field_idx;
+		_header_index_append_field(header_idx, field_idx);
 
 		if (!edmail->headers_parsed)  {
 			if (edmail->header_fields_appended == NULL) {
@@ -947,10 +988,7 @@ void edit_mail_header_add(struct edit_mail *edmail, const char *field_name,
 	} else {
 		DLLIST2_PREPEND(&edmail->header_fields_head,
 				&edmail->header_fields_tail, field_idx);
-
-		header_idx->first = field_idx;
-		if (header_idx->last == NULL)
-			header_idx->last = field_idx;
+		_header_index_prepend_field(header_idx, field_idx);
 	}
 
 	header_idx->count++;
@@ -968,6 +1006,11 @@ int edit_mail_header_delete(struct edit_mail *edmail, const char *field_name,
 	int pos = 0;
 	int ret = 0;
 
+	/* Avoid parsing the headers when the field does not exist at all */
+	if ((ret = edit_mail_header_lookup(edmail, field_name)) <= 0)
+		return ret;
+	ret = 0;
+
 	/* Make sure headers are parsed */
 	if (edit_mail_headers_parse(edmail) <= 0)
 		return -1;
@@ -982,57 +1025,30 @@ int edit_mail_header_delete(struct edit_mail *edmail, const char *field_name,
 	/* Signal modification */
 	edit_mail_modify(edmail);
 
-	/* Iterate through all header fields and remove those that match */
+	/* Iterate through the fields with this name and remove those that
+	   match */
 	field_idx = (index >= 0 ? header_idx->first : header_idx->last);
 	while (field_idx != NULL) {
 		struct _header_field_index *next =
-			(index >= 0 ? field_idx->next : field_idx->prev);
-
-		if (field_idx->field->header == header_idx->header) {
-			bool final;
-
-			if (index >= 0) {
-				pos++;
-				final = (header_idx->last == field_idx);
-			} else {
-				pos--;
-				final = (header_idx->first == field_idx);
-			}
-
-			if (index == 0 || index == pos) {
-				if (header_idx->first == field_idx)
-					header_idx->first = NULL;
-				if (header_idx->last == field_idx)
-					header_idx->last = NULL;
-				edit_mail_header_field_delete(
-					edmail, field_idx, FALSE);
-				ret++;
-			}
-
-			if (final || (index != 0 && index == pos))
+			(index >= 0 ? field_idx->header_next :
+				      field_idx->header_prev);
+
+		pos += (index >= 0 ? 1 : -1);
+		if (index == 0 || index == pos) {
+			edit_mail_header_field_delete(edmail, field_idx, FALSE);
+			ret++;
+			if (index != 0)
 				break;
 		}
 
 		field_idx = next;
 	}
 
-	if (index == 0 || header_idx->count == 0) {
+	if (header_idx->count == 0) {
 		DLLIST2_REMOVE(&edmail->headers_head,
 			       &edmail->headers_tail, header_idx);
 		_header_unref(header_idx->header);
 		i_free(header_idx);
-	} else if (header_idx->first == NULL || header_idx->last == NULL) {
-		struct _header_field_index *current =
-			edmail->header_fields_head;
-
-		while (current != NULL) {
-			if (current->header == header_idx) {
-				if (header_idx->first == NULL)
-					header_idx->first = current;
-				header_idx->last = current;
-			}
-			current = current->next;
-		}
 	}
 
 	return ret;
@@ -1042,11 +1058,16 @@ int edit_mail_header_replace(struct edit_mail *edmail,
 			     const char *field_name, int index,
 			     const char *newname, const char *newvalue)
 {
-	struct _header_index *header_idx, *header_idx_new;
-	struct _header_field_index *field_idx, *field_idx_new;
+	struct _header_index *header_idx;
+	struct _header_field_index *field_idx;
 	int pos = 0;
 	int ret = 0;
 
+	/* Avoid parsing the headers when the field does not exist at all */
+	if ((ret = edit_mail_header_lookup(edmail, field_name)) <= 0)
+		return ret;
+	ret = 0;
+
 	/* Make sure headers are parsed */
 	if (edit_mail_headers_parse(edmail) <= 0)
 		return -1;
@@ -1061,36 +1082,20 @@ int edit_mail_header_replace(struct edit_mail *edmail,
 	/* Signal modification */
 	edit_mail_modify(edmail);
 
-	/* Iterate through all header fields and replace those that match */
+	/* Iterate through the fields with this name and replace those that
+	   match */
 	field_idx = (index >= 0 ? header_idx->first : header_idx->last);
-	field_idx_new = NULL;
 	while (field_idx != NULL) {
 		struct _header_field_index *next =
-			(index >= 0 ? field_idx->next : field_idx->prev);
-
-		if (field_idx->field->header == header_idx->header) {
-			bool final;
-
-			if (index >= 0) {
-				pos++;
-				final = (header_idx->last == field_idx);
-			} else {
-				pos--;
-				final = (header_idx->first == field_idx);
-			}
-
-			if (index == 0 || index == pos) {
-				if (header_idx->first == field_idx)
-					header_idx->first = NULL;
-				if (header_idx->last == field_idx)
-					header_idx->last = NULL;
-				field_idx_new = edit_mail_header_field_replace(
-					edmail, field_idx, newname, newvalue,
-					FALSE);
-				ret++;
-			}
-
-			if (final || (index != 0 && index == pos))
+			(index >= 0 ? field_idx->header_next :
+				      field_idx->header_prev);
+
+		pos += (index >= 0 ? 1 : -1);
+		if (index == 0 || index == pos) {
+			(void)edit_mail_header_field_replace(
+				edmail, field_idx, newname, newvalue, FALSE);
+			ret++;
+			if (index != 0)
 				break;
 		}
 
@@ -1103,34 +1108,6 @@ int edit_mail_header_replace(struct edit_mail *edmail,
 			       header_idx);
 		_header_unref(header_idx->header);
 		i_free(header_idx);
-	} else if (header_idx->first == NULL || header_idx->last == NULL) {
-		struct _header_field_index *current =
-			edmail->header_fields_head;
-
-		while (current != NULL) {
-			if (current->header == header_idx) {
-				if (header_idx->first == NULL)
-					header_idx->first = current;
-				header_idx->last = current;
-			}
-			current = current->next;
-		}
-	}
-
-	/* Update new header index */
-	if (field_idx_new != NULL) {
-		struct _header_field_index *current =
-			edmail->header_fields_head;
-
-		header_idx_new = field_idx_new->header;
-		while (current != NULL) {
-			if (current->header == header_idx_new) {
-				if (header_idx_new->first == NULL)
-					header_idx_new->first = current;
-				header_idx_new->last = current;
-			}
-			current = current->next;
-		}
 	}
 
 	return ret;
@@ -1152,6 +1129,12 @@ int edit_mail_headers_iterate_init(struct edit_mail *edmail,
 	struct edit_mail_header_iter *edhiter;
 	struct _header_index *header_idx = NULL;
 	struct _header_field_index *current = NULL;
+	int ret;
+
+	/* Avoid parsing the headers when the field does not exist at all */
+	if (field_name != NULL &&
+	    (ret = edit_mail_header_lookup(edmail, field_name)) <= 0)
+		return ret;
 
 	/* Make sure headers are parsed */
 	if (edit_mail_headers_parse(edmail) <= 0) {
@@ -1214,14 +1197,16 @@ bool edit_mail_headers_iterate_next(struct edit_mail_header_iter *edhiter)
 	if (edhiter->current == NULL)
 		return FALSE;
 
-	do {
+	if (edhiter->header != NULL) {
 		edhiter->current = (!edhiter->reverse ?
-				    edhiter->current->next :
-				    edhiter->current->prev );
-	} while (edhiter->current != NULL && edhiter->current->header != NULL &&
-		 edhiter->header != NULL &&
-		 edhiter->current->header != edhiter->header);
+				    edhiter->current->header_next :
+				    edhiter->current->header_prev);
+		return (edhiter->current != NULL);
+	}
 
+	edhiter->current = (!edhiter->reverse ?
+			    edhiter->current->next :
+			    edhiter->current->prev);
 	return (edhiter->current != NULL && edhiter->current->header != NULL);
 }
 
@@ -0,0 +1,141 @@
+/* Copyright (c) 2018 Pigeonhole authors, see the included COPYING file */
+
+#include "lib.h"
+#include "test-common.h"
+
+#include "ascii-casemap.h"
+
+static const char *const casemap_test_strings[] = {
+	"",
+	"a",
+	"Subject",
+	"SUBJECT",
+	"subjecT",
+	"subjecu",
+	"From: Stephan Bosch <stephan@example.com>",
+	"FROM: STEPHAN BOSCH <STEPHAN@EXAMPLE.COM>",
+	"from: stephan bosch <stephan@example.org>",
+	"@[\\]^_`{|}~ AZaz",
+	"`{|}~ @[\\]^_ azAZ",
+	"Sm\xc3\xb8rrebr\xc3\xb8""d",
+	"SM\xc3\x98RREBR\xc3\x98""D",
+	"X-Spam-Score: ********** (very-long-header-value-exceeding-words)",
+	"x-spam-score: ********** (VERY-LONG-HEADER-VALUE-EXCEEDING-WORDS)",
+	"x-spam-score: ********** (VERY-LONG-HEADER-VALUE-EXCEEDING-WORDt)",
+};
+
+static int test_casemap_memcmp_ref
+(const char *data1, const char *data2, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		int c1 = ascii_casemap_fold(data1[i]);
+		int c2 = ascii_casemap_fold(data2[i]);
+
+		if (c1 != c2)
+			return c1 - c2;
+	}
+	return 0;
+}
+
+static size_t test_casemap_find_ref
+(const char *data, size_t data_size, const char *needle, size_t needle_size)
+{
+	size_t i;
+
+	for (i = 0; i + needle_size <= data_size; i++) {
+		if (test_casemap_memcmp_ref(data + i, needle, needle_size) == 0)
+			return i;
+	}
+	return (size_t)-1;
+}
+
+static int test_sign(int value)
+{
+	return (value < 0 ? -1 : (value > 0 ? 1 : 0));
+}
+
+static void test_ascii_casemap_fold(void)
+{
+	unsigned int c;
+
+	test_begin("ascii casemap - fold");
+	for (c = 0; c < 256; c++) {
+		unsigned char expected = c;
+
+		if (c >= 'A' && c <= 'Z')
+			expected = c - 'A' + 'a';
+		test_assert_idx(ascii_casemap_fold(c) == expected, c);
+	}
+	test_end();
+}
+
+static void test_ascii_casemap_memcmp(void)
+{
+	unsigned int i, j, count = N_ELEMENTS(casemap_test_strings);
+
+	test_begin("ascii casemap - memcmp and prefix");
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < count; j++) {
+			const char *s1 = casemap_test_strings[i];
+			const char *s2 = casemap_test_strings[j];
+			size_t size = I_MIN(strlen(s1), strlen(s2)), prefix;
+
+			test_assert_idx(test_sign(ascii_casemap_memcmp(s1, s2, size)) ==
+				test_sign(test_casemap_memcmp_ref(s1, s2, size)),
+				i * count + j);
+
+			prefix = ascii_casemap_prefix_len(s1, s2, size);
+			test_assert_idx(prefix <= size, i * count + j);
+			test_assert_idx(test_casemap_memcmp_ref(s1, s2, prefix) == 0,
+				i * count + j);
+			test_assert_idx(prefix == size ||
+				ascii_casemap_fold(s1[prefix]) !=
+					ascii_casemap_fold(s2[prefix]), i * count + j);
+		}
+	}
+	test_end();
+}
+
+static void test_ascii_casemap_find(void)
+{
+	unsigned int i, count = N_ELEMENTS(casemap_test_strings);
+	size_t offset, len;
+
+	test_begin("ascii casemap - find");
+	for (i = 0; i < count; i++) {
+		const char *data = casemap_test_strings[i];
+		size_t data_size = strlen(data);
+
+		/* Every substring of every test string, in both cases */
+		for (offset = 0; offset < data_size; offset++) {
+			for (len = 0; offset + len <= data_size; len++) {
+				const char *needle = t_strndup(data + offset, len);
+				const char *needle_uc = t_str_ucase(needle);
+
+				test_assert_idx(ascii_casemap_find(data, data_size,
+					needle, len) == test_casemap_find_ref(data, data_size,
+						needle, len), i);
+				test_assert_idx(ascii_casemap_find(data, data_size,
+					needle_uc, len) == test_casemap_find_ref(data,
+						data_size, needle_uc, len), i);
+			}
+		}
+
+		test_assert_idx(ascii_casemap_find(data, data_size, "frop", 4) ==
+			(size_t)-1, i);
+	}
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_ascii_casemap_fold,
+		test_ascii_casemap_memcmp,
+		test_ascii_casemap_find,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,252 @@
+/* Copyright (c) 2018 Pigeonhole authors, see the included COPYING file */
+
+#include "lib.h"
+#include "write-full.h"
+#include "test-common.h"
+
+#include "duplicate-filter.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#define TEST_FILTER_PATH ".test-duplicate-filter"
+
+static const char *const test_ids[] = {
+	"<msgid1@example.com>-user@example.com-target@example.org",
+	"<msgid2@example.com>-user@example.com-target@example.org",
+	"vacation-sender@example.net",
+	"frop",
+	"a",
+};
+
+static const char *const test_absent_ids[] = {
+	"<msgid3@example.com>-user@example.com-target@example.org",
+	"vacation-other@example.net",
+	"friep",
+	"b",
+};
+
+static void test_add_ids(struct duplicate_filter *filter, time_t expire)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(test_ids); i++) {
+		duplicate_filter_add(filter, test_ids[i], strlen(test_ids[i]),
+				     expire);
+	}
+}
+
+static void
+test_check_ids(struct duplicate_filter *filter, time_t now, bool present)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(test_ids); i++) {
+		test_assert_idx(duplicate_filter_may_contain(
+			filter, test_ids[i], strlen(test_ids[i]),
+			now) == present, i);
+	}
+}
+
+static void
+test_check_absent_ids(struct duplicate_filter *filter, time_t now)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(test_absent_ids); i++) {
+		test_assert_idx(!duplicate_filter_may_contain(
+			filter, test_absent_ids[i],
+			strlen(test_absent_ids[i]), now), i);
+	}
+}
+
+static void test_duplicate_filter_lookup(void)
+{
+	struct duplicate_filter *filter;
+	time_t now = 1500000000;
+
+	test_begin("duplicate filter - lookup");
+
+	filter = duplicate_filter_init(TEST_FILTER_PATH, TRUE, 0);
+	test_check_ids(filter, now, FALSE);
+	test_add_ids(filter, now + 3600);
+	test_check_ids(filter, now, TRUE);
+	test_check_absent_ids(filter, now);
+	test_assert(!duplicate_filter_is_valid(filter, now));
+	duplicate_filter_deinit(&filter);
+
+	test_end();
+}
+
+static void test_duplicate_filter_expiry(void)
+{
+	struct duplicate_filter *filter;
+	time_t now = 1500000000;
+
+	test_begin("duplicate filter - expiry");
+
+	filter = duplicate_filter_init(TEST_FILTER_PATH, TRUE, 0);
+	test_add_ids(filter, now + 60);
+	test_check_ids(filter, now, TRUE);
+	test_check_ids(filter, now + 2*24*3600, FALSE);
+	duplicate_filter_deinit(&filter);
+
+	test_end();
+}
+
+static void test_duplicate_filter_file(void)
+{
+	struct duplicate_filter *filter, *filter2;
+	time_t now = time(NULL);
+	const char *error;
+
+	test_begin("duplicate filter - file");
+
+	i_unlink_if_exists(TEST_FILTER_PATH);
+
+	/* Create */
+	filter = duplicate_filter_init(TEST_FILTER_PATH, TRUE, 0);
+	test_assert(duplicate_filter_refresh(filter, &error) == 0);
+	test_add_ids(filter, now + 3600);
+	test_assert(duplicate_filter_commit(filter, now, &error) > 0);
+	test_assert(duplicate_filter_is_valid(filter, now));
+
+	/* Read by another instance */
+	filter2 = duplicate_filter_init(TEST_FILTER_PATH, TRUE, 0);
+	test_assert(duplicate_filter_refresh(filter2, &error) > 0);
+	test_assert(duplicate_filter_is_valid(filter2, now));
+	test_check_ids(filter2, now, TRUE);
+	test_check_absent_ids(filter2, now);
+
+	/* Changes that are rolled back are forgotten */
+	duplicate_filter_add(filter2, test_absent_ids[0],
+			     strlen(test_absent_ids[0]), now + 3600);
+	duplicate_filter_rollback(filter2);
+	test_assert(duplicate_filter_refresh(filter2, &error) > 0);
+	test_check_ids(filter2, now, TRUE);
+	test_check_absent_ids(filter2, now);
+
+	/* Changes made by another instance are merged */
+	duplicate_filter_add(filter2, test_absent_ids[1],
+			     strlen(test_absent_ids[1]), now + 3600);
+	test_assert(duplicate_filter_commit(filter2, now, &error) > 0);
+	test_assert(duplicate_filter_refresh(filter, &error) > 0);
+	test_assert(duplicate_filter_may_contain(
+		filter, test_absent_ids[1], strlen(test_absent_ids[1]), now));
+	test_check_ids(filter, now, TRUE);
+
+	duplicate_filter_deinit(&filter);
+	duplicate_filter_deinit(&filter2);
+	i_unlink_if_exists(TEST_FILTER_PATH);
+
+	test_end();
+}
+
+static void test_duplicate_filter_writer(void)
+{
+	struct duplicate_filter *writer, *filter;
+	time_t now = time(NULL);
+	const char *error;
+
+	test_begin("duplicate filter - non-creating writer");
+
+	i_unlink_if_exists(TEST_FILTER_PATH);
+
+	/* A writer that doesn't own the filter doesn't create it */
+	writer = duplicate_filter_init(TEST_FILTER_PATH, FALSE, 0);
+	test_add_ids(writer, now + 3600);
+	test_assert(duplicate_filter_commit(writer, now, &error) == 0);
+	duplicate_filter_deinit(&writer);
+	test_assert(access(TEST_FILTER_PATH, F_OK) < 0 && errno == ENOENT);
+
+	/* Created by its owner */
+	filter = duplicate_filter_init(TEST_FILTER_PATH, TRUE, 0);
+	duplicate_filter_add(filter, test_absent_ids[0],
+			     strlen(test_absent_ids[0]), now + 3600);
+	test_assert(duplicate_filter_commit(filter, now, &error) > 0);
+	duplicate_filter_deinit(&filter);
+
+	/* IDs marked by the writer are seen by the owner */
+	writer = duplicate_filter_init(TEST_FILTER_PATH, FALSE, 0);
+	test_add_ids(writer, now + 3600);
+	test_assert(duplicate_filter_commit(writer, now, &error) > 0);
+	duplicate_filter_deinit(&writer);
+
+	filter = duplicate_filter_init(TEST_FILTER_PATH, TRUE, 3600);
+	test_assert(duplicate_filter_refresh(filter, &error) > 0);
+	test_assert(duplicate_filter_is_valid(filter, now));
+	test_check_ids(filter, now, TRUE);
+	test_check_absent_ids(filter, now);
+	test_assert(duplicate_filter_may_contain(
+		filter, test_absent_ids[0], strlen(test_absent_ids[0]), now));
+	duplicate_filter_deinit(&filter);
+
+	i_unlink_if_exists(TEST_FILTER_PATH);
+
+	test_end();
+}
+
+static void test_duplicate_filter_write_corrupt(void)
+{
+	int fd;
+
+	fd = open(TEST_FILTER_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_FILTER_PATH);
+	if (write_full(fd, "frop", 4) < 0)
+		i_fatal("write(%s) failed: %m", TEST_FILTER_PATH);
+	i_close_fd(&fd);
+}
+
+static void test_duplicate_filter_corrupt(void)
+{
+	struct duplicate_filter *filter, *filter2;
+	time_t now = time(NULL);
+	const char *error;
+
+	test_begin("duplicate filter - corrupt file");
+
+	/* A writer that doesn't own the filter removes it */
+	test_duplicate_filter_write_corrupt();
+	filter = duplicate_filter_init(TEST_FILTER_PATH, FALSE, 0);
+	test_add_ids(filter, now + 3600);
+	test_assert(duplicate_filter_commit(filter, now, &error) < 0);
+	duplicate_filter_deinit(&filter);
+	test_assert(access(TEST_FILTER_PATH, F_OK) < 0 && errno == ENOENT);
+
+	/* The owner rebuilds it with a new warmup */
+	test_duplicate_filter_write_corrupt();
+	filter = duplicate_filter_init(TEST_FILTER_PATH, TRUE, 3600);
+	test_assert(duplicate_filter_refresh(filter, &error) < 0);
+	test_assert(!duplicate_filter_is_valid(filter, now));
+	test_add_ids(filter, now + 7200);
+	test_assert(duplicate_filter_commit(filter, now, &error) > 0);
+	test_assert(!duplicate_filter_is_valid(filter, now));
+	test_assert(!duplicate_filter_is_valid(filter, now + 3599));
+	test_assert(duplicate_filter_is_valid(filter, now + 3600));
+
+	filter2 = duplicate_filter_init(TEST_FILTER_PATH, TRUE, 3600);
+	test_assert(duplicate_filter_refresh(filter2, &error) > 0);
+	test_assert(!duplicate_filter_is_valid(filter2, now));
+	test_assert(duplicate_filter_is_valid(filter2, now + 3600));
+	test_check_ids(filter2, now, TRUE);
+
+	duplicate_filter_deinit(&filter);
+	duplicate_filter_deinit(&filter2);
+	i_unlink_if_exists(TEST_FILTER_PATH);
+
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_duplicate_filter_lookup,
+		test_duplicate_filter_expiry,
+		test_duplicate_filter_file,
+		test_duplicate_filter_writer,
+		test_duplicate_filter_corrupt,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,131 @@
+/* Copyright (c) 2018 Pigeonhole authors, see the included COPYING file */
+
+#include "lib.h"
+#include "test-common.h"
+#include "unlink-directory.h"
+
+#include "duplicate-log.h"
+
+#define TEST_LOG_PATH ".test-duplicate-log"
+
+static void test_log_cleanup(void)
+{
+	const char *error;
+
+	if (unlink_directory(TEST_LOG_PATH, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_fatal("unlink_directory(%s) failed: %s", TEST_LOG_PATH, error);
+}
+
+static int
+test_check(struct duplicate_log *dlog, const char *id, time_t now)
+{
+	struct duplicate_log_transaction *trans;
+	const char *error;
+	int ret;
+
+	trans = duplicate_log_transaction_begin(dlog);
+	ret = duplicate_log_check(trans, id, strlen(id), now, &error);
+	duplicate_log_transaction_rollback(&trans);
+	return ret;
+}
+
+static void test_duplicate_log_mark(void)
+{
+	struct duplicate_log *dlog, *dlog2;
+	struct duplicate_log_transaction *trans;
+	time_t now = time(NULL);
+	const char *error;
+
+	test_begin("duplicate log - mark");
+
+	test_log_cleanup();
+	dlog = duplicate_log_init(TEST_LOG_PATH);
+	dlog2 = duplicate_log_init(TEST_LOG_PATH);
+
+	test_assert(test_check(dlog, "frop", now) == 0);
+
+	/* Marks are visible within the transaction */
+	trans = duplicate_log_transaction_begin(dlog);
+	duplicate_log_mark(trans, "frop", 4, now + 3600);
+	duplicate_log_mark(trans, "friep", 5, now + 3600);
+	test_assert(duplicate_log_check(trans, "frop", 4, now, &error) == 1);
+	test_assert(test_check(dlog2, "frop", now) == 0);
+	test_assert(duplicate_log_transaction_commit(&trans, &error) == 0);
+
+	/* ... and to others after commit */
+	test_assert(test_check(dlog, "frop", now) == 1);
+	test_assert(test_check(dlog2, "frop", now) == 1);
+	test_assert(test_check(dlog2, "friep", now) == 1);
+	test_assert(test_check(dlog2, "frml", now) == 0);
+
+	/* Expiry */
+	test_assert(test_check(dlog2, "frop", now + 7200) == 0);
+
+	/* Rollback */
+	trans = duplicate_log_transaction_begin(dlog);
+	duplicate_log_mark(trans, "frml", 4, now + 3600);
+	duplicate_log_transaction_rollback(&trans);
+	test_assert(test_check(dlog2, "frml", now) == 0);
+
+	/* Marking again updates the expiry time */
+	trans = duplicate_log_transaction_begin(dlog2);
+	duplicate_log_mark(trans, "frop", 4, now + 10800);
+	test_assert(duplicate_log_transaction_commit(&trans, &error) == 0);
+	test_assert(test_check(dlog, "frop", now + 7200) == 1);
+
+	duplicate_log_deinit(&dlog);
+	duplicate_log_deinit(&dlog2);
+	test_log_cleanup();
+
+	test_end();
+}
+
+static void test_duplicate_log_compact(void)
+{
+	struct duplicate_log *dlog, *dlog2;
+	struct duplicate_log_transaction *trans;
+	time_t now = time(NULL);
+	const char *error;
+	unsigned int i;
+
+	test_begin("duplicate log - compact");
+
+	test_log_cleanup();
+	dlog = duplicate_log_init(TEST_LOG_PATH);
+	dlog2 = duplicate_log_init(TEST_LOG_PATH);
+
+	trans = duplicate_log_transaction_begin(dlog);
+	duplicate_log_mark(trans, "live", 4, now + 3600);
+	test_assert(duplicate_log_transaction_commit(&trans, &error) == 0);
+	test_assert(test_check(dlog2, "live", now) == 1);
+
+	/* Plenty of expired entries trigger compaction of each shard */
+	trans = duplicate_log_transaction_begin(dlog);
+	for (i = 0; i < 40000; i++) {
+		const char *id = t_strdup_printf("expired-%u", i);
+
+		duplicate_log_mark(trans, id, strlen(id), now - 1);
+	}
+	test_assert(duplicate_log_transaction_commit(&trans, &error) == 0);
+
+	test_assert(test_check(dlog, "live", now) == 1);
+	test_assert(test_check(dlog2, "live", now) == 1);
+	test_assert(test_check(dlog2, "expired-1", now) == 0);
+
+	duplicate_log_deinit(&dlog);
+	duplicate_log_deinit(&dlog2);
+	test_log_cleanup();
+
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_duplicate_log_mark,
+		test_duplicate_log_compact,
+		NULL
+	};
+	return test_run(test_functions);
+}
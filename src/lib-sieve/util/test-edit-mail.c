@@ -865,6 +865,142 @@ static void test_edit_mail_empty(void)
 	test_end();
 }
 
+static void test_edit_mail_absent_header(void)
+{
+	static const char *msg =
+		"From: stephan@example.com\r\n"
+		"To: timo@example.com\r\n"
+		"Subject: Frop!\r\n"
+		"\r\n"
+		"Frop!\r\n";
+	static const char *msg_added =
+		"From: stephan@example.com\r\n"
+		"To: timo@example.com\r\n"
+		"Subject: Frop!\r\n"
+		"X-Spam: yes\r\n"
+		"\r\n"
+		"Frop!\r\n";
+	struct istream *input_msg, *input_mail;
+	buffer_t *buffer;
+	struct mail_raw *rawmail;
+	struct edit_mail *edmail;
+	struct edit_mail_header_iter *edhiter;
+	struct mail *mail;
+	const char *value;
+
+	test_begin("edit-mail - absent header");
+	test_init();
+
+	input_msg = i_stream_create_from_data(msg, strlen(msg));
+	rawmail = mail_raw_open_stream(test_raw_mail_user, input_msg);
+	edmail = edit_mail_wrap(rawmail->mail);
+
+	/* Nothing to delete or replace */
+	test_assert(edit_mail_header_delete(edmail, "X-Spam", 0) == 0);
+	test_assert(edit_mail_header_replace(edmail, "X-Spam", 0,
+					     NULL, "no") == 0);
+	test_assert(edit_mail_headers_iterate_init(edmail, "X-Spam", FALSE,
+						   &edhiter) == 0);
+
+	/* Append it and delete an absent header once more */
+	edit_mail_header_add(edmail, "X-Spam", "yes", TRUE);
+	test_assert(edit_mail_header_delete(edmail, "X-Frop", 0) == 0);
+
+	mail = edit_mail_get_mail(edmail);
+	test_assert(mail_get_first_header(mail, "X-Spam", &value) > 0 &&
+		    strcmp(value, "yes") == 0);
+	test_assert(mail_get_first_header(mail, "Subject", &value) > 0 &&
+		    strcmp(value, "Frop!") == 0);
+
+	if (mail_get_stream(mail, NULL, NULL, &input_mail) < 0) {
+		i_fatal("Failed to open mail stream: %s",
+			mailbox_get_last_error(mail->box, NULL));
+	}
+
+	buffer = buffer_create_dynamic(default_pool, 1024);
+	test_stream_data(input_mail, buffer);
+	test_out("stream", strcmp(str_c(buffer), msg_added) == 0);
+
+	/* Deleting the present header still works */
+	test_assert(edit_mail_header_delete(edmail, "X-Spam", 0) == 1);
+
+	buffer_free(&buffer);
+	edit_mail_unwrap(&edmail);
+	mail_raw_close(&rawmail);
+	i_stream_unref(&input_msg);
+	test_deinit();
+	test_end();
+}
+
+static void test_edit_mail_indexed_header(void)
+{
+	static const char *msg =
+		"X-A: 1\r\n"
+		"X-B: 1\r\n"
+		"X-A: 2\r\n"
+		"X-B: 2\r\n"
+		"X-A: 3\r\n"
+		"X-A: 4\r\n"
+		"Subject: Frop!\r\n"
+		"\r\n"
+		"Frop!\r\n";
+	static const char *msg_edited =
+		"X-A: 1\r\n"
+		"X-B: 1\r\n"
+		"X-A: 3\r\n"
+		"Subject: Frop!\r\n"
+		"X-A: 5\r\n"
+		"\r\n"
+		"Frop!\r\n";
+	struct istream *input_msg, *input_mail;
+	buffer_t *buffer;
+	struct mail_raw *rawmail;
+	struct edit_mail *edmail;
+	struct mail *mail;
+	const char *const *values;
+
+	test_begin("edit-mail - indexed header");
+	test_init();
+
+	input_msg = i_stream_create_from_data(msg, strlen(msg));
+	rawmail = mail_raw_open_stream(test_raw_mail_user, input_msg);
+	edmail = edit_mail_wrap(rawmail->mail);
+
+	/* Delete the second and the last occurrence */
+	test_assert(edit_mail_header_delete(edmail, "X-A", 2) == 1);
+	test_assert(edit_mail_header_delete(edmail, "X-A", -1) == 1);
+	test_assert(edit_mail_header_delete(edmail, "X-A", 5) == 0);
+
+	/* Renamed field ends up in message order among the X-A fields */
+	test_assert(edit_mail_header_replace(edmail, "X-B", 2,
+					     "X-A", NULL) == 1);
+	mail = edit_mail_get_mail(edmail);
+	test_assert(mail_get_headers_utf8(mail, "X-A", &values) > 0 &&
+		    str_array_length(values) == 3 &&
+		    strcmp(values[0], "1") == 0 &&
+		    strcmp(values[1], "2") == 0 &&
+		    strcmp(values[2], "3") == 0);
+
+	test_assert(edit_mail_header_delete(edmail, "X-A", 2) == 1);
+	edit_mail_header_add(edmail, "X-A", "5", TRUE);
+
+	if (mail_get_stream(mail, NULL, NULL, &input_mail) < 0) {
+		i_fatal("Failed to open mail stream: %s",
+			mailbox_get_last_error(mail->box, NULL));
+	}
+
+	buffer = buffer_create_dynamic(default_pool, 1024);
+	test_stream_data(input_mail, buffer);
+	test_out("stream", strcmp(str_c(buffer), msg_edited) == 0);
+
+	buffer_free(&buffer);
+	edit_mail_unwrap(&edmail);
+	mail_raw_close(&rawmail);
+	i_stream_unref(&input_msg);
+	test_deinit();
+	test_end();
+}
+
 int main(int argc, char *argv[])
 {
 	static void (*test_functions[])(void) = {
@@ -872,6 +1008,8 @@ int main(int argc, char *argv[])
 		test_edit_mail_big_header,
 		test_edit_mail_small_buffer,
 		test_edit_mail_empty,
+		test_edit_mail_absent_header,
+		test_edit_mail_indexed_header,
 		NULL
 	};
 	const enum master_service_flags service_flags =
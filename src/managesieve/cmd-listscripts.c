@@ -3,6 +3,7 @@
 
 #include "lib.h"
 #include "str.h"
+#include "ostream.h"
 
 #include "sieve.h"
 #include "sieve-storage.h"
@@ -12,30 +13,53 @@
 #include "managesieve-common.h"
 #include "managesieve-commands.h"
 
-bool cmd_listscripts(struct client_command_context *cmd)
+struct cmd_listscripts_context {
+	struct client_command_context *cmd;
+	struct sieve_storage_list_context *list;
+	unsigned int script_count;
+};
+
+static bool cmd_listscripts_finish(struct cmd_listscripts_context *ctx)
 {
+	struct client_command_context *cmd = ctx->cmd;
 	struct client *client = cmd->client;
-	struct sieve_storage_list_context *ctx;
-	const char *scriptname;
-	unsigned int script_count = 0;
-	bool active;
-	string_t *str;
+	int ret;
 
-	/* no arguments */
-	if (!client_read_no_args(cmd))
-		return FALSE;
+	ret = sieve_storage_list_deinit(&ctx->list);
 
-	if ((ctx = sieve_storage_list_init(client->storage)) == NULL) {
+	if (client->output->closed)
+		return TRUE;
+	if (ret < 0) {
 		client_command_storage_error(
 			cmd, "Failed to list scripts");
 		return TRUE;
 	}
 
-	/* FIXME: This will be quite slow for large script lists. Implement
-	 * some buffering to fix this. Wont truely be an issue with managesieve
-	 * though.
-	 */
-	while ((scriptname = sieve_storage_list_next(ctx, &active)) != NULL) {
+	struct event_passthrough *e =
+		client_command_create_finish_event(cmd);
+	e_debug(e->event(), "Listed %u scripts", ctx->script_count);
+
+	client_send_ok(client, "Listscripts completed.");
+	return TRUE;
+}
+
+static bool cmd_listscripts_continue(struct client_command_context *cmd)
+{
+	struct client *client = cmd->client;
+	struct cmd_listscripts_context *ctx = cmd->context;
+	const char *scriptname;
+	bool active;
+	string_t *str;
+
+	/* Write script lines for as long as the output buffer has room; the
+	   command is continued once the client has read them */
+	while (!client->output->closed &&
+	       o_stream_get_buffer_used_size(client->output) <
+	       CLIENT_OUTPUT_OPTIMAL_SIZE) {
+		scriptname = sieve_storage_list_next(ctx->list, &active);
+		if (scriptname == NULL)
+			return cmd_listscripts_finish(ctx);
+
 		T_BEGIN {
 			str = t_str_new(128);
 
@@ -43,23 +67,43 @@ bool cmd_listscripts(struct client_command_context *cmd)
 
 			if (active)
 				str_append(str, " ACTIVE");
+			str_append(str, "\r\n");
 
-			client_send_line(client, str_c(str));
+			o_stream_nsend(client->output,
+				       str_data(str), str_len(str));
 		} T_END;
 
-		script_count++;
+		ctx->script_count++;
 	}
 
-	if (sieve_storage_list_deinit(&ctx) < 0) {
+	if (client->output->closed)
+		return cmd_listscripts_finish(ctx);
+	return FALSE;
+}
+
+bool cmd_listscripts(struct client_command_context *cmd)
+{
+	struct client *client = cmd->client;
+	struct cmd_listscripts_context *ctx;
+	struct sieve_storage_list_context *list;
+
+	/* no arguments */
+	if (!client_read_no_args(cmd))
+		return FALSE;
+
+	if ((list = sieve_storage_list_init(client->storage)) == NULL) {
 		client_command_storage_error(
 			cmd, "Failed to list scripts");
 		return TRUE;
 	}
 
-	struct event_passthrough *e =
-		client_command_create_finish_event(cmd);
-	e_debug(e->event(), "Listed %u scripts", script_count);
+	ctx = p_new(cmd->pool, struct cmd_listscripts_context, 1);
+	ctx->cmd = cmd;
+	ctx->list = list;
 
-	client_send_ok(client, "Listscripts completed.");
-	return TRUE;
+	client->command_pending = TRUE;
+	cmd->func = cmd_listscripts_continue;
+	cmd->context = ctx;
+
+	return cmd_listscripts_continue(cmd);
 }
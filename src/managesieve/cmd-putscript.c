@@ -22,6 +22,7 @@
 #include "managesieve-client.h"
 #include "managesieve-commands.h"
 #include "managesieve-quota.h"
+#include "managesieve-compile-cache.h"
 
 #include <sys/time.h>
 
@@ -178,8 +179,11 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 	struct sieve_error_handler *ehandler;
 	enum sieve_compile_flags cpflags =
 		SIEVE_COMPILE_FLAG_NOGLOBAL | SIEVE_COMPILE_FLAG_UPLOADED;
-	struct sieve_binary *sbin;
-	bool success = TRUE;
+	struct sieve_binary *sbin = NULL;
+	unsigned char digest[MD5_RESULTLEN];
+	bool success = TRUE, have_digest, cached = FALSE;
+	unsigned int warnings = 0;
+	const char *cached_warnings;
 	enum sieve_error error;
 	string_t *errors;
 
@@ -194,9 +198,20 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 		client->svinst, errors, TRUE,
 		client->set->managesieve_max_compile_errors);
 
-	/* Compile */
-	sbin = sieve_compile_script(script, ehandler, cpflags, &error);
-	if (sbin == NULL) {
+	/* Skip compilation if the same script was compiled before */
+	have_digest = (managesieve_compile_cache_digest(script, digest) == 0);
+	if (have_digest &&
+	    managesieve_compile_cache_lookup(client, digest, cpflags,
+					     &warnings, &cached_warnings)) {
+		e_debug(cmd->event, "Script was compiled before; "
+			"using cached compile result");
+		str_append(errors, cached_warnings);
+		cached = TRUE;
+	} else {
+		/* Compile */
+		sbin = sieve_compile_script(script, ehandler, cpflags, &error);
+	}
+	if (!cached && sbin == NULL) {
 		const char *errormsg = NULL, *action;
 
 		if (error != SIEVE_ERROR_NOT_VALID) {
@@ -236,7 +251,15 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 
 		success = FALSE;
 	} else {
-		sieve_close(&sbin);
+		if (sbin != NULL) {
+			warnings = sieve_get_warnings(ehandler);
+			if (have_digest) {
+				managesieve_compile_cache_add(
+					client, digest, cpflags, sbin,
+					warnings, str_c(errors));
+			}
+			sieve_close(&sbin);
+		}
 
 		if (!cmd_putscript_save(ctx))
 			success = FALSE;
@@ -258,18 +281,16 @@ cmd_putscript_finish_script(struct cmd_putscript_context *ctx,
 		struct event_passthrough *e =
 			client_command_create_finish_event(cmd)->
 			add_int("script_size", ctx->script_size)->
-			add_int("compile_warnings",
-				sieve_get_warnings(ehandler));
+			add_int("compile_warnings", warnings);
 		if (ctx->scriptname != NULL) {
 			e_debug(e->event(), "Stored script `%s' successfully "
-				"(%u warnings)", ctx->scriptname,
-				sieve_get_warnings(ehandler));
+				"(%u warnings)", ctx->scriptname, warnings);
 		} else {
 			e_debug(e->event(), "Checked script successfully "
-				"(%u warnings)", sieve_get_warnings(ehandler));
+				"(%u warnings)", warnings);
 		}
 
-		if (sieve_get_warnings(ehandler) > 0)
+		if (warnings > 0)
 			client_send_okresp(client, "WARNINGS", str_c(errors));
 		else if (ctx->scriptname != NULL)
 			client_send_ok(client, "PUTSCRIPT completed.");
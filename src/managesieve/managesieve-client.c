@@ -25,6 +25,7 @@
 #include "managesieve-common.h"
 #include "managesieve-commands.h"
 #include "managesieve-client.h"
+#include "managesieve-compile-cache.h"
 
 #include <unistd.h>
 
@@ -276,6 +277,7 @@ void client_destroy(struct client *client, const char *reason)
 	i_stream_destroy(&client->input);
 	o_stream_destroy(&client->output);
 
+	managesieve_compile_cache_free(client);
 	sieve_storage_unref(&client->storage);
 	sieve_deinit(&client->svinst);
 
@@ -714,8 +716,13 @@ void client_input(struct client *client)
 	switch (i_stream_read(client->input)) {
 	case -1:
 		/* disconnected */
-		client_destroy(client, NULL);
-		return;
+		if (i_stream_get_data_size(client->input) == 0) {
+			client_destroy(client, NULL);
+			return;
+		}
+		/* pipelined commands are still buffered; execute those
+		   first */
+		break;
 	case -2:
 		/* parameter word is longer than max. input buffer size.
 		   this is most likely an error, so skip the new data
@@ -742,6 +749,11 @@ void client_input(struct client *client)
 
 	if (client->output->closed)
 		client_destroy(client, NULL);
+	else if (client->input->eof && !client->command_pending &&
+		 !client->disconnected) {
+		/* the remaining input is not a complete command */
+		client_destroy(client, NULL);
+	}
 }
 
 int client_output(struct client *client)
@@ -59,6 +59,7 @@ struct client {
 
 	struct sieve_instance *svinst;
 	struct sieve_storage *storage;
+	struct managesieve_compile_cache *compile_cache;
 
 	time_t last_input, last_output;
 	unsigned int bad_counter;
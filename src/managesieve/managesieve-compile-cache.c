@@ -0,0 +1,150 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "istream.h"
+#include "md5.h"
+
+#include "sieve.h"
+#include "sieve-extensions.h"
+#include "sieve-binary.h"
+#include "sieve-script.h"
+
+#include "managesieve-client.h"
+#include "managesieve-compile-cache.h"
+
+/* Clients commonly check a script using CHECKSCRIPT and then upload the very
+   same script using PUTSCRIPT. The second compilation is avoided by
+   remembering the result of the first, keyed by the digest of the script
+   content. Only successful compilations are remembered, and only for
+   scripts that didn't include other scripts, since those can change in the
+   mean time. */
+
+struct managesieve_compile_cache_entry {
+	unsigned char digest[MD5_RESULTLEN];
+	enum sieve_compile_flags cpflags;
+
+	unsigned int warning_count;
+	char *warnings;
+};
+
+struct managesieve_compile_cache {
+	/* Most recently used first */
+	ARRAY(struct managesieve_compile_cache_entry) entries;
+};
+
+int managesieve_compile_cache_digest(struct sieve_script *script,
+				     unsigned char digest_r[MD5_RESULTLEN])
+{
+	struct md5_context md5ctx;
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	int ret = 0;
+
+	if (sieve_script_get_stream(script, &input, NULL) < 0)
+		return -1;
+
+	md5_init(&md5ctx);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		md5_update(&md5ctx, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0 || !input->eof)
+		ret = -1;
+	md5_final(&md5ctx, digest_r);
+
+	i_stream_seek(input, 0);
+	return ret;
+}
+
+bool managesieve_compile_cache_lookup(struct client *client,
+				      const unsigned char digest[MD5_RESULTLEN],
+				      enum sieve_compile_flags cpflags,
+				      unsigned int *warning_count_r,
+				      const char **warnings_r)
+{
+	struct managesieve_compile_cache *cache = client->compile_cache;
+	struct managesieve_compile_cache_entry *entries, entry;
+	unsigned int count, i;
+
+	if (cache == NULL)
+		return FALSE;
+
+	entries = array_get_modifiable(&cache->entries, &count);
+	for (i = 0; i < count; i++) {
+		if (entries[i].cpflags == cpflags &&
+		    memcmp(entries[i].digest, digest, MD5_RESULTLEN) == 0)
+			break;
+	}
+	if (i == count)
+		return FALSE;
+
+	/* Move to front */
+	if (i > 0) {
+		entry = entries[i];
+		array_delete(&cache->entries, i, 1);
+		array_insert(&cache->entries, 0, &entry, 1);
+	}
+
+	entries = array_front_modifiable(&cache->entries);
+	*warning_count_r = entries->warning_count;
+	*warnings_r = entries->warnings;
+	return TRUE;
+}
+
+void managesieve_compile_cache_add(struct client *client,
+				   const unsigned char digest[MD5_RESULTLEN],
+				   enum sieve_compile_flags cpflags,
+				   struct sieve_binary *sbin,
+				   unsigned int warning_count,
+				   const char *warnings)
+{
+	struct managesieve_compile_cache *cache = client->compile_cache;
+	struct managesieve_compile_cache_entry entry, *last;
+	const struct sieve_extension *include_ext;
+	unsigned int count;
+
+	include_ext = sieve_extension_get_by_name(client->svinst, "include");
+	if (include_ext != NULL &&
+	    sieve_binary_extension_get_index(sbin, include_ext) >= 0)
+		return;
+
+	if (cache == NULL) {
+		cache = client->compile_cache =
+			i_new(struct managesieve_compile_cache, 1);
+		i_array_init(&cache->entries,
+			     MANAGESIEVE_COMPILE_CACHE_MAX_ENTRIES);
+	}
+
+	/* Evict the least recently used entry */
+	count = array_count(&cache->entries);
+	if (count >= MANAGESIEVE_COMPILE_CACHE_MAX_ENTRIES) {
+		last = array_idx_modifiable(&cache->entries, count - 1);
+		i_free(last->warnings);
+		array_delete(&cache->entries, count - 1, 1);
+	}
+
+	i_zero(&entry);
+	memcpy(entry.digest, digest, MD5_RESULTLEN);
+	entry.cpflags = cpflags;
+	entry.warning_count = warning_count;
+	entry.warnings = i_strdup(warnings);
+	array_insert(&cache->entries, 0, &entry, 1);
+}
+
+void managesieve_compile_cache_free(struct client *client)
+{
+	struct managesieve_compile_cache *cache = client->compile_cache;
+	struct managesieve_compile_cache_entry *entry;
+
+	if (cache == NULL)
+		return;
+	client->compile_cache = NULL;
+
+	array_foreach_modifiable(&cache->entries, entry)
+		i_free(entry->warnings);
+	array_free(&cache->entries);
+	i_free(cache);
+}
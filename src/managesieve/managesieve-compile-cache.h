@@ -0,0 +1,33 @@
+#ifndef MANAGESIEVE_COMPILE_CACHE_H
+#define MANAGESIEVE_COMPILE_CACHE_H
+
+#include "md5.h"
+
+/* Number of successful compile results remembered per client */
+#define MANAGESIEVE_COMPILE_CACHE_MAX_ENTRIES 8
+
+struct managesieve_compile_cache;
+
+/* Compute the digest of the script content by which compile results are
+   cached. The script stream is rewound afterwards. */
+int managesieve_compile_cache_digest(struct sieve_script *script,
+				     unsigned char digest_r[MD5_RESULTLEN]);
+
+/* Returns TRUE if a script with the same content was compiled successfully
+   with the same flags before. The warnings it produced are returned. */
+bool managesieve_compile_cache_lookup(struct client *client,
+				      const unsigned char digest[MD5_RESULTLEN],
+				      enum sieve_compile_flags cpflags,
+				      unsigned int *warning_count_r,
+				      const char **warnings_r);
+/* Remember the successful compilation of the script. */
+void managesieve_compile_cache_add(struct client *client,
+				   const unsigned char digest[MD5_RESULTLEN],
+				   enum sieve_compile_flags cpflags,
+				   struct sieve_binary *sbin,
+				   unsigned int warning_count,
+				   const char *warnings);
+
+void managesieve_compile_cache_free(struct client *client);
+
+#endif
@@ -0,0 +1,306 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "doveadm-print.h"
+#include "doveadm-mail.h"
+
+#include "sieve.h"
+#include "sieve-script.h"
+#include "sieve-storage.h"
+
+#include "doveadm-sieve-cmd.h"
+
+#include <time.h>
+
+/* Measures the cost of the storage operations that are performed for each
+   delivery and ManageSieve login, so that storage backends and caching can be
+   compared. Samples are collected for all users and reported per storage
+   driver once all users are processed. Only phases that could be performed
+   are sampled; a missing active script or binary counts as a sample, since
+   these negative lookups are part of the cost of delivery. */
+
+enum cmd_sieve_benchmark_phase {
+	CMD_SIEVE_BENCHMARK_PHASE_STORAGE = 0,
+	CMD_SIEVE_BENCHMARK_PHASE_ACTIVE_SCRIPT,
+	CMD_SIEVE_BENCHMARK_PHASE_BINARY,
+	CMD_SIEVE_BENCHMARK_PHASE_LIST,
+
+	CMD_SIEVE_BENCHMARK_PHASE_COUNT
+};
+
+static const char *const cmd_sieve_benchmark_phase_names[] = {
+	"storage",
+	"active-script",
+	"binary",
+	"list",
+};
+static_assert_array_size(cmd_sieve_benchmark_phase_names,
+			 CMD_SIEVE_BENCHMARK_PHASE_COUNT);
+
+struct cmd_sieve_benchmark_backend {
+	const char *driver_name;
+
+	ARRAY(uint64_t) samples[CMD_SIEVE_BENCHMARK_PHASE_COUNT];
+	unsigned int failures[CMD_SIEVE_BENCHMARK_PHASE_COUNT];
+};
+
+struct doveadm_sieve_benchmark_cmd_context {
+	struct doveadm_sieve_cmd_context ctx;
+
+	unsigned int iterations;
+	ARRAY(struct cmd_sieve_benchmark_backend) backends;
+};
+
+static uint64_t cmd_sieve_benchmark_now(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static struct cmd_sieve_benchmark_backend *
+cmd_sieve_benchmark_backend_get(struct doveadm_sieve_benchmark_cmd_context *ctx,
+				const char *driver_name)
+{
+	pool_t pool = ctx->ctx.ctx.pool;
+	struct cmd_sieve_benchmark_backend *backend;
+	unsigned int i;
+
+	array_foreach_modifiable(&ctx->backends, backend) {
+		if (strcmp(backend->driver_name, driver_name) == 0)
+			return backend;
+	}
+
+	backend = array_append_space(&ctx->backends);
+	backend->driver_name = p_strdup(pool, driver_name);
+	for (i = 0; i < CMD_SIEVE_BENCHMARK_PHASE_COUNT; i++)
+		p_array_init(&backend->samples[i], pool, 64);
+	return backend;
+}
+
+static void
+cmd_sieve_benchmark_add(struct cmd_sieve_benchmark_backend *backend,
+			enum cmd_sieve_benchmark_phase phase,
+			uint64_t start, bool failed)
+{
+	uint64_t usecs = cmd_sieve_benchmark_now() - start;
+
+	array_append(&backend->samples[phase], &usecs, 1);
+	if (failed)
+		backend->failures[phase]++;
+}
+
+static void
+cmd_sieve_benchmark_storage(struct doveadm_sieve_benchmark_cmd_context *ctx,
+			    struct sieve_storage *storage, uint64_t start)
+{
+	struct doveadm_sieve_cmd_context *_ctx = &ctx->ctx;
+	struct event *event = _ctx->ctx.cctx->event;
+	struct cmd_sieve_benchmark_backend *backend;
+	struct sieve_storage_list_context *lctx;
+	struct sieve_script *script;
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+	bool active, list_failed = TRUE;
+
+	backend = cmd_sieve_benchmark_backend_get(
+		ctx, sieve_storage_driver_name(storage));
+	cmd_sieve_benchmark_add(backend, CMD_SIEVE_BENCHMARK_PHASE_STORAGE,
+				start, FALSE);
+
+	/* Active script */
+	start = cmd_sieve_benchmark_now();
+	script = sieve_storage_active_script_open(storage, &error);
+	cmd_sieve_benchmark_add(backend, CMD_SIEVE_BENCHMARK_PHASE_ACTIVE_SCRIPT,
+				start, (script == NULL &&
+					error != SIEVE_ERROR_NOT_FOUND));
+	if (script == NULL && error != SIEVE_ERROR_NOT_FOUND) {
+		e_error(event, "Failed to open active Sieve script: %s",
+			sieve_storage_get_last_error(storage, &error));
+	}
+
+	/* Binary */
+	if (script != NULL) {
+		start = cmd_sieve_benchmark_now();
+		sbin = sieve_script_binary_load(script, &error);
+		cmd_sieve_benchmark_add(backend,
+					CMD_SIEVE_BENCHMARK_PHASE_BINARY, start,
+					(sbin == NULL &&
+					 error != SIEVE_ERROR_NOT_FOUND));
+		if (sbin != NULL)
+			sieve_close(&sbin);
+		sieve_script_unref(&script);
+	}
+
+	/* Listing */
+	start = cmd_sieve_benchmark_now();
+	lctx = sieve_storage_list_init(storage);
+	if (lctx != NULL) {
+		while (sieve_storage_list_next(lctx, &active) != NULL);
+		list_failed = (sieve_storage_list_deinit(&lctx) < 0);
+	}
+	cmd_sieve_benchmark_add(backend, CMD_SIEVE_BENCHMARK_PHASE_LIST,
+				start, list_failed);
+	if (list_failed) {
+		e_error(event, "Listing Sieve scripts failed: %s",
+			sieve_storage_get_last_error(storage, &error));
+	}
+}
+
+static int cmd_sieve_benchmark_run(struct doveadm_sieve_cmd_context *_ctx)
+{
+	struct doveadm_sieve_benchmark_cmd_context *ctx =
+		container_of(_ctx, struct doveadm_sieve_benchmark_cmd_context,
+			     ctx);
+	struct mail_user *user = _ctx->ctx.cur_mail_user;
+	struct event *event = _ctx->ctx.cctx->event;
+	struct cmd_sieve_benchmark_backend *backend;
+	struct sieve_storage *storage;
+	enum sieve_error error;
+	unsigned int i;
+	uint64_t start;
+	int ret = 0;
+
+	for (i = 0; i < ctx->iterations; i++) {
+		start = cmd_sieve_benchmark_now();
+		storage = sieve_storage_create_main(_ctx->svinst, user, 0,
+						    &error);
+		if (storage != NULL) {
+			cmd_sieve_benchmark_storage(ctx, storage, start);
+			sieve_storage_unref(&storage);
+			continue;
+		}
+
+		/* The driver is not known when the storage cannot be
+		   created */
+		backend = cmd_sieve_benchmark_backend_get(ctx, "-");
+		if (error == SIEVE_ERROR_NOT_POSSIBLE ||
+		    error == SIEVE_ERROR_NOT_FOUND) {
+			/* Sieve is disabled or unavailable for this user */
+			cmd_sieve_benchmark_add(
+				backend, CMD_SIEVE_BENCHMARK_PHASE_STORAGE,
+				start, FALSE);
+			break;
+		}
+		cmd_sieve_benchmark_add(backend,
+					CMD_SIEVE_BENCHMARK_PHASE_STORAGE,
+					start, TRUE);
+		e_error(event, "Failed to open Sieve storage.");
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		ret = -1;
+		break;
+	}
+	return ret;
+}
+
+static int uint64_cmp_p(const uint64_t *v1, const uint64_t *v2)
+{
+	if (*v1 < *v2)
+		return -1;
+	if (*v1 > *v2)
+		return 1;
+	return 0;
+}
+
+static uint64_t
+cmd_sieve_benchmark_percentile(const uint64_t *samples, unsigned int count,
+			       unsigned int percentile)
+{
+	unsigned int rank;
+
+	/* Nearest-rank method */
+	rank = (count * percentile + 99) / 100;
+	if (rank > 0)
+		rank--;
+	return samples[rank];
+}
+
+static void cmd_sieve_benchmark_deinit(struct doveadm_mail_cmd_context *_ctx)
+{
+	struct doveadm_sieve_benchmark_cmd_context *ctx =
+		container_of(_ctx, struct doveadm_sieve_benchmark_cmd_context,
+			     ctx.ctx);
+	struct cmd_sieve_benchmark_backend *backend;
+	const uint64_t *samples;
+	unsigned int i, count;
+
+	array_foreach_modifiable(&ctx->backends, backend) {
+		for (i = 0; i < CMD_SIEVE_BENCHMARK_PHASE_COUNT; i++) {
+			array_sort(&backend->samples[i], uint64_cmp_p);
+			samples = array_get(&backend->samples[i], &count);
+			if (count == 0)
+				continue;
+
+			doveadm_print(backend->driver_name);
+			doveadm_print(cmd_sieve_benchmark_phase_names[i]);
+			doveadm_print_num(count);
+			doveadm_print_num(backend->failures[i]);
+			doveadm_print_num(cmd_sieve_benchmark_percentile(
+				samples, count, 50));
+			doveadm_print_num(cmd_sieve_benchmark_percentile(
+				samples, count, 99));
+			doveadm_print_num(samples[count - 1]);
+		}
+	}
+}
+
+static void cmd_sieve_benchmark_init(struct doveadm_mail_cmd_context *_ctx)
+{
+	struct doveadm_cmd_context *cctx = _ctx->cctx;
+	struct doveadm_sieve_benchmark_cmd_context *ctx =
+		container_of(_ctx, struct doveadm_sieve_benchmark_cmd_context,
+			     ctx.ctx);
+	int64_t iterations;
+
+	ctx->iterations = 1;
+	if (doveadm_cmd_param_int64(cctx, "iterations", &iterations)) {
+		if (iterations <= 0 || iterations > UINT_MAX) {
+			doveadm_mail_help_name("sieve benchmark");
+			i_unreached();
+		}
+		ctx->iterations = (unsigned int)iterations;
+	}
+
+	p_array_init(&ctx->backends, _ctx->pool, 4);
+
+	doveadm_print_header("backend", "backend", 0);
+	doveadm_print_header("phase", "phase", 0);
+	doveadm_print_header("count", "count",
+			     DOVEADM_PRINT_HEADER_FLAG_RIGHT_JUSTIFY);
+	doveadm_print_header("failed", "failed",
+			     DOVEADM_PRINT_HEADER_FLAG_RIGHT_JUSTIFY);
+	doveadm_print_header("p50_usecs", "p50 (us)",
+			     DOVEADM_PRINT_HEADER_FLAG_RIGHT_JUSTIFY);
+	doveadm_print_header("p99_usecs", "p99 (us)",
+			     DOVEADM_PRINT_HEADER_FLAG_RIGHT_JUSTIFY);
+	doveadm_print_header("max_usecs", "max (us)",
+			     DOVEADM_PRINT_HEADER_FLAG_RIGHT_JUSTIFY);
+}
+
+static struct doveadm_mail_cmd_context *cmd_sieve_benchmark_alloc(void)
+{
+	struct doveadm_sieve_benchmark_cmd_context *ctx;
+
+	ctx = doveadm_sieve_cmd_alloc(
+		struct doveadm_sieve_benchmark_cmd_context);
+	ctx->ctx.ctx.v.init = cmd_sieve_benchmark_init;
+	ctx->ctx.ctx.v.deinit = cmd_sieve_benchmark_deinit;
+	ctx->ctx.v.run = cmd_sieve_benchmark_run;
+	ctx->ctx.no_storage = TRUE;
+	doveadm_print_init(DOVEADM_PRINT_TYPE_TABLE);
+	return &ctx->ctx.ctx;
+}
+
+struct doveadm_cmd_ver2 doveadm_sieve_cmd_benchmark = {
+	.name = "sieve benchmark",
+	.mail_cmd = cmd_sieve_benchmark_alloc,
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX"[-n <iterations>]",
+DOVEADM_CMD_PARAMS_START
+DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAM('n',"iterations",CMD_PARAM_INT64,0)
+DOVEADM_CMD_PARAMS_END
+};
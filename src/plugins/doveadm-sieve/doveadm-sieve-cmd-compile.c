@@ -0,0 +1,194 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "doveadm-print.h"
+#include "doveadm-mail.h"
+
+#include "sieve.h"
+#include "sieve-script.h"
+#include "sieve-storage.h"
+
+#include "doveadm-sieve-cmd.h"
+
+/* Brings the binaries of the scripts executed at delivery up to date, so that
+   the first delivery after an upgrade or a configuration change does not need
+   to recompile them. Binaries that are still up to date are left alone. */
+
+struct doveadm_sieve_compile_cmd_context {
+	struct doveadm_sieve_cmd_context ctx;
+
+	bool global:1;
+};
+
+static int
+cmd_sieve_compile_script(struct doveadm_sieve_cmd_context *_ctx,
+			 struct sieve_script *script,
+			 enum sieve_compile_flags cpflags)
+{
+	struct event *event = _ctx->ctx.cctx->event;
+	struct sieve_error_handler *ehandler;
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+	int ret = 0;
+
+	ehandler = sieve_master_ehandler_create(_ctx->svinst, 0);
+	sbin = sieve_open_script(script, ehandler, cpflags, &error);
+	sieve_error_handler_unref(&ehandler);
+
+	doveadm_print(sieve_script_location(script));
+	if (sbin == NULL) {
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		doveadm_print("failed");
+		return -1;
+	}
+	if (sieve_is_loaded(sbin)) {
+		doveadm_print("up-to-date");
+	} else if (sieve_save(sbin, FALSE, &error) < 0) {
+		e_error(event, "Failed to save binary for Sieve script `%s'",
+			sieve_script_location(script));
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		doveadm_print("failed");
+		ret = -1;
+	} else {
+		doveadm_print("compiled");
+	}
+	sieve_close(&sbin);
+	return ret;
+}
+
+static int
+cmd_sieve_compile_sequence(struct doveadm_sieve_cmd_context *_ctx,
+			   const char *location)
+{
+	struct event *event = _ctx->ctx.cctx->event;
+	struct sieve_script_sequence *seq;
+	struct sieve_script *script;
+	enum sieve_error error;
+	int ret = 0;
+
+	seq = sieve_script_sequence_create(_ctx->svinst, location, &error);
+	if (seq == NULL) {
+		if (error == SIEVE_ERROR_NOT_FOUND)
+			return 0;
+		e_error(event, "Failed to open Sieve script sequence `%s'",
+			location);
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		return -1;
+	}
+
+	for (;;) {
+		script = sieve_script_sequence_next(seq, &error);
+		if (script == NULL) {
+			if (error == SIEVE_ERROR_NONE)
+				break;
+			if (error == SIEVE_ERROR_TEMP_FAILURE) {
+				e_error(event, "Failed to access Sieve script "
+					"from `%s' (temporary failure)",
+					location);
+				doveadm_sieve_cmd_failed_error(_ctx, error);
+				ret = -1;
+				break;
+			}
+			/* Skip scripts that cannot be opened, like
+			   delivery does */
+			continue;
+		}
+
+		if (cmd_sieve_compile_script(_ctx, script, 0) < 0)
+			ret = -1;
+		sieve_script_unref(&script);
+	}
+	sieve_script_sequence_free(&seq);
+	return ret;
+}
+
+static int
+cmd_sieve_compile_global(struct doveadm_sieve_cmd_context *_ctx,
+			 const char *setting)
+{
+	struct mail_user *user = _ctx->ctx.cur_mail_user;
+	const char *setting_name = setting, *location;
+	unsigned int i = 2;
+	int ret = 0;
+
+	location = mail_user_plugin_getenv(user, setting_name);
+	while (location != NULL && *location != '\0') {
+		if (cmd_sieve_compile_sequence(_ctx, location) < 0)
+			ret = -1;
+
+		setting_name = t_strdup_printf("%s%u", setting, i++);
+		location = mail_user_plugin_getenv(user, setting_name);
+	}
+	return ret;
+}
+
+static int cmd_sieve_compile_run(struct doveadm_sieve_cmd_context *_ctx)
+{
+	struct doveadm_sieve_compile_cmd_context *ctx =
+		container_of(_ctx, struct doveadm_sieve_compile_cmd_context,
+			     ctx);
+	struct event *event = _ctx->ctx.cctx->event;
+	struct sieve_storage *storage = _ctx->storage;
+	struct sieve_script *script;
+	enum sieve_error error;
+	int ret = 0;
+
+	if (ctx->global &&
+	    cmd_sieve_compile_global(_ctx, "sieve_before") < 0)
+		ret = -1;
+
+	script = sieve_storage_active_script_open(storage, &error);
+	if (script != NULL) {
+		if (cmd_sieve_compile_script(
+			_ctx, script, SIEVE_COMPILE_FLAG_NOGLOBAL) < 0)
+			ret = -1;
+		sieve_script_unref(&script);
+	} else if (error != SIEVE_ERROR_NOT_FOUND) {
+		e_error(event, "Failed to open active Sieve script: %s",
+			sieve_storage_get_last_error(storage, &error));
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		ret = -1;
+	}
+
+	if (ctx->global &&
+	    cmd_sieve_compile_global(_ctx, "sieve_after") < 0)
+		ret = -1;
+	return ret;
+}
+
+static void cmd_sieve_compile_init(struct doveadm_mail_cmd_context *_ctx)
+{
+	struct doveadm_cmd_context *cctx = _ctx->cctx;
+	struct doveadm_sieve_compile_cmd_context *ctx =
+		container_of(_ctx, struct doveadm_sieve_compile_cmd_context,
+			     ctx.ctx);
+
+	ctx->global = doveadm_cmd_param_flag(cctx, "global");
+
+	doveadm_print_header("script", "script",
+			     DOVEADM_PRINT_HEADER_FLAG_HIDE_TITLE);
+	doveadm_print_header("status", "status",
+			     DOVEADM_PRINT_HEADER_FLAG_HIDE_TITLE);
+}
+
+static struct doveadm_mail_cmd_context *cmd_sieve_compile_alloc(void)
+{
+	struct doveadm_sieve_compile_cmd_context *ctx;
+
+	ctx = doveadm_sieve_cmd_alloc(struct doveadm_sieve_compile_cmd_context);
+	ctx->ctx.ctx.v.init = cmd_sieve_compile_init;
+	ctx->ctx.v.run = cmd_sieve_compile_run;
+	doveadm_print_init(DOVEADM_PRINT_TYPE_FLOW);
+	return &ctx->ctx.ctx;
+}
+
+struct doveadm_cmd_ver2 doveadm_sieve_cmd_compile = {
+	.name = "sieve compile",
+	.mail_cmd = cmd_sieve_compile_alloc,
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX"[-g]",
+DOVEADM_CMD_PARAMS_START
+DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAM('g',"global",CMD_PARAM_BOOL,0)
+DOVEADM_CMD_PARAMS_END
+};
@@ -0,0 +1,306 @@
+/* Copyright (c) 2002-2018 Pigeonhole authors, see the included COPYING file
+ */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "str-sanitize.h"
+#include "istream.h"
+#include "json-parser.h"
+#include "doveadm-mail.h"
+
+#include "sieve.h"
+#include "sieve-script.h"
+#include "sieve-storage.h"
+
+#include "doveadm-sieve-cmd.h"
+
+/* The input is a JSON object that maps script names to script contents:
+
+   {"main": "require \"fileinto\"; ...", "lists": "..."}
+
+   All scripts are uploaded before any of them is compiled. Each script is
+   committed as soon as it compiles, which happens in repeated passes over the
+   scripts that are still pending. That way, a script that includes another
+   imported script is compiled once the included script is stored. Scripts
+   stored before a failure remain stored; the script to activate is only
+   activated when all scripts are stored. */
+
+struct cmd_sieve_import_save {
+	const char *scriptname;
+	struct sieve_storage_save_context *save_ctx;
+	enum sieve_compile_flags cpflags;
+
+	string_t *errors;
+};
+
+struct doveadm_sieve_import_cmd_context {
+	struct doveadm_sieve_cmd_context ctx;
+
+	const char *activate_name;
+	ARRAY(struct cmd_sieve_import_save) saves;
+};
+
+static int
+cmd_sieve_import_save(struct doveadm_sieve_import_cmd_context *ctx,
+		      const char *scriptname, struct istream *input)
+{
+	struct doveadm_sieve_cmd_context *_ctx = &ctx->ctx;
+	struct event *event = _ctx->ctx.cctx->event;
+	struct sieve_storage *storage = _ctx->storage;
+	struct sieve_storage_save_context *save_ctx;
+	struct cmd_sieve_import_save *save;
+	enum sieve_compile_flags cpflags =
+		SIEVE_COMPILE_FLAG_NOGLOBAL | SIEVE_COMPILE_FLAG_UPLOADED;
+	enum sieve_error error;
+	ssize_t ret;
+	bool save_failed = FALSE;
+
+	save_ctx = sieve_storage_save_init(storage, scriptname, input);
+	if (save_ctx == NULL) {
+		e_error(event, "Saving script `%s' failed: %s",
+			str_sanitize(scriptname, 80),
+			sieve_storage_get_last_error(storage, &error));
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		return -1;
+	}
+
+	while ((ret = i_stream_read(input)) > 0 || ret == -2) {
+		if (sieve_storage_save_continue(save_ctx) < 0) {
+			save_failed = TRUE;
+			break;
+		}
+	}
+
+	if (input->stream_errno != 0) {
+		e_error(event, "read(script input) failed: %s",
+			i_stream_get_error(input));
+		doveadm_sieve_cmd_failed_error(_ctx, SIEVE_ERROR_TEMP_FAILURE);
+		sieve_storage_save_cancel(&save_ctx);
+		return -1;
+	}
+	if (save_failed || sieve_storage_save_finish(save_ctx) < 0 ||
+	    sieve_storage_save_get_tempscript(save_ctx) == NULL) {
+		e_error(event, "Saving script `%s' failed: %s",
+			str_sanitize(scriptname, 80),
+			sieve_storage_get_last_error(storage, NULL));
+		doveadm_sieve_cmd_failed_storage(_ctx, storage);
+		sieve_storage_save_cancel(&save_ctx);
+		return -1;
+	}
+
+	if ((ctx->activate_name != NULL &&
+	     strcmp(ctx->activate_name, scriptname) == 0) ||
+	    sieve_storage_save_will_activate(save_ctx))
+		cpflags |= SIEVE_COMPILE_FLAG_ACTIVATED;
+
+	save = array_append_space(&ctx->saves);
+	save->scriptname = p_strdup(_ctx->ctx.pool, scriptname);
+	save->save_ctx = save_ctx;
+	save->cpflags = cpflags;
+	return 0;
+}
+
+/* Returns 1 when the script compiled and was committed, 0 when it failed to
+   compile and -1 when committing it failed. */
+static int
+cmd_sieve_import_compile_commit(struct doveadm_sieve_import_cmd_context *ctx,
+				struct cmd_sieve_import_save *save)
+{
+	struct doveadm_sieve_cmd_context *_ctx = &ctx->ctx;
+	struct event *event = _ctx->ctx.cctx->event;
+	struct sieve_storage *storage = _ctx->storage;
+	struct sieve_error_handler *ehandler;
+	struct sieve_script *script;
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+
+	/* Errors are only reported when the script cannot be compiled in
+	   the last pass */
+	if (save->errors == NULL)
+		save->errors = str_new(_ctx->ctx.pool, 256);
+	str_truncate(save->errors, 0);
+
+	script = sieve_storage_save_get_tempscript(save->save_ctx);
+	ehandler = sieve_strbuf_ehandler_create(_ctx->svinst, save->errors,
+						FALSE, 0);
+	sbin = sieve_compile_script(script, ehandler, save->cpflags, &error);
+	sieve_error_handler_unref(&ehandler);
+	if (sbin == NULL)
+		return 0;
+	sieve_close(&sbin);
+
+	if (sieve_storage_save_commit(&save->save_ctx) < 0) {
+		e_error(event, "Saving script `%s' failed: %s",
+			str_sanitize(save->scriptname, 80),
+			sieve_storage_get_last_error(storage, &error));
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		return -1;
+	}
+	return 1;
+}
+
+static int
+cmd_sieve_import_parse(struct doveadm_sieve_import_cmd_context *ctx,
+		       struct istream *input)
+{
+	struct event *event = ctx->ctx.ctx.cctx->event;
+	struct json_parser *parser;
+	struct istream *script_input;
+	enum json_type type;
+	const char *value, *scriptname, *error;
+	bool failed = FALSE;
+	int ret;
+
+	parser = json_parser_init(input);
+	while (!failed &&
+	       (ret = json_parse_next(parser, &type, &value)) >= 0) {
+		if (ret == 0) {
+			/* Need more input */
+			if (i_stream_read(input) < 0)
+				break;
+			continue;
+		}
+
+		if (type != JSON_TYPE_OBJECT_KEY) {
+			e_error(event, "Invalid script input: "
+				"Expected script name");
+			failed = TRUE;
+			break;
+		}
+		scriptname = t_strdup(value);
+		if (json_parse_next_stream(parser, &script_input) <= 0) {
+			e_error(event, "Invalid script input: "
+				"Expected contents of script `%s'",
+				str_sanitize(scriptname, 80));
+			failed = TRUE;
+			break;
+		}
+
+		if (cmd_sieve_import_save(ctx, scriptname, script_input) < 0)
+			failed = TRUE;
+		i_stream_unref(&script_input);
+	}
+
+	if (json_parser_deinit(&parser, &error) < 0 && !failed) {
+		e_error(event, "Invalid script input: %s", error);
+		doveadm_sieve_cmd_failed_error(&ctx->ctx,
+					       SIEVE_ERROR_BAD_PARAMS);
+		failed = TRUE;
+	}
+	return (failed ? -1 : 0);
+}
+
+static int cmd_sieve_import_commit(struct doveadm_sieve_import_cmd_context *ctx)
+{
+	struct doveadm_sieve_cmd_context *_ctx = &ctx->ctx;
+	struct event *event = _ctx->ctx.cctx->event;
+	struct sieve_storage *storage = _ctx->storage;
+	struct cmd_sieve_import_save *save;
+	struct sieve_script *script;
+	enum sieve_error error;
+	unsigned int pending = array_count(&ctx->saves);
+	bool progress = TRUE;
+	int ret = 0;
+
+	/* Compile and commit in passes until no more scripts compile */
+	while (ret == 0 && pending > 0 && progress) {
+		progress = FALSE;
+		array_foreach_modifiable(&ctx->saves, save) {
+			if (save->save_ctx == NULL)
+				continue;
+			ret = cmd_sieve_import_compile_commit(ctx, save);
+			if (ret < 0)
+				break;
+			if (ret > 0) {
+				pending--;
+				progress = TRUE;
+			}
+			ret = 0;
+		}
+	}
+	if (ret < 0)
+		return -1;
+
+	if (pending > 0) {
+		array_foreach(&ctx->saves, save) {
+			if (save->save_ctx == NULL)
+				continue;
+			e_error(event, "Script `%s' failed to compile: %s",
+				str_sanitize(save->scriptname, 80),
+				str_c(save->errors));
+		}
+		doveadm_sieve_cmd_failed_error(_ctx, SIEVE_ERROR_NOT_VALID);
+		return -1;
+	}
+	if (ctx->activate_name == NULL)
+		return 0;
+
+	script = sieve_storage_open_script(storage, ctx->activate_name, NULL);
+	if (script == NULL ||
+	    sieve_script_activate(script, (time_t)-1) < 0) {
+		e_error(event, "Failed to activate Sieve script: %s",
+			sieve_storage_get_last_error(storage, &error));
+		doveadm_sieve_cmd_failed_error(_ctx, error);
+		ret = -1;
+	}
+	if (script != NULL)
+		sieve_script_unref(&script);
+	return ret;
+}
+
+static int cmd_sieve_import_run(struct doveadm_sieve_cmd_context *_ctx)
+{
+	struct doveadm_sieve_import_cmd_context *ctx =
+		container_of(_ctx, struct doveadm_sieve_import_cmd_context,
+			     ctx);
+	struct cmd_sieve_import_save *save;
+	int ret;
+
+	i_array_init(&ctx->saves, 16);
+
+	ret = cmd_sieve_import_parse(ctx, _ctx->ctx.cmd_input);
+	if (ret == 0)
+		ret = cmd_sieve_import_commit(ctx);
+
+	array_foreach_modifiable(&ctx->saves, save) {
+		if (save->save_ctx != NULL)
+			sieve_storage_save_cancel(&save->save_ctx);
+	}
+	array_free(&ctx->saves);
+	return ret;
+}
+
+static void cmd_sieve_import_init(struct doveadm_mail_cmd_context *_ctx)
+{
+	struct doveadm_cmd_context *cctx = _ctx->cctx;
+	struct doveadm_sieve_import_cmd_context *ctx =
+		container_of(_ctx, struct doveadm_sieve_import_cmd_context,
+			     ctx.ctx);
+
+	if (doveadm_cmd_param_str(cctx, "activate", &ctx->activate_name))
+		doveadm_sieve_cmd_scriptname_check(ctx->activate_name);
+	doveadm_mail_get_input(_ctx);
+}
+
+static struct doveadm_mail_cmd_context *
+cmd_sieve_import_alloc(void)
+{
+	struct doveadm_sieve_import_cmd_context *ctx;
+
+	ctx = doveadm_sieve_cmd_alloc(struct doveadm_sieve_import_cmd_context);
+	ctx->ctx.ctx.v.init = cmd_sieve_import_init;
+	ctx->ctx.v.run = cmd_sieve_import_run;
+	return &ctx->ctx.ctx;
+}
+
+struct doveadm_cmd_ver2 doveadm_sieve_cmd_import = {
+	.name = "sieve import",
+	.mail_cmd = cmd_sieve_import_alloc,
+	.usage = DOVEADM_CMD_MAIL_USAGE_PREFIX"[-a <scriptname>] <file>",
+DOVEADM_CMD_PARAMS_START
+DOVEADM_CMD_MAIL_COMMON
+DOVEADM_CMD_PARAM('a',"activate",CMD_PARAM_STR,0)
+DOVEADM_CMD_PARAM('\0',"file",CMD_PARAM_ISTREAM,CMD_PARAM_FLAG_POSITIONAL)
+DOVEADM_CMD_PARAMS_END
+};
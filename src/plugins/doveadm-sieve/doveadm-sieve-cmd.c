@@ -115,6 +115,13 @@ doveadm_sieve_cmd_run(struct doveadm_mail_cmd_context *_ctx,
 	ctx->svinst = sieve_init(&svenv, &sieve_callbacks, (void *)ctx,
 				 user->set->mail_debug);
 
+	if (ctx->no_storage) {
+		i_assert(ctx->v.run != NULL);
+		ret = ctx->v.run(ctx);
+		sieve_deinit(&ctx->svinst);
+		return ret;
+	}
+
 	ctx->storage = sieve_storage_create_main(
 		ctx->svinst, user, SIEVE_STORAGE_FLAG_READWRITE, &error);
 	if (ctx->storage == NULL) {
@@ -157,10 +164,13 @@ static struct doveadm_cmd_ver2 *doveadm_sieve_commands[] = {
 	&doveadm_sieve_cmd_list,
 	&doveadm_sieve_cmd_get,
 	&doveadm_sieve_cmd_put,
+	&doveadm_sieve_cmd_import,
 	&doveadm_sieve_cmd_delete,
 	&doveadm_sieve_cmd_activate,
 	&doveadm_sieve_cmd_deactivate,
 	&doveadm_sieve_cmd_rename,
+	&doveadm_sieve_cmd_compile,
+	&doveadm_sieve_cmd_benchmark,
 };
 
 void doveadm_sieve_cmds_init(void)
@@ -16,6 +16,9 @@ struct doveadm_sieve_cmd_context {
 	struct sieve_storage *storage;
 
 	struct doveadm_sieve_cmd_vfuncs v;
+
+	/* The command opens the personal storage itself */
+	bool no_storage:1;
 };
 
 void doveadm_sieve_cmd_failed_error(struct doveadm_sieve_cmd_context *ctx,
@@ -33,10 +36,13 @@ void doveadm_sieve_cmd_scriptnames_check(ARRAY_TYPE(const_string) *args);
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_list;
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_get;
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_put;
+extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_import;
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_delete;
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_activate;
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_deactivate;
 extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_rename;
+extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_compile;
+extern struct doveadm_cmd_ver2 doveadm_sieve_cmd_benchmark;
 
 void doveadm_sieve_cmds_init(void);
 
@@ -1,7 +1,10 @@
 /* Copyright (c) 2017-2018 Pigeonhole authors, see the included COPYING file */
 
 #include "imap-common.h"
+#include "array.h"
 #include "str.h"
+#include "sha1.h"
+#include "istream.h"
 #include "ioloop.h"
 #include "time-util.h"
 #include "module-context.h"
@@ -14,11 +17,16 @@
 #include "sieve.h"
 #include "sieve-storage.h"
 #include "sieve-script.h"
+#include "sieve-binary.h"
+#include "duplicate-filter.h"
 
 #include "imap-filter-sieve.h"
 
 #define DUPLICATE_DB_NAME "lda-dupes"
 
+/* Maximum number of inline FILTER SIEVE scripts kept compiled per session */
+#define IMAP_FILTER_SIEVE_INLINE_CACHE_MAX 8
+
 #define IMAP_FILTER_SIEVE_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, imap_filter_sieve_user_module)
 #define IMAP_FILTER_SIEVE_USER_CONTEXT_REQUIRE(obj) \
@@ -32,10 +40,20 @@ struct imap_filter_sieve_script {
 	   don't try again for this transaction */
 	enum sieve_error compile_error;
 
+	/* Digest of the script text; only for inline scripts */
+	unsigned char digest[SHA1_RESULTLEN];
+
 	/* Binary corrupt after recompile; don't recompile again */
 	bool binary_corrupt:1;
 	/* Resource usage exceeded */
 	bool rusage_exceeded:1;
+	/* The digest is valid */
+	bool have_digest:1;
+};
+
+struct imap_filter_sieve_inline_binary {
+	unsigned char digest[SHA1_RESULTLEN];
+	struct sieve_binary *binary;
 };
 
 struct imap_filter_sieve_user {
@@ -49,6 +67,9 @@ struct imap_filter_sieve_user {
 	struct mail_duplicate_db *dup_db;
 
 	struct sieve_error_handler *master_ehandler;
+
+	/* Compiled inline scripts, most recently used first */
+	ARRAY(struct imap_filter_sieve_inline_binary) inline_binaries;
 };
 
 static MODULE_CONTEXT_DEFINE_INIT(imap_filter_sieve_user_module,
@@ -411,9 +432,84 @@ imap_sieve_filter_open_script(struct imap_filter_sieve_context *sctx,
 	return sbin;
 }
 
+static struct sieve_binary *
+imap_filter_sieve_inline_lookup(struct imap_filter_sieve_user *ifsuser,
+				const unsigned char digest[SHA1_RESULTLEN])
+{
+	struct imap_filter_sieve_inline_binary *entries, entry;
+	unsigned int count, i;
+
+	if (!array_is_created(&ifsuser->inline_binaries))
+		return NULL;
+
+	entries = array_get_modifiable(&ifsuser->inline_binaries, &count);
+	for (i = 0; i < count; i++) {
+		if (memcmp(entries[i].digest, digest, SHA1_RESULTLEN) == 0)
+			break;
+	}
+	if (i == count)
+		return NULL;
+
+	entry = entries[i];
+	array_delete(&ifsuser->inline_binaries, i, 1);
+	array_insert(&ifsuser->inline_binaries, 0, &entry, 1);
+
+	sieve_binary_ref(entry.binary);
+	return entry.binary;
+}
+
+static void
+imap_filter_sieve_inline_add(struct imap_filter_sieve_user *ifsuser,
+			     const unsigned char digest[SHA1_RESULTLEN],
+			     struct sieve_binary *sbin)
+{
+	struct imap_filter_sieve_inline_binary entry;
+	unsigned int count;
+
+	if (!array_is_created(&ifsuser->inline_binaries)) {
+		i_array_init(&ifsuser->inline_binaries,
+			     IMAP_FILTER_SIEVE_INLINE_CACHE_MAX);
+	}
+
+	count = array_count(&ifsuser->inline_binaries);
+	if (count >= IMAP_FILTER_SIEVE_INLINE_CACHE_MAX) {
+		struct imap_filter_sieve_inline_binary *last =
+			array_idx_modifiable(&ifsuser->inline_binaries,
+					     count - 1);
+
+		sieve_close(&last->binary);
+		array_delete(&ifsuser->inline_binaries, count - 1, 1);
+	}
+
+	/* The script text is not needed anymore; don't keep the command input
+	   alive for as long as the binary is cached */
+	sieve_data_script_release_input(sieve_binary_script(sbin));
+
+	i_zero(&entry);
+	memcpy(entry.digest, digest, SHA1_RESULTLEN);
+	entry.binary = sbin;
+	sieve_binary_ref(sbin);
+	array_insert(&ifsuser->inline_binaries, 0, &entry, 1);
+}
+
+static void
+imap_filter_sieve_inline_deinit(struct imap_filter_sieve_user *ifsuser)
+{
+	struct imap_filter_sieve_inline_binary *entry;
+
+	if (!array_is_created(&ifsuser->inline_binaries))
+		return;
+
+	array_foreach_modifiable(&ifsuser->inline_binaries, entry)
+		sieve_close(&entry->binary);
+	array_free(&ifsuser->inline_binaries);
+}
+
 int imap_filter_sieve_compile(struct imap_filter_sieve_context *sctx,
 			      string_t **errors_r, bool *have_warnings_r)
 {
+	struct imap_filter_sieve_user *ifsuser =
+		IMAP_FILTER_SIEVE_USER_CONTEXT_REQUIRE(sctx->user);
 	struct imap_filter_sieve_script *scripts = sctx->scripts;
 	unsigned int count = sctx->scripts_count, i;
 	struct sieve_error_handler *ehandler;
@@ -431,10 +527,28 @@ int imap_filter_sieve_compile(struct imap_filter_sieve_context *sctx,
 
 		i_assert(script != NULL);
 
+		/* Inline scripts sent again in this session are not compiled
+		   again */
+		if (scripts[i].have_digest) {
+			scripts[i].binary = imap_filter_sieve_inline_lookup(
+				ifsuser, scripts[i].digest);
+			if (scripts[i].binary != NULL)
+				continue;
+		}
+
 		scripts[i].binary =
 			imap_sieve_filter_open_script(sctx, script, 0, ehandler,
 						     FALSE, &error);
-		if (scripts[i].binary == NULL) {
+		if (scripts[i].binary != NULL) {
+			/* Only cache binaries without warnings, so that
+			   these are still reported each time */
+			if (scripts[i].have_digest &&
+			    sieve_get_warnings(ehandler) == 0) {
+				imap_filter_sieve_inline_add(
+					ifsuser, scripts[i].digest,
+					scripts[i].binary);
+			}
+		} else {
 			if (error != SIEVE_ERROR_NOT_VALID) {
 				const char *errormsg =
 					sieve_script_get_last_error(
@@ -462,6 +576,30 @@ int imap_filter_sieve_compile(struct imap_filter_sieve_context *sctx,
 	return ret;
 }
 
+static bool
+imap_filter_sieve_input_digest(struct istream *input,
+			       unsigned char digest_r[SHA1_RESULTLEN])
+{
+	struct sha1_ctxt ctx;
+	const unsigned char *data;
+	size_t size;
+
+	/* The script input is read completely before it is compiled */
+	sha1_init(&ctx);
+	i_stream_seek(input, 0);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		sha1_loop(&ctx, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0 || !input->eof) {
+		i_stream_seek(input, 0);
+		return FALSE;
+	}
+	sha1_result(&ctx, digest_r);
+	i_stream_seek(input, 0);
+	return TRUE;
+}
+
 void imap_filter_sieve_open_input(struct imap_filter_sieve_context *sctx,
 				  struct istream *input)
 {
@@ -475,6 +613,9 @@ void imap_filter_sieve_open_input(struct imap_filter_sieve_context *sctx,
 	sctx->scripts = p_new(sctx->pool, struct imap_filter_sieve_script, 1);
 	sctx->scripts_count = 1;
 	sctx->scripts[0].script = script;
+	sctx->scripts[0].have_digest =
+		imap_filter_sieve_input_digest(input,
+					       sctx->scripts[0].digest);
 }
 
 int imap_filter_sieve_open_personal(struct imap_filter_sieve_context *sctx,
@@ -620,6 +761,14 @@ imap_filter_sieve_smtp_finish(const struct sieve_script_env *senv ATTR_UNUSED,
  * Duplicate checking
  */
 
+/* IDs recorded in the duplicate database are also added to the duplicate
+   filter file of the LDA (if it exists), which would otherwise miss them */
+struct imap_filter_sieve_duplicate_transaction {
+	struct event *event;
+	struct mail_duplicate_transaction *dup_trans;
+	struct duplicate_filter *filter;
+};
+
 static void *
 imap_filter_sieve_duplicate_transaction_begin(
 	const struct sieve_script_env *senv)
@@ -627,26 +776,49 @@ imap_filter_sieve_duplicate_transaction_begin(
 	struct imap_filter_sieve_context *sctx = senv->script_context;
 	struct imap_filter_sieve_user *ifsuser =
 		IMAP_FILTER_SIEVE_USER_CONTEXT_REQUIRE(sctx->user);
-
-	return mail_duplicate_transaction_begin(ifsuser->dup_db);
+	struct imap_filter_sieve_duplicate_transaction *ftrans;
+	const char *home;
+
+	ftrans = i_new(struct imap_filter_sieve_duplicate_transaction, 1);
+	ftrans->event = sieve_get_event(ifsuser->svinst);
+	ftrans->dup_trans = mail_duplicate_transaction_begin(ifsuser->dup_db);
+	if (mail_user_get_home(sctx->user, &home) > 0) {
+		ftrans->filter = duplicate_filter_init(
+			t_strconcat(home, "/",
+				    DUPLICATE_FILTER_LDA_DUPES_FNAME, NULL),
+			FALSE, 0);
+	}
+	return ftrans;
 }
 
 static void imap_filter_sieve_duplicate_transaction_commit(void **_dup_trans)
 {
-	struct mail_duplicate_transaction *dup_trans = *_dup_trans;
+	struct imap_filter_sieve_duplicate_transaction *ftrans = *_dup_trans;
+	const char *error;
 
 	*_dup_trans = NULL;
 
-	mail_duplicate_transaction_commit(&dup_trans);
+	/* Update the filter first; an ID that ends up in the filter but not in
+	   the database only costs a database lookup later on */
+	if (ftrans->filter != NULL &&
+	    duplicate_filter_commit(ftrans->filter, ioloop_time, &error) < 0) {
+		e_error(ftrans->event,
+			"Failed to update duplicate filter: %s", error);
+	}
+	duplicate_filter_deinit(&ftrans->filter);
+	mail_duplicate_transaction_commit(&ftrans->dup_trans);
+	i_free(ftrans);
 }
 
 static void imap_filter_sieve_duplicate_transaction_rollback(void **_dup_trans)
 {
-	struct mail_duplicate_transaction *dup_trans = *_dup_trans;
+	struct imap_filter_sieve_duplicate_transaction *ftrans = *_dup_trans;
 
 	*_dup_trans = NULL;
 
-	mail_duplicate_transaction_rollback(&dup_trans);
+	duplicate_filter_deinit(&ftrans->filter);
+	mail_duplicate_transaction_rollback(&ftrans->dup_trans);
+	i_free(ftrans);
 }
 
 static enum sieve_duplicate_check_result
@@ -654,9 +826,9 @@ imap_filter_sieve_duplicate_check(void *_dup_trans,
 				  const struct sieve_script_env *senv,
 				  const void *id, size_t id_size)
 {
-	struct mail_duplicate_transaction *dup_trans = _dup_trans;
+	struct imap_filter_sieve_duplicate_transaction *ftrans = _dup_trans;
 
-	switch (mail_duplicate_check(dup_trans, id, id_size,
+	switch (mail_duplicate_check(ftrans->dup_trans, id, id_size,
 				     senv->user->username)) {
 	case MAIL_DUPLICATE_CHECK_RESULT_EXISTS:
 		return SIEVE_DUPLICATE_CHECK_RESULT_EXISTS;
@@ -677,9 +849,12 @@ imap_filter_sieve_duplicate_mark(void *_dup_trans,
 				 const struct sieve_script_env *senv,
 				 const void *id, size_t id_size, time_t time)
 {
-	struct mail_duplicate_transaction *dup_trans = _dup_trans;
+	struct imap_filter_sieve_duplicate_transaction *ftrans = _dup_trans;
 
-	mail_duplicate_mark(dup_trans, id, id_size, senv->user->username, time);
+	mail_duplicate_mark(ftrans->dup_trans, id, id_size,
+			    senv->user->username, time);
+	if (ftrans->filter != NULL)
+		duplicate_filter_add(ftrans->filter, id, id_size, time);
 }
 
 /*
@@ -799,6 +974,7 @@ imap_sieve_filter_run_scripts(struct imap_filter_sieve_context *sctx,
 	struct sieve_multiscript *mscript;
 	struct sieve_error_handler *ehandler;
 	struct sieve_script *last_script = NULL;
+	struct sieve_delivery_timing timing;
 	bool user_script = FALSE, more = TRUE, rusage_exceeded = FALSE;
 	enum sieve_compile_flags cpflags;
 	enum sieve_execute_flags exflags;
@@ -808,6 +984,10 @@ imap_sieve_filter_run_scripts(struct imap_filter_sieve_context *sctx,
 
 	*fatal_r = FALSE;
 
+	/* Scripts are opened once for all mails when the filter command is
+	   started, so only the later phases are timed here */
+	sieve_delivery_timing_init(&timing);
+
 	/* Start execution */
 	mscript = sieve_multiscript_start_execute(svinst, msgdata, scriptenv);
 
@@ -848,8 +1028,12 @@ imap_sieve_filter_run_scripts(struct imap_filter_sieve_context *sctx,
 		e_debug(sieve_get_event(svinst),
 			"Executing script from `%s'",
 			sieve_get_source(sbin));
+		sieve_delivery_timing_begin(&timing,
+					    SIEVE_DELIVERY_TIMING_EXECUTE);
 		more = sieve_multiscript_run(mscript,
 			sbin, ehandler, ehandler, exflags);
+		sieve_delivery_timing_end(&timing,
+					  sieve_script_location(script));
 
 		mstatus = sieve_multiscript_status(mscript);
 		if (!more && mstatus == SIEVE_EXEC_BIN_CORRUPT &&
@@ -858,19 +1042,27 @@ imap_sieve_filter_run_scripts(struct imap_filter_sieve_context *sctx,
 			sieve_close(&sbin);
 
 			/* Recompile */
+			sieve_delivery_timing_begin(
+				&timing, SIEVE_DELIVERY_TIMING_COMPILE);
 			scripts[i].binary = sbin =
 				imap_sieve_filter_open_script(
 					sctx, script, cpflags, user_ehandler,
 					FALSE, &compile_error);
+			sieve_delivery_timing_end(
+				&timing, sieve_script_location(script));
 			if (sbin == NULL) {
 				scripts[i].compile_error = compile_error;
 				break;
 			}
 
 			/* Execute again */
+			sieve_delivery_timing_begin(
+				&timing, SIEVE_DELIVERY_TIMING_EXECUTE);
 			more = sieve_multiscript_run(mscript, sbin,
 						     ehandler, ehandler,
 						     exflags);
+			sieve_delivery_timing_end(
+				&timing, sieve_script_location(script));
 
 			/* Save new version */
 
@@ -892,6 +1084,7 @@ imap_sieve_filter_run_scripts(struct imap_filter_sieve_context *sctx,
 	exflags = SIEVE_EXECUTE_FLAG_SKIP_RESPONSES;
 	ehandler = (user_ehandler != NULL ?
 		user_ehandler : ifsuser->master_ehandler);
+	sieve_delivery_timing_begin(&timing, SIEVE_DELIVERY_TIMING_COMMIT);
 	if (compile_error == SIEVE_ERROR_TEMP_FAILURE) {
 		ret = sieve_multiscript_finish(&mscript, ehandler, exflags,
 					       SIEVE_EXEC_TEMP_FAILURE);
@@ -906,6 +1099,7 @@ imap_sieve_filter_run_scripts(struct imap_filter_sieve_context *sctx,
 		ret = sieve_multiscript_finish(&mscript, ehandler, exflags,
 					       SIEVE_EXEC_OK);
 	}
+	sieve_delivery_timing_finish(svinst, &timing);
 
 	/* Don't log additional messages about compile failure */
 	if (compile_error != SIEVE_ERROR_NONE &&
@@ -1120,6 +1314,7 @@ static void imap_filter_sieve_user_deinit(struct mail_user *user)
 
 	sieve_error_handler_unref(&ifsuser->master_ehandler);
 
+	imap_filter_sieve_inline_deinit(ifsuser);
 	if (ifsuser->storage != NULL)
 		sieve_storage_unref(&ifsuser->storage);
 	if (ifsuser->global_storage != NULL)
@@ -148,7 +148,11 @@ imap_filter_start(struct imap_filter_context *ctx,
 	ctx->trans = mailbox_transaction_begin(ctx->box, 0,
 					       imap_client_command_get_reason(cmd));
 	ctx->sargs = sargs;
-	ctx->search_ctx = mailbox_search_init(ctx->trans, sargs, NULL, 0, NULL);
+	/* The script needs the full message, so let the search prefetch it
+	   ahead of the message that is currently being filtered. */
+	ctx->search_ctx = mailbox_search_init(ctx->trans, sargs, NULL,
+					      MAIL_FETCH_STREAM_HEADER |
+					      MAIL_FETCH_STREAM_BODY, NULL);
 
 	if (imap_sieve_filter_run_init(ctx->sieve) < 0) {
 		const char *error = t_strflocaltime(
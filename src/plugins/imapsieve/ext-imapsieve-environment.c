@@ -32,6 +32,7 @@ envit_imap_user_get_value(const struct sieve_runtime_env *renv,
 
 const struct sieve_environment_item imap_user_env_item = {
 	.name = "imap.user",
+	.scope = SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE,
 	.get_value = envit_imap_user_get_value
 };
 
@@ -52,6 +53,7 @@ envit_imap_email_get_value(const struct sieve_runtime_env *renv,
 
 const struct sieve_environment_item imap_email_env_item = {
 	.name = "imap.email",
+	.scope = SIEVE_ENVIRONMENT_ITEM_SCOPE_INSTANCE,
 	.get_value = envit_imap_email_get_value
 };
 
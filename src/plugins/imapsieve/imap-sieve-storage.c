@@ -62,6 +62,18 @@ struct imap_sieve_mailbox_rule {
 	const char *const *causes;
 	const char *before, *after;
 	const char *copy_source_after;
+
+	/* Compiled mailbox patterns (for the hierarchy separator they were
+	   compiled with) */
+	struct imap_match_glob *mailbox_glob, *from_glob;
+	char mailbox_glob_sep, from_glob_sep;
+};
+
+struct imap_sieve_mailbox_rules_cache {
+	const char *cause;
+	const char *src_name;
+
+	ARRAY_TYPE(imap_sieve_mailbox_rule) rules;
 };
 
 struct imap_sieve_user {
@@ -85,6 +97,10 @@ struct imap_sieve_mailbox {
 	struct imap_sieve_user *user;
 
 	struct event *event;
+
+	/* Matched mailbox rules per cause and source mailbox; the rules are
+	   static, so these remain valid for the lifetime of the mailbox. */
+	ARRAY(struct imap_sieve_mailbox_rules_cache) rules_cache;
 };
 
 struct imap_sieve_mailbox_event {
@@ -103,6 +119,8 @@ struct imap_sieve_mailbox_transaction {
 	struct mailbox_transaction_context *src_mail_trans;
 
 	ARRAY_TYPE(imap_sieve_mailbox_event) events;
+	/* UID => index+1 of the FLAG event queued for that mail */
+	HASH_TABLE(void *, void *) flag_events;
 };
 
 struct imap_sieve_mail {
@@ -206,6 +224,39 @@ imap_sieve_mailbox_get_script(struct mailbox *box, const char **script_name_r)
 	return ret;
 }
 
+/* Add the flag to the space-separated list, or remove it when it is already
+   listed. */
+static void imap_sieve_flags_toggle(string_t *flags, const char *flag)
+{
+	const char *list = str_c(flags), *p = list;
+	size_t flag_len = strlen(flag);
+
+	while (*p != '\0') {
+		const char *end = strchr(p, ' ');
+		size_t len = (end == NULL ? strlen(p) : (size_t)(end - p));
+
+		if (len == flag_len && strncasecmp(p, flag, len) == 0) {
+			size_t pos = p - list;
+
+			/* Remove it along with one separating space */
+			if (end != NULL)
+				str_delete(flags, pos, len + 1);
+			else if (pos > 0)
+				str_delete(flags, pos - 1, len + 1);
+			else
+				str_truncate(flags, 0);
+			return;
+		}
+		if (end == NULL)
+			break;
+		p = end + 1;
+	}
+
+	if (str_len(flags) > 0)
+		str_append_c(flags, ' ');
+	str_append(flags, flag);
+}
+
 static struct imap_sieve_mailbox_event *
 imap_sieve_create_mailbox_event(struct mailbox_transaction_context *t,
 				struct mail *dest_mail)
@@ -258,6 +309,45 @@ imap_sieve_add_mailbox_copy_event(struct mailbox_transaction_context *t,
 	event->src_mail_uid = src_mail->uid;
 }
 
+static void
+imap_sieve_add_mailbox_flag_event(struct mailbox_transaction_context *t,
+				  struct mail *dest_mail,
+				  const char *changed_flags)
+{
+	struct imap_sieve_mailbox_transaction *ismt =
+		IMAP_SIEVE_CONTEXT_REQUIRE(t);
+	struct imap_sieve_mailbox_event *event;
+	const char *const *flags;
+	string_t *merged;
+	unsigned int idx;
+
+	if (!hash_table_is_created(ismt->flag_events))
+		hash_table_create_direct(&ismt->flag_events, ismt->pool, 0);
+
+	idx = POINTER_CAST_TO(hash_table_lookup(ismt->flag_events,
+						POINTER_CAST(dest_mail->uid)),
+			      unsigned int);
+	if (idx == 0) {
+		imap_sieve_add_mailbox_event(t, dest_mail, dest_mail->box,
+					     changed_flags);
+		hash_table_insert(ismt->flag_events,
+				  POINTER_CAST(dest_mail->uid),
+				  POINTER_CAST(array_count(&ismt->events)));
+		return;
+	}
+
+	/* Merge with the changes recorded earlier in this transaction, so
+	   that the script runs only once for this mail with the net changes. A
+	   flag that changed twice is back at its original state. */
+	event = array_idx_modifiable(&ismt->events, idx - 1);
+	merged = t_str_new(128);
+	str_append(merged, event->changed_flags);
+	flags = t_strsplit_spaces(changed_flags, " ");
+	for (; *flags != NULL; flags++)
+		imap_sieve_flags_toggle(merged, *flags);
+	event->changed_flags = p_strdup(ismt->pool, str_c(merged));
+}
+
 /*
  * Mail
  */
@@ -269,6 +359,8 @@ imap_sieve_mail_update_flags(struct mail *_mail, enum modify_type modify_type,
 	struct mail_private *mail = (struct mail_private *)_mail;
 	struct imap_sieve_mail *ismail = IMAP_SIEVE_MAIL_CONTEXT(mail);
 	enum mail_flags old_flags, new_flags, changed_flags;
+	const char *const *flag_names;
+	string_t *str;
 
 	old_flags = mail_get_flags(_mail);
 	ismail->module_ctx.super.update_flags(_mail, modify_type, flags);
@@ -280,7 +372,12 @@ imap_sieve_mail_update_flags(struct mail *_mail, enum modify_type modify_type,
 
 	if (ismail->flags == NULL)
 		ismail->flags = str_new(default_pool, 64);
-	imap_write_flags(ismail->flags, changed_flags, NULL);
+
+	str = t_str_new(64);
+	imap_write_flags(str, changed_flags, NULL);
+	flag_names = t_strsplit_spaces(str_c(str), " ");
+	for (; *flag_names != NULL; flag_names++)
+		imap_sieve_flags_toggle(ismail->flags, *flag_names);
 }
 
 static void
@@ -306,11 +403,8 @@ imap_sieve_mail_update_keywords(struct mail *_mail,
 			if (strcmp(old_keywords[i], new_keywords[j]) == 0)
 				break;
 		}
-		if (new_keywords[j] == NULL) {
-			if (str_len(ismail->flags) > 0)
-				str_append_c(ismail->flags, ' ');
-			str_append(ismail->flags, old_keywords[i]);
-		}
+		if (new_keywords[j] == NULL)
+			imap_sieve_flags_toggle(ismail->flags, old_keywords[i]);
 	}
 
 	/* Added flags */
@@ -319,11 +413,8 @@ imap_sieve_mail_update_keywords(struct mail *_mail,
 			if (strcmp(new_keywords[i], old_keywords[j]) == 0)
 				break;
 		}
-		if (old_keywords[j] == NULL) {
-			if (str_len(ismail->flags) > 0)
-				str_append_c(ismail->flags, ' ');
-			str_append(ismail->flags, new_keywords[i]);
-		}
+		if (old_keywords[j] == NULL)
+			imap_sieve_flags_toggle(ismail->flags, new_keywords[i]);
 	}
 }
 
@@ -340,8 +431,8 @@ static void imap_sieve_mail_close(struct mail *_mail)
 			e_debug(isbox->event, "FLAG event (changed flags: %s)",
 				str_c(ismail->flags));
 
-			imap_sieve_add_mailbox_event(
-				t, _mail, _mail->box, str_c(ismail->flags));
+			imap_sieve_add_mailbox_flag_event(
+				t, _mail, str_c(ismail->flags));
 		}
 		str_truncate(ismail->flags, 0);
 	}
@@ -477,6 +568,8 @@ imap_sieve_mailbox_transaction_free(struct imap_sieve_mailbox_transaction *ismt)
 {
 	if (array_is_created(&ismt->events))
 		array_free(&ismt->events);
+	if (hash_table_is_created(ismt->flag_events))
+		hash_table_destroy(&ismt->flag_events);
 	pool_unref(&ismt->pool);
 }
 
@@ -662,6 +755,12 @@ imap_sieve_mailbox_transaction_run(
 		uint32_t uid;
 		bool fatal;
 
+		if (mevent->changed_flags != NULL &&
+		    *mevent->changed_flags == '\0') {
+			/* Flag changes cancelled each other out */
+			continue;
+		}
+
 		/* Determine UID for saved message */
 		if (mevent->dest_mail_uid > 0)
 			uid = mevent->dest_mail_uid;
@@ -978,6 +1077,20 @@ imap_sieve_mailbox_rule_match_cause(struct imap_sieve_mailbox_rule *rule,
 	return FALSE;
 }
 
+static struct imap_match_glob *
+imap_sieve_mailbox_rule_glob(struct imap_match_glob **glob, char *glob_sep,
+			     const char *pattern, char sep)
+{
+	if (*glob != NULL && *glob_sep == sep)
+		return *glob;
+
+	if (*glob != NULL)
+		imap_match_deinit(glob);
+	*glob = imap_match_init(default_pool, pattern, TRUE, sep);
+	*glob_sep = sep;
+	return *glob;
+}
+
 static void
 imap_sieve_mailbox_rules_match_patterns(
 	struct mail_user *user, struct mailbox *dst_box,
@@ -1003,17 +1116,17 @@ imap_sieve_mailbox_rules_match_patterns(
 			continue;
 
 		if (strcmp(rule->mailbox, "*") != 0) {
-			glob = imap_match_init(
-				pool_datastack_create(), rule->mailbox, TRUE,
-				mail_namespace_get_sep(dst_ns));
+			glob = imap_sieve_mailbox_rule_glob(
+				&rule->mailbox_glob, &rule->mailbox_glob_sep,
+				rule->mailbox, mail_namespace_get_sep(dst_ns));
 			if (imap_match(glob, mailbox_get_vname(dst_box))
 				!= IMAP_MATCH_YES)
 				continue;
 		}
 		if (rule->from != NULL) {
-			glob = imap_match_init(
-				pool_datastack_create(), rule->from, TRUE,
-				mail_namespace_get_sep(src_ns));
+			glob = imap_sieve_mailbox_rule_glob(
+				&rule->from_glob, &rule->from_glob_sep,
+				rule->from, mail_namespace_get_sep(src_ns));
 			if (imap_match(glob, mailbox_get_vname(src_box)) !=
 			    IMAP_MATCH_YES)
 				continue;
@@ -1059,15 +1172,13 @@ imap_sieve_mailbox_rules_match(struct mail_user *user,
 }
 
 static void
-imap_sieve_mailbox_rules_get(struct mail_user *user,
-			     struct mailbox *dst_box, struct mailbox *src_box,
-			     const char *cause,
-			     ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
+imap_sieve_mailbox_rules_find(struct mail_user *user,
+			      struct mailbox *dst_box, struct mailbox *src_box,
+			      const char *cause,
+			      ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
 {
 	const char *dst_name, *src_name;
 
-	imap_sieve_mailbox_rules_init(user);
-
 	imap_sieve_mailbox_rules_match_patterns(user, dst_box, src_box,
 						cause, rules);
 
@@ -1083,6 +1194,39 @@ imap_sieve_mailbox_rules_get(struct mail_user *user,
 	}
 }
 
+static void
+imap_sieve_mailbox_rules_get(struct mail_user *user,
+			     struct mailbox *dst_box, struct mailbox *src_box,
+			     const char *cause,
+			     ARRAY_TYPE(imap_sieve_mailbox_rule) *rules)
+{
+	struct imap_sieve_mailbox *isbox = IMAP_SIEVE_CONTEXT_REQUIRE(dst_box);
+	struct imap_sieve_mailbox_rules_cache *cache;
+	const char *src_name;
+
+	imap_sieve_mailbox_rules_init(user);
+
+	src_name = (src_box == NULL ? NULL : mailbox_get_vname(src_box));
+
+	if (!array_is_created(&isbox->rules_cache))
+		p_array_init(&isbox->rules_cache, dst_box->pool, 4);
+	array_foreach_modifiable(&isbox->rules_cache, cache) {
+		if (strcmp(cache->cause, cause) == 0 &&
+		    null_strcmp(cache->src_name, src_name) == 0) {
+			array_append_array(rules, &cache->rules);
+			return;
+		}
+	}
+
+	cache = array_append_space(&isbox->rules_cache);
+	cache->cause = p_strdup(dst_box->pool, cause);
+	cache->src_name = p_strdup(dst_box->pool, src_name);
+	p_array_init(&cache->rules, dst_box->pool, 4);
+	imap_sieve_mailbox_rules_find(user, dst_box, src_box, cause,
+				      &cache->rules);
+	array_append_array(rules, &cache->rules);
+}
+
 /*
  * User
  */
@@ -1095,8 +1239,17 @@ static void imap_sieve_user_deinit(struct mail_user *user)
 		imap_sieve_deinit(&isuser->isieve);
 
 	hash_table_destroy(&isuser->mbox_rules);
-	if (array_is_created(&isuser->mbox_patterns))
+	if (array_is_created(&isuser->mbox_patterns)) {
+		struct imap_sieve_mailbox_rule *rule;
+
+		array_foreach_elem(&isuser->mbox_patterns, rule) {
+			if (rule->mailbox_glob != NULL)
+				imap_match_deinit(&rule->mailbox_glob);
+			if (rule->from_glob != NULL)
+				imap_match_deinit(&rule->from_glob);
+		}
 		array_free(&isuser->mbox_patterns);
+	}
 
 	event_unref(&isuser->event);
 
@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "str.h"
 #include "home-expand.h"
 #include "smtp-address.h"
@@ -13,6 +14,8 @@
 #include "imap-client.h"
 #include "imap-settings.h"
 
+#include "duplicate-filter.h"
+
 #include "sieve.h"
 #include "sieve-script.h"
 #include "sieve-storage.h"
@@ -27,6 +30,8 @@
 
 #define DUPLICATE_DB_NAME "lda-dupes"
 #define IMAP_SIEVE_MAX_USER_ERRORS 30
+/* Maximum number of duplicate IDs locked by one shared transaction */
+#define IMAP_SIEVE_DUPLICATE_MAX_LOCKS 32
 
 /*
  * IMAP Sieve
@@ -209,32 +214,142 @@ imap_sieve_smtp_finish(const struct sieve_script_env *senv ATTR_UNUSED,
 	return ret;
 }
 
+/*
+ * IMAP Sieve run state
+ */
+
+struct imap_sieve_run_script {
+	struct sieve_script *script;
+	struct sieve_binary *binary;
+
+	/* Compile failed once with this error;
+	   don't try again for this transaction */
+	enum sieve_error compile_error;
+
+	/* Binary corrupt after recompile; don't recompile again */
+	bool binary_corrupt:1;
+	/* Resource usage exceeded */
+	bool rusage_exceeded:1;
+};
+
+struct imap_sieve_duplicate_mark {
+	const void *id;
+	size_t id_size;
+	time_t time;
+};
+
+struct imap_sieve_run {
+	pool_t pool;
+	struct imap_sieve *isieve;
+	struct mailbox *dest_mailbox, *src_mailbox;
+	char *cause;
+
+	struct sieve_error_handler *user_ehandler;
+	char *userlog;
+
+	struct sieve_trace_config trace_config;
+	struct sieve_trace_log *trace_log;
+
+	struct sieve_script *user_script;
+	struct imap_sieve_run_script *scripts;
+	unsigned int scripts_count;
+
+	struct mail_duplicate_transaction *dup_trans;
+	unsigned int dup_locks;
+	pool_t dup_pool;
+	ARRAY(struct imap_sieve_duplicate_mark) dup_marks;
+	struct duplicate_filter *dup_filter;
+
+	bool trace_log_initialized:1;
+};
+
 /*
  * Duplicate checking
  */
 
+/* Messages of one run share a duplicate transaction, so that the duplicate
+   database is not written for each message of e.g. a COPY of many messages.
+   Each checked ID stays locked until the transaction is committed, so the
+   transaction is committed after the execution for a message once it holds
+   IMAP_SIEVE_DUPLICATE_MAX_LOCKS locks; the next message starts a new one.
+   The IDs marked while executing the scripts for a message are kept in the
+   run until that execution is committed; a rolled back execution must not
+   leave its marks. Committed marks are also added to the duplicate filter
+   file of the LDA (if it exists), which would otherwise miss them. */
+
 static void *
 imap_sieve_duplicate_transaction_begin(const struct sieve_script_env *senv)
 {
 	struct imap_sieve_context *isctx = senv->script_context;
+	struct imap_sieve_run *isrun = isctx->isrun;
 
-	return mail_duplicate_transaction_begin(isctx->isieve->dup_db);
+	if (isrun->dup_trans == NULL) {
+		isrun->dup_trans = mail_duplicate_transaction_begin(
+			isctx->isieve->dup_db);
+		isrun->dup_locks = 0;
+	}
+	if (isrun->dup_pool == NULL) {
+		isrun->dup_pool = pool_alloconly_create(
+			"imap_sieve_run duplicate marks", 256);
+		p_array_init(&isrun->dup_marks, isrun->pool, 4);
+	}
+	if (isrun->dup_filter == NULL && isctx->isieve->home_dir != NULL) {
+		const char *path = t_strconcat(
+			isctx->isieve->home_dir, "/",
+			DUPLICATE_FILTER_LDA_DUPES_FNAME, NULL);
+
+		isrun->dup_filter = duplicate_filter_init(path, FALSE, 0);
+	}
+	return isrun;
+}
+
+static void imap_sieve_duplicate_transaction_end(struct imap_sieve_run *isrun)
+{
+	array_clear(&isrun->dup_marks);
+	p_clear(isrun->dup_pool);
+
+	/* Release the locks before too many file descriptors are held and
+	   concurrent deliveries are blocked for too long */
+	if (isrun->dup_locks >= IMAP_SIEVE_DUPLICATE_MAX_LOCKS)
+		mail_duplicate_transaction_commit(&isrun->dup_trans);
 }
 
 static void imap_sieve_duplicate_transaction_commit(void **_dup_trans)
 {
-	struct mail_duplicate_transaction *dup_trans = *_dup_trans;
+	struct imap_sieve_run *isrun = *_dup_trans;
+	struct mail_user *user = isrun->isieve->client->user;
+	const struct imap_sieve_duplicate_mark *mark;
+	const char *error;
 
 	*_dup_trans = NULL;
-	mail_duplicate_transaction_commit(&dup_trans);
+
+	array_foreach(&isrun->dup_marks, mark) {
+		if (isrun->dup_filter != NULL) {
+			duplicate_filter_add(isrun->dup_filter, mark->id,
+					     mark->id_size, mark->time);
+		}
+		mail_duplicate_mark(isrun->dup_trans, mark->id, mark->id_size,
+				    user->username, mark->time);
+	}
+	/* The filter is updated before the database is committed; an ID that
+	   ends up in the filter but not in the database only costs a database
+	   lookup later on */
+	if (isrun->dup_filter != NULL &&
+	    duplicate_filter_commit(isrun->dup_filter, ioloop_time,
+				    &error) < 0) {
+		e_error(sieve_get_event(isrun->isieve->svinst),
+			"Failed to update duplicate filter: %s", error);
+	}
+	imap_sieve_duplicate_transaction_end(isrun);
 }
 
 static void imap_sieve_duplicate_transaction_rollback(void **_dup_trans)
 {
-	struct mail_duplicate_transaction *dup_trans = *_dup_trans;
+	struct imap_sieve_run *isrun = *_dup_trans;
 
 	*_dup_trans = NULL;
-	mail_duplicate_transaction_rollback(&dup_trans);
+
+	imap_sieve_duplicate_transaction_end(isrun);
 }
 
 static enum sieve_duplicate_check_result
@@ -242,9 +357,17 @@ imap_sieve_duplicate_check(void *_dup_trans,
 			   const struct sieve_script_env *senv,
 			   const void *id, size_t id_size)
 {
-	struct mail_duplicate_transaction *dup_trans = _dup_trans;
+	struct imap_sieve_run *isrun = _dup_trans;
+	const struct imap_sieve_duplicate_mark *mark;
 
-	switch (mail_duplicate_check(dup_trans, id, id_size,
+	array_foreach(&isrun->dup_marks, mark) {
+		if (mark->id_size == id_size &&
+		    memcmp(mark->id, id, id_size) == 0)
+			return SIEVE_DUPLICATE_CHECK_RESULT_EXISTS;
+	}
+
+	isrun->dup_locks++;
+	switch (mail_duplicate_check(isrun->dup_trans, id, id_size,
 				     senv->user->username)) {
 	case MAIL_DUPLICATE_CHECK_RESULT_EXISTS:
 		return SIEVE_DUPLICATE_CHECK_RESULT_EXISTS;
@@ -261,12 +384,17 @@ imap_sieve_duplicate_check(void *_dup_trans,
 }
 
 static void
-imap_sieve_duplicate_mark(void *_dup_trans, const struct sieve_script_env *senv,
+imap_sieve_duplicate_mark(void *_dup_trans,
+			  const struct sieve_script_env *senv ATTR_UNUSED,
 			  const void *id, size_t id_size, time_t time)
 {
-	struct mail_duplicate_transaction *dup_trans = _dup_trans;
+	struct imap_sieve_run *isrun = _dup_trans;
+	struct imap_sieve_duplicate_mark *mark;
 
-	mail_duplicate_mark(dup_trans, id, id_size, senv->user->username, time);
+	mark = array_append_space(&isrun->dup_marks);
+	mark->id = p_memdup(isrun->dup_pool, id, id_size);
+	mark->id_size = id_size;
+	mark->time = time;
 }
 
 /*
@@ -294,39 +422,6 @@ imap_sieve_result_amend_log_message(const struct sieve_script_env *senv,
  * IMAP Sieve run
  */
 
-struct imap_sieve_run_script {
-	struct sieve_script *script;
-	struct sieve_binary *binary;
-
-	/* Compile failed once with this error;
-	   don't try again for this transaction */
-	enum sieve_error compile_error;
-
-	/* Binary corrupt after recompile; don't recompile again */
-	bool binary_corrupt:1;
-	/* Resource usage exceeded */
-	bool rusage_exceeded:1;
-};
-
-struct imap_sieve_run {
-	pool_t pool;
-	struct imap_sieve *isieve;
-	struct mailbox *dest_mailbox, *src_mailbox;
-	char *cause;
-
-	struct sieve_error_handler *user_ehandler;
-	char *userlog;
-
-	struct sieve_trace_config trace_config;
-	struct sieve_trace_log *trace_log;
-
-	struct sieve_script *user_script;
-	struct imap_sieve_run_script *scripts;
-	unsigned int scripts_count;
-
-	bool trace_log_initialized:1;
-};
-
 static void
 imap_sieve_run_init_user_log(struct imap_sieve_run *isrun)
 {
@@ -516,6 +611,11 @@ void imap_sieve_run_deinit(struct imap_sieve_run **_isrun)
 		sieve_error_handler_unref(&isrun->user_ehandler);
 	if (isrun->trace_log != NULL)
 		sieve_trace_log_free(&isrun->trace_log);
+	if (isrun->dup_trans != NULL)
+		mail_duplicate_transaction_commit(&isrun->dup_trans);
+	if (isrun->dup_pool != NULL)
+		pool_unref(&isrun->dup_pool);
+	duplicate_filter_deinit(&isrun->dup_filter);
 
 	pool_unref(&isrun->pool);
 }
@@ -704,6 +804,7 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 	struct sieve_multiscript *mscript;
 	struct sieve_error_handler *ehandler;
 	struct sieve_script *last_script = NULL;
+	struct sieve_delivery_timing timing;
 	bool user_script = FALSE, more = TRUE, rusage_exceeded = FALSE;
 	enum sieve_compile_flags cpflags;
 	enum sieve_execute_flags exflags;
@@ -713,6 +814,10 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 
 	*fatal_r = FALSE;
 
+	/* Scripts are found once for all mails in imap_sieve_run_init(), so
+	   only the later phases are timed here */
+	sieve_delivery_timing_init(&timing);
+
 	/* Start execution */
 	mscript = sieve_multiscript_start_execute(svinst, msgdata, scriptenv);
 
@@ -757,8 +862,12 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 			}
 
 			/* Try to open/compile binary */
+			sieve_delivery_timing_begin(
+				&timing, SIEVE_DELIVERY_TIMING_COMPILE);
 			scripts[i].binary = sbin = imap_sieve_run_open_script(
 				isrun, script, cpflags, FALSE, &compile_error);
+			sieve_delivery_timing_end(
+				&timing, sieve_script_location(script));
 			if (sbin == NULL) {
 				scripts[i].compile_error = compile_error;
 				break;
@@ -769,8 +878,12 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 		e_debug(sieve_get_event(svinst),
 			"Executing script from `%s'",
 			sieve_get_source(sbin));
+		sieve_delivery_timing_begin(&timing,
+					    SIEVE_DELIVERY_TIMING_EXECUTE);
 		more = sieve_multiscript_run(mscript, sbin, ehandler, ehandler,
 					     exflags);
+		sieve_delivery_timing_end(&timing,
+					  sieve_script_location(script));
 
 		mstatus = sieve_multiscript_status(mscript);
 		if (!more && mstatus == SIEVE_EXEC_BIN_CORRUPT &&
@@ -779,19 +892,27 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 			sieve_close(&sbin);
 
 			/* Recompile */
+			sieve_delivery_timing_begin(
+				&timing, SIEVE_DELIVERY_TIMING_COMPILE);
 			scripts[i].binary = sbin =
 				imap_sieve_run_open_script(
 					isrun, script, cpflags, FALSE,
 					&compile_error);
+			sieve_delivery_timing_end(
+				&timing, sieve_script_location(script));
 			if (sbin == NULL) {
 				scripts[i].compile_error = compile_error;
 				break;
 			}
 
 			/* Execute again */
+			sieve_delivery_timing_begin(
+				&timing, SIEVE_DELIVERY_TIMING_EXECUTE);
 			more = sieve_multiscript_run(mscript, sbin,
 						     ehandler, ehandler,
 						     exflags);
+			sieve_delivery_timing_end(
+				&timing, sieve_script_location(script));
 
 			/* Save new version */
 
@@ -814,6 +935,7 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 		  SIEVE_EXECUTE_FLAG_SKIP_RESPONSES;
 	ehandler = (isrun->user_ehandler != NULL ?
 		    isrun->user_ehandler : isieve->master_ehandler);
+	sieve_delivery_timing_begin(&timing, SIEVE_DELIVERY_TIMING_COMMIT);
 	if (compile_error == SIEVE_ERROR_TEMP_FAILURE) {
 		ret = sieve_multiscript_finish(&mscript, ehandler, exflags,
 					       SIEVE_EXEC_TEMP_FAILURE);
@@ -828,6 +950,7 @@ imap_sieve_run_scripts(struct imap_sieve_run *isrun,
 		ret = sieve_multiscript_finish(&mscript, ehandler, exflags,
 					       SIEVE_EXEC_OK);
 	}
+	sieve_delivery_timing_finish(svinst, &timing);
 
 	/* Don't log additional messages about compile failure */
 	if (compile_error != SIEVE_ERROR_NONE && ret == SIEVE_EXEC_FAILURE) {
@@ -867,6 +990,7 @@ int imap_sieve_run_mail(struct imap_sieve_run *isrun, struct mail *mail,
 	context.event.changed_flags = changed_flags;
 	context.mail = mail;
 	context.isieve = isieve;
+	context.isrun = isrun;
 
 	/* Initialize trace logging */
 	imap_sieve_run_init_trace_log(isrun, &trace_config, &trace_log);
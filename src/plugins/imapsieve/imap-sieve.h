@@ -18,6 +18,7 @@ struct imap_sieve_context {
 	struct mail *mail;
 
 	struct imap_sieve *isieve;
+	struct imap_sieve_run *isrun;
 };
 
 static inline bool
@@ -2,6 +2,7 @@
  */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "str.h"
 #include "array.h"
 #include "home-expand.h"
@@ -18,9 +19,13 @@
 #include "iostream-ssl.h"
 #include "lda-settings.h"
 
+#include "duplicate-filter.h"
+
 #include "sieve.h"
+#include "sieve-settings.h"
 #include "sieve-script.h"
 #include "sieve-storage.h"
+#include "sieve-message.h"
 
 #include "lda-sieve-plugin.h"
 
@@ -35,12 +40,34 @@
 
 #define LDA_SIEVE_MAX_USER_ERRORS 30
 
+#define LDA_SIEVE_DUPLICATE_DB_FNAME ".dovecot.lda-dupes"
+#define LDA_SIEVE_DEFAULT_DUPLICATE_FILTER_WARMUP (90*24*60*60)
+
 /*
  * Global variables
  */
 
 static deliver_mail_func_t *next_deliver_mail;
 
+/* Parsed header field values (addresses, dates, content headers) shared
+   between the recipients of one delivery session (LMTP transaction). The
+   header values themselves are always read from the recipient's own mail.
+   The key is checked for each recipient, so that the cache does not grow
+   across different messages. */
+static struct {
+	struct mail_deliver_session *session;
+	char *message_id;
+	uoff_t virtual_size;
+
+	struct sieve_message_cache *cache;
+} lda_sieve_msgcache;
+
+/* Duplicate filter settings of the current recipient */
+static struct {
+	bool enabled;
+	sieve_number_t warmup;
+} lda_sieve_dupfilter_set;
+
 /*
  * Settings handling
  */
@@ -144,37 +171,141 @@ lda_sieve_reject_mail(const struct sieve_script_env *senv,
  * Duplicate checking
  */
 
+/* The duplicate database is fronted by a filter file that answers "definitely
+   not seen" without having to lock and read the database. The database is
+   only opened once an ID may be present or needs to be recorded; an ID is
+   always locked in the database before it is recorded. Even when the filter
+   is not used for lookups, recorded IDs are added to an existing filter file
+   so that it stays complete. */
+struct lda_sieve_duplicate_transaction {
+	struct mail_deliver_context *mdctx;
+	struct mail_duplicate_transaction *dup_trans;
+	struct duplicate_filter *filter;
+
+	bool filter_lookup:1;
+};
+
+static void
+lda_sieve_duplicate_filter_init(struct lda_sieve_duplicate_transaction *ltrans)
+{
+	struct mail_deliver_context *mdctx = ltrans->mdctx;
+	bool enabled = lda_sieve_dupfilter_set.enabled;
+	const char *home, *path, *error;
+	unsigned int warmup = 0;
+	struct stat st;
+
+	if (mail_user_get_home(mdctx->rcpt_user, &home) <= 0)
+		return;
+
+	/* A filter file created now does not know the IDs that are already
+	   recorded in the database. Its negative answers can only be trusted
+	   once these have expired. */
+	if (enabled) {
+		path = t_strconcat(home, "/", LDA_SIEVE_DUPLICATE_DB_FNAME,
+				   NULL);
+		if (stat(path, &st) == 0 || errno != ENOENT)
+			warmup = lda_sieve_dupfilter_set.warmup;
+	}
+
+	path = t_strconcat(home, "/", DUPLICATE_FILTER_LDA_DUPES_FNAME, NULL);
+	ltrans->filter = duplicate_filter_init(path, enabled, warmup);
+	if (!enabled)
+		return;
+
+	/* A filter file that cannot be read is not trusted and it is rebuilt
+	   when the transaction is committed */
+	if (duplicate_filter_refresh(ltrans->filter, &error) < 0) {
+		e_error(mdctx->event,
+			"sieve: Failed to read duplicate filter: %s", error);
+	}
+	ltrans->filter_lookup = TRUE;
+}
+
+static struct mail_duplicate_transaction *
+lda_sieve_duplicate_get_db(struct lda_sieve_duplicate_transaction *ltrans)
+{
+	if (ltrans->dup_trans == NULL) {
+		ltrans->dup_trans =
+			mail_duplicate_transaction_begin(ltrans->mdctx->dup_db);
+	}
+	return ltrans->dup_trans;
+}
+
 static void *
 lda_sieve_duplicate_transaction_begin(const struct sieve_script_env *senv)
 {
 	struct mail_deliver_context *dctx =
 		(struct mail_deliver_context *)senv->script_context;
+	struct lda_sieve_duplicate_transaction *ltrans;
 
-	return mail_duplicate_transaction_begin(dctx->dup_db);
+	ltrans = i_new(struct lda_sieve_duplicate_transaction, 1);
+	ltrans->mdctx = dctx;
+	T_BEGIN {
+		lda_sieve_duplicate_filter_init(ltrans);
+	} T_END;
+	return ltrans;
 }
 
 static void lda_sieve_duplicate_transaction_commit(void **_dup_trans)
 {
-	struct mail_duplicate_transaction *dup_trans = *_dup_trans;
+	struct lda_sieve_duplicate_transaction *ltrans = *_dup_trans;
+	const char *error;
 
 	*_dup_trans = NULL;
-	mail_duplicate_transaction_commit(&dup_trans);
+
+	/* Update the filter first; an ID that ends up in the filter but not in
+	   the database only costs a database lookup later on */
+	if (ltrans->filter != NULL &&
+	    duplicate_filter_commit(ltrans->filter, ioloop_time, &error) < 0) {
+		e_error(ltrans->mdctx->event,
+			"sieve: Failed to update duplicate filter: %s", error);
+	}
+	duplicate_filter_deinit(&ltrans->filter);
+	if (ltrans->dup_trans != NULL)
+		mail_duplicate_transaction_commit(&ltrans->dup_trans);
+	i_free(ltrans);
 }
 
 static void lda_sieve_duplicate_transaction_rollback(void **_dup_trans)
 {
-	struct mail_duplicate_transaction *dup_trans = *_dup_trans;
+	struct lda_sieve_duplicate_transaction *ltrans = *_dup_trans;
 
 	*_dup_trans = NULL;
-	mail_duplicate_transaction_rollback(&dup_trans);
+	if (ltrans == NULL)
+		return;
+
+	if (ltrans->filter != NULL)
+		duplicate_filter_rollback(ltrans->filter);
+	duplicate_filter_deinit(&ltrans->filter);
+	if (ltrans->dup_trans != NULL)
+		mail_duplicate_transaction_rollback(&ltrans->dup_trans);
+	i_free(ltrans);
 }
 
 static enum sieve_duplicate_check_result
 lda_sieve_duplicate_check(void *_dup_trans, const struct sieve_script_env *senv,
 			  const void *id, size_t id_size)
 {
-	struct mail_duplicate_transaction *dup_trans = _dup_trans;
+	struct lda_sieve_duplicate_transaction *ltrans = _dup_trans;
+	struct mail_duplicate_transaction *dup_trans;
+	const char *error;
+
+	if (ltrans->filter_lookup) {
+		/* Pick up IDs recorded by concurrent deliveries */
+		if (duplicate_filter_refresh(ltrans->filter, &error) < 0) {
+			e_error(ltrans->mdctx->event,
+				"sieve: Failed to read duplicate filter: %s",
+				error);
+		} else if (duplicate_filter_is_valid(ltrans->filter,
+						     ioloop_time) &&
+			   !duplicate_filter_may_contain(ltrans->filter,
+							 id, id_size,
+							 ioloop_time)) {
+			return SIEVE_DUPLICATE_CHECK_RESULT_NOT_FOUND;
+		}
+	}
 
+	dup_trans = lda_sieve_duplicate_get_db(ltrans);
 	switch (mail_duplicate_check(dup_trans, id, id_size,
 				     senv->user->username)) {
 	case MAIL_DUPLICATE_CHECK_RESULT_EXISTS:
@@ -195,9 +326,26 @@ static void
 lda_sieve_duplicate_mark(void *_dup_trans, const struct sieve_script_env *senv,
 			 const void *id, size_t id_size, time_t time)
 {
-	struct mail_duplicate_transaction *dup_trans = _dup_trans;
+	struct lda_sieve_duplicate_transaction *ltrans = _dup_trans;
+	struct mail_duplicate_transaction *dup_trans =
+		lda_sieve_duplicate_get_db(ltrans);
 
+	/* The ID must be locked before it can be marked. This is not the case
+	   yet when the filter answered the check, so check it in the database
+	   now; this is cheap when the check already locked it. */
+	switch (mail_duplicate_check(dup_trans, id, id_size,
+				     senv->user->username)) {
+	case MAIL_DUPLICATE_CHECK_RESULT_EXISTS:
+	case MAIL_DUPLICATE_CHECK_RESULT_NOT_FOUND:
+		break;
+	default:
+		e_error(ltrans->mdctx->event,
+			"sieve: Failed to lock duplicate ID for marking");
+		return;
+	}
 	mail_duplicate_mark(dup_trans, id, id_size, senv->user->username, time);
+	if (ltrans->filter != NULL)
+		duplicate_filter_add(ltrans->filter, id, id_size, time);
 }
 
 /*
@@ -242,6 +390,7 @@ struct lda_sieve_run_context {
 	struct sieve_script *user_script;
 	struct sieve_script *main_script;
 	struct sieve_script *discard_script;
+	const char *discard_location;
 
 	const struct sieve_message_data *msgdata;
 	const struct sieve_script_env *scriptenv;
@@ -250,6 +399,8 @@ struct lda_sieve_run_context {
 	struct sieve_error_handler *master_ehandler;
 	struct sieve_error_handler *action_ehandler;
 	const char *userlog;
+
+	struct sieve_delivery_timing timing;
 };
 
 static int
@@ -335,7 +486,9 @@ lda_sieve_binary_save(struct lda_sieve_run_context *srctx,
 			"The LDA Sieve plugin does not have permission "
 			"to save global Sieve script binaries; "
 			"global Sieve scripts like `%s' need to be "
-			"pre-compiled using the sievec tool",
+			"pre-compiled using the sievec tool or "
+			"`doveadm sieve compile -g', or given a "
+			"writable bindir= location option",
 			sieve_script_location(script));
 	}
 }
@@ -552,7 +705,11 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 			sieve_script_location(script));
 	}
 
+	sieve_delivery_timing_begin(&srctx->timing,
+				    SIEVE_DELIVERY_TIMING_COMPILE);
 	sbin = lda_sieve_open(srctx, script, cpflags, FALSE, error_r);
+	sieve_delivery_timing_end(&srctx->timing,
+				  sieve_script_location(script));
 	if (sbin == NULL)
 		return 0;
 
@@ -562,6 +719,8 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 		"Executing script from `%s'",
 		sieve_get_source(sbin));
 
+	sieve_delivery_timing_begin(&srctx->timing,
+				    SIEVE_DELIVERY_TIMING_EXECUTE);
 	if (!discard_script) {
 		ret = (sieve_multiscript_run(mscript, sbin, exec_ehandler,
 					     exec_ehandler, exflags) ? 1 : 0);
@@ -570,6 +729,8 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 					      exec_ehandler, exflags);
 		ret = 0;
 	}
+	sieve_delivery_timing_end(&srctx->timing,
+				  sieve_script_location(script));
 
 	mstatus = sieve_multiscript_status(mscript);
 	if (ret == 0 && mstatus == SIEVE_EXEC_BIN_CORRUPT &&
@@ -580,13 +741,19 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 
 		/* Recompile */
 
+		sieve_delivery_timing_begin(&srctx->timing,
+					    SIEVE_DELIVERY_TIMING_COMPILE);
 		sbin = lda_sieve_open(srctx, script, cpflags, TRUE,
 				      error_r);
+		sieve_delivery_timing_end(&srctx->timing,
+					  sieve_script_location(script));
 		if (sbin == NULL)
 			return 0;
 
 		/* Execute again */
 
+		sieve_delivery_timing_begin(&srctx->timing,
+					    SIEVE_DELIVERY_TIMING_EXECUTE);
 		if (!discard_script) {
 			ret = (sieve_multiscript_run(
 				mscript, sbin, exec_ehandler,
@@ -596,6 +763,8 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 				mscript, sbin, exec_ehandler,
 				exec_ehandler, exflags);
 		}
+		sieve_delivery_timing_end(&srctx->timing,
+					  sieve_script_location(script));
 
 		/* Save new version */
 
@@ -614,6 +783,45 @@ lda_sieve_execute_script(struct lda_sieve_run_context *srctx,
 	return ret;
 }
 
+static int
+lda_sieve_open_discard_script(struct lda_sieve_run_context *srctx,
+			      enum sieve_error *error_r)
+{
+	struct sieve_instance *svinst = srctx->svinst;
+	enum sieve_error error;
+
+	/* The discard script is only needed for messages that end up being
+	   discarded, so it is not opened until then. */
+	if (srctx->discard_script != NULL)
+		return 1;
+	if (srctx->discard_location == NULL)
+		return 0;
+
+	srctx->discard_script = sieve_script_create_open(
+		svinst, srctx->discard_location, NULL, &error);
+	if (srctx->discard_script != NULL)
+		return 1;
+
+	switch (error) {
+	case SIEVE_ERROR_NOT_FOUND:
+		e_debug(sieve_get_event(svinst),
+			"Location for sieve_discard not found: %s",
+			srctx->discard_location);
+		break;
+	case SIEVE_ERROR_TEMP_FAILURE:
+		e_error(sieve_get_event(svinst),
+			"Failed to access discard script `%s' "
+			"(temporary failure)", srctx->discard_location);
+		*error_r = error;
+		return -1;
+	default:
+		break;
+	}
+	/* Don't try again */
+	srctx->discard_location = NULL;
+	return 0;
+}
+
 static int lda_sieve_execute_scripts(struct lda_sieve_run_context *srctx)
 {
 	struct sieve_instance *svinst = srctx->svinst;
@@ -674,7 +882,7 @@ static int lda_sieve_execute_scripts(struct lda_sieve_run_context *srctx)
 		} else if (error != SIEVE_ERROR_NONE) {
 			break;
 		} else if (sieve_multiscript_will_discard(mscript) &&
-			   srctx->discard_script != NULL) {
+			   lda_sieve_open_discard_script(srctx, &error) > 0) {
 			/* Mail is set to be discarded, but we have a discard script. */
 			discard_script = TRUE;
 		} else {
@@ -685,10 +893,13 @@ static int lda_sieve_execute_scripts(struct lda_sieve_run_context *srctx)
 	/* Finish execution */
 	exec_ehandler = (srctx->user_ehandler != NULL ?
 			 srctx->user_ehandler : srctx->master_ehandler);
+	sieve_delivery_timing_begin(&srctx->timing,
+				    SIEVE_DELIVERY_TIMING_COMMIT);
 	ret = sieve_multiscript_finish(&mscript, exec_ehandler, exflags,
 				       (error == SIEVE_ERROR_TEMP_FAILURE ?
 					SIEVE_EXEC_TEMP_FAILURE :
 					SIEVE_EXEC_OK));
+	sieve_delivery_timing_end(&srctx->timing, NULL);
 
 	/* Don't log additional messages about compile failure */
 	if (error != SIEVE_ERROR_NONE && ret == SIEVE_EXEC_FAILURE) {
@@ -842,24 +1053,8 @@ static int lda_sieve_find_scripts(struct lda_sieve_run_context *srctx)
 	/* discard */
 	sieve_discard = mail_user_plugin_getenv(
 		mdctx->rcpt_user, "sieve_discard");
-	if (sieve_discard != NULL && *sieve_discard != '\0') {
-		srctx->discard_script = sieve_script_create_open(
-			svinst, sieve_discard, NULL, &error);
-		if (srctx->discard_script == NULL) {
-			switch (error) {
-			case SIEVE_ERROR_NOT_FOUND:
-				e_debug(sieve_get_event(svinst),
-					"Location for sieve_discard not found: %s",
-					sieve_discard);
-				break;
-			case SIEVE_ERROR_TEMP_FAILURE:
-				ret = -1;
-				break;
-			default:
-				break;
-			}
-		}
-	}
+	if (sieve_discard != NULL && *sieve_discard != '\0')
+		srctx->discard_location = sieve_discard;
 
 	if (ret < 0) {
 		mdctx->tempfail_error =
@@ -920,6 +1115,43 @@ lda_sieve_init_trace_log(struct lda_sieve_run_context *srctx,
 	*trace_log_r = trace_log;
 }
 
+/*
+ * Shared message cache
+ */
+
+static void lda_sieve_message_cache_clear(void)
+{
+	sieve_message_cache_unref(&lda_sieve_msgcache.cache);
+	i_free(lda_sieve_msgcache.message_id);
+	i_zero(&lda_sieve_msgcache);
+}
+
+static struct sieve_message_cache *
+lda_sieve_message_cache_get(struct mail_deliver_context *mdctx,
+			    const char *message_id)
+{
+	uoff_t virtual_size;
+
+	if (mdctx->session == NULL || message_id == NULL ||
+	    mail_get_virtual_size(mdctx->src_mail, &virtual_size) < 0) {
+		lda_sieve_message_cache_clear();
+		return NULL;
+	}
+
+	if (lda_sieve_msgcache.cache != NULL &&
+	    lda_sieve_msgcache.session == mdctx->session &&
+	    lda_sieve_msgcache.virtual_size == virtual_size &&
+	    strcmp(lda_sieve_msgcache.message_id, message_id) == 0)
+		return lda_sieve_msgcache.cache;
+
+	lda_sieve_message_cache_clear();
+	lda_sieve_msgcache.session = mdctx->session;
+	lda_sieve_msgcache.message_id = i_strdup(message_id);
+	lda_sieve_msgcache.virtual_size = virtual_size;
+	lda_sieve_msgcache.cache = sieve_message_cache_create();
+	return lda_sieve_msgcache.cache;
+}
+
 static int
 lda_sieve_execute(struct lda_sieve_run_context *srctx,
 		  struct mail_storage **storage_r)
@@ -985,6 +1217,7 @@ lda_sieve_execute(struct lda_sieve_run_context *srctx,
 	msgdata.envelope.rcpt_to = mdctx->rcpt_to;
 	msgdata.envelope.rcpt_params = &mdctx->rcpt_params;
 	(void)mail_get_message_id(msgdata.mail, &msgdata.id);
+	msgdata.cache = lda_sieve_message_cache_get(mdctx, msgdata.id);
 
 	srctx->msgdata = &msgdata;
 
@@ -1070,6 +1303,16 @@ lda_sieve_deliver_mail(struct mail_deliver_context *mdctx,
 
 	srctx.svinst = sieve_init(&svenv, &lda_sieve_callbacks, mdctx, debug);
 
+	lda_sieve_dupfilter_set.enabled = FALSE;
+	(void)sieve_setting_get_bool_value(srctx.svinst,
+					   "sieve_duplicate_filter",
+					   &lda_sieve_dupfilter_set.enabled);
+	lda_sieve_dupfilter_set.warmup =
+		LDA_SIEVE_DEFAULT_DUPLICATE_FILTER_WARMUP;
+	(void)sieve_setting_get_duration_value(
+		srctx.svinst, "sieve_duplicate_filter_warmup",
+		&lda_sieve_dupfilter_set.warmup);
+
 	/* Initialize master error handler */
 
 	srctx.master_ehandler = sieve_master_ehandler_create(srctx.svinst, 0);
@@ -1081,8 +1324,15 @@ lda_sieve_deliver_mail(struct mail_deliver_context *mdctx,
 
 	/* Find Sieve scripts and run them */
 
+	sieve_delivery_timing_init(&srctx.timing);
+
 	T_BEGIN {
-		if (lda_sieve_find_scripts(&srctx) < 0)
+		sieve_delivery_timing_begin(&srctx.timing,
+					    SIEVE_DELIVERY_TIMING_FIND_SCRIPTS);
+		ret = lda_sieve_find_scripts(&srctx);
+		sieve_delivery_timing_end(&srctx.timing, NULL);
+
+		if (ret < 0)
 			ret = -1;
 		else if (srctx.scripts == NULL)
 			ret = 0;
@@ -1092,6 +1342,8 @@ lda_sieve_deliver_mail(struct mail_deliver_context *mdctx,
 		lda_sieve_free_scripts(&srctx);
 	} T_END;
 
+	sieve_delivery_timing_finish(srctx.svinst, &srctx.timing);
+
 	/* Clean up */
 
 	if (srctx.user_ehandler != NULL)
@@ -1119,4 +1371,6 @@ void sieve_plugin_deinit(void)
 {
 	/* Remove hook */
 	mail_deliver_hook_set(next_deliver_mail);
+
+	lda_sieve_message_cache_clear();
 }
@@ -63,7 +63,7 @@ struct sieve_extprograms_config *sieve_extprograms_config_init
 	struct sieve_extprograms_config *ext_config;
 	const char *extname = sieve_extension_name(ext);
 	const char *bin_dir, *socket_dir, *input_eol;
-	sieve_number_t execute_timeout;
+	sieve_number_t execute_timeout, connect_timeout;
 
 	extname = strrchr(extname, '.');
 	i_assert(extname != NULL);
@@ -79,6 +79,8 @@ struct sieve_extprograms_config *sieve_extprograms_config_init
 	ext_config = i_new(struct sieve_extprograms_config, 1);
 	ext_config->execute_timeout = 
 		SIEVE_EXTPROGRAMS_DEFAULT_EXEC_TIMEOUT_SECS;
+	ext_config->connect_timeout_msecs =
+		SIEVE_EXTPROGRAMS_CONNECT_TIMEOUT_MSECS;
 
 	if ( bin_dir == NULL && socket_dir == NULL ) {
 		e_debug(svinst->event, "%s extension: "
@@ -94,6 +96,11 @@ struct sieve_extprograms_config *sieve_extprograms_config_init
 				&execute_timeout)) {
 			ext_config->execute_timeout = execute_timeout;
 		}
+		if (sieve_setting_get_duration_value
+			(svinst, t_strdup_printf("sieve_%s_connect_timeout", extname),
+				&connect_timeout)) {
+			ext_config->connect_timeout_msecs = connect_timeout * 1000;
+		}
 
 		ext_config->default_input_eol = SIEVE_EXTPROGRAMS_EOL_CRLF;
 		if (input_eol != NULL && strcasecmp(input_eol, "lf") == 0)
@@ -375,6 +382,8 @@ struct sieve_extprogram {
 	const struct sieve_script_env *scriptenv;
 	struct program_client_settings set;
 	struct program_client *program_client;
+
+	struct event *event;
 };
 
 void sieve_extprogram_exec_error
@@ -521,8 +530,14 @@ struct sieve_extprogram *sieve_extprogram_create
 	sprog->ext_config = ext_config;
 	sprog->scriptenv = senv;
 
+	sprog->event = event_create(svinst->event);
+	event_add_str(sprog->event, "action", action);
+	event_add_str(sprog->event, "program", program_name);
+	event_add_str(sprog->event, "program_transport",
+		( fork ? "exec" : "socket" ));
+
 	sprog->set.client_connect_timeout_msecs =
-		SIEVE_EXTPROGRAMS_CONNECT_TIMEOUT_MSECS;
+		ext_config->connect_timeout_msecs;
 	sprog->set.input_idle_timeout_msecs =
 		ext_config->execute_timeout * 1000;
 	restrict_access_init(&sprog->set.restrict_set);
@@ -574,6 +589,7 @@ void sieve_extprogram_destroy(struct sieve_extprogram **_sprog)
 	struct sieve_extprogram *sprog = *_sprog;
 
 	program_client_destroy(&sprog->program_client);
+	event_unref(&sprog->event);
 	i_free(sprog);
 	*_sprog = NULL;
 }
@@ -633,14 +649,28 @@ int sieve_extprogram_set_input_mail
 	return 1;
 }
 
+static void
+sieve_extprogram_finished(struct sieve_extprogram *sprog, const char *result)
+{
+	struct event_passthrough *e =
+		event_create_passthrough(sprog->event)->
+		set_name("sieve_extprogram_finished")->
+		add_str("result", result);
+
+	e_debug(e->event(), "Program finished: %s", result);
+}
+
 int sieve_extprogram_run(struct sieve_extprogram *sprog)
 {
 	switch (program_client_run(sprog->program_client)) {
 	case PROGRAM_CLIENT_EXIT_STATUS_INTERNAL_FAILURE:
+		sieve_extprogram_finished(sprog, "internal_failure");
 		return -1;
 	case PROGRAM_CLIENT_EXIT_STATUS_FAILURE:
+		sieve_extprogram_finished(sprog, "failure");
 		return 0;
 	case PROGRAM_CLIENT_EXIT_STATUS_SUCCESS:
+		sieve_extprogram_finished(sprog, "success");
 		return 1;
 	}
 	i_unreached();
@@ -22,6 +22,7 @@ struct sieve_extprograms_config {
 	enum sieve_extprograms_eol default_input_eol;
 
 	unsigned int execute_timeout;
+	unsigned int connect_timeout_msecs;
 };
 
 struct sieve_extprograms_config *sieve_extprograms_config_init
@@ -9,6 +9,9 @@
 #include "str-sanitize.h"
 #include "ostream.h"
 #include "array.h"
+#include "seq-range-array.h"
+#include "time-util.h"
+#include "write-full.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "mail-search-build.h"
@@ -24,6 +27,8 @@
 #include <fcntl.h>
 #include <pwd.h>
 #include <sysexits.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 /*
  * Print help
@@ -34,7 +39,8 @@ static void print_help(void)
 	printf(
 "Usage: sieve-filter [-c <config-file>] [-C] [-D] [-e] [-m <default-mailbox>]\n"
 "                    [-P <plugin>] [-q <output-mailbox>] [-Q <mail-command>]\n"
-"                    [-s <script-file>] [-u <user>] [-v] [-W] [-x <extensions>]\n"
+"                    [-j <workers>] [-s <script-file>] [-u <user>] [-v] [-W]\n"
+"                    [-x <extensions>]\n"
 "                    <script-file> <source-mailbox> [<discard-action>]\n"
 	);
 }
@@ -65,6 +71,18 @@ struct sieve_filter_context {
 	struct mailbox_transaction_context *move_trans;
 
 	struct ostream *teststream;
+
+	unsigned int messages;
+	struct timeval start_time;
+};
+
+/* Number of messages after which progress is reported */
+#define SIEVE_FILTER_PROGRESS_INTERVAL 10000
+#define SIEVE_FILTER_MAX_WORKERS 64
+
+struct sieve_filter_worker_result {
+	unsigned int messages;
+	int ret;
 };
 
 static const char *
@@ -285,8 +303,26 @@ mail_search_build_add_flags(struct mail_search_args *args,
 	args->args = arg;
 }
 
+static void filter_report_progress(struct sieve_filter_context *sfctx)
+{
+	struct timeval now;
+	long long msecs;
+
+	i_gettimeofday(&now);
+	msecs = timeval_diff_msecs(&now, &sfctx->start_time);
+
+	if (msecs <= 0) {
+		i_info("%u messages filtered", sfctx->messages);
+	} else {
+		i_info("%u messages filtered (%.1f messages/second)",
+		       sfctx->messages,
+		       (double)sfctx->messages * 1000 / msecs);
+	}
+}
+
 static int
-filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
+filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box,
+	       uint32_t uid1, uint32_t uid2, unsigned int *messages_r)
 {
 	struct sieve_filter_context sfctx;
 	struct mailbox *move_box = sfdata->move_mailbox;
@@ -308,6 +344,7 @@ filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
 
 	i_zero(&sfctx);
 	sfctx.data = sfdata;
+	i_gettimeofday(&sfctx.start_time);
 
 	/* Create test stream */
 	if (!sfdata->execute) {
@@ -327,6 +364,14 @@ filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
 
 	search_args = mail_search_build_init();
 	mail_search_build_add_flags(search_args, MAIL_DELETED, TRUE);
+	if (uid1 != 1 || uid2 != (uint32_t)-1) {
+		struct mail_search_arg *arg;
+
+		/* Only the UID range assigned to this worker */
+		arg = mail_search_build_add(search_args, SEARCH_UIDSET);
+		p_array_init(&arg->value.seqset, search_args->pool, 1);
+		seq_range_array_add_range(&arg->value.seqset, uid1, uid2);
+	}
 
 	t = mailbox_transaction_begin(src_box, 0,
 				      "sieve_filter_data src_box");
@@ -335,9 +380,14 @@ filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
 
 	/* Iterate through all requested messages */
 
-	while (ret >= 0 && mailbox_search_next(search_ctx, &mail))
+	while (ret >= 0 && mailbox_search_next(search_ctx, &mail)) {
 		ret = filter_message(&sfctx, mail);
 
+		if (++sfctx.messages % SIEVE_FILTER_PROGRESS_INTERVAL == 0)
+			filter_report_progress(&sfctx);
+	}
+	*messages_r = sfctx.messages;
+
 	/* Cleanup */
 
 	if (mailbox_search_deinit(&search_ctx) < 0)
@@ -369,6 +419,166 @@ filter_mailbox(const struct sieve_filter_data *sfdata, struct mailbox *src_box)
 	return ret;
 }
 
+/*
+ * Parallel filtering
+ */
+
+/* With multiple workers, the source mailbox is divided into consecutive UID
+   ranges with roughly equal numbers of messages. Each worker is a forked
+   process that opens the mailboxes by itself and filters its own UID range
+   using the binary compiled before forking. */
+
+static struct mailbox *
+filter_open_mailbox(struct mail_user *mail_user, const char *name,
+		    enum mailbox_flags open_flags)
+{
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	enum mail_error error;
+
+	ns = mail_namespace_find(mail_user->namespaces, name);
+	if (ns == NULL)
+		i_fatal("Unknown namespace for mailbox '%s'", name);
+
+	box = mailbox_alloc(ns->list, name, open_flags);
+	if (mailbox_open(box) < 0) {
+		i_fatal("Couldn't open mailbox '%s': %s",
+			name, mailbox_get_last_internal_error(box, &error));
+	}
+	return box;
+}
+
+static void
+filter_mailbox_get_uid_bounds(struct mailbox *box, unsigned int workers,
+			      uint32_t *uid_bounds)
+{
+	struct mailbox_transaction_context *t;
+	struct mailbox_status status;
+	struct mail *mail;
+	unsigned int i;
+
+	if (mailbox_sync(box, MAILBOX_SYNC_FLAG_FULL_READ) < 0)
+		i_fatal("failed to sync source mailbox");
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+
+	/* uid_bounds[i] is the first UID of worker i */
+	t = mailbox_transaction_begin(box, 0, "sieve_filter uid bounds");
+	mail = mail_alloc(t, 0, NULL);
+	uid_bounds[0] = 1;
+	for (i = 1; i < workers; i++) {
+		uint32_t seq = (uint32_t)(((uint64_t)status.messages * i) /
+					  workers) + 1;
+
+		if (seq > status.messages) {
+			uid_bounds[i] = (uint32_t)-1;
+			continue;
+		}
+		mail_set_seq(mail, seq);
+		uid_bounds[i] = I_MAX(mail->uid, uid_bounds[i-1]);
+	}
+	mail_free(&mail);
+	(void)mailbox_transaction_commit(&t);
+}
+
+static int
+filter_mailbox_parallel(struct sieve_filter_data *sfdata,
+			struct mail_user *mail_user, const char *src_mailbox,
+			const char *move_mailbox, enum mailbox_flags open_flags,
+			unsigned int workers)
+{
+	struct sieve_filter_worker_result result;
+	uint32_t uid_bounds[SIEVE_FILTER_MAX_WORKERS];
+	pid_t pids[SIEVE_FILTER_MAX_WORKERS];
+	int fds[SIEVE_FILTER_MAX_WORKERS];
+	struct mailbox *box;
+	struct timeval tv_start, tv_end;
+	unsigned int i, messages = 0;
+	long long msecs;
+	int ret = 1;
+
+	i_gettimeofday(&tv_start);
+
+	/* Determine the ranges; the mailbox is closed again before forking */
+	box = filter_open_mailbox(mail_user, src_mailbox,
+				  open_flags | MAILBOX_FLAG_READONLY);
+	filter_mailbox_get_uid_bounds(box, workers, uid_bounds);
+	mailbox_free(&box);
+
+	for (i = 0; i < workers; i++) {
+		int pfd[2];
+
+		if (pipe(pfd) < 0)
+			i_fatal("pipe() failed: %m");
+		if ((pids[i] = fork()) < 0)
+			i_fatal("fork() failed: %m");
+
+		if (pids[i] == 0) {
+			/* Worker */
+			struct mailbox *src_box, *move_box = NULL;
+			uint32_t uid2 = (i + 1 < workers ?
+					 uid_bounds[i+1] - 1 : (uint32_t)-1);
+
+			i_close_fd(&pfd[0]);
+			i_zero(&result);
+
+			src_box = filter_open_mailbox(mail_user, src_mailbox,
+						      open_flags);
+			if (move_mailbox != NULL) {
+				move_box = filter_open_mailbox(
+					mail_user, move_mailbox, open_flags);
+			}
+			sfdata->move_mailbox = move_box;
+
+			if (uid2 >= uid_bounds[i]) {
+				result.ret = filter_mailbox(
+					sfdata, src_box, uid_bounds[i], uid2,
+					&result.messages);
+			}
+
+			mailbox_free(&src_box);
+			if (move_box != NULL)
+				mailbox_free(&move_box);
+
+			if (write_full(pfd[1], &result, sizeof(result)) < 0)
+				i_fatal("write(pipe) failed: %m");
+			i_close_fd(&pfd[1]);
+			exit(EXIT_SUCCESS);
+		}
+
+		i_close_fd(&pfd[1]);
+		fds[i] = pfd[0];
+	}
+
+	/* Collect the results of the workers */
+	for (i = 0; i < workers; i++) {
+		int status;
+
+		if (read(fds[i], &result, sizeof(result)) ==
+		    (ssize_t)sizeof(result)) {
+			messages += result.messages;
+			if (result.ret < 0)
+				ret = -1;
+		} else {
+			i_error("worker %u (pid %s) did not report results",
+				i, dec2str(pids[i]));
+			ret = -1;
+		}
+		i_close_fd(&fds[i]);
+
+		if (waitpid(pids[i], &status, 0) < 0)
+			i_error("waitpid(%s) failed: %m", dec2str(pids[i]));
+	}
+
+	i_gettimeofday(&tv_end);
+	msecs = timeval_diff_msecs(&tv_end, &tv_start);
+	i_info("%u messages filtered by %u workers in %lld.%03lld seconds"
+	       "%s", messages, workers, msecs / 1000, msecs % 1000,
+	       (msecs <= 0 ? "" : t_strdup_printf(
+	       		" (%.1f messages/second)",
+			(double)messages * 1000 / msecs)));
+	return ret;
+}
+
 /*
  * Tool implementation
  */
@@ -391,10 +601,11 @@ int main(int argc, char **argv)
 	enum mailbox_flags open_flags = MAILBOX_FLAG_IGNORE_ACLS;
 	enum mail_error error;
 	const char *errstr;
+	unsigned int workers = 1, messages;
 	int c;
 
 	sieve_tool = sieve_tool_init("sieve-filter", &argc, &argv,
-				     "m:s:x:P:u:q:Q:DCevW", FALSE);
+				     "m:s:x:P:u:q:Q:DCevWj:", FALSE);
 
 	t_array_init(&scriptfiles, 16);
 
@@ -448,6 +659,15 @@ int main(int argc, char **argv)
 			/* enable verbose output */
 			verbose = TRUE;
 			break;
+		case 'j':
+			/* number of worker processes */
+			if (str_to_uint(optarg, &workers) < 0 ||
+			    workers == 0 || workers > SIEVE_FILTER_MAX_WORKERS) {
+				i_fatal_status(EX_USAGE,
+					"Invalid number of workers: %s",
+					optarg);
+			}
+			break;
 		default:
 			/* unrecognized option */
 			print_help();
@@ -535,6 +755,39 @@ int main(int argc, char **argv)
 	/* Initialize mail user */
 	mail_user = sieve_tool_get_mail_user(sieve_tool);
 
+	if (!source_write || !execute)
+		open_flags |= MAILBOX_FLAG_READONLY;
+
+	if (workers > 1) {
+		if (execute && discard_action == SIEVE_FILTER_DACT_MOVE &&
+		    move_mailbox != NULL &&
+		    strcmp(move_mailbox, src_mailbox) == 0)
+			i_fatal("Source mailbox and mailbox for move action are identical.");
+
+		/* Compose script environment */
+		if (sieve_script_env_init(&scriptenv, mail_user, &errstr) < 0)
+			i_fatal("Failed to initialize script execution: %s",
+				errstr);
+		scriptenv.mailbox_autocreate = FALSE;
+		scriptenv.default_mailbox = dst_mailbox;
+		scriptenv.result_amend_log_message = result_amend_log_message;
+
+		i_zero(&sfdata);
+		sfdata.senv = &scriptenv;
+		sfdata.discard_action = discard_action;
+		sfdata.main_sbin = main_sbin;
+		sfdata.ehandler = ehandler;
+		sfdata.execute = execute;
+		sfdata.source_write = source_write;
+		sfdata.default_move = default_move;
+
+		(void)filter_mailbox_parallel(
+			&sfdata, mail_user, src_mailbox,
+			(execute && discard_action == SIEVE_FILTER_DACT_MOVE ?
+			 move_mailbox : NULL), open_flags, workers);
+		goto deinit;
+	}
+
 	/* Open the source mailbox */
 
 	ns = mail_namespace_find(mail_user->namespaces, src_mailbox);
@@ -543,9 +796,6 @@ int main(int argc, char **argv)
 			src_mailbox);
 	}
 
-	if (!source_write || !execute)
-		open_flags |= MAILBOX_FLAG_READONLY;
-
 	src_box = mailbox_alloc(ns->list, src_mailbox, open_flags);
 	if (mailbox_open(src_box) < 0) {
 		i_fatal("Couldn't open source mailbox '%s': %s",
@@ -591,7 +841,7 @@ int main(int argc, char **argv)
 	sfdata.default_move = default_move;
 
 	/* Apply Sieve filter to all messages found */
-	(void)filter_mailbox(&sfdata, src_box);
+	(void)filter_mailbox(&sfdata, src_box, 1, (uint32_t)-1, &messages);
 
 	/* Close the source mailbox */
 	if (src_box != NULL)
@@ -601,6 +851,7 @@ int main(int argc, char **argv)
 	if (move_box != NULL)
 		mailbox_free(&move_box);
 
+deinit:
 	/* Close the script binary */
 	if (main_sbin != NULL)
 		sieve_close(&main_sbin);
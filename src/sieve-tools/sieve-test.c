@@ -8,6 +8,7 @@
 #include "str.h"
 #include "ostream.h"
 #include "array.h"
+#include "time-util.h"
 #include "mail-namespace.h"
 #include "mail-storage.h"
 #include "master-service.h"
@@ -24,7 +25,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <dirent.h>
 #include <sysexits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 
 /*
@@ -47,6 +51,9 @@ static void print_help(void)
 "                  [-r <recipient-address>] [-s <script-file>]\n"
 "                  [-t <trace-file>] [-T <trace-option>] [-x <extensions>]\n"
 "                  <script-file> <mail-file>\n"
+"       sieve-test [-c <config-file>] [-C] [-D] [-P <plugin>] [-x <extensions>]\n"
+"                  -B <iterations> [-R <compare-script-file>]\n"
+"                  <script-file> <corpus>\n"
 	);
 }
 
@@ -162,6 +169,393 @@ result_amend_log_message(const struct sieve_script_env *senv,
 	return str_c(str);
 }
 
+/*
+ * Benchmark mode
+ */
+
+/* Runs the script in test mode (no actions are executed) against all messages
+   of a corpus a number of times and reports throughput, latency percentiles
+   and the time spent setting up the message versus running the script. The
+   corpus is a single message file, an mbox file, a maildir or a directory of
+   message files. All messages are read into memory before timing starts.
+
+   When a second script is given, each message is also run against that
+   script. The printed results of both are compared per message and the
+   script execution times of both are reported side by side, so that a
+   change to a script can be checked for equivalence and performance impact
+   against a real corpus. Each run opens the message afresh and the order of
+   the two runs alternates between messages, so that neither script profits
+   from the other's work. Two Pigeonhole builds are compared by running the
+   same benchmark with each of them and comparing the saved reports. */
+
+ARRAY_DEFINE_TYPE(bench_message, string_t *);
+
+static void
+bench_corpus_add_mbox_message(ARRAY_TYPE(bench_message) *corpus,
+			      const char *data, size_t size)
+{
+	const char *p, *pend = data + size, *line_end;
+	string_t *msg;
+
+	/* Skip the "From " separator line */
+	p = memchr(data, '\n', size);
+	if (p == NULL)
+		return;
+	p++;
+
+	/* The empty line preceding the next separator is not part of the
+	   message */
+	if (pend - p >= 2 && pend[-1] == '\n' && pend[-2] == '\n')
+		pend--;
+
+	/* Unescape ">From " lines (mboxrd) */
+	msg = t_str_new(pend - p);
+	while (p < pend) {
+		line_end = memchr(p, '\n', pend - p);
+		line_end = (line_end == NULL ? pend : line_end + 1);
+
+		if (*p == '>') {
+			const char *q = p;
+
+			while (q < line_end && *q == '>')
+				q++;
+			if ((size_t)(line_end - q) >= 5 &&
+			    strncmp(q, "From ", 5) == 0)
+				p++;
+		}
+		str_append_data(msg, p, line_end - p);
+		p = line_end;
+	}
+	array_append(corpus, &msg, 1);
+}
+
+static void
+bench_corpus_add_file(ARRAY_TYPE(bench_message) *corpus, const char *path)
+{
+	string_t *data = NULL;
+	const char *text, *p, *next;
+	char buf[8192];
+	ssize_t ret;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		i_fatal("open(%s) failed: %m", path);
+
+	data = t_str_new(8192);
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		str_append_data(data, buf, ret);
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+
+	if (str_len(data) == 0)
+		return;
+
+	text = str_c(data);
+	if (strncmp(text, "From ", 5) != 0) {
+		array_append(corpus, &data, 1);
+		return;
+	}
+
+	/* mbox: split on "From " lines */
+	p = text;
+	while (p != NULL && *p != '\0') {
+		next = strstr(p, "\nFrom ");
+		if (next != NULL)
+			next++;
+
+		bench_corpus_add_mbox_message(
+			corpus, p, (next == NULL ? strlen(p) :
+				    (size_t)(next - p)));
+		p = next;
+	}
+}
+
+static void
+bench_corpus_add_dir(ARRAY_TYPE(bench_message) *corpus, const char *path)
+{
+	DIR *dirp;
+	struct dirent *dp;
+	struct stat st;
+
+	if ((dirp = opendir(path)) == NULL)
+		i_fatal("opendir(%s) failed: %m", path);
+
+	for (;;) {
+		const char *file;
+
+		errno = 0;
+		if ((dp = readdir(dirp)) == NULL) {
+			if (errno != 0)
+				i_fatal("readdir(%s) failed: %m", path);
+			break;
+		}
+		if (dp->d_name[0] == '.')
+			continue;
+
+		file = t_strconcat(path, "/", dp->d_name, NULL);
+		if (stat(file, &st) < 0)
+			i_fatal("stat(%s) failed: %m", file);
+
+		if (S_ISDIR(st.st_mode)) {
+			/* Maildir */
+			if (strcmp(dp->d_name, "cur") == 0 ||
+			    strcmp(dp->d_name, "new") == 0)
+				bench_corpus_add_dir(corpus, file);
+		} else if (S_ISREG(st.st_mode)) {
+			bench_corpus_add_file(corpus, file);
+		}
+	}
+
+	if (closedir(dirp) < 0)
+		i_fatal("closedir(%s) failed: %m", path);
+}
+
+static int bench_usecs_cmp(const long long *usecs1, const long long *usecs2)
+{
+	if (*usecs1 < *usecs2)
+		return -1;
+	return (*usecs1 > *usecs2 ? 1 : 0);
+}
+
+static void
+sieve_test_print_alloc_audit(const struct sieve_alloc_audit *audit)
+{
+	unsigned int i;
+
+	i_info("allocations during execution:");
+	for (i = 0; i < SIEVE_ALLOC_SUBSYSTEM_COUNT; i++) {
+		i_info("  %-12s %6u created, %10"PRIuUOFF_T" bytes",
+		       sieve_alloc_subsystem_name(i),
+		       audit->count[i], audit->bytes[i]);
+	}
+}
+
+struct bench_script {
+	struct sieve_binary *sbin;
+
+	ARRAY(long long) latencies;
+	long long setup_usecs, exec_usecs;
+	unsigned int failures;
+
+	buffer_t *result;
+};
+
+struct bench_context {
+	struct sieve_script_env *senv;
+	struct sieve_message_data *msgdata;
+	const struct smtp_address *mail_from;
+	const struct smtp_address *rcpt_to;
+	const struct smtp_address *final_rcpt_to;
+
+	struct sieve_error_handler *ehandler;
+	struct ostream *output;
+	buffer_t *outbuf;
+};
+
+static void
+sieve_test_bench_script_init(struct bench_script *bscript,
+			     struct sieve_binary *sbin, unsigned int runs)
+{
+	i_zero(bscript);
+	bscript->sbin = sbin;
+	i_array_init(&bscript->latencies, runs);
+	bscript->result = buffer_create_dynamic(default_pool, 4096);
+}
+
+static void sieve_test_bench_script_deinit(struct bench_script *bscript)
+{
+	array_free(&bscript->latencies);
+	buffer_free(&bscript->result);
+}
+
+/* The message is opened afresh for each run, so that no run benefits from
+   data parsed and cached by a previous run on the same mail. */
+static void
+sieve_test_bench_run(struct bench_context *bctx, struct bench_script *bscript,
+		     string_t *msg)
+{
+	struct sieve_message_data *msgdata = bctx->msgdata;
+	struct sieve_exec_status estatus;
+	struct timeval tv_start, tv_setup, tv_end;
+	struct mail *mail;
+	long long setup_usecs, exec_usecs;
+	int ret;
+
+	i_gettimeofday(&tv_start);
+
+	mail = sieve_tool_open_data_as_mail(sieve_tool, msg);
+	i_zero(msgdata);
+	msgdata->mail = mail;
+	msgdata->auth_user = sieve_tool_get_username(sieve_tool);
+	(void)mail_get_message_id(mail, &msgdata->id);
+	sieve_tool_get_envelope_data(msgdata, mail, bctx->mail_from,
+				     bctx->rcpt_to, bctx->final_rcpt_to);
+
+	i_zero(&estatus);
+	bctx->senv->exec_status = &estatus;
+
+	buffer_set_used_size(bctx->outbuf, 0);
+	i_gettimeofday(&tv_setup);
+	ret = sieve_test(bscript->sbin, msgdata, bctx->senv, bctx->ehandler,
+			 bctx->output, 0);
+	i_gettimeofday(&tv_end);
+	(void)o_stream_flush(bctx->output);
+
+	buffer_set_used_size(bscript->result, 0);
+	buffer_append_buf(bscript->result, bctx->outbuf, 0, SIZE_MAX);
+
+	if (ret != SIEVE_EXEC_OK)
+		bscript->failures++;
+	setup_usecs = timeval_diff_usecs(&tv_setup, &tv_start);
+	exec_usecs = timeval_diff_usecs(&tv_end, &tv_setup);
+	bscript->setup_usecs += setup_usecs;
+	bscript->exec_usecs += exec_usecs;
+	exec_usecs += setup_usecs;
+	array_append(&bscript->latencies, &exec_usecs, 1);
+}
+
+static void
+sieve_test_bench_print_latency(const char *label, struct bench_script *bscript)
+{
+	const long long *lat;
+	unsigned int runs;
+
+	array_sort(&bscript->latencies, bench_usecs_cmp);
+	lat = array_get(&bscript->latencies, &runs);
+	printf("%-13s p50 %lld us, p99 %lld us, max %lld us\n", label,
+	       lat[runs / 2], lat[(runs * 99) / 100], lat[runs - 1]);
+}
+
+static int
+sieve_test_bench(struct sieve_binary *sbin, struct sieve_binary *cmp_sbin,
+		 const char *corpus_path, struct sieve_script_env *senv,
+		 struct sieve_message_data *msgdata,
+		 const struct smtp_address *mail_from,
+		 const struct smtp_address *rcpt_to,
+		 const struct smtp_address *final_rcpt_to,
+		 unsigned int iterations)
+{
+	struct sieve_instance *svinst = sieve_binary_svinst(sbin);
+	ARRAY_TYPE(bench_message) corpus;
+	struct bench_context bctx;
+	struct bench_script main_script, cmp_script;
+	string_t *const *msgs;
+	struct stat st;
+	long long total_usecs;
+	unsigned int count, runs, cmp_differ = 0, i, j;
+	bool failed;
+
+	t_array_init(&corpus, 256);
+	if (stat(corpus_path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", corpus_path);
+	if (S_ISDIR(st.st_mode))
+		bench_corpus_add_dir(&corpus, corpus_path);
+	else
+		bench_corpus_add_file(&corpus, corpus_path);
+
+	msgs = array_get(&corpus, &count);
+	if (count == 0)
+		i_fatal("No messages found in corpus %s", corpus_path);
+
+	i_zero(&bctx);
+	bctx.senv = senv;
+	bctx.msgdata = msgdata;
+	bctx.mail_from = mail_from;
+	bctx.rcpt_to = rcpt_to;
+	bctx.final_rcpt_to = final_rcpt_to;
+
+	/* Only errors are relevant while benchmarking */
+	bctx.ehandler = sieve_stderr_ehandler_create(svinst, 0);
+	sieve_error_handler_accept_infolog(bctx.ehandler, FALSE);
+
+	bctx.outbuf = buffer_create_dynamic(default_pool, 4096);
+	bctx.output = o_stream_create_buffer(bctx.outbuf);
+
+	sieve_test_bench_script_init(&main_script, sbin, count * iterations);
+	if (cmp_sbin != NULL) {
+		sieve_test_bench_script_init(&cmp_script, cmp_sbin,
+					     count * iterations);
+	}
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < count; j++) T_BEGIN {
+			if (cmp_sbin == NULL) {
+				sieve_test_bench_run(&bctx, &main_script,
+						     msgs[j]);
+			} else if ((i + j) % 2 == 0) {
+				/* Alternate which script runs first, so that
+				   neither one consistently profits from the
+				   other warming up the process */
+				sieve_test_bench_run(&bctx, &main_script,
+						     msgs[j]);
+				sieve_test_bench_run(&bctx, &cmp_script,
+						     msgs[j]);
+			} else {
+				sieve_test_bench_run(&bctx, &cmp_script,
+						     msgs[j]);
+				sieve_test_bench_run(&bctx, &main_script,
+						     msgs[j]);
+			}
+
+			/* Report differences only once */
+			if (cmp_sbin != NULL && i == 0 &&
+			    !buffer_cmp(main_script.result,
+					cmp_script.result)) {
+				cmp_differ++;
+				i_info("message %u (msgid=%s): "
+				       "results differ", j + 1,
+				       (msgdata->id == NULL ?
+					"unspecified" : msgdata->id));
+			}
+		} T_END;
+	}
+
+	runs = array_count(&main_script.latencies);
+	total_usecs = main_script.setup_usecs + main_script.exec_usecs;
+
+	printf("messages:     %u (%u iterations, %u runs, %u failed)\n",
+	       count, iterations, runs, main_script.failures);
+	if (total_usecs > 0) {
+		printf("throughput:   %.1f messages/second\n",
+		       (double)runs * 1000000 / total_usecs);
+	}
+	sieve_test_bench_print_latency("latency:", &main_script);
+	printf("message:      %lld us total, %lld us average\n",
+	       main_script.setup_usecs, main_script.setup_usecs / runs);
+	printf("script:       %lld us total, %lld us average\n",
+	       main_script.exec_usecs, main_script.exec_usecs / runs);
+	failed = (main_script.failures > 0);
+
+	if (cmp_sbin != NULL) {
+		long long exec_usecs = main_script.exec_usecs;
+		long long cmp_usecs = cmp_script.exec_usecs;
+
+		printf("compared:     %lld us total, %lld us average "
+		       "(%u failed)\n",
+		       cmp_usecs, cmp_usecs / runs, cmp_script.failures);
+		sieve_test_bench_print_latency("cmp latency:", &cmp_script);
+		if (exec_usecs > 0) {
+			printf("delta:        %+lld us average (%+.1f%%)\n",
+			       (cmp_usecs - exec_usecs) / runs,
+			       (double)(cmp_usecs - exec_usecs) * 100 /
+			       exec_usecs);
+		}
+		printf("equivalence:  %u of %u messages with "
+		       "different results\n", cmp_differ, count);
+		if (cmp_script.failures > 0 || cmp_differ > 0)
+			failed = TRUE;
+		sieve_test_bench_script_deinit(&cmp_script);
+	}
+
+	sieve_test_bench_script_deinit(&main_script);
+	o_stream_destroy(&bctx.output);
+	buffer_free(&bctx.outbuf);
+	sieve_error_handler_unref(&bctx.ehandler);
+
+	return (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
 /*
  * Tool implementation
  */
@@ -171,11 +565,11 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	ARRAY_TYPE (const_string) scriptfiles;
 	const char *scriptfile, *mailbox, *dumpfile, *tracefile, *mailfile,
-		*mailloc, *errstr;
+		*mailloc, *cmp_scriptfile, *errstr;
 	struct smtp_address *rcpt_to, *final_rcpt_to, *mail_from;
 	struct sieve_trace_config trace_config;
 	struct mail *mail;
-	struct sieve_binary *main_sbin, *sbin = NULL;
+	struct sieve_binary *main_sbin, *sbin = NULL, *cmp_sbin = NULL;
 	struct sieve_message_data msgdata;
 	struct sieve_script_env scriptenv;
 	struct sieve_exec_status estatus;
@@ -184,17 +578,18 @@ int main(int argc, char **argv)
 	struct ostream *teststream = NULL;
 	struct sieve_trace_log *trace_log = NULL;
 	bool force_compile = FALSE, execute = FALSE;
+	unsigned int bench_iterations = 0;
 	int exit_status = EXIT_SUCCESS;
 	int ret, c;
 
 	sieve_tool = sieve_tool_init("sieve-test", &argc, &argv,
-				     "r:a:f:m:d:l:s:eCt:T:DP:x:u:", FALSE);
+				     "r:a:f:m:d:l:s:eCt:T:B:R:DP:x:u:", FALSE);
 
 	ehandler = NULL;
 	t_array_init(&scriptfiles, 16);
 
 	/* Parse arguments */
-	mailbox = dumpfile = tracefile = mailloc = NULL;
+	mailbox = dumpfile = tracefile = mailloc = cmp_scriptfile = NULL;
 	mail_from = final_rcpt_to = rcpt_to = NULL;
 	i_zero(&trace_config);
 	trace_config.level = SIEVE_TRLVL_ACTIONS;
@@ -260,6 +655,18 @@ int main(int argc, char **argv)
 		case 'C':
 			force_compile = TRUE;
 			break;
+			/* benchmark mode */
+		case 'B':
+			if (str_to_uint(optarg, &bench_iterations) < 0 ||
+			    bench_iterations == 0) {
+				i_fatal_status(EX_USAGE,
+					"Invalid -B parameter: %s", optarg);
+			}
+			break;
+			/* benchmark comparison script */
+		case 'R':
+			cmp_scriptfile = optarg;
+			break;
 		default:
 			/* unrecognized option */
 			print_help();
@@ -287,6 +694,18 @@ int main(int argc, char **argv)
 		i_fatal_status(EX_USAGE, "Unknown argument: %s", argv[optind]);
 	}
 
+	if (bench_iterations > 0 &&
+	    (execute || array_count(&scriptfiles) > 0 || tracefile != NULL)) {
+		print_help();
+		i_fatal_status(EX_USAGE,
+			"The -B option cannot be combined with -e, -s or -t");
+	}
+	if (cmp_scriptfile != NULL && bench_iterations == 0) {
+		print_help();
+		i_fatal_status(EX_USAGE,
+			"The -R option can only be used with -B");
+	}
+
 	/* Finish tool initialization */
 	svinst = sieve_tool_init_finish(sieve_tool, mailloc == NULL, FALSE);
 
@@ -317,8 +736,10 @@ int main(int argc, char **argv)
 		if (mailloc != NULL)
 			sieve_tool_init_mail_user(sieve_tool, mailloc);
 
-		/* Initialize raw mail object */
-		mail = sieve_tool_open_file_as_mail(sieve_tool, mailfile);
+		/* Initialize raw mail object; in benchmark mode the corpus is
+		   loaded later */
+		mail = (bench_iterations > 0 ? NULL :
+			sieve_tool_open_file_as_mail(sieve_tool, mailfile));
 
 		if (mailbox == NULL)
 			mailbox = "INBOX";
@@ -327,10 +748,12 @@ int main(int argc, char **argv)
 		i_zero(&msgdata);
 		msgdata.mail = mail;
 		msgdata.auth_user = sieve_tool_get_username(sieve_tool);
-		(void)mail_get_message_id(mail, &msgdata.id);
+		if (mail != NULL) {
+			(void)mail_get_message_id(mail, &msgdata.id);
 
-		sieve_tool_get_envelope_data(&msgdata, mail,
-					     mail_from, rcpt_to, final_rcpt_to);
+			sieve_tool_get_envelope_data(&msgdata, mail, mail_from,
+						     rcpt_to, final_rcpt_to);
+		}
 
 		/* Create streams for test and trace output */
 
@@ -377,7 +800,23 @@ int main(int argc, char **argv)
 
 		/* Run the test */
 		ret = 1;
-		if (array_count(&scriptfiles) == 0) {
+		if (bench_iterations > 0) {
+			if (cmp_scriptfile != NULL) {
+				cmp_sbin = sieve_tool_script_open(
+					svinst, cmp_scriptfile);
+			}
+			if (cmp_scriptfile != NULL && cmp_sbin == NULL)
+				exit_status = EXIT_FAILURE;
+			else {
+				exit_status = sieve_test_bench(
+					main_sbin, cmp_sbin, mailfile,
+					&scriptenv, &msgdata, mail_from,
+					rcpt_to, final_rcpt_to,
+					bench_iterations);
+			}
+			if (cmp_sbin != NULL)
+				sieve_close(&cmp_sbin);
+		} else if (array_count(&scriptfiles) == 0) {
 			/* Single script */
 			sbin = main_sbin;
 			main_sbin = NULL;
@@ -467,31 +906,36 @@ int main(int argc, char **argv)
 		}
 
 		/* Run */
-		switch (ret) {
-		case SIEVE_EXEC_OK:
-			i_info("final result: success");
-			break;
-		case SIEVE_EXEC_RESOURCE_LIMIT:
-			i_info("resource limit exceeded");
-			exit_status = EXIT_FAILURE;
-			break;
-		case SIEVE_EXEC_BIN_CORRUPT:
-			i_info("corrupt binary deleted.");
-			i_unlink_if_exists(sieve_binary_path(sbin));
-			/* fall through */
-		case SIEVE_EXEC_FAILURE:
-			i_info("final result: failed; "
-			       "resolved with successful implicit keep");
-			exit_status = EXIT_FAILURE;
-			break;
-		case SIEVE_EXEC_TEMP_FAILURE:
-			i_info("final result: temporary failure");
-			exit_status = EXIT_FAILURE;
-			break;
-		case SIEVE_EXEC_KEEP_FAILED:
-			i_info("final result: utter failure");
-			exit_status = EXIT_FAILURE;
-			break;
+		if (bench_iterations == 0) {
+			switch (ret) {
+			case SIEVE_EXEC_OK:
+				i_info("final result: success");
+				break;
+			case SIEVE_EXEC_RESOURCE_LIMIT:
+				i_info("resource limit exceeded");
+				exit_status = EXIT_FAILURE;
+				break;
+			case SIEVE_EXEC_BIN_CORRUPT:
+				i_info("corrupt binary deleted.");
+				i_unlink_if_exists(sieve_binary_path(sbin));
+				/* fall through */
+			case SIEVE_EXEC_FAILURE:
+				i_info("final result: failed; "
+				       "resolved with successful implicit keep");
+				exit_status = EXIT_FAILURE;
+				break;
+			case SIEVE_EXEC_TEMP_FAILURE:
+				i_info("final result: temporary failure");
+				exit_status = EXIT_FAILURE;
+				break;
+			case SIEVE_EXEC_KEEP_FAILED:
+				i_info("final result: utter failure");
+				exit_status = EXIT_FAILURE;
+				break;
+			}
+
+			if (!sieve_alloc_audit_is_empty(&estatus.alloc_audit))
+				sieve_test_print_alloc_audit(&estatus.alloc_audit);
 		}
 
 		if (teststream != NULL)
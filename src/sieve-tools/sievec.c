@@ -3,6 +3,9 @@
 
 #include "lib.h"
 #include "array.h"
+#include "istream.h"
+#include "time-util.h"
+#include "write-full.h"
 #include "master-service.h"
 #include "master-service-settings.h"
 #include "mail-storage-service.h"
@@ -21,6 +24,8 @@
 #include <stdio.h>
 #include <dirent.h>
 #include <sysexits.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 
 /*
  * Print help
@@ -31,9 +36,181 @@ static void print_help(void)
 	printf(
 "Usage: sievec  [-c <config-file>] [-d] [-D] [-P <plugin>] [-x <extensions>] \n"
 "              <script-file> [<out-file>]\n"
+"       sievec  [-c <config-file>] [-D] [-P <plugin>] [-x <extensions>] \n"
+"              -b [-j <workers>]\n"
 	);
 }
 
+/*
+ * Batch mode
+ */
+
+/* In batch mode, script locations are read from stdin (one per line) and
+   each is compiled and saved to its default binary location. The work is
+   divided among a number of worker processes, each of which uses its own
+   (forked) copy of the Sieve instance. */
+
+#define SIEVEC_BATCH_MAX_WORKERS 256
+
+struct sievec_batch_result {
+	unsigned int compiled;
+	unsigned int failed;
+};
+
+static bool
+sievec_batch_compile(struct sieve_instance *svinst, const char *location)
+{
+	struct sieve_error_handler *ehandler;
+	struct sieve_binary *sbin;
+	enum sieve_error error;
+	bool result = TRUE;
+
+	ehandler = sieve_stderr_ehandler_create(svinst, 0);
+	sieve_error_handler_accept_infolog(ehandler, TRUE);
+	sieve_error_handler_accept_debuglog(ehandler, svinst->debug);
+
+	if ( (sbin=sieve_compile(svinst, location, NULL, ehandler,
+		0, &error)) == NULL ) {
+		i_error("failed to compile sieve script '%s'", location);
+		result = FALSE;
+	} else {
+		if ( sieve_save(sbin, TRUE, &error) < 0 ) {
+			i_error("failed to save binary for sieve script '%s'",
+				location);
+			result = FALSE;
+		}
+		sieve_close(&sbin);
+	}
+
+	sieve_error_handler_unref(&ehandler);
+	return result;
+}
+
+static void
+sievec_batch_run_worker(struct sieve_instance *svinst,
+	const ARRAY_TYPE(const_string) *locations,
+	unsigned int worker, unsigned int workers,
+	struct sievec_batch_result *result_r)
+{
+	const char *const *locs;
+	unsigned int count, i;
+
+	i_zero(result_r);
+
+	locs = array_get(locations, &count);
+	for ( i = worker; i < count; i += workers ) {
+		bool success;
+
+		T_BEGIN {
+			success = sievec_batch_compile(svinst, locs[i]);
+		} T_END;
+
+		if ( success )
+			result_r->compiled++;
+		else
+			result_r->failed++;
+	}
+}
+
+static int
+sievec_batch(struct sieve_instance *svinst, unsigned int workers)
+{
+	ARRAY_TYPE(const_string) locations;
+	struct sievec_batch_result result, wresult;
+	struct istream *input;
+	struct timeval tv_start, tv_end;
+	const char *line;
+	pid_t pids[SIEVEC_BATCH_MAX_WORKERS];
+	int fds[SIEVEC_BATCH_MAX_WORKERS];
+	unsigned int i, started = 0;
+	long long msecs;
+
+	/* Read the list of script locations */
+	t_array_init(&locations, 1024);
+	input = i_stream_create_fd(STDIN_FILENO, 1024);
+	while ( (line=i_stream_read_next_line(input)) != NULL ) {
+		if ( *line == '\0' )
+			continue;
+		line = t_strdup(line);
+		array_append(&locations, &line, 1);
+	}
+	if ( input->stream_errno != 0 ) {
+		i_fatal("read(stdin) failed: %s",
+			i_stream_get_error(input));
+	}
+	i_stream_unref(&input);
+
+	if ( workers > array_count(&locations) )
+		workers = I_MAX(array_count(&locations), 1);
+
+	i_zero(&result);
+	i_gettimeofday(&tv_start);
+
+	if ( workers == 1 ) {
+		sievec_batch_run_worker(svinst, &locations, 0, 1, &result);
+	} else {
+		for ( i = 0; i < workers; i++ ) {
+			int pfd[2];
+
+			if ( pipe(pfd) < 0 )
+				i_fatal("pipe() failed: %m");
+
+			if ( (pids[i]=fork()) < 0 )
+				i_fatal("fork() failed: %m");
+
+			if ( pids[i] == 0 ) {
+				/* Worker */
+				i_close_fd(&pfd[0]);
+				sievec_batch_run_worker(svinst, &locations,
+					i, workers, &wresult);
+				if ( write_full(pfd[1], &wresult, sizeof(wresult)) < 0 )
+					i_fatal("write(pipe) failed: %m");
+				i_close_fd(&pfd[1]);
+				sieve_tool_deinit(&sieve_tool);
+				exit(EXIT_SUCCESS);
+			}
+
+			i_close_fd(&pfd[1]);
+			fds[i] = pfd[0];
+			started++;
+		}
+
+		/* Collect the results of the workers */
+		for ( i = 0; i < started; i++ ) {
+			ssize_t ret;
+			int status;
+
+			ret = read(fds[i], &wresult, sizeof(wresult));
+			if ( ret == (ssize_t)sizeof(wresult) ) {
+				result.compiled += wresult.compiled;
+				result.failed += wresult.failed;
+			} else {
+				i_error("worker %u (pid %s) did not report results",
+					i, dec2str(pids[i]));
+				result.failed++;
+			}
+			i_close_fd(&fds[i]);
+
+			if ( waitpid(pids[i], &status, 0) < 0 )
+				i_error("waitpid(%s) failed: %m", dec2str(pids[i]));
+		}
+	}
+
+	i_gettimeofday(&tv_end);
+	msecs = timeval_diff_msecs(&tv_end, &tv_start);
+
+	printf("compiled %u scripts (%u failed) in %lld.%03lld seconds "
+		"using %u worker(s)", result.compiled, result.failed,
+		msecs / 1000, msecs % 1000, workers);
+	if ( msecs > 0 ) {
+		printf(": %.1f scripts/second",
+			(double)(result.compiled + result.failed) * 1000 / msecs);
+	}
+	printf("\n");
+
+	return ( result.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS );
+}
+
 /*
  * Tool implementation
  */
@@ -43,12 +220,13 @@ int main(int argc, char **argv)
 	struct sieve_instance *svinst;
 	struct stat st;
 	struct sieve_binary *sbin;
-	bool dump = FALSE;
+	bool dump = FALSE, batch = FALSE;
+	unsigned int workers = 1;
 	const char *scriptfile, *outfile;
 	int exit_status = EXIT_SUCCESS;
 	int c;
 
-	sieve_tool = sieve_tool_init("sievec", &argc, &argv, "DdP:x:u:", FALSE);
+	sieve_tool = sieve_tool_init("sievec", &argc, &argv, "DdP:x:u:bj:", FALSE);
 
 	outfile = NULL;
 	while ((c = sieve_tool_getopt(sieve_tool)) > 0) {
@@ -57,6 +235,18 @@ int main(int argc, char **argv)
 			/* dump file */
 			dump = TRUE;
 			break;
+		case 'b':
+			/* batch mode */
+			batch = TRUE;
+			break;
+		case 'j':
+			/* number of workers */
+			if ( str_to_uint(optarg, &workers) < 0 || workers == 0 ||
+				workers > SIEVEC_BATCH_MAX_WORKERS ) {
+				i_fatal_status(EX_USAGE,
+					"Invalid number of workers: %s", optarg);
+			}
+			break;
 		default:
 			print_help();
 			i_fatal_status(EX_USAGE, "Unknown argument: %c", c);
@@ -64,6 +254,22 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if ( batch ) {
+		if ( dump || optind < argc ) {
+			print_help();
+			i_fatal_status(EX_USAGE,
+				"the -b option does not accept -d or script arguments");
+		}
+
+		svinst = sieve_tool_init_finish(sieve_tool, FALSE, TRUE);
+		sieve_enable_debug_extension(svinst);
+
+		exit_status = sievec_batch(svinst, workers);
+
+		sieve_tool_deinit(&sieve_tool);
+		return exit_status;
+	}
+
 	if ( optind < argc ) {
 		scriptfile = argv[optind++];
 	} else {
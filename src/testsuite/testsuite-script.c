@@ -33,7 +33,7 @@ void testsuite_script_deinit(void)
 
 static struct sieve_binary *
 _testsuite_script_compile(const struct sieve_runtime_env *renv,
-			  const char *script)
+			  const char *script, enum sieve_compile_flags flags)
 {
 	struct sieve_instance *svinst = testsuite_sieve_instance;
 	struct sieve_binary *sbin;
@@ -48,23 +48,25 @@ _testsuite_script_compile(const struct sieve_runtime_env *renv,
 
 	script_path = t_strconcat(script_path, "/", script, NULL);
 	if ((sbin = sieve_compile(svinst, script_path, NULL,
-				  testsuite_log_ehandler, 0, NULL)) == NULL)
+				  testsuite_log_ehandler, flags, NULL)) == NULL)
 		return NULL;
 
 	return sbin;
 }
 
 bool testsuite_script_compile(const struct sieve_runtime_env *renv,
-			      const char *script)
+			      const char *script, bool upload)
 {
 	struct testsuite_interpreter_context *ictx =
 		testsuite_interpreter_context_get(renv->interp, testsuite_ext);
+	enum sieve_compile_flags flags =
+		(upload ? SIEVE_COMPILE_FLAG_UPLOADED : 0);
 	struct sieve_binary *sbin;
 
 	i_assert(ictx != NULL);
 	testsuite_log_clear_messages();
 
-	if ((sbin = _testsuite_script_compile(renv, script)) == NULL)
+	if ((sbin = _testsuite_script_compile(renv, script, flags)) == NULL)
 		return FALSE;
 
 	sieve_binary_unref(&ictx->compiled_script);
@@ -234,7 +236,7 @@ bool testsuite_script_multiscript(const struct sieve_runtime_env *renv,
 		const char *script = scripts[i];
 
 		/* Open */
-		if ((sbin = _testsuite_script_compile(renv, script)) == NULL) {
+		if ((sbin = _testsuite_script_compile(renv, script, 0)) == NULL) {
 			result = FALSE;
 			break;
 		}
@@ -9,7 +9,7 @@ void testsuite_script_deinit(void);
 bool testsuite_script_is_subtest(const struct sieve_runtime_env *renv);
 
 bool testsuite_script_compile(const struct sieve_runtime_env *renv,
-			      const char *script);
+			      const char *script, bool upload);
 bool testsuite_script_run(const struct sieve_runtime_env *renv);
 bool testsuite_script_multiscript(const struct sieve_runtime_env *renv,
 				  ARRAY_TYPE (const_string) *scriptfiles);
@@ -19,9 +19,12 @@
  * Test_script_compile command
  *
  * Syntax:
- *   test_script_compile <scriptpath: string>
+ *   test_script_compile [:upload] <scriptpath: string>
  */
 
+static bool tst_test_script_compile_registered
+	(struct sieve_validator *valdtr, const struct sieve_extension *ext,
+		struct sieve_command_registration *cmd_reg);
 static bool tst_test_script_compile_validate
 	(struct sieve_validator *valdtr, struct sieve_command *cmd);
 static bool tst_test_script_compile_generate
@@ -34,10 +37,28 @@ const struct sieve_command_def tst_test_script_compile = {
 	.subtests = 0,
 	.block_allowed = FALSE,
 	.block_required = FALSE,
+	.registered = tst_test_script_compile_registered,
 	.validate = tst_test_script_compile_validate,
 	.generate = tst_test_script_compile_generate
 };
 
+/*
+ * Tagged arguments
+ */
+
+/* Compile the script as if it were uploaded by the user (e.g. using
+   ManageSieve) */
+static const struct sieve_argument_def test_script_compile_upload_tag = {
+	.identifier = "upload"
+};
+
+/* Codes for optional arguments */
+
+enum tst_test_script_compile_optional {
+	OPT_END,
+	OPT_UPLOAD
+};
+
 /*
  * Operation
  */
@@ -55,6 +76,19 @@ const struct sieve_operation_def test_script_compile_operation = {
 	.execute = tst_test_script_compile_operation_execute
 };
 
+/*
+ * Test registration
+ */
+
+static bool tst_test_script_compile_registered
+(struct sieve_validator *valdtr, const struct sieve_extension *ext,
+	struct sieve_command_registration *cmd_reg)
+{
+	sieve_validator_register_tag
+		(valdtr, cmd_reg, ext, &test_script_compile_upload_tag, OPT_UPLOAD);
+	return TRUE;
+}
+
 /*
  * Validation
  */
@@ -92,9 +126,29 @@ static bool tst_test_script_compile_generate
 static bool tst_test_script_compile_operation_dump
 (const struct sieve_dumptime_env *denv, sieve_size_t *address)
 {
+	int opt_code = 0;
+
 	sieve_code_dumpf(denv, "TEST_SCRIPT_COMPILE:");
 	sieve_code_descend(denv);
 
+	/* Dump optional operands */
+	for (;;) {
+		int opt;
+
+		if ( (opt=sieve_opr_optional_dump(denv, address, &opt_code)) < 0 )
+			return FALSE;
+
+		if ( opt == 0 ) break;
+
+		switch ( opt_code ) {
+		case OPT_UPLOAD:
+			sieve_code_dumpf(denv, "upload");
+			break;
+		default:
+			return FALSE;
+		}
+	}
+
 	if ( !sieve_opr_string_dump(denv, address, "script-name") )
 		return FALSE;
 
@@ -108,14 +162,34 @@ static bool tst_test_script_compile_operation_dump
 static int tst_test_script_compile_operation_execute
 (const struct sieve_runtime_env *renv, sieve_size_t *address)
 {
+	int opt_code = 0;
 	string_t *script_name;
-	bool result = TRUE;
+	bool upload = FALSE, result = TRUE;
 	int ret;
 
 	/*
 	 * Read operands
 	 */
 
+	/* Optional operands */
+	for (;;) {
+		int opt;
+
+		if ( (opt=sieve_opr_optional_read(renv, address, &opt_code)) < 0 )
+			return SIEVE_EXEC_BIN_CORRUPT;
+
+		if ( opt == 0 ) break;
+
+		switch ( opt_code ) {
+		case OPT_UPLOAD:
+			upload = TRUE;
+			break;
+		default:
+			sieve_runtime_trace_error(renv, "unknown optional operand");
+			return SIEVE_EXEC_BIN_CORRUPT;
+		}
+	}
+
 	if ( (ret=sieve_opr_string_read(renv, address, "script-name", &script_name))
 		<= 0 )
 		return ret;
@@ -131,7 +205,7 @@ static int tst_test_script_compile_operation_execute
 
 	/* Attempt script compile */
 
-	result = testsuite_script_compile(renv, str_c(script_name));
+	result = testsuite_script_compile(renv, str_c(script_name), upload);
 
 	/* Set result */
 	sieve_interpreter_set_test_result(renv->interp, result);